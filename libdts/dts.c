@@ -72,6 +72,7 @@ dtsInit (char *config, int port, char *host, char *sroot, int initialize)
     dts = calloc (1, sizeof (DTS));
 
     dts->serverPort	= port;
+    dts->dataPort	= DEF_DATA_PORT;
     dts->debug		= 0;		/* debug is set by the API	 */
     dts->mon_fd 	= DTSMON_NONE;
     strcpy (dts->serverHost, host);
@@ -86,6 +86,7 @@
 #define USE_SEM_IF 	    1 
 
 #define	MAX_CLIENTS	    32		/* max no. connected clients	  */
+#define	MAX_NET_PATHS	    4		/* max network paths to a host	  */
 #define	MAX_QUEUES	    16		/* max no. queues to manage	  */
 #define	MAX_DIR_ENTRIES	    4096	/* max directory entries	  */
 #define	MAX_EMSGS	    512		/* max error messages to save	  */
@@ -93,11 +94,30 @@
 
 #define MIN_MULTI_FSIZE	    65536	/* smaller and we single-thread   */
 
+/*  Large spool files are read and written with O_DIRECT so a file passing
+**  through once doesn't evict everything else from the page cache.
+*/
+#define	DIO_MIN_FSIZE	    (128*1024*1024) /* min size for direct I/O	  */
+#define	DIO_ALIGN	    4096	/* direct I/O alignment		  */
+#define	DIO_BUFSIZE	    (1024*1024)	/* pooled aligned buffer size	  */
+#define	DIO_NBUF	    32		/* max pooled buffers		  */
+#define	DIO_MAX_FD	    4096	/* max direct descriptor	  */
+
 
 #define	DTS_BSD_SUM32	    0		/* 32-bit checksum types	  */
 #define	DTS_SYSV_SUM32	    1
 #define	DTS_SUM32_TYPE	    DTS_SYSV_SUM32
 
+/*  Digests computed in one pass over a file by dts_fileDigest().
+*/
+#define	DTS_DIGEST_SUM32    0x01	/* SysV 32-bit checksum		  */
+#define	DTS_DIGEST_CRC32    0x02	/* CRC-32			  */
+#define	DTS_DIGEST_MD5	    0x04	/* MD5 hash			  */
+#define	DTS_DIGEST_ALL	    0x07
+#define	SZ_MD5_HEX	    33		/* MD5 hex string, incl. NUL	  */
+#define	DIGEST_NBUF	    4		/* read-ahead buffers		  */
+#define	DIGEST_MIN_THREAD   (16*1024*1024) /* smaller and we don't thread */
+
 
 /*  Compile-time passwd		  
  */
@@ -137,6 +157,10 @@
 
 #define	DTS_ASYNC  (getenv("DTS_ASYNC")!=NULL||access("/tmp/DTS_ASYNC",F_OK)==0)
 #define DTS_NAGLE  (getenv("DTS_NAGLE")!=NULL||access("/tmp/DTS_NAGLE",F_OK)==0)
+#define DTS_NOSUM  (getenv("DTS_NOSUM")!=NULL||access("/tmp/DTS_NOSUM",F_OK)==0)
+#define DTS_NOTUNE (getenv("DTS_NOTUNE")!=NULL||access("/tmp/DTS_NOTUNE",F_OK)==0)
+#define DTS_NODIRECT \
+	(getenv("DTS_NODIRECT")!=NULL||access("/tmp/DTS_NODIRECT",F_OK)==0)
 #define DTS_SUM_ALL \
 	(getenv("DTS_SUM_ALL")!=NULL||access("/tmp/DTS_SUM_ALL",F_OK)==0)
 #define DTS_SUM_DBG \
@@ -152,6 +176,7 @@
 #define	TM_PSOCK	    2		/* parallel socket transport	  */
 #define	TM_SCP		    3		/* scp as transport		  */
 #define	TM_UDT		    4		/* UDT as transport		  */
+#define	TM_URING	    5		/* io_uring parallel sockets	  */
 
 
 /**
@@ -182,7 +207,7 @@
  */
 #define MBYTE             1048576.0     /* 1024 * 1024 		  	  */
 #define GBYTE           1073741824.0    /* 1024 * 1024 * 1024	  	  */
-#define SELWIDTH            513		/* select() size		  */
+#define SOCK_IO_TIMEOUT     600		/* max idle wait on data (sec)	  */
 
 #define SOCK_MAX_TRY        5		/* max socket retry		  */
 #define SOCK_PAUSE_TIME     3		/* pause before socket retry	  */
@@ -285,6 +310,49 @@ typedef struct {
 } xferStat, *xferStatP;
 
 
+/**
+ *  Client transfer state.  Everything about a transfer requested with
+ *  dts_xferTo() or dts_xferFrom() is kept here rather than in statics, so
+ *  any number of transfers may run at once as long as each has its own
+ *  context.  A directory sent a file at a time uses one copy per file in
+ *  flight (see dtsXfer.c).
+ */
+#define	DEF_XFER_FILES	    4		/* max files in flight per dir	  */
+
+typedef struct {
+    char   src_host[SZ_PATH];		/* source host			  */
+    char   dest_host[SZ_PATH];		/* destination host		  */
+    char   msg_host[SZ_PATH];		/* host we command		  */
+    char   s_url[SZ_PATH];		/* source command URL		  */
+    char   d_url[SZ_PATH];		/* destination command URL	  */
+    char   s_path[SZ_PATH];		/* source path			  */
+    char   d_path[SZ_PATH];		/* destination path		  */
+    char   s_dir[SZ_PATH];		/* source directory		  */
+    char   d_dir[SZ_PATH];		/* destination directory	  */
+    char   s_fname[SZ_PATH];		/* source file name		  */
+    char   d_fname[SZ_PATH];		/* destination file name	  */
+
+    char   host[SZ_PATH];		/* host running the transfer	  */
+    char  *func;			/* RPC method to call		  */
+
+    int    method;			/* transport method		  */
+    int    rate;			/* transfer rate (Mbps)		  */
+    int    mode;			/* XFER_PUSH or XFER_PULL	  */
+    int    nthreads;			/* streams per file		  */
+    int    port;			/* first transfer port		  */
+    int    maxport;			/* last transfer port		  */
+    int    stream;			/* send a dir as a tar stream?	  */
+    int    srcLocal;			/* is the source this machine?	  */
+    int    dstLocal;			/* is the dest this machine?	  */
+
+    long   fsize;			/* size of current file/stream	  */
+    mode_t fmode;			/* mode of current file		  */
+    int    client;			/* RPC client handle (or -1)	  */
+    struct timeval start;		/* start of current transfer	  */
+    xferStat stats;			/* transfer stats		  */
+} dtsXferCtx, *dtsXferCtxP;
+
+
 
 /**
  *  DTS client connection.
@@ -301,6 +369,8 @@ typedef struct {
     int    clientLoPort;		/* low xfer port 		  */
     int    clientHiPort;		/* high xfer port 		  */
     int    clientContact;		/* contact server port 		  */
+    char   clientPath[MAX_NET_PATHS][SZ_FNAME]; /* address on each network */
+    int    clientNPaths;		/* number of network paths	  */
 
     int    conn;			/* client connection		  */
     int    active;			/* connection active?		  */
@@ -309,6 +379,274 @@ typedef struct {
 
 
 
+/**
+ *  Pooled transfer connection.  Queues with 'keepalive' set leave their
+ *  data connections open between files (see dtsPool.c).
+ */
+#define	MAX_POOL_CONN	    256		/* max pooled connections	  */
+#define	DEF_POOL_IDLE	    300		/* default idle time (sec)	  */
+
+typedef struct {
+    char   host[SZ_FNAME];		/* peer host 			  */
+    char   qname[SZ_FNAME];		/* queue name 			  */
+    int    port;			/* stream port 			  */
+    int    sock;			/* connected data socket	  */
+    int    lsock;			/* listening socket (server side) */
+    int    idle;			/* max idle time (sec)		  */
+    time_t last;			/* time last used		  */
+} dtsConn, *dtsConnP;
+
+
+/**
+ *  Shared data port.  Stream connections for every transfer arrive on a
+ *  single listening port and are handed to the waiting stream by the
+ *  session and stripe number the client sends first (see dtsDemux.c).
+ *  Only the daemon listens on the port, the session is chosen by the
+ *  listening side and sent to the peer in the transfer RPC.
+ */
+#define	DEF_DATA_PORT	    3004	/* default data port		  */
+#define	MAX_DATA_SESS	    1024	/* max waiting streams		  */
+#define	DATA_MAGIC	    0x44545344	/* data header magic ("DTSD")	  */
+#define	DATA_HDR_TIME	    5		/* header read timeout (sec)	  */
+#define	DATA_PEND_TIME	    30		/* unclaimed connection time (sec)*/
+
+typedef struct {
+    int    magic;			/* header magic			  */
+    int    session;			/* transfer session		  */
+    int    stripe;			/* stream number		  */
+} dtsDataHdr, *dtsDataHdrP;
+
+typedef struct {
+    int    session;			/* transfer session 		  */
+    int    stripe;			/* stream number		  */
+    int    rfd;				/* our end of the waiter's pair	  */
+    int    sock;			/* connection not yet claimed	  */
+    time_t last;			/* time connection arrived	  */
+} dtsDataSess, *dtsDataSessP;
+
+
+/**
+ *  Content index of objects received by a queue, keyed by MD5 so that an
+ *  object the destination already holds needn't be sent again (see
+ *  dtsIndex.c).
+ */
+#define	DTS_INDEX_MAX	    4096	/* max entries kept per queue	  */
+#define	DTS_DUP_TAG	    "Dup:"	/* initTransfer reply, have obj	  */
+
+
+/**
+ *  Fan-out reads.  An object a fan-out queue sends to several destinations
+ *  at once is read from the spool a block at a time into a cache shared
+ *  by the senders for each destination (see dtsFanout.c).  A destination
+ *  which falls too far behind reads its blocks from the spool itself.
+ */
+#define	MAX_FANOUT	    8		/* max destinations of a queue	  */
+#define	FAN_BLOCK	    (4*1024*1024)  /* shared read block size	  */
+#define	FAN_MAX_CACHE	    (64*1024*1024) /* max data held for readers	  */
+#define	FAN_MAX_FD	    4096	/* max reader descriptor	  */
+
+#define	FB_EMPTY	    0		/* block not yet read		  */
+#define	FB_LOADING	    1		/* block being read		  */
+#define	FB_CACHED	    2		/* block held in the cache	  */
+#define	FB_SPILLED	    3		/* block dropped, read from spool */
+
+typedef struct {
+    char   *buf;			/* block data			  */
+    int     state;			/* block state			  */
+    long    used[MAX_FANOUT];		/* bytes taken by each reader	  */
+} fanBlock, *fanBlockP;
+
+typedef struct {
+    dev_t   dev;			/* file identity		  */
+    ino_t   ino;
+    int     fd;				/* shared descriptor		  */
+    long    size;			/* file size			  */
+    int     nreaders;			/* expected readers		  */
+    int     nattached;			/* readers attached so far	  */
+    int     ndetached;			/* readers finished		  */
+    int     done[MAX_FANOUT];		/* reader has finished		  */
+    int     closed;			/* owner has closed the source	  */
+    int     nblocks;			/* number of blocks		  */
+    fanBlock *blk;			/* blocks			  */
+    long    ncached;			/* bytes held in the cache	  */
+    long    nfill;			/* bytes read for the cache	  */
+    long    nspill;			/* bytes read by readers directly */
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} fanSource, *fanSourceP;
+
+
+/**
+ *  Cut-through forwarding.  A transfer node may start sending an object on
+ *  to the next hop while it is still arriving, the next hop only commits
+ *  it once we've validated our copy (see dtsCut.c).
+ */
+#define	CUT_BLOCK	    (1024*1024)	/* receive progress block size	  */
+#define	CUT_MAX_FILES	    64		/* max objects in flight	  */
+#define	CUT_MAX_FD	    4096	/* max reader descriptor	  */
+#define	CUT_MAX_IDLE	    300		/* secs without progress	  */
+
+#define	CUT_RECEIVING	    0		/* object is arriving		  */
+#define	CUT_RECEIVED	    1		/* all data received		  */
+#define	CUT_VALID	    2		/* validated and delivered	  */
+#define	CUT_INVALID	    3		/* failed validation		  */
+
+typedef struct {
+    dev_t   ddev;			/* spool dir identity		  */
+    ino_t   dino;
+    dev_t   dev;			/* object identity		  */
+    ino_t   ino;
+    long    size;			/* object size			  */
+    unsigned int sum32;			/* checksums it was sent with	  */
+    unsigned int crc32;
+    char    md5[SZ_PATH];
+    int     writer;			/* receive descriptor, or -1	  */
+    int     state;			/* object state			  */
+    int     nreaders;			/* readers attached		  */
+    int     closed;			/* no longer tracked		  */
+    long    nblocks;			/* number of progress blocks	  */
+    long   *nrecv;			/* bytes received per block	  */
+    time_t  mtime;			/* time of last progress	  */
+} cutObject, *cutObjectP;
+
+
+/**
+ *  Bandwidth shaping.  Outbound socket transfers pace themselves through
+ *  a token bucket per queue, the overall rate may depend on the time of
+ *  day (see dtsShaper.c).
+ */
+#define	MAX_RATES	    8		/* max 'maxRate' entries	  */
+#define	MAX_SHAPE	    (MAX_QUEUES+1) /* max queue buckets		  */
+#define	SHAPE_BURST	    0.1		/* max burst saved (sec of rate)  */
+#define	SHAPE_IDLE	    2.0		/* queue idle after (sec)	  */
+
+typedef struct {
+    int    mbps;			/* rate (Mbps, 0 = no limit)	  */
+    int    start;			/* window start (min, -1 = always)*/
+    int    end;				/* window end (min of day)	  */
+} dtsRate, *dtsRateP;
+
+typedef struct {
+    char   qname[SZ_FNAME];		/* queue name			  */
+    double weight;			/* share weight			  */
+    double minRate;			/* min rate (bytes/sec)		  */
+    double maxRate;			/* max rate (bytes/sec)		  */
+    double tokens;			/* bytes we may send now	  */
+    double last;			/* time of last refill		  */
+    double used;			/* time of last send		  */
+} dtsShape, *dtsShapeP;
+
+
+/**
+ *  Transfer worker pool.  Stream threads for a transfer are run by a
+ *  persistent pool of worker threads, the work items for one transfer
+ *  form a group the caller can wait on (see dtsWorker.c).
+ */
+#define	MAX_WORK_GROUP	    512		/* max work items in a group	  */
+#define	MIN_WORKERS	    16		/* workers kept when idle	  */
+#define	DEF_WORKER_IDLE	    300		/* idle time before exit (sec)	  */
+
+typedef struct {
+    int    nwork;			/* number of work items		  */
+    int    nready;			/* number of items ready	  */
+    int    ndone;			/* number of items completed	  */
+    int    nerrs;			/* number of items failed	  */
+    int    freed;			/* free when last item completes  */
+    int    cancel;			/* items should give up		  */
+    int    stat[MAX_WORK_GROUP];	/* item status			  */
+    pthread_mutex_t mutex;		/* group lock			  */
+    pthread_cond_t  cond;		/* ready/done condition		  */
+} dtsWorkGroup, *dtsWorkGroupP;
+
+typedef struct dtsWork {
+    void  (*func)(void *data);		/* work function		  */
+    void   *arg;			/* work function argument	  */
+    int     tnum;			/* item number in group		  */
+    int     ready;			/* item has signalled ready	  */
+    dtsWorkGroup   *grp;		/* owning group			  */
+    struct dtsWork *next;		/* next queued item		  */
+} dtsWork, *dtsWorkP;
+
+
+
+/**
+ *  Transfer tuning learned for a peer.  The stream count, chunk size and
+ *  socket buffer size are adjusted from the measured RTT and throughput
+ *  of earlier transfers (see dtsTune.c).
+ */
+#define	MAX_TUNE_PEERS	    64		/* max peers tuned		  */
+#define	TUNE_MIN_FSIZE	    (16*1024*1024) /* min file size to sample	  */
+#define	TUNE_NSAMP	    2		/* samples per setting		  */
+#define	TUNE_GAIN	    1.05	/* min gain to keep a change	  */
+#define	TUNE_DRIFT	    0.30	/* drift that forces a re-tune	  */
+#define	TUNE_MAX_BUF	    (16*1024*1024) /* max socket buffer	  */
+#define	TUNE_MAX_CHUNK	    (8*1024*1024) /* max transfer chunk	  */
+
+#define	TUNE_PROBE	    0		/* measuring current setting	  */
+#define	TUNE_SEARCH	    1		/* trying fewer streams		  */
+#define	TUNE_SETTLED	    2		/* watching for drift		  */
+
+typedef struct {
+    char   host[SZ_FNAME];		/* peer host 			  */
+    int    state;			/* tuning state			  */
+    int    maxthreads;			/* configured stream count	  */
+    int    nthreads;			/* current stream count		  */
+    int    best_nthreads;		/* best stream count found	  */
+    int    sockbuf;			/* socket buffer size (0=kernel)  */
+    long   chunk;			/* transfer chunk size (0=def)	  */
+    int    nsamp;			/* samples at current setting	  */
+    int    ndrift;			/* consecutive drifting samples	  */
+    double rtt;				/* round-trip time (sec)	  */
+    double tput;			/* throughput at setting (Mb/s)	  */
+    double best_tput;			/* best throughput (Mb/s)	  */
+    time_t last;			/* time last updated		  */
+} dtsTune, *dtsTuneP;
+
+
+
+/**
+ *  Network paths to a peer.  A host lists its address on each network it
+ *  has with the 'path' keyword, and the streams of a transfer are spread
+ *  over the paths in proportion to their measured throughput, each bound
+ *  to our own address on that network (see dtsPath.c).
+ */
+#define	MAX_PATH_PEERS	    64		/* max peers with paths		  */
+#define	PATH_MIN_BYTES	    (4*1024*1024) /* min stream bytes to sample	  */
+#define	PATH_DOWN_TIME	    120		/* time a failed path is skipped  */
+
+typedef struct {
+    char   host[SZ_FNAME];		/* peer DTS name		  */
+    double tput[MAX_NET_PATHS];		/* path throughput (Mb/s)	  */
+    int    nsamp[MAX_NET_PATHS];	/* samples on the path		  */
+    time_t down[MAX_NET_PATHS];		/* path skipped until this time	  */
+    time_t last;			/* time last used		  */
+} dtsPathPeer, *dtsPathPeerP;
+
+
+
+/**
+ *  WAN emulation, for testing only.  Data connections may be made to act
+ *  like a long, lossy link so transfers between two daemons on the same
+ *  machine behave as they would across a WAN (see dtsWan.c).
+ */
+#define	MAX_WAN_LINKS	    256		/* max emulated connections	  */
+#define	WAN_MSS		    1448	/* emulated segment size	  */
+#define	WAN_CHUNK	    65536	/* max bytes sent at each step	  */
+#define	WAN_INIT_CWND	    10		/* initial window (segments)	  */
+#define	WAN_ENV		    "DTS_WAN"	/* environment setting		  */
+
+typedef struct {
+    double delay;			/* one-way delay (sec)		  */
+    double jitter;			/* delay variation (sec)	  */
+    double loss;			/* segment loss probability	  */
+    double reorder;			/* segment reorder probability	  */
+    double rate;			/* rate cap (Mb/s, 0 for none)	  */
+    long   window;			/* max window (bytes, 0 = sockbuf)*/
+    unsigned int seed;			/* random seed			  */
+} dtsWanSpec, *dtsWanSpecP;
+
+
+
 /**
  *  DTS transfer queue.
  */
@@ -329,6 +667,7 @@ typedef struct {
 #define QUEUE_NORMAL	    8		/* normal queue			  */
 #define QUEUE_SCHEDULED	    9		/* schedule queue		  */
 #define QUEUE_PRIORITY	    10		/* priority queue		  */
+#define QUEUE_FANOUT	    19		/* fan-out queue		  */
 
 #define	QUEUE_REPLACE	    11		/* overwrite existing file	  */
 #define	QUEUE_NUMBER	    12		/* renumber duplicate files	  */
@@ -354,6 +693,25 @@ typedef struct {
 #define CS_STRIPE       3               /* stripe checksum validation   */
 
 
+/**
+ *  In-transit compression (see dtsRice.c).
+ */
+#define CODEC_NONE      0               /* send data as is              */
+#define CODEC_RICE      1               /* Rice code FITS integer images*/
+
+#define RICE_NBLOCK     32              /* pixels per Rice block        */
+#define FITS_BLOCK      2880            /* FITS logical record size     */
+#define FITS_CARD       80              /* FITS header card size        */
+#define FITS_MAX_HDU    1024            /* max HDUs to look at          */
+#define FITS_MAX_IMG    64              /* max image HDUs to code       */
+
+typedef struct {
+    long        start;                  /* file offset of image data    */
+    long        nbytes;                 /* size of image data           */
+    int         bytepix;                /* bytes per pixel              */
+} dtsFitsImg;
+
+
 /**
  *  Status information on the queue.
  */
@@ -523,6 +881,13 @@ typedef struct {
     int         deliveryPolicy;		/* existing file policy		  */
     int	 	auto_purge;		/* auto purge the spool dir	  */
     int         checksumPolicy;		/* checksum policy		  */
+    int         compress;		/* in-transit compression	  */
+    int         dedup;			/* skip objects dest already has */
+    int         cut_through;		/* forward objects as they arrive */
+    char        wan[SZ_FNAME];		/* WAN emulation (testing only)	  */
+    int         rate_weight;		/* bandwidth share weight	  */
+    int         min_rate;		/* min rate (Mbps)		  */
+    int         max_rate;		/* max rate (Mbps, 0=none)	  */
     
     int		activeSem;		/* queue is active semaphore	  */
     int		countSem;		/* queue count semaphore	  */
@@ -579,6 +944,9 @@ typedef struct {
 
     int         loPort;			/* low transfer port 		  */
     int         hiPort;			/* high transfer port 		  */
+    int         dataPort;		/* daemon data port (0=none)	  */
+    dtsRate     rates[MAX_RATES];	/* overall rate schedule	  */
+    int         nrates;			/* no. of rate entries		  */
     int	 	semId;			/* semaphore starting ID	  */
 
     char        configFile[SZ_FNAME];	/* DTS config file		  */
@@ -651,6 +1019,8 @@ uint    dts_fileCRCChecksum (char *fname, unsigned int *crc);
 uint    dts_fileChecksum (char *fname, int do_sysv);
 uint    dts_fileCRC32 (char *fname);
 int     dts_fileValidate (char *fname, uint sum32, uint crc, char *md5);
+int     dts_fileDigest (char *fname, int which, uint *sum32, uint *crc,
+		char *md5);
 
 char   *dts_memMD5 (unsigned char *buf, size_t len);
 uint    dts_memChecksum (unsigned char *buf, size_t len, int do_sysv);
@@ -697,6 +1067,7 @@ char   *dts_cfgQModeStr (int mode);
 char   *dts_cfgPath (void);
 time_t  dts_cfgInterval (char *intstr);
 time_t  dts_cfgStartTime (char *tstr);
+int     dts_cfgRate (char *val, dtsRate *rate);
 
 void    dts_printConfig (DTS *dts);
 char   *dts_fmtConfig (DTS *dts);
@@ -723,8 +1094,8 @@ int     dts_hostDel (char *host, char *path, char *passwd, int recursive);
 char   *dts_hostDestDir (char *host, char *qname);
 char   *dts_hostDir (char *host, char *path, int lsLong);
 int     dts_hostIsDir (char *host, char *path);
-int 	dts_hostDiskUsed (char *host, char *path);
-int 	dts_hostDiskFree (char *host, char *path);
+long 	dts_hostDiskUsed (char *host, char *path);
+long 	dts_hostDiskFree (char *host, char *path);
 char   *dts_hostEcho (char *host, char *str);
 int     dts_hostFGet (char *host, char *fname, char *local, int blk);
 long    dts_hostFSize (char *host, char *path);
@@ -770,11 +1141,11 @@ int     dts_hostDelFromQueue (char *host, char *qname, char *fname);
 int 	dts_hostPush (char *host, int cmdPort, int argc, char *argv[]);
 int 	dts_hostPull (char *host, int cmdPort, int argc, char *argv[]);
 
-unsigned char *dts_hostRead(char *host, char *path, int off, int sz, int *nb);
+unsigned char *dts_hostRead(char *host, char *path, long off, int sz, int *nb);
 int 	dts_hostWrite (char *host, char *path, int off, long sz, char *data);
 int 	dts_hostPrealloc (char *host, char *path, long size);
 int 	dts_hostStat (char *host, char *path, struct stat *st);
-int 	dts_hostStatVal (char *host, char *path, char *val);
+long 	dts_hostStatVal (char *host, char *path, char *val);
 
 int 	dts_hostAbort (char *host, char *passwd);
 int 	dts_hostContact (char *host);
@@ -826,7 +1197,7 @@ int     dts_localMkdir (char *path);
 int     dts_localMtime (char *path, long mtime);
 int     dts_localRename (char *old, char *new);
 int     dts_localTouch (char *path);
-int     dts_localPrealloc (char *path, int size);
+int     dts_localPrealloc (char *path, long size);
 
 
 /*  dtsLog.c 
@@ -918,13 +1289,18 @@ int 	dts_hostTo (char *host, int cmdPort, int method, int rate,
 int 	dts_hostFrom (char *host, int cmdPort, int method, int rate,
 		int loPort, int hiPort, int threads, int mode,
 		int argc, char *argv[], xferStat *xfs);
-int     dts_xferDirTo (char *host, char *func, int method, int rate, 
-		char *path, char *root, char *prefix, xferStat *xs);
-int     dts_xferDirFrom (char *srcHost, char *dstHost, int dstLocal,
-		char *func, int method, int rate, char *path, char *root, 
-		char *prefix, xferStat *xs);
-int     dts_xferFile (char *host, char *func, int method, int rate, char *path, 
-		int fsize, mode_t fmode, xferStat *xs);
+void    dts_xferInit (dtsXferCtx *ctx, int method, int rate, int loPort,
+		int hiPort, int threads, int mode);
+int     dts_xferTo (dtsXferCtx *ctx, char *host, int cmdPort, int argc,
+		char *argv[]);
+int     dts_xferFrom (dtsXferCtx *ctx, char *host, int cmdPort, int argc,
+		char *argv[]);
+int     dts_xferDirTo (dtsXferCtx *ctx, char *path, char *root, 
+		char *prefix);
+int     dts_xferDirFrom (dtsXferCtx *ctx, char *path, char *prefix);
+int     dts_xferDirStream (dtsXferCtx *ctx, char *path, long fsize);
+int     dts_xferFile (dtsXferCtx *ctx, char *path, long fsize, 
+		mode_t fmode);
 
 int 	dts_xferParseArgs (int argc, char *argv[], int *nthreads, int *port,
         	int *verbose, char **path_A, char **path_B);
@@ -950,6 +1326,9 @@ int 	dts_xferSendFile (void *data);
 FILE   *dts_fopen (char *fname, char *mode);
 int     dts_fclose (FILE *fp);
 int     dts_fileOpen (char *fname, int flags);
+int     dts_fileOpenDirect (char *fname, int flags, long fsize);
+int     dts_fileIsDirect (int fd);
+int     dts_fileBuffered (int fd);
 int     dts_fileClose (int fd);
 int     dts_fileSync (int fd);
 int     dts_preAlloc (char *fname, long fsize);
@@ -960,7 +1339,11 @@ long    dts_nameMode (char *fname);
 int     dts_getBuffer (int fd, unsigned char **buf, long chunkSize, int tnum);
 int     dts_fileRead (int fd, void *vptr, int nbytes);
 int     dts_fileWrite (int fd, void *vptr, int nbytes);
+int     dts_filePRead (int fd, void *vptr, int nbytes, off_t offset);
+int     dts_filePWrite (int fd, void *vptr, int nbytes, off_t offset);
 int     dts_fileCopy (char *in, char *out);
+void   *dts_dioAlloc (void);
+void    dts_dioFree (void *buf);
 int 	dts_isDir (char *path);
 int 	dts_isFile (char *path);
 int 	dts_isLink (char *path);
@@ -983,30 +1366,162 @@ char   *dts_sandboxPath (char *in);
 /*  dtsSockUtil.c
 */
 int 	dts_openServerSocket (int port);
+int 	dts_openServerSocketBuf (int port, int bufsz);
 int 	dts_testServerSocket (int port);
 int 	dts_getOpenPort (int port, int maxTries);
 int 	dts_openClientSocket (char *host, int port, int retry);
+int 	dts_openClientSocketBuf (char *host, int port, int retry, int bufsz);
+int 	dts_openClientSocketVia (char *host, char *local, int port, int retry,
+		int bufsz);
 
 int 	dts_openUDTServerSocket (int port, int rate);
 int 	dts_openUDTClientSocket (char *host, int port, int retry);
 
 int 	dts_sockRead (int fd, void *vptr, int nbytes);
 int 	dts_sockWrite (int fd, void *vptr, int nbytes);
+long 	dts_sockSendFile (int sock, int fd, off_t offset, long nbytes);
+long 	dts_sockRecvFile (int sock, int fd, off_t offset, long nbytes);
+int 	dts_sockWait (int fd, int events, int timeout);
 void	dts_setBlock (int sock);
 void	dts_setNonBlock (int sock);
 int 	dts_udtRead (int fd, void *vptr, long nbytes, int flags);
 int 	dts_udtWrite (int fd, void *vptr, long nbytes, int flags);
 
 
+/*  dtsPool.c
+*/
+int	dts_poolKeepalive (char *path, char *qname);
+int	dts_poolGet (char *host, char *qname, int port, int *sock, int *lsock);
+int	dts_poolPut (char *host, char *qname, int port, int sock, int lsock,
+		int idle);
+void	dts_poolExpire (void);
+void	dts_poolFlush (void);
+
+
+/*  dtsDemux.c
+*/
+int	dts_dataListen (int port);
+int	dts_dataPort (void);
+int	dts_dataSession (void);
+int	dts_dataRegister (int dport, int session, int stripe, int port,
+		int bufsz);
+int	dts_dataAccept (int lsock, int bufsz);
+int	dts_dataConnect (char *host, int dport, int session, int stripe,
+		int port, int retry, int bufsz);
+int	dts_dataConnectVia (char *host, char *local, int dport, int session,
+		int stripe, int port, int retry, int bufsz);
+
+
+/*  dtsWorker.c
+*/
+dtsWorkGroup *dts_workGroup (void);
+int	dts_workSubmit (dtsWorkGroup *grp, int tnum, void (*func)(void *data),
+		void *arg);
+void	dts_workReady (void);
+void	dts_workStatus (int status);
+int	dts_workCancelled (void);
+void	dts_workCancel (dtsWorkGroup *grp);
+void	dts_workWaitReady (dtsWorkGroup *grp);
+int    *dts_workWait (dtsWorkGroup *grp);
+void	dts_workFree (dtsWorkGroup *grp);
+
+
+/*  dtsRice.c
+*/
+int	dts_fitsImages (int fd, long fsize, dtsFitsImg *img, int maximg);
+long	dts_riceEncode (unsigned char *in, long nbytes, unsigned char *out,
+		long maxout, int bytepix);
+long	dts_riceDecode (unsigned char *in, long nin, unsigned char *out,
+		long nbytes, int bytepix);
+
+
+/*  dtsIndex.c
+*/
+int	dts_indexAdd (char *qname, char *md5, long fsize, char *path);
+char   *dts_indexLookup (char *qname, char *md5, long fsize);
+void	dts_indexRemove (char *qname, char *md5);
+int	dts_indexLink (char *src, char *dst);
+
+
+/*  dtsFanout.c
+*/
+int	dts_fanoutOpen (char *path, int nreaders);
+int	dts_fanoutAttach (char *path);
+int	dts_fanoutIsReader (int fd);
+int	dts_fanoutRead (int fd, void *buf, int nbytes, off_t offset);
+void	dts_fanoutDetach (int fd);
+long	dts_fanoutClose (int handle);
+
+
+/*  dtsCut.c
+*/
+int	dts_cutOpen (char *dir, char *path, long fsize, unsigned int sum32,
+		unsigned int crc32, char *md5);
+int	dts_cutPending (char *dir);
+long	dts_cutSize (char *path);
+int	dts_cutControl (char *path, Control *ctrl);
+void	dts_cutBind (int fd);
+void	dts_cutMark (int fd, long offset, long nbytes);
+void	dts_cutUnbind (int fd, int status);
+int	dts_cutAttach (char *path);
+int	dts_cutIsReader (int fd);
+int	dts_cutRead (int fd, void *buf, int nbytes, off_t offset);
+void	dts_cutDetach (int fd);
+void	dts_cutDone (char *dir, int status);
+int	dts_cutWait (char *path);
+
+
+/*  dtsShaper.c
+*/
+void	dts_shapeWait (char *qname, long nbytes);
+double	dts_shapeRate (char *qname);
+
+
+/*  dtsTune.c
+*/
+int	dts_tuneStreams (char *host, char *url, int nthreads);
+void	dts_tuneSocket (char *host, long *chunk, int *sockbuf);
+void	dts_tuneUpdate (char *host, long fsize, int nthreads, double secs);
+double	dts_tuneProbeRTT (char *host, int port);
+
+
+/*  dtsPath.c
+*/
+int	dts_pathAlloc (char *host, int nthreads, int *path, int *nshare);
+int	dts_pathAddr (char *host, int path, char *local, char *remote);
+void	dts_pathUpdate (char *host, int path, int nshare, long nbytes,
+		double secs);
+void	dts_pathFail (char *host, int path);
+
+
+/*  dtsWan.c
+*/
+int	dts_wanParse (char *spec, dtsWanSpec *w);
+int	dts_wanAttach (int fd, char *qname);
+void	dts_wanDetach (int fd);
+long	dts_wanSend (int fd, long nbytes);
+void	dts_wanSent (int fd, long nbytes);
+void	dts_wanRecv (int fd);
+
+
 /*  dtsTar.c
 */
 int	dts_wtar(int nargc, char *nargv[]);
 int	dts_rtar (int nargc, char *nargv[]);
+int	dts_tarOpenSource (char *path, long *size);
+int	dts_tarOpenSink (char *dir);
+int	dts_tarIsStream (int fd);
+int	dts_tarRead (int fd, void *buf, int nbytes, off_t offset);
+int	dts_tarWrite (int fd, void *buf, int nbytes, off_t offset);
+int	dts_tarClose (int fd);
+long	dts_tarSize (char *path);
 
 
 /*  dtsQueue.c
 */
 int   	dts_hostInitTransfer (char *host, char *qname, char *fname, char *msg);
+int   	dts_hostInitTransferMD5 (char *host, char *qname, char *fname, 
+		char *md5, char *msg, int *dup);
 int   	dts_hostEndTransfer (char *host, char *qname, char *qpath);
 int   	dts_hostQueueAccept (char *host, char *qname, char *fname, char *msg);
 int   	dts_hostQueueComplete (char *host, char *qname, char *qpath);
@@ -1034,11 +1549,17 @@ char      *dts_fmtQueueCmd (dtsQueue *dtsq, Control *ctrl);
 char      *dts_getQueuePath (DTS *dts, char *qname);
 char      *dts_getQueueLog (DTS *dts, char *qname, char *logname);
 char      *dts_getNextQueueDir (DTS *dts, char *qname);
-char      *dts_verifyDTS (char *host, char *qname, char *fname);
+char      *dts_verifyDTS (char *host, char *qname, char *fname, 
+		    char *md5, int *dup);
 int        dts_queueInitControl(char *host, char *qname, char *qpath, 
 			char *opath, char *lfname, char *fname, char *dfname);
 int        dts_queueProcess (dtsQueue *dtsq, char *lpath, char *rpath, 
 			char *fname);
+int        dts_queueProcessTo (dtsQueue *dtsq, char *dest, int port, 
+			char *lpath, char *rpath, char *fname);
+int        dts_queueDestList (dtsQueue *dtsq, char dest[][SZ_FNAME]);
+int        dts_queueFanout (dtsQueue *dtsq, Control *ctrl, char *cpath,
+			char *lpath);
 char      *dts_queueFromPath (char *qpath);
 char      *dts_queueNameFmt (char *qname);
 void       dts_queueDelete (DTS *dts, char *qpath);
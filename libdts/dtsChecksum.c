@@ -6,6 +6,8 @@
  *         crc = dts_fileCRC32 (char *fname)
  *      sum = dts_fileChecksum (char *fname, int do_sysv)
  *   sum = dts_fileCRCChecksum (char *fname, unsigned int *crc)
+ *   stat = dts_fileDigest (char *fname, int which, uint *sum32, uint *crc,
+ *			char *md5)
 
  *    valid = dts_fileValidate (char *fname, uint sum32, uint crc, char *md5)
  *
@@ -21,12 +23,14 @@
  *
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/fcntl.h>
+#include <sys/stat.h>
 
 #include "dts.h"
 
@@ -445,82 +449,56 @@ int
 dts_fileValidate (char *fname, unsigned int sum32, unsigned int crc, char *md5)
 {
     unsigned int f_sum32 = 0, f_crc = 0;
-    char  *f_md5 = NULL;
-    int    status = OK;
-    struct timeval  t1, t2, t3, t4;
+    char   f_md5[SZ_MD5_HEX];
+    int    status = OK, which = 0;
+    struct timeval  t1, t2;
 
 
-    memset (&t1, 0, sizeof (struct timeval));	/* initialize timers	*/
-    memset (&t2, 0, sizeof (struct timeval));
-    memset (&t3, 0, sizeof (struct timeval));
-    memset (&t4, 0, sizeof (struct timeval));
-
-    if (TIME_DEBUG || PERF_DEBUG)
-        gettimeofday (&t1, NULL);
+    gettimeofday (&t1, NULL);			/* initialize timers	*/
 
+    /*  Work out what we were given to check against, then compute all of
+     *  it in a single pass over the file.
+     */
     if (DTS_SUM_ALL) {
-        if (crc > 0 && sum32 > 0) {
-	    /*  If we have both a CRC and SUM32 compute them in a single pass.
-	     */
-            f_sum32 = dts_fileCRCChecksum (fname, &f_crc);
-            if (crc != f_crc) {
-	        dtsLog (dts, "Error: CRC failed for '%s', %d != %d\n", 
-		    fname, crc, f_crc);
-	        status = ERR;
-	    }
-            if (sum32 != f_sum32) {
-	        dtsLog (dts, "Error: SUM32 failed for '%s', %d != %d\n", 
-		    fname, sum32, f_sum32);
-	        status = ERR;
-	    }
+	if (crc > 0)
+	    which |= DTS_DIGEST_CRC32;
+	if (sum32 > 0)
+	    which |= DTS_DIGEST_SUM32;
+    }
+    if (md5 && md5[0] && !isspace ((int) md5[0]))
+	which |= DTS_DIGEST_MD5;
 
-            if (TIME_DEBUG || PERF_DEBUG)
-                gettimeofday (&t2, NULL);
-        } else {
-	    /*  Otherwise, compute them individually.
-	     */
-            if (crc > 0 && (crc != dts_fileCRC32 (fname))) {
-	        dtsLog (dts, "Error: CRC failed for '%s', %d != %d\n", 
-		    fname, crc, f_crc);
-	        status = ERR;
-	    }
-            if (sum32 > 0 && (sum32!=dts_fileChecksum(fname,DTS_SUM32_TYPE))) {
-	        dtsLog (dts, "Error: SUM32 failed for '%s', %d != %d\n", 
-		    fname, sum32, f_sum32);
-	        status = ERR;
-	    }
+    if (which == 0)
+	return (OK);
 
-            if (TIME_DEBUG || PERF_DEBUG)
-                gettimeofday (&t3, NULL);
-        }
+    if (dts_fileDigest (fname, which, &f_sum32, &f_crc, f_md5) != OK) {
+	dtsLog (dts, "Error: cannot read '%s' to validate\n", fname);
+	return (ERR);
     }
+    gettimeofday (&t2, NULL);
 
-    /* Now check the MD5 hash if we were given one.
-     */
-    if (md5 && md5[0] && (f_md5 = dts_fileMD5 (fname))) {
-	if (strcmp (md5, f_md5) != 0) {
-	    dtsLog (dts, "Error: MD5 failed for '%s', %s != %s\n", 
-		fname, md5, f_md5);
-	    status = ERR;
-	}
-	if (f_md5) free ((char *) f_md5);
+    if ((which & DTS_DIGEST_CRC32) && crc != f_crc) {
+	dtsLog (dts, "Error: CRC failed for '%s', %d != %d\n", 
+	    fname, crc, f_crc);
+	status = ERR;
+    }
+    if ((which & DTS_DIGEST_SUM32) && sum32 != f_sum32) {
+	dtsLog (dts, "Error: SUM32 failed for '%s', %d != %d\n", 
+	    fname, sum32, f_sum32);
+	status = ERR;
+    }
+    if ((which & DTS_DIGEST_MD5) && strcmp (md5, f_md5) != 0) {
+	dtsLog (dts, "Error: MD5 failed for '%s', %s != %s\n", 
+	    fname, md5, f_md5);
+	status = ERR;
     }
 
-
-    gettimeofday (&t4, NULL);
     if (dts->verbose > 2)
 	dtsLog (dts, "%6.6s <  XFER: file validation time: %g\n", "",
-	    dts_timediff (t1, t4));
-
-    if (TIME_DEBUG || PERF_DEBUG) {
-	dtsLog (dts, "fileValidate: t4-t1=%g\n", dts_timediff (t1, t4));
-        if (DTS_SUM_ALL) {
-          if (crc > 0 && sum32 > 0)
-	    dtsLog (dts, "fileValidate: t2-t1=%g\n", dts_timediff (t1, t2));
-	  else
-	    dtsLog (dts, "fileValidate: t3-t1=%g\n", dts_timediff (t1, t3));
-	}
-    }
+	    dts_timediff (t1, t2));
+
+    if (TIME_DEBUG || PERF_DEBUG)
+	dtsLog (dts, "fileValidate: t2-t1=%g\n", dts_timediff (t1, t2));
 
     return ( status );
 }
@@ -1253,3 +1231,336 @@ md5_process_block (const void *buffer, size_t len, struct md5_ctx *ctx)
   ctx->C = C;
   ctx->D = D;
 }
+
+
+
+/******************************************************************************
+ *
+ *  Single-pass file digests.  The file is read once, in large aligned
+ *  buffers (direct I/O for large files, see dts_fileOpenDirect), and each
+ *  buffer is fed to every digest asked for.  Files of DIGEST_MIN_THREAD
+ *  or more are read ahead by the caller into a ring of DIGEST_NBUF buffers
+ *  while worker threads compute the digests, MD5 on one thread and the
+ *  SUM32 and CRC-32 on another when there is more than one CPU.
+ *
+ ******************************************************************************/
+
+typedef struct {
+    void          *ring;			/* read-ahead ring	*/
+    int            worker;			/* worker thread number	*/
+    int            which;			/* digests to compute	*/
+    unsigned int   sum;			/* running SysV sum	*/
+    unsigned int   crc;			/* running CRC-32	*/
+    struct md5_ctx md5;			/* running MD5		*/
+} dtsDigest;
+
+typedef struct {
+    char          *buf[DIGEST_NBUF];	/* read-ahead ring	*/
+    int            len[DIGEST_NBUF];	/* bytes in each buffer	*/
+    long           nread;			/* buffers filled	*/
+    long           ndone[2];		/* buffers digested	*/
+    int            nworkers;		/* digest threads	*/
+    int            eof;			/* no more buffers	*/
+    dtsDigest      dig[2];			/* each thread's part	*/
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} dtsDigestRing;
+
+static unsigned int crc_slice[8][256];	/* slice-by-8 CRC tables	*/
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void   dts_digestInit (dtsDigest *d, int which);
+static void   dts_digestUpdate (dtsDigest *d, unsigned char *buf, size_t n);
+static void  *dts_digestWorker (void *data);
+static void   dts_crcSliceInit (void);
+
+
+
+/**
+ *  DTS_FILEDIGEST -- Compute any of the SUM32, CRC-32 and MD5 of a file
+ *  in a single pass over the data.
+ *
+ *  @brief  Compute the checksums of a file in a single pass.
+ *  @fn     int dts_fileDigest (char *fname, int which, uint *sum32,
+ *		uint *crc, char *md5)
+ *
+ *  @param  fname	file name
+ *  @param  which	DTS_DIGEST_* flags of the digests wanted
+ *  @param  sum32	SysV 32-bit checksum (output, may be NULL)
+ *  @param  crc		CRC-32 value (output, may be NULL)
+ *  @param  md5		MD5 hex string, SZ_MD5_HEX chars (output, may be NULL)
+ *  @return		OK, or ERR if the file can't be read
+ */
+int
+dts_fileDigest (char *fname, int which, unsigned int *sum32, 
+	unsigned int *crc, char *md5)
+{
+    dtsDigestRing  ring;
+    dtsDigest     *d = &ring.dig[0];
+    pthread_t      tid[2];
+    pthread_attr_t attr;
+    struct stat    st;
+    unsigned char  res[MD5_DIGEST_SIZE];
+    unsigned int   s = 0, r = 0;
+    int    fd = -1, i, nb = 0, slot = 0, status = OK, ncpu = 1;
+    long   lo = 0;
+    off_t  offset = (off_t) 0;
+
+
+    if (sum32) *sum32 = 0;
+    if (crc)   *crc = 0;
+    if (md5)   md5[0] = '\0';
+
+    if (!which || access (fname, R_OK) < 0 || stat (fname, &st) < 0)
+	return (ERR);
+    if ((fd = dts_fileOpenDirect (fname, O_RDONLY, (long) st.st_size)) < 0)
+	return (ERR);
+    if (!dts_fileIsDirect (fd))
+	posix_fadvise (fd, (off_t) 0, (off_t) 0, POSIX_FADV_SEQUENTIAL);
+
+    memset (&ring, 0, sizeof (ring));
+    pthread_once (&crc_once, dts_crcSliceInit);
+
+    for (i=0; i < DIGEST_NBUF; i++) {
+	if ((ring.buf[i] = dts_dioAlloc ()) == NULL) {
+	    status = ERR;
+	    goto done_;
+	}
+    }
+
+    /*  Split the digests between threads for a large file, the MD5 costs
+     *  about as much as the other two together.
+     */
+    if ((long) st.st_size >= DIGEST_MIN_THREAD) {
+#ifdef _SC_NPROCESSORS_ONLN
+	ncpu = (int) sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+	if (ncpu > 1 && (which & DTS_DIGEST_MD5) && (which & ~DTS_DIGEST_MD5)) {
+	    dts_digestInit (&ring.dig[0], DTS_DIGEST_MD5);
+	    dts_digestInit (&ring.dig[1], which & ~DTS_DIGEST_MD5);
+	    ring.nworkers = 2;
+	} else {
+	    dts_digestInit (&ring.dig[0], which);
+	    ring.nworkers = 1;
+	}
+    } else
+	dts_digestInit (&ring.dig[0], which);
+
+    if (ring.nworkers == 0) {
+	/*  Small file, just read and digest each buffer in turn.
+	 */
+	while ((nb = dts_filePRead (fd, ring.buf[0], DIO_BUFSIZE, offset)) > 0) {
+	    dts_digestUpdate (d, (unsigned char *) ring.buf[0], (size_t) nb);
+	    offset += nb;
+	    if (nb < DIO_BUFSIZE)
+		break;
+	}
+	if (nb < 0)
+	    status = ERR;
+
+    } else {
+	pthread_mutex_init (&ring.mutex, NULL);
+	pthread_cond_init (&ring.cond, NULL);
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_JOINABLE);
+
+	for (i=0; i < ring.nworkers; i++) {
+	    ring.dig[i].ring = (void *) &ring;
+	    ring.dig[i].worker = i;
+	    if (pthread_create (&tid[i], &attr, dts_digestWorker, 
+		(void *) &ring.dig[i])) {
+		    dtsErrLog (NULL, "Cannot create digest thread\n");
+		    ring.nworkers = i;
+		    status = ERR;
+		    break;
+	    }
+	}
+
+	/*  Read ahead into the ring while the workers digest what's there.
+	 */
+	while (status == OK) {
+	    pthread_mutex_lock (&ring.mutex);
+	    for ( ; ; ) {
+		lo = ring.ndone[0];
+		if (ring.nworkers > 1)
+		    lo = min (lo, ring.ndone[1]);
+		if (ring.nread - lo < DIGEST_NBUF)
+		    break;
+		pthread_cond_wait (&ring.cond, &ring.mutex);
+	    }
+	    pthread_mutex_unlock (&ring.mutex);
+
+	    slot = (int) (ring.nread % DIGEST_NBUF);
+	    nb = dts_filePRead (fd, ring.buf[slot], DIO_BUFSIZE, offset);
+
+	    pthread_mutex_lock (&ring.mutex);
+	    if (nb > 0) {
+		ring.len[slot] = nb;
+		ring.nread++;
+		offset += nb;
+	    }
+	    if (nb < DIO_BUFSIZE)
+		ring.eof = 1;
+	    pthread_cond_broadcast (&ring.cond);
+	    pthread_mutex_unlock (&ring.mutex);
+
+	    if (nb < 0)
+		status = ERR;
+	    if (ring.eof)
+		break;
+	}
+
+	pthread_mutex_lock (&ring.mutex);
+	ring.eof = 1;
+	pthread_cond_broadcast (&ring.cond);
+	pthread_mutex_unlock (&ring.mutex);
+
+	for (i=0; i < ring.nworkers; i++)
+	    pthread_join (tid[i], NULL);
+
+	pthread_attr_destroy (&attr);
+	pthread_cond_destroy (&ring.cond);
+	pthread_mutex_destroy (&ring.mutex);
+
+	/*  Put the two halves back together.
+	 */
+	if (ring.nworkers > 1) {
+	    ring.dig[0].which |= ring.dig[1].which;
+	    ring.dig[0].sum = ring.dig[1].sum;
+	    ring.dig[0].crc = ring.dig[1].crc;
+	}
+    }
+
+    if (status == OK) {
+	if (sum32 && (d->which & DTS_DIGEST_SUM32)) {
+	    s = d->sum;
+	    r = (s & 0xffff) + ((s & 0xffffffff) >> 16);
+	    *sum32 = (r & 0xffff) + (r >> 16);
+	}
+	if (crc && (d->which & DTS_DIGEST_CRC32))
+	    *crc = d->crc ^ 0xFFFFFFFF;
+	if (md5 && (d->which & DTS_DIGEST_MD5)) {
+	    md5_finish_ctx (&d->md5, res);
+	    for (i=0; i < MD5_DIGEST_SIZE; i++)
+		sprintf (&md5[2*i], "%02x", res[i]);
+	}
+    }
+
+done_:
+    for (i=0; i < DIGEST_NBUF; i++)
+	dts_dioFree (ring.buf[i]);
+    dts_fileClose (fd);
+
+    return (status);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ ****************************************************************************/
+
+/**
+ *  DTS_DIGESTINIT -- Start the digests of a new file.
+ */
+static void
+dts_digestInit (dtsDigest *d, int which)
+{
+    d->which = which;
+    d->sum = 0;
+    d->crc = 0xFFFFFFFF;
+    if (which & DTS_DIGEST_MD5)
+	md5_init_ctx (&d->md5);
+}
+
+
+/**
+ *  DTS_DIGESTUPDATE -- Add a buffer of data to the digests.  The CRC is
+ *  done eight bytes at a time with the slice-by-8 tables, the result is
+ *  the same as the byte-wise crc_tab loop of dts_fileCRC32.
+ */
+static void
+dts_digestUpdate (dtsDigest *d, unsigned char *buf, size_t n)
+{
+    register unsigned char *bp = buf, *ep = buf + n;
+    register unsigned int   c, hi, s;
+
+
+    if (d->which & DTS_DIGEST_MD5)
+	md5_process_bytes (buf, n, &d->md5);
+
+    if (d->which & DTS_DIGEST_SUM32) {
+	for (s = d->sum, bp = buf; bp < ep; bp++)
+	    s += *bp;
+	d->sum = s;
+    }
+
+    if (d->which & DTS_DIGEST_CRC32) {
+	for (c = d->crc, bp = buf; ep - bp >= 8; bp += 8) {
+	    c ^= (unsigned int) bp[0]       | ((unsigned int) bp[1] << 8) |
+		((unsigned int) bp[2] << 16) | ((unsigned int) bp[3] << 24);
+	    hi = (unsigned int) bp[4]       | ((unsigned int) bp[5] << 8) |
+		((unsigned int) bp[6] << 16) | ((unsigned int) bp[7] << 24);
+	    c = crc_slice[7][c & 0xFF]         ^ crc_slice[6][(c >> 8) & 0xFF] ^
+		crc_slice[5][(c >> 16) & 0xFF]  ^ crc_slice[4][c >> 24] ^
+		crc_slice[3][hi & 0xFF]        ^ crc_slice[2][(hi >> 8) & 0xFF] ^
+		crc_slice[1][(hi >> 16) & 0xFF] ^ crc_slice[0][hi >> 24];
+	}
+	for ( ; bp < ep; bp++)
+	    c = (c >> 8) ^ crc_slice[0][(c ^ *bp) & 0xFF];
+	d->crc = c;
+    }
+}
+
+
+/**
+ *  DTS_DIGESTWORKER -- Digest the buffers of the read-ahead ring as the
+ *  reader fills them.
+ */
+static void *
+dts_digestWorker (void *data)
+{
+    dtsDigest     *d = (dtsDigest *) data;
+    dtsDigestRing *ring = (dtsDigestRing *) d->ring;
+    int   w = d->worker, slot = 0;
+
+    for ( ; ; ) {
+	pthread_mutex_lock (&ring->mutex);
+	while (ring->ndone[w] == ring->nread && !ring->eof)
+	    pthread_cond_wait (&ring->cond, &ring->mutex);
+	if (ring->ndone[w] == ring->nread) {
+	    pthread_mutex_unlock (&ring->mutex);
+	    break;
+	}
+	slot = (int) (ring->ndone[w] % DIGEST_NBUF);
+	pthread_mutex_unlock (&ring->mutex);
+
+	dts_digestUpdate (d, (unsigned char *) ring->buf[slot], 
+	    (size_t) ring->len[slot]);
+
+	pthread_mutex_lock (&ring->mutex);
+	ring->ndone[w]++;
+	pthread_cond_broadcast (&ring->cond);
+	pthread_mutex_unlock (&ring->mutex);
+    }
+
+    return ((void *) NULL);
+}
+
+
+/**
+ *  DTS_CRCSLICEINIT -- Build the slice-by-8 CRC tables from crc_tab.
+ */
+static void
+dts_crcSliceInit (void)
+{
+    register int i, k;
+
+    for (i=0; i < 256; i++)
+	crc_slice[0][i] = crc_tab[i];
+    for (k=1; k < 8; k++)
+	for (i=0; i < 256; i++)
+	    crc_slice[k][i] = (crc_slice[k-1][i] >> 8) ^ 
+		crc_slice[0][crc_slice[k-1][i] & 0xFF];
+}
@@ -9,6 +9,7 @@
  */
 /*****************************************************************************/
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -40,6 +41,9 @@ static char *localhost 	= (char *) NULL;
 #ifdef USE_CLEVEL
 static int   clevel	= 0;
 #endif
+static pthread_once_t cmd_once = PTHREAD_ONCE_INIT;
+
+static void  dts_cmdOnce (void);
 
 extern  DTS *dts;
 extern  int  dts_monitor;
@@ -640,10 +644,11 @@ dts_hostIsDir (char *host, char *path)
  *  @param  path	path on disk partition to be checked.
  *  @return		1 (one) if DTS responds.
  */
-int
+long
 dts_hostDiskFree (char *host, char *path)
 {
-    int   client = dts_getClient (host), size;
+    int   client = dts_getClient (host);
+    long long size = 0;
 
 
     dts_cmdInit();			/* initialize static variables	*/
@@ -655,11 +660,11 @@ dts_hostDiskFree (char *host, char *path)
     xr_setStringInParam (client, (path ? path : ""));
 
     if (xr_callSync (client, "diskFree") == OK) {
-	xr_getIntFromResult (client, &size);
+	xr_getLongLongFromResult (client, &size);
         if (DEBUG) 
-	    fprintf (stderr, "dts_hostDiskFree:  sz = %d\n", size);
+	    fprintf (stderr, "dts_hostDiskFree:  sz = %lld\n", size);
 	dts_closeClient (client);
-	return (size);
+	return ((long) size);
     }
 
     dts_closeClient (client);
@@ -678,10 +683,11 @@ dts_hostDiskFree (char *host, char *path)
  *  @param  path	path on disk partition to be checked.
  *  @return		1 (one) if DTS responds.
  */
-int
+long
 dts_hostDiskUsed (char *host, char *path)
 {
-    int   client = dts_getClient (host), size;
+    int   client = dts_getClient (host);
+    long long size = 0;
 
 
     dts_cmdInit();			/* initialize static variables	*/
@@ -693,11 +699,11 @@ dts_hostDiskUsed (char *host, char *path)
     xr_setStringInParam (client, (path ? path : ""));
 
     if (xr_callSync (client, "diskUsed") == OK) {
-	xr_getIntFromResult (client, &size);
+	xr_getLongLongFromResult (client, &size);
         if (DEBUG) 
-	    fprintf (stderr, "dts_hostDiskUsed:  sz = %d\n", size);
+	    fprintf (stderr, "dts_hostDiskUsed:  sz = %lld\n", size);
 	dts_closeClient (client);
-	return (size);
+	return ((long) size);
     }
 
     dts_closeClient (client);
@@ -759,7 +765,8 @@ dts_hostEcho (char *host, char *str)
 long
 dts_hostFSize (char *host, char *path)
 {
-    int client = dts_getClient (host), res;
+    int client = dts_getClient (host);
+    long long res = 0;
 
 
     dts_cmdInit();			/* initialize static variables	*/
@@ -776,11 +783,11 @@ dts_hostFSize (char *host, char *path)
     xr_setStringInParam (client, (path ? path : ""));
 
     if (xr_callSync (client, "fsize") == OK) {
-        xr_getIntFromResult (client, &res);
+        xr_getLongLongFromResult (client, &res);
         if (DEBUG) 
-	    fprintf (stderr, "dts_hostFSize:  res = %d\n", res);
+	    fprintf (stderr, "dts_hostFSize:  res = %lld\n", res);
 	dts_closeClient (client);
-        return (res);
+        return ((long) res);
     }
 
     dts_closeClient (client);
@@ -893,8 +900,9 @@ int
 dts_hostFGet (char *host, char *fname, char *local, int blk)
 {
     long   fsize = dts_hostFSize (host, fname);	/* get the file size */
-    int    noff = 0, ofd, sz;
-    int    nread = 0, nleft, nw=0, snum, tsec=0, tusec=0;
+    long long noff = 0;
+    long   nread = 0, nleft;
+    int    ofd, sz, nw=0, snum, tsec=0, tusec=0;
     struct timeval tv1, tv2;
 
     char  res[65536], *sres = res;
@@ -938,14 +946,14 @@ dts_hostFGet (char *host, char *fname, char *local, int blk)
 	/* Make the service call to read a chunk of data.
 	*/
 	xr_setStringInParam (client, (fname ? fname : ""));
-	xr_setIntInParam (client, noff);
+	xr_setLongLongInParam (client, noff);
 	xr_setIntInParam (client, blk);
 
 	memset (sres, 0, (2*blk));
     	if (xr_callSync (client, "read") == OK) {
             xr_getStructFromResult (client, &snum);
 	        xr_getIntFromStruct (snum, "size",   &sz);
-	        xr_getIntFromStruct (snum, "offset", &noff);
+	        xr_getLongLongFromStruct (snum, "offset", &noff);
 	        xr_getStringFromStruct (snum, "data", &sres);
 
 	    /* Decode.
@@ -1391,7 +1399,7 @@ dts_hostPrealloc (char *host, char *path, long size)
     /* Make the service call.
     */
     xr_setStringInParam (client, (path ? path : ""));
-    xr_setIntInParam (client, (int) size);
+    xr_setLongLongInParam (client, (long long) size);
 
     if (xr_callSync (client, "prealloc") == OK) {
         xr_getIntFromResult (client, &res);
@@ -1540,10 +1548,11 @@ dts_hostStat (char *host, char *path, struct stat *st)
  *  @param  val		value to retrieve
  *  @return		value from stat() structure
  */
-int
+long
 dts_hostStatVal (char *host, char *path, char *val)
 {
-    int client = dts_getClient (host), res;
+    int client = dts_getClient (host);
+    long long res = 0;
 
 
     dts_cmdInit();			/* initialize static variables	*/
@@ -1561,11 +1570,11 @@ dts_hostStatVal (char *host, char *path, char *val)
     xr_setStringInParam (client, val);
 
     if (xr_callSync (client, "statVal") == OK) {
-        xr_getIntFromResult (client, &res);
+        xr_getLongLongFromResult (client, &res);
         if (DEBUG) 
-	    fprintf (stderr, "dts_hostStatVal:  res = %d\n", res);
+	    fprintf (stderr, "dts_hostStatVal:  res = %lld\n", res);
 	dts_closeClient (client);
-        return (res);
+        return ((long) res);
     }
 
     dts_closeClient (client);
@@ -1735,7 +1744,7 @@ dts_hostTouch (char *host, char *path)
  *  DTS_HOSTREAD -- Read a chunk from a file.
  *
  *  @brief  Read a chunk from a file.
- *  @fn     str = dts_hostRead (char *host, char *fname, int offset, 
+ *  @fn     str = dts_hostRead (char *host, char *fname, long offset, 
  *				    int sz, int *retnb)
  *
  *  @param  host	host machine name (or IP string)
@@ -1750,11 +1759,12 @@ dts_hostTouch (char *host, char *path)
 
 
 unsigned char *
-dts_hostRead (char *host, char *fname, int offset, int sz, int *retnb)
+dts_hostRead (char *host, char *fname, long offset, int sz, int *retnb)
 {
     long   fsize = dts_hostFSize (host, fname);	/* get the file size */
-    int    nbytes, chunk, noff;
-    int    nread = 0, nleft = sz, snum;
+    long long noff;
+    long   nbytes, nleft = sz;
+    int    chunk, nread = 0, snum;
     char  res[2*SZ_BLOCK], *sres = res;
     unsigned char  *data, *dp;
 
@@ -1795,14 +1805,14 @@ dts_hostRead (char *host, char *fname, int offset, int sz, int *retnb)
 	/* Make the service call to read a chunk of data.
 	*/
 	xr_setStringInParam (client, (fname ? fname : ""));
-	xr_setIntInParam (client, noff);
+	xr_setLongLongInParam (client, noff);
 	xr_setIntInParam (client, chunk);
 
 	memset (sres, 0, (2*SZ_BLOCK));
     	if (xr_callSync (client, "read") == OK) {
             xr_getStructFromResult (client, &snum);
 	        xr_getIntFromStruct (snum, "size",   &sz);
-	        xr_getIntFromStruct (snum, "offset", &noff);
+	        xr_getLongLongFromStruct (snum, "offset", &noff);
 	        xr_getStringFromStruct (snum, "data", &sres);
 	    xr_freeStruct (snum);
 
@@ -2742,7 +2752,7 @@ dts_hostUpStats (char *host, char *qname, xferStat *xfs)
     /* Make the service call.
     */
     xr_setStringInParam (client, qname);
-    xr_setIntInParam (client, xfs->fsize);
+    xr_setLongLongInParam (client, (long long) xfs->fsize);
     xr_setDoubleInParam (client, xfs->tput_mb);
     xr_setDoubleInParam (client, xfs->time);
 
@@ -3024,13 +3034,22 @@ dts_isLocal (char *host)
 
 
 /**
- *  DTS_CMDINIT - Initialize the command interface.
+ *  DTS_CMDINIT - Initialize the command interface.  Transfers may call
+ *  this from several threads at once, only the first does the work.
  */
 void
 dts_cmdInit ()
 {
-    /* Get the local host name the first time called.
-    */
+    pthread_once (&cmd_once, dts_cmdOnce);
+}
+
+
+/**
+ *  DTS_CMDONCE - Get the local host name the first time called.
+ */
+static void
+dts_cmdOnce (void)
+{
     if (!localhost) {
 	localhost = (char *) calloc (1, SZ_PATH);
 	gethostname (localhost, SZ_PATH);
@@ -3048,6 +3067,7 @@ dts_getClient (char *host)
 {
     int  client;
     char *s_host = dts_resolveHost (host);
+    char  c_url[SZ_URL];		/* per-call, may be threaded	*/
 
 
     if (s_host == NULL)			/* cannot resolve host		*/
@@ -3055,17 +3075,17 @@ dts_getClient (char *host)
 
     dts_cmdInit();			/* initialize static variables	*/
 
-    memset (url, 0, SZ_URL);
+    memset (c_url, 0, SZ_URL);
     if (host && strchr (host, (int)':'))
-	sprintf (url, "http://%s/RPC2", host);
+	sprintf (c_url, "http://%s/RPC2", host);
     else
-	sprintf (url, "http://%s:%d/RPC2", s_host, DTS_PORT);
+	sprintf (c_url, "http://%s:%d/RPC2", s_host, DTS_PORT);
 
     if (DEBUG) 
 	fprintf (stderr, "getClient: host '%s' -> server url = '%s'\n", 
-	    host, url);
+	    host, c_url);
     
-    client = xr_initClient (url, "client", "1.0");
+    client = xr_initClient (c_url, "client", "1.0");
 
     if (client >= 0) {
         xr_initParam (client);
@@ -18,9 +18,11 @@
 #include <math.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
-#include "dtsPSock.h"
 #include "dts.h"
+#include "dtsPSock.h"
 
 
 /*
@@ -50,6 +52,7 @@ static char *dts_cfgKey (char *line);
 static char *dts_cfgVal (char *line);
 static int   dts_cfgBool (char *line);
 static int   dts_cfgInt (char *line);
+static void  dts_cfgNetPath (char *val, char path[][SZ_FNAME], int *npaths);
 
 extern char *dtsGets (char *s, int len, FILE *fd);
 
@@ -179,9 +182,10 @@ dts_loadConfigFile (DTS *dts, char *cfg, char *dhost, int dport, char *droot,
     static char line[SZ_LINE], dhostIP[SZ_LINE], localhost[SZ_LINE];
     char   str[SZ_LINE], name[SZ_LINE], port[SZ_LINE], cport[SZ_LINE];
     char   hostIP[SZ_LINE], host[SZ_LINE], root[SZ_PATH], network[SZ_LINE];
-    char   copyDir[SZ_PATH];
+    char   copyDir[SZ_PATH], npath[MAX_NET_PATHS][SZ_FNAME];
     char  *key, *val, *lp, *hip;
     int    i, lnum = 0, found = 0, valid = 0, nmatch = 0, in_dts = 0;
+    int    npaths = 0;
     int	   dlport = -1, dhport = -1, dcport = -1;
 
     dtsClient   *client	= (dtsClient *) NULL;
@@ -270,6 +274,7 @@ dts_loadConfigFile (DTS *dts, char *cfg, char *dhost, int dport, char *droot,
 	       	strcpy (cport,   DTS_CPORT_STR);
 	       	dhport = -1;
 	       	dlport = -1;
+		npaths = 0;
 
 		for (i=CFG_NREQUIRED; i ; ) {
     		    dtsGets (line, SZ_LINE, fd);
@@ -316,6 +321,13 @@ dts_loadConfigFile (DTS *dts, char *cfg, char *dhost, int dport, char *droot,
 	    	    } else if (strncasecmp (key, "copyDir", 4) == 0) {
 	       		strcpy (copyDir, val);
 
+	    	    } else if (strcasecmp (key, "path") == 0) {
+			/*  Address on another network, any number may be
+			 *  given so they don't count as a required keyword.
+			 */
+			dts_cfgNetPath (val, npath, &npaths);
+			continue;
+
 		    } else {
 			/*  Break on the first optional keyword.
 			 */
@@ -424,6 +436,9 @@ dts_loadConfigFile (DTS *dts, char *cfg, char *dhost, int dport, char *droot,
                     strcpy (client->clientCopy, copyDir);
                     strcpy (client->clientIP, hostIP);
                     sprintf (client->clientUrl,"http://%s:%s/RPC2",hostIP,port);
+                    for (i=0; i < npaths; i++)
+                        strcpy (client->clientPath[i], npath[i]);
+                    client->clientNPaths = npaths;
                     for (i=0; i < dts->nclients; i++) {
                         if (strcmp (name, dts->clients[i]->clientName) == 0) {
                             dtsLog (dts,
@@ -461,6 +476,9 @@ dts_loadConfigFile (DTS *dts, char *cfg, char *dhost, int dport, char *droot,
 		    strcpy (client->clientIP, hostIP);
 		    sprintf (client->clientUrl,"http://%s:%s/RPC2", 
 			hostIP, port);
+                    for (i=0; i < npaths; i++)
+                        strcpy (client->clientPath[i], npath[i]);
+                    client->clientNPaths = npaths;
 
 		    if (DEBUG || dts->debug) {
 			fprintf (stderr, "NOT MATCHED host=%s  localhost=%s\n",
@@ -490,6 +508,9 @@ dts_loadConfigFile (DTS *dts, char *cfg, char *dhost, int dport, char *droot,
 	    	    	    context = CON_DTS;
 			    break;
 		        }
+			if (strcasecmp (dts_cfgKey (str), "path") == 0)
+			    dts_cfgNetPath (dts_cfgVal (str), client->clientPath,
+				&client->clientNPaths);
     		    }
 
 		    /* Check for end of file
@@ -548,6 +569,22 @@ dts_loadConfigFile (DTS *dts, char *cfg, char *dhost, int dport, char *droot,
 		strcpy (cport, val);
 		dts->contactPort = atoi (val);
 
+	    } else if (strcasecmp (key, "dataPort") == 0) {
+		dts->dataPort = atoi (val);
+
+	    } else if (strcasecmp (key, "maxRate") == 0) {
+		if (dts->nrates >= MAX_RATES ||
+		    dts_cfgRate (val, &dts->rates[dts->nrates]) != OK) {
+	    	        fprintf (stderr, "Error: Invalid maxRate '%s'\n",
+			    (val ? val : ""));
+		        exit (1);
+		}
+		dts->nrates++;
+
+	    } else if (strcasecmp (key, "path") == 0 && dts->self) {
+		dts_cfgNetPath (val, dts->self->clientPath, 
+		    &dts->self->clientNPaths);
+
 	    } else if (strcasecmp (key, "queue") == 0) {
 	        context = CON_QUEUE;
 	        dtsq = dts_newQueue (dts);
@@ -658,8 +695,41 @@ dts_loadConfigFile (DTS *dts, char *cfg, char *dhost, int dport, char *droot,
 	            dtsq->port = dts_getQPort (dts,dtsq->name,dts_cfgInt(line));
 	    } else if (strcasecmp (key, "keepalive") == 0) {
 	        dtsq->keepalive = dts_cfgInt (line);
+	    } else if (strcasecmp (key, "compress") == 0) {
+		if (strncasecmp (val, "rice", 4) == 0)
+		    dtsq->compress = CODEC_RICE;
+		else if (!val[0] || strncasecmp (val, "none", 4) == 0)
+		    dtsq->compress = CODEC_NONE;
+		else {
+	    	    fprintf (stderr, 
+			"Error: Invalid compress '%s' for queue '%s'\n",
+			val, dtsq->name);
+		    exit (1);
+		}
+	    } else if (strcasecmp (key, "dedup") == 0) {
+		dtsq->dedup = dts_cfgBool (val);
+	    } else if (strcasecmp (key, "cutthrough") == 0) {
+		dtsq->cut_through = dts_cfgBool (val);
+	    } else if (strcasecmp (key, "wan") == 0) {
+		dtsWanSpec  w;
+
+		if (!val[0] || strcasecmp (val, "none") == 0)
+		    dtsq->wan[0] = '\0';
+		else if (dts_wanParse (val, &w) != OK) {
+	    	    fprintf (stderr, 
+			"Error: Invalid wan '%s' for queue '%s'\n",
+			val, dtsq->name);
+		    exit (1);
+		} else
+	            strncpy (dtsq->wan, val, SZ_FNAME - 1);
 	    } else if (strcasecmp (key, "udt_rate") == 0) {
 	        dtsq->udt_rate = dts_cfgInt (line);
+	    } else if (strcasecmp (key, "rate_weight") == 0) {
+	        dtsq->rate_weight = dts_cfgInt (line);
+	    } else if (strcasecmp (key, "min_rate") == 0) {
+	        dtsq->min_rate = dts_cfgInt (line);
+	    } else if (strcasecmp (key, "max_rate") == 0) {
+	        dtsq->max_rate = dts_cfgInt (line);
 	    } else if (strcasecmp (key, "interval") == 0) {
 	        dtsq->interval = dts_cfgInterval (val);
 	    } else if (strcasecmp (key, "start_time") == 0) {
@@ -857,6 +927,9 @@ dts_newQueue (DTS *dts)
     dtsq->port            = -1;			/* force value to be found    */
     dtsq->nthreads        = 4;
     dtsq->keepalive       = 0;
+    dtsq->compress        = CODEC_NONE;
+    dtsq->dedup           = 1;
+    dtsq->rate_weight     = 1;
     dtsq->deliveryPolicy  = QUEUE_REPLACE;
 
     /*  Initialize the queue semaphores.  These are actually created in the
@@ -964,6 +1037,9 @@ dts_getQPort (DTS *dts, char *qname, int tport)
             for (i=0; i < dts->nqueues && i < MAX_QUEUES; i++) {
 	        dtsq = dts->queues[i];
 	        hi = lo + dtsq->nthreads - 1;
+		if (dtsq->type == QUEUE_FANOUT)	/* a block for each dest */
+		    hi = lo + dtsq->nthreads * 
+			max (1, dts_queueDestList (dtsq, NULL)) - 1;
 
 	        if (!dtsq->name || strcmp (qname, dtsq->name) == 0) {
 	            dtsq->port = lo;
@@ -1209,6 +1285,7 @@ dts_cfgQType (char *s)
     if (strcasecmp (s,"normal")    == 0) return (QUEUE_NORMAL);
     if (strcasecmp (s,"scheduled") == 0) return (QUEUE_SCHEDULED);
     if (strcasecmp (s,"priority")  == 0) return (QUEUE_PRIORITY);
+    if (strcasecmp (s,"fanout")    == 0) return (QUEUE_FANOUT);
 
     return (-1);
 }
@@ -1252,6 +1329,7 @@ dts_cfgQMethod (char *s)
     if (strcasecmp (s, "user") == 0)    return (TM_USER);
     if (strcasecmp (s, "inline") == 0)  return (TM_INLINE);
     if (strcasecmp (s, "udt") == 0)     return (TM_UDT);
+    if (strcasecmp (s, "uring") == 0)   return (TM_URING);
     if (strcasecmp (s, "scp") == 0)     return (TM_SCP);
 
     return (-1);
@@ -1288,7 +1366,8 @@ dts_cfgQTypeStr (int type)
 {
     return (type == QUEUE_NORMAL    ? "normal" : 
 	   (type == QUEUE_SCHEDULED ? "scheduled" : 
-	   (type == QUEUE_PRIORITY  ?  "priority" : "unknown" )));
+	   (type == QUEUE_PRIORITY  ?  "priority" : 
+	   (type == QUEUE_FANOUT    ?  "fanout" : "unknown" ))));
 }
 
 
@@ -1328,6 +1407,7 @@ dts_cfgQMethodStr (int method)
     case TM_PSOCK:	return ("psock");
     case TM_SCP:	return ("scp");
     case TM_UDT:	return ("udt");
+    case TM_URING:	return ("uring");
     default: 		return ("");
     }
 }
@@ -1399,6 +1479,43 @@ dts_cfgStartTime (char *tstr)
 }
 
 
+/**
+ *  DTS_CFGRATE -- Convert a rate entry, a rate in Mbps optionally followed
+ *  by the time of day it applies (e.g. "200 18:00-07:00").
+ *
+ *  @brief  Convert a rate entry
+ *  @fn     int dts_cfgRate (char *val, dtsRate *rate)
+ *
+ *  @param  val		rate value (string type)
+ *  @param  rate	rate entry (output)
+ *  @return		OK or ERR
+ */
+int
+dts_cfgRate (char *val, dtsRate *rate)
+{
+    int  n, sh = 0, sm = 0, eh = 0, em = 0;
+
+
+    memset (rate, 0, sizeof (dtsRate));
+    rate->start = rate->end = -1;
+
+    if (!val || (n = sscanf (val, "%d %d:%d-%d:%d", 
+	&rate->mbps, &sh, &sm, &eh, &em)) < 1 || rate->mbps < 0)
+	    return (ERR);
+
+    if (n == 5) {
+	if (sh < 0 || sh > 24 || sm < 0 || sm > 59 || 
+	    eh < 0 || eh > 24 || em < 0 || em > 59)
+		return (ERR);
+	rate->start = sh * 60 + sm;
+	rate->end   = eh * 60 + em;
+    } else if (n != 1)
+	return (ERR);
+
+    return (OK);
+}
+
+
 
 /******************************************************************************
 **  Private Methods
@@ -1485,6 +1602,33 @@ dts_cfgInt (char *line)
 }
 
 
+/**
+ *  DTS_CFGNETPATH -- Add the address of a host on another network to its
+ *  list of paths.  The address is resolved here so a bad entry is caught
+ *  when the config is loaded rather than when a transfer uses it.
+ */
+static void
+dts_cfgNetPath (char *val, char path[][SZ_FNAME], int *npaths)
+{
+    struct in_addr addr;
+    char  *ip;
+
+
+    if (!val || !val[0])
+	return;
+    if (*npaths >= MAX_NET_PATHS) {
+	fprintf (stderr, "Warning: too many paths, '%s' ignored\n", val);
+	return;
+    }
+
+    if ((ip = dts_resolveHost (val)) == NULL || !inet_aton (ip, &addr)) {
+	fprintf (stderr, "Cannot resolve path '%s'\n", val);
+	exit (1);
+    }
+    strcpy (path[(*npaths)++], ip);
+}
+
+
 /**
  *  DTS_CFGPATH -- Construct a path to a user's ".dts_config" file.
  */
@@ -1523,6 +1667,7 @@ dts_printConfig (DTS *dts)
     printf ("  serverHost:  %s\n", dts->serverHost);
     printf ("  serverPort:  %d\n", dts->serverPort);
     printf (" contactPort:  %d\n", dts->contactPort);
+    printf ("    dataPort:  %d\n", dts->dataPort);
     printf ("\n");
     printf ("  configFile:  %s\n", dts->configFile);
     printf ("     logFile:  %s\n", dts->logFile);
@@ -1557,6 +1702,7 @@ dts_fmtConfig (DTS *dts)
       serverHost:  %s\n\
       serverPort:  %d\n\
      contactPort:  %d\n\
+        dataPort:  %d\n\
       configFile:  %s\n\
          logFile:  %s\n\
         nclients:  %d\n\
@@ -1575,6 +1721,7 @@ dts_fmtConfig (DTS *dts)
 		dts->serverHost,
 		dts->serverPort,
 		dts->contactPort,
+		dts->dataPort,
 		dts->configFile,
 		dts->logFile,
 		dts->nclients,
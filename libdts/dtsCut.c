@@ -0,0 +1,666 @@
+/**
+ *  DTSCUT.C -- Cut-through forwarding on intermediate transfer nodes.
+ *
+ *  Normally a transfer node waits for the whole object to arrive and be
+ *  validated in endTransfer before its queue manager starts sending it on
+ *  to the next hop.  On a queue with cut-through enabled the object is
+ *  registered here when its control file arrives.  The queue manager may
+ *  then pick it up at once and the senders for the next hop attach to it
+ *  as readers:  a read waits until the range asked for has been received
+ *  (the psock receiver marks the ranges it writes), so the next hop is
+ *  fed as the data comes in.  Only the commit is held back:  the manager
+ *  waits for our own validation of the object before it ends the transfer
+ *  at the next hop, and an object which fails validation here is never
+ *  delivered downstream.
+ *
+ *  Readers are real descriptors open on the file, and dts_filePRead()
+ *  dispatches to dts_cutRead() for them.  An object whose sender stops
+ *  for longer than CUT_MAX_IDLE seconds is given up on, the readers fail
+ *  and the manager falls back to the normal store-and-forward handling.
+ *
+ *	 stat = dts_cutOpen (dir, path, fsize, sum32, crc32, md5)
+ *	 stat = dts_cutPending (dir)
+ *	 size = dts_cutSize (path)
+ *	 stat = dts_cutControl (path, ctrl)
+ *	        dts_cutBind (fd)
+ *	        dts_cutMark (fd, offset, nbytes)
+ *	        dts_cutUnbind (fd, status)
+ *	   fd = dts_cutAttach (path)
+ *	 stat = dts_cutIsReader (fd)
+ *	nread = dts_cutRead (fd, buf, nbytes, offset)
+ *	        dts_cutDetach (fd)
+ *	        dts_cutDone (dir, status)
+ *	 stat = dts_cutWait (path)
+ *
+ *  @file       dtsCut.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  Cut-through forwarding on intermediate transfer nodes.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "dts.h"
+
+
+static cutObject *cut_object[CUT_MAX_FILES];	/* objects in flight	*/
+static cutObject *cut_reader[CUT_MAX_FD];	/* attached readers	*/
+
+static pthread_mutex_t cut_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cut_cond  = PTHREAD_COND_INITIALIZER;
+
+static cutObject *dts_cutFind (char *path, int isDir);
+static cutObject *dts_cutWriter (int fd);
+static int   dts_cutHave (cutObject *co, long offset, long nbytes);
+static int   dts_cutIdle (cutObject *co);
+static void  dts_cutSleep (void);
+static void  dts_cutFree (cutObject *co);
+static int   dts_cutPRead (int fd, char *buf, long nbytes, off_t offset);
+
+
+
+
+/**
+ *  DTS_CUTOPEN -- Register an object about to arrive in a spool dir for
+ *  cut-through forwarding.  The (empty) file is created so the next hop
+ *  may open it before the first data arrive.  An object we already hold
+ *  in full, e.g. one linked in by initTransfer, isn't registered.
+ *
+ *  @brief	Register an incoming object for cut-through forwarding.
+ *  @fn		int dts_cutOpen (char *dir, char *path, long fsize,
+ *			unsigned int sum32, unsigned int crc32, char *md5)
+ *
+ *  @param  dir		spool directory
+ *  @param  path	path to the object
+ *  @param  fsize	size of the object
+ *  @param  sum32	32-bit checksum of the object
+ *  @param  crc32	CRC of the object
+ *  @param  md5		MD5 sum of the object
+ *  @return		OK or ERR
+ */
+int
+dts_cutOpen (char *dir, char *path, long fsize, unsigned int sum32,
+	unsigned int crc32, char *md5)
+{
+    cutObject *co = (cutObject *) NULL;
+    struct stat ds, st;
+    int    i, fd, slot = -1;
+
+
+    if (fsize <= 0 || stat (dir, &ds) < 0)
+	return (ERR);
+    if ((fd = open (path, O_RDWR|O_CREAT, DTS_FILE_MODE)) < 0)
+	return (ERR);
+    if (fstat (fd, &st) < 0 || (long) st.st_size >= fsize) {
+	close (fd);
+	return (ERR);
+    }
+    close (fd);
+
+    if ((co = calloc (1, sizeof (cutObject))) == NULL)
+	return (ERR);
+    co->nblocks = (fsize + CUT_BLOCK - 1) / CUT_BLOCK;
+    if ((co->nrecv = calloc (co->nblocks, sizeof (long))) == NULL) {
+	free ((void *) co);
+	return (ERR);
+    }
+    co->ddev   = ds.st_dev;
+    co->dino   = ds.st_ino;
+    co->dev    = st.st_dev;
+    co->ino    = st.st_ino;
+    co->size   = fsize;
+    co->sum32  = sum32;
+    co->crc32  = crc32;
+    strncpy (co->md5, (md5 ? md5 : ""), SZ_PATH-1);
+    co->writer = -1;
+    co->state  = CUT_RECEIVING;
+    co->mtime  = time (NULL);
+
+    /*  Take a free slot, or one whose sender has given up.  A dir being
+     *  reused replaces its old entry.
+     */
+    pthread_mutex_lock (&cut_mutex);
+    for (i=0; i < CUT_MAX_FILES; i++) {
+	cutObject *old = cut_object[i];
+
+	if (old && old->ddev == co->ddev && old->dino == co->dino) {
+	    slot = i;
+	    break;
+	} else if (slot < 0 && (!old || (dts_cutIdle (old) && !old->nreaders)))
+	    slot = i;
+    }
+    if (slot >= 0) {
+	if (cut_object[slot]) {
+	    cut_object[slot]->closed = 1;
+	    if (cut_object[slot]->nreaders == 0)
+		dts_cutFree (cut_object[slot]);
+	}
+	cut_object[slot] = co;
+    }
+    pthread_mutex_unlock (&cut_mutex);
+
+    if (slot < 0) {
+	dts_cutFree (co);
+	return (ERR);
+    }
+    return (OK);
+}
+
+
+/**
+ *  DTS_CUTPENDING -- See whether the object in a spool dir may be
+ *  forwarded before its transfer here has completed.
+ *
+ *  @brief	See whether a spool dir holds a cut-through object.
+ *  @fn		int dts_cutPending (char *dir)
+ *
+ *  @param  dir		spool directory
+ *  @return		1 if the object may be forwarded now, 0 otherwise
+ */
+int
+dts_cutPending (char *dir)
+{
+    cutObject *co = (cutObject *) NULL;
+    int   pending = 0;
+
+
+    pthread_mutex_lock (&cut_mutex);
+    if ((co = dts_cutFind (dir, 1)))
+	pending = !dts_cutIdle (co);
+    pthread_mutex_unlock (&cut_mutex);
+
+    return (pending);
+}
+
+
+/**
+ *  DTS_CUTSIZE -- Get the size a cut-through object will have once it has
+ *  all arrived.
+ *
+ *  @brief	Get the final size of a cut-through object.
+ *  @fn		long dts_cutSize (char *path)
+ *
+ *  @param  path	path to the object
+ *  @return		size of the object, or -1 if not a cut-through object
+ */
+long
+dts_cutSize (char *path)
+{
+    cutObject *co = (cutObject *) NULL;
+    long  size = -1;
+
+
+    pthread_mutex_lock (&cut_mutex);
+    if ((co = dts_cutFind (path, 0)))
+	size = co->size;
+    pthread_mutex_unlock (&cut_mutex);
+
+    return (size);
+}
+
+
+/**
+ *  DTS_CUTCONTROL -- Set the size and checksums in the control for the
+ *  next hop from those the object was sent to us with, since we can't
+ *  compute them from a file still arriving.
+ *
+ *  @brief	Set the control sums for a cut-through object.
+ *  @fn		int dts_cutControl (char *path, Control *ctrl)
+ *
+ *  @param  path	path to the object
+ *  @param  ctrl	control structure
+ *  @return		OK, or ERR if not a cut-through object
+ */
+int
+dts_cutControl (char *path, Control *ctrl)
+{
+    cutObject *co = (cutObject *) NULL;
+    int   stat = ERR;
+
+
+    pthread_mutex_lock (&cut_mutex);
+    if ((co = dts_cutFind (path, 0))) {
+	ctrl->fsize = co->size;
+	ctrl->sum32 = co->sum32;
+	ctrl->crc32 = co->crc32;
+	strcpy (ctrl->md5, co->md5);
+	stat = OK;
+    }
+    pthread_mutex_unlock (&cut_mutex);
+
+    return (stat);
+}
+
+
+/**
+ *  DTS_CUTBIND -- Bind the descriptor of a file being received to its
+ *  cut-through object, if any.
+ *
+ *  @brief	Bind a receive descriptor to a cut-through object.
+ *  @fn		void dts_cutBind (int fd)
+ *
+ *  @param  fd		receive file descriptor
+ *  @return		nothing
+ */
+void
+dts_cutBind (int fd)
+{
+    struct stat st;
+    int   i;
+
+
+    if (fd < 0 || fstat (fd, &st) < 0)
+	return;
+
+    pthread_mutex_lock (&cut_mutex);
+    for (i=0; i < CUT_MAX_FILES; i++) {
+	cutObject *co = cut_object[i];
+
+	if (co && co->dev == st.st_dev && co->ino == st.st_ino) {
+	    co->writer = fd;
+	    co->mtime  = time (NULL);
+	    break;
+	}
+    }
+    pthread_mutex_unlock (&cut_mutex);
+}
+
+
+/**
+ *  DTS_CUTMARK -- Record a range of a cut-through object as received and
+ *  wake any readers waiting for it.
+ *
+ *  @brief	Record a range of a cut-through object as received.
+ *  @fn		void dts_cutMark (int fd, long offset, long nbytes)
+ *
+ *  @param  fd		receive file descriptor
+ *  @param  offset	file offset of the range
+ *  @param  nbytes	size of the range
+ *  @return		nothing
+ */
+void
+dts_cutMark (int fd, long offset, long nbytes)
+{
+    cutObject *co = (cutObject *) NULL;
+    long   b, lo, hi;
+
+
+    if (fd < 0 || nbytes <= 0)
+	return;
+
+    pthread_mutex_lock (&cut_mutex);
+    if ((co = dts_cutWriter (fd))) {
+	for (b = offset / CUT_BLOCK; b <= (offset + nbytes - 1) / CUT_BLOCK &&
+	    b < co->nblocks; b++) {
+		lo = max (offset, b * CUT_BLOCK);
+		hi = min (offset + nbytes, (b + 1) * CUT_BLOCK);
+		co->nrecv[b] += (hi - lo);
+	}
+	co->mtime = time (NULL);
+	pthread_cond_broadcast (&cut_cond);
+    }
+    pthread_mutex_unlock (&cut_mutex);
+}
+
+
+/**
+ *  DTS_CUTUNBIND -- Release the receive descriptor of a cut-through object
+ *  when the file is closed.  After a successful transfer the readers may
+ *  take whatever remains.
+ *
+ *  @brief	Release the receive descriptor of a cut-through object.
+ *  @fn		void dts_cutUnbind (int fd, int status)
+ *
+ *  @param  fd		receive file descriptor
+ *  @param  status	transfer status
+ *  @return		nothing
+ */
+void
+dts_cutUnbind (int fd, int status)
+{
+    cutObject *co = (cutObject *) NULL;
+
+
+    pthread_mutex_lock (&cut_mutex);
+    if ((co = dts_cutWriter (fd))) {
+	co->writer = -1;
+	co->mtime  = time (NULL);
+	if (status == OK && co->state == CUT_RECEIVING)
+	    co->state = CUT_RECEIVED;
+	pthread_cond_broadcast (&cut_cond);
+    }
+    pthread_mutex_unlock (&cut_mutex);
+}
+
+
+/**
+ *  DTS_CUTATTACH -- Open a cut-through object to send it on.
+ *
+ *  @brief	Open a cut-through object to send it on.
+ *  @fn		int dts_cutAttach (char *path)
+ *
+ *  @param  path	path to the object
+ *  @return		reader descriptor, or -1 if not a cut-through object
+ */
+int
+dts_cutAttach (char *path)
+{
+    cutObject *co = (cutObject *) NULL;
+    int   fd = -1;
+
+
+    pthread_mutex_lock (&cut_mutex);
+    if ((co = dts_cutFind (path, 0)) && (fd = open (path, O_RDONLY)) >= 0) {
+	if (fd >= CUT_MAX_FD) {
+	    close (fd);
+	    fd = -1;
+	} else {
+	    cut_reader[fd] = co;
+	    co->nreaders++;
+	}
+    }
+    pthread_mutex_unlock (&cut_mutex);
+
+    return (fd);
+}
+
+
+/**
+ *  DTS_CUTISREADER -- See whether a descriptor reads a cut-through object.
+ *
+ *  @brief	See whether a descriptor reads a cut-through object.
+ *  @fn		int dts_cutIsReader (int fd)
+ *
+ *  @param  fd		file descriptor
+ *  @return		1 if a cut-through reader, 0 otherwise
+ */
+int
+dts_cutIsReader (int fd)
+{
+    return ((fd >= 0 && fd < CUT_MAX_FD) ? (cut_reader[fd] != NULL) : 0);
+}
+
+
+/**
+ *  DTS_CUTREAD -- Read part of a cut-through object, waiting until the
+ *  range has been received.  Once the object has been validated (or has
+ *  failed) the file is read as it is, the commit downstream depends on
+ *  our validation rather than on what we send.
+ *
+ *  @brief	Read part of a cut-through object.
+ *  @fn		int dts_cutRead (int fd, void *buf, int nbytes, off_t offset)
+ *
+ *  @param  fd		reader descriptor
+ *  @param  buf		data buffer
+ *  @param  nbytes	number of bytes to read
+ *  @param  offset	file offset
+ *  @return		number of bytes read, or -1 on error
+ */
+int
+dts_cutRead (int fd, void *buf, int nbytes, off_t offset)
+{
+    cutObject *co = (cutObject *) NULL;
+
+
+    if (!dts_cutIsReader (fd))
+	return (-1);
+
+    pthread_mutex_lock (&cut_mutex);
+    co = cut_reader[fd];
+    while (co->state == CUT_RECEIVING &&
+	!dts_cutHave (co, (long) offset, (long) nbytes)) {
+	    if (dts_cutIdle (co)) {
+		pthread_mutex_unlock (&cut_mutex);
+		dtsErrLog (NULL, "cutRead: no data for %ds at offset %ld\n",
+		    CUT_MAX_IDLE, (long) offset);
+		return (-1);
+	    }
+	    dts_cutSleep ();
+    }
+    pthread_mutex_unlock (&cut_mutex);
+
+    return (dts_cutPRead (fd, (char *) buf, (long) nbytes, offset));
+}
+
+
+/**
+ *  DTS_CUTDETACH -- Close a reader of a cut-through object.
+ *
+ *  @brief	Close a reader of a cut-through object.
+ *  @fn		void dts_cutDetach (int fd)
+ *
+ *  @param  fd		reader descriptor
+ *  @return		nothing
+ */
+void
+dts_cutDetach (int fd)
+{
+    cutObject *co = (cutObject *) NULL;
+
+
+    if (!dts_cutIsReader (fd))
+	return;
+
+    pthread_mutex_lock (&cut_mutex);
+    co = cut_reader[fd];
+    cut_reader[fd] = (cutObject *) NULL;
+    close (fd);
+    if (--co->nreaders == 0 && co->closed)
+	dts_cutFree (co);
+    pthread_mutex_unlock (&cut_mutex);
+}
+
+
+/**
+ *  DTS_CUTDONE -- Record the result of validating a cut-through object
+ *  once its transfer to us has ended.
+ *
+ *  @brief	Record the validation of a cut-through object.
+ *  @fn		void dts_cutDone (char *dir, int status)
+ *
+ *  @param  dir		spool directory
+ *  @param  status	OK if the object was valid and delivered
+ *  @return		nothing
+ */
+void
+dts_cutDone (char *dir, int status)
+{
+    cutObject *co = (cutObject *) NULL;
+
+
+    pthread_mutex_lock (&cut_mutex);
+    if ((co = dts_cutFind (dir, 1))) {
+	co->state = (status == OK ? CUT_VALID : CUT_INVALID);
+	co->mtime = time (NULL);
+	pthread_cond_broadcast (&cut_cond);
+    }
+    pthread_mutex_unlock (&cut_mutex);
+}
+
+
+/**
+ *  DTS_CUTWAIT -- Wait for the validation of a cut-through object before
+ *  committing it at the next hop.  The object is no longer tracked once
+ *  we return.
+ *
+ *  @brief	Wait for the validation of a cut-through object.
+ *  @fn		int dts_cutWait (char *path)
+ *
+ *  @param  path	path to the object
+ *  @return		OK if the object is valid, ERR otherwise
+ */
+int
+dts_cutWait (char *path)
+{
+    cutObject *co = (cutObject *) NULL;
+    int   i, stat = ERR;
+
+
+    pthread_mutex_lock (&cut_mutex);
+    if ((co = dts_cutFind (path, 0))) {
+	co->nreaders++;				/* hold it while we wait */
+	while (co->state < CUT_VALID && !co->closed && !dts_cutIdle (co))
+	    dts_cutSleep ();
+	stat = (co->state == CUT_VALID ? OK : ERR);
+
+	for (i=0; i < CUT_MAX_FILES; i++)
+	    if (cut_object[i] == co)
+		cut_object[i] = (cutObject *) NULL;
+	co->closed = 1;
+	if (--co->nreaders == 0)
+	    dts_cutFree (co);
+    }
+    pthread_mutex_unlock (&cut_mutex);
+
+    return (stat);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ ****************************************************************************/
+
+/**
+ *  DTS_CUTFIND -- Find the object for a path, or for its spool dir.
+ *  Called with the table locked.
+ */
+static cutObject *
+dts_cutFind (char *path, int isDir)
+{
+    struct stat st;
+    int   i;
+
+
+    if (!path || stat (path, &st) < 0)
+	return ((cutObject *) NULL);
+
+    for (i=0; i < CUT_MAX_FILES; i++) {
+	cutObject *co = cut_object[i];
+
+	if (co && isDir && co->ddev == st.st_dev && co->dino == st.st_ino)
+	    return (co);
+	if (co && !isDir && co->dev == st.st_dev && co->ino == st.st_ino)
+	    return (co);
+    }
+    return ((cutObject *) NULL);
+}
+
+
+/**
+ *  DTS_CUTWRITER -- Find the object being written on a descriptor.
+ *  Called with the table locked.
+ */
+static cutObject *
+dts_cutWriter (int fd)
+{
+    int   i;
+
+    for (i=0; i < CUT_MAX_FILES; i++)
+	if (cut_object[i] && cut_object[i]->writer == fd)
+	    return (cut_object[i]);
+    return ((cutObject *) NULL);
+}
+
+
+/**
+ *  DTS_CUTHAVE -- See whether a range of an object has been received.
+ */
+static int
+dts_cutHave (cutObject *co, long offset, long nbytes)
+{
+    long  b, blen;
+
+
+    if (offset + nbytes > co->size)
+	nbytes = co->size - offset;
+    if (nbytes <= 0)
+	return (1);
+
+    for (b = offset / CUT_BLOCK; b <= (offset + nbytes - 1) / CUT_BLOCK; b++) {
+	blen = min (CUT_BLOCK, co->size - b * CUT_BLOCK);
+	if (co->nrecv[b] < blen)
+	    return (0);
+    }
+    return (1);
+}
+
+
+/**
+ *  DTS_CUTIDLE -- See whether an object has gone too long without any
+ *  progress:  its sender has stopped, it's been left unvalidated, or the
+ *  manager never came for it.
+ */
+static int
+dts_cutIdle (cutObject *co)
+{
+    if (co->writer >= 0)
+	return (0);
+    return ((time (NULL) - co->mtime) >= CUT_MAX_IDLE);
+}
+
+
+/**
+ *  DTS_CUTSLEEP -- Wait (at most a second) for progress on any object.
+ *  Called with the table locked.
+ */
+static void
+dts_cutSleep (void)
+{
+    struct timeval  now;
+    struct timespec ts;
+
+    gettimeofday (&now, NULL);
+    ts.tv_sec  = now.tv_sec + 1;
+    ts.tv_nsec = now.tv_usec * 1000;
+    pthread_cond_timedwait (&cut_cond, &cut_mutex, &ts);
+}
+
+
+/**
+ *  DTS_CUTFREE -- Free an object.
+ */
+static void
+dts_cutFree (cutObject *co)
+{
+    if (co->nrecv)
+	free ((void *) co->nrecv);
+    free ((void *) co);
+}
+
+
+/**
+ *  DTS_CUTPREAD -- Read exactly 'nbytes' from a file offset.
+ */
+static int
+dts_cutPRead (int fd, char *buf, long nbytes, off_t offset)
+{
+    long  nread = 0, nb;
+
+    while (nread < nbytes) {
+	if ((nb = pread (fd, &buf[nread], (nbytes - nread),
+	    offset + nread)) < 0) {
+		if (errno == EINTR)
+		    continue;
+		return (-1);
+	} else if (nb == 0)
+	    break;
+	nread += nb;
+    }
+    return ((int) nread);
+}
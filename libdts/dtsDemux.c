@@ -0,0 +1,597 @@
+/**
+ *  DTSDEMUX.C -- DTS shared data port.
+ *
+ *  Rather than every stream of a transfer binding its own port out of the
+ *  queue's loPort..hiPort range, the daemon listens on a single data port
+ *  for all transfers.  A client stream connects and first sends a small
+ *  header giving the session and its stripe number, our listener thread
+ *  then hands the connection to the stream waiting for it.  The side
+ *  listening for the streams picks a new session for each transfer with
+ *  dts_dataSession() and sends it, along with the data port it listens
+ *  on, to the peer in the transfer RPC.  Peers sharing a config have the
+ *  same port ranges so the base port alone can't tell transfers apart.
+ *
+ *  A waiting stream registers its session/stripe and is given one end of
+ *  a local socket pair which it may poll() on as it would a listening
+ *  socket, connections are passed over the pair and taken with
+ *  dts_dataAccept().  A connection arriving before its stream registers is
+ *  held for a while rather than refused.  A registration lasts until the
+ *  stream closes its end so a keepalive queue may pool it along with the
+ *  connection (see dtsPool.c).
+ *
+ *  Only the daemon listens on its 'dataPort' (see dtsd.c), other tasks
+ *  such as dtscp, or a daemon which couldn't open the port, have a data
+ *  port of zero.  The streams of such a transfer each bind their own port
+ *  as before and the peer is told to connect to those, the routines below
+ *  take the stream port for that case.  A daemon which couldn't open the
+ *  port tries again for later transfers.
+ *
+ *	 stat = dts_dataListen (port)
+ *	dport = dts_dataPort ()
+ *	 sess = dts_dataSession ()
+ *	lsock = dts_dataRegister (dport, session, stripe, port, bufsz)
+ *	 sock = dts_dataAccept (lsock, bufsz)
+ *	 sock = dts_dataConnect (host, dport, session, stripe, port, retry, 
+ *		    bufsz)
+ *	 sock = dts_dataConnectVia (host, local, dport, session, stripe, port,
+ *		    retry, bufsz)
+ *
+ *  @file       dtsDemux.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  DTS shared data port.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dts.h"
+
+
+extern  DTS  *dts;
+
+static  dtsDataSess  sess[MAX_DATA_SESS]; /* waiting streams		*/
+static  pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
+static  int  data_lsock		= 0;	/* listening socket		*/
+static  int  data_port		= 0;	/* port we're listening on	*/
+static  int  data_want		= 0;	/* port we were asked to open	*/
+static  unsigned int data_session = 0;	/* next transfer session	*/
+
+static void *dts_dataListener (void *data);
+static void  dts_dataRoute (int sock);
+static int   dts_dataPass (int rfd, int sock);
+static void  dts_dataPrune (void);
+static void  dts_dataClear (dtsDataSess *s);
+
+
+
+/**
+ *  DTS_DATALISTEN -- Start listening on the shared data port.  The first
+ *  call opens the port and starts the listener thread, later calls simply
+ *  check it's running.  If the port can't be opened we may be called
+ *  again to retry.
+ *
+ *  @brief  Start listening on the shared data port.
+ *  @fn     int dts_dataListen (int port)
+ *
+ *  @param  port	data port number
+ *  @return		OK if listening, else ERR
+ */
+int
+dts_dataListen (int port)
+{
+    pthread_t       tid;
+    pthread_attr_t  attr;
+    int   rc, status = OK;
+
+
+    pthread_mutex_lock (&data_mutex);
+    data_want = port;
+    if (data_lsock > 0) {
+	status = (port == data_port ? OK : ERR);
+
+    } else if ((data_lsock = dts_openServerSocket (port)) < 0) {
+	dtsErrLog (NULL, "dataListen: cannot open data port %d\n", port);
+	data_lsock  = 0;
+	status = ERR;
+
+    } else {
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	if ((rc = pthread_create (&tid, &attr, dts_dataListener, NULL))) {
+	    dtsErrLog (NULL, "dataListen: pthread_create() fails, code: %d\n",
+		rc);
+	    close (data_lsock);
+	    data_lsock = 0;
+	    status = ERR;
+	} else
+	    data_port = port;
+	pthread_attr_destroy (&attr);
+    }
+    pthread_mutex_unlock (&data_mutex);
+
+    return (status);
+}
+
+
+/**
+ *  DTS_DATAPORT -- Get the data port the streams of a new transfer should
+ *  connect to, i.e. the shared port if we're listening on it.  If the
+ *  port couldn't be opened earlier we try it again.
+ *
+ *  @brief  Get the data port for a new transfer.
+ *  @fn     int dts_dataPort (void)
+ *
+ *  @return		shared data port, or 0 to use the stream ports
+ */
+int
+dts_dataPort (void)
+{
+    int   port = 0, want = 0;
+
+
+    pthread_mutex_lock (&data_mutex);
+    port = (data_lsock > 0 ? data_port : 0);
+    want = data_want;
+    pthread_mutex_unlock (&data_mutex);
+
+    if (port == 0 && want > 0 && dts_dataListen (want) == OK)
+	port = want;
+
+    return (port);
+}
+
+
+/**
+ *  DTS_DATASESSION -- Get a new session for the streams of a transfer.
+ *  Sessions are unique within the listening task, the first is taken from
+ *  the pid and time so they're unlikely to match those of a task that
+ *  went before.
+ *
+ *  @brief  Get a new transfer session.
+ *  @fn     int dts_dataSession (void)
+ *
+ *  @return		session number (> 0)
+ */
+int
+dts_dataSession (void)
+{
+    int   session = 0;
+
+
+    pthread_mutex_lock (&data_mutex);
+    if (data_session == 0)
+	data_session = ((unsigned int) getpid () << 16) ^ 
+	    (unsigned int) time ((time_t) 0);
+    while ((session = (int) (data_session++ & 0x7fffffff)) == 0)
+	;
+    pthread_mutex_unlock (&data_mutex);
+
+    return (session);
+}
+
+
+/**
+ *  DTS_DATAREGISTER -- Register a stream waiting for its connection on the
+ *  shared data port.  The returned descriptor becomes readable when a
+ *  connection arrives, which is then taken with dts_dataAccept().  Closing
+ *  the descriptor cancels the registration.  A stream already registered
+ *  for the session is refused.  Without a shared port this is a listening
+ *  socket on the stream port.
+ *
+ *  @brief  Register a stream waiting on the data port.
+ *  @fn     int dts_dataRegister (int dport, int session, int stripe, 
+ *		int port, int bufsz)
+ *
+ *  @param  dport	shared data port (0 for none)
+ *  @param  session	transfer session
+ *  @param  stripe	stream number
+ *  @param  port	stream port (no shared port)
+ *  @param  bufsz	SO_SNDBUF/SO_RCVBUF size (no shared port)
+ *  @return		descriptor to wait on, or -1 on error
+ */
+int
+dts_dataRegister (int dport, int session, int stripe, int port, int bufsz)
+{
+    register int i;
+    dtsDataSess *s = (dtsDataSess *) NULL, *free_s = (dtsDataSess *) NULL;
+    int   pair[2];
+
+
+    if (dport <= 0)
+	return (dts_openServerSocketBuf (port, bufsz));
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+	dtsErrLog (NULL, "dataRegister: socketpair: %s\n", strerror (errno));
+	return (-1);
+    }
+
+    pthread_mutex_lock (&data_mutex);
+    if (data_lsock <= 0 || dport != data_port) {
+	pthread_mutex_unlock (&data_mutex);
+	dtsErrLog (NULL, "dataRegister: not listening on data port %d\n",
+	    dport);
+	close (pair[0]);
+	close (pair[1]);
+	return (-1);
+    }
+
+    dts_dataPrune ();
+    for (i=0; i < MAX_DATA_SESS; i++) {
+	if ((sess[i].rfd > 0 || sess[i].sock > 0) &&
+	    sess[i].session == session && sess[i].stripe == stripe) {
+		s = &sess[i];
+		break;
+	} else if (sess[i].rfd <= 0 && sess[i].sock <= 0 && !free_s)
+	    free_s = &sess[i];
+    }
+
+    if (s && s->rfd > 0) {
+	pthread_mutex_unlock (&data_mutex);
+	dtsErrLog (NULL, "dataRegister: stream %d:%d already registered\n",
+	    session, stripe);
+	close (pair[0]);
+	close (pair[1]);
+	return (-1);
+
+    } else if (!s && !(s = free_s)) {
+	pthread_mutex_unlock (&data_mutex);
+	dtsErrLog (NULL, "dataRegister: too many waiting streams\n");
+	close (pair[0]);
+	close (pair[1]);
+	return (-1);
+    }
+
+    s->session = session;
+    s->stripe  = stripe;
+    s->rfd     = pair[0];
+
+    /*  Hand over a connection which beat us here.
+    */
+    if (s->sock > 0) {
+	if (dts_dataPass (s->rfd, s->sock) != OK)
+	    dtsErrLog (NULL, "dataRegister: cannot pass connection %d:%d\n",
+		session, stripe);
+	close (s->sock);
+	s->sock = 0;
+    }
+    pthread_mutex_unlock (&data_mutex);
+
+    if (SOCK_DEBUG)
+	dtsErrLog (NULL, "dataRegister: session %d:%d lsock=%d\n",
+	    session, stripe, pair[1]);
+
+    return (pair[1]);
+}
+
+
+/**
+ *  DTS_DATAACCEPT -- Accept a data connection.  For a registration on the
+ *  shared data port we take the connection passed to us by the listener,
+ *  otherwise 'lsock' is an ordinary listening socket.  Since the shared
+ *  port leaves its buffers to the kernel, a tuned buffer size is applied
+ *  to the connection here.
+ *
+ *  @brief  Accept a data connection.
+ *  @fn     int dts_dataAccept (int lsock, int bufsz)
+ *
+ *  @param  lsock	registration or listening socket
+ *  @param  bufsz	SO_SNDBUF/SO_RCVBUF size (0 for default)
+ *  @return		connected socket, or -1 on error
+ */
+int
+dts_dataAccept (int lsock, int bufsz)
+{
+    struct sockaddr_storage  sa;
+    struct msghdr  msg;
+    struct iovec   iov;
+    struct cmsghdr *cm;
+    socklen_t  len = sizeof (sa);
+    char   c, cbuf[CMSG_SPACE(sizeof(int))];
+    int    sock = -1, nb = 0;
+
+
+    memset (&sa, 0, sizeof (sa));
+    if (getsockname (lsock, (struct sockaddr *) &sa, &len) < 0 ||
+	sa.ss_family != AF_UNIX)
+	    return (accept (lsock, NULL, NULL));
+
+    memset (&msg, 0, sizeof (msg));
+    iov.iov_base       = &c;
+    iov.iov_len        = 1;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof (cbuf);
+
+    while ((nb = recvmsg (lsock, &msg, 0)) < 0 && errno == EINTR)
+	;
+    if (nb <= 0) {
+	dtsErrLog (NULL, "dataAccept: %s\n",
+	    (nb < 0 ? strerror (errno) : "registration closed"));
+	return (-1);
+    }
+
+    if ((cm = CMSG_FIRSTHDR (&msg)) && cm->cmsg_level == SOL_SOCKET &&
+	cm->cmsg_type == SCM_RIGHTS)
+	    memcpy (&sock, CMSG_DATA (cm), sizeof (int));
+
+    if (sock >= 0 && bufsz > 0) {
+	setsockopt (sock, SOL_SOCKET, SO_SNDBUF, (void *)&bufsz, sizeof(int));
+	setsockopt (sock, SOL_SOCKET, SO_RCVBUF, (void *)&bufsz, sizeof(int));
+    }
+
+    return (sock);
+}
+
+
+/**
+ *  DTS_DATACONNECT -- Connect to a peer's shared data port and tell it
+ *  which stream we are.  Without a shared port we connect to the stream
+ *  port.
+ *
+ *  @brief  Connect to a peer's shared data port.
+ *  @fn     int dts_dataConnect (char *host, int dport, int session, 
+ *		int stripe, int port, int retry, int bufsz)
+ *
+ *  @param  host	peer host name
+ *  @param  dport	peer's shared data port (0 for none)
+ *  @param  session	transfer session
+ *  @param  stripe	stream number
+ *  @param  port	stream port (no shared port)
+ *  @param  retry	attempt to reconnect?
+ *  @param  bufsz	SO_SNDBUF/SO_RCVBUF size (0 for default)
+ *  @return		connected socket, or -1 on error
+ */
+int
+dts_dataConnect (char *host, int dport, int session, int stripe, int port, 
+		int retry, int bufsz)
+{
+    return (dts_dataConnectVia (host, NULL, dport, session, stripe, port, 
+	retry, bufsz));
+}
+
+
+/**
+ *  DTS_DATACONNECTVIA -- Connect to a peer's data port from the given
+ *  local address, i.e. over a particular network path (see dtsPath.c).
+ *
+ *  @brief  Connect to a peer's data port from a local address.
+ *  @fn     int dts_dataConnectVia (char *host, char *local, int dport,
+ *		int session, int stripe, int port, int retry, int bufsz)
+ *
+ *  @param  host	peer host name
+ *  @param  local	local (source) IP address, or NULL
+ *  @param  dport	peer's shared data port (0 for none)
+ *  @param  session	transfer session
+ *  @param  stripe	stream number
+ *  @param  port	stream port (no shared port)
+ *  @param  retry	attempt to reconnect?
+ *  @param  bufsz	SO_SNDBUF/SO_RCVBUF size (0 for default)
+ *  @return		connected socket, or -1 on error
+ */
+int
+dts_dataConnectVia (char *host, char *local, int dport, int session, 
+		int stripe, int port, int retry, int bufsz)
+{
+    dtsDataHdr  hdr;
+    int   sock;
+
+
+    if (dport <= 0)
+	return (dts_openClientSocketVia (host, local, port, retry, bufsz));
+
+    port = dport;
+    if ((sock = dts_openClientSocketVia (host, local, port, retry, bufsz)) < 0)
+	return (-1);
+
+    hdr.magic   = htonl (DATA_MAGIC);
+    hdr.session = htonl (session);
+    hdr.stripe  = htonl (stripe);
+    if (send (sock, &hdr, sizeof (hdr), MSG_NOSIGNAL) != sizeof (hdr)) {
+	dtsErrLog (NULL, "dataConnect: %s:%d header: %s\n", host, port,
+	    strerror (errno));
+	close (sock);
+	return (-1);
+    }
+
+    return (sock);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ *****************************************************************************/
+
+/**
+ *  DTS_DATALISTENER -- Listener thread.  Accept connections on the data
+ *  port and route them to their stream, dropping any left unclaimed.
+ */
+static void *
+dts_dataListener (void *data)
+{
+    register int i;
+    time_t now;
+    int    sock;
+
+
+    while (1) {
+	if (dts_sockWait (data_lsock, POLLIN, 1) > 0) {
+	    if ((sock = accept (data_lsock, NULL, NULL)) >= 0)
+		dts_dataRoute (sock);
+	    else if (errno != EINTR && errno != ECONNABORTED)
+		dtsErrLog (NULL, "dataListener: accept: %s\n",strerror(errno));
+	}
+
+	now = time ((time_t) 0);
+	pthread_mutex_lock (&data_mutex);
+	for (i=0; i < MAX_DATA_SESS; i++) {
+	    if (sess[i].rfd <= 0 && sess[i].sock > 0 &&
+		(now - sess[i].last) > DATA_PEND_TIME) {
+		    dtsErrLog (NULL, "dataListener: unclaimed stream %d:%d\n",
+			sess[i].session, sess[i].stripe);
+		    dts_dataClear (&sess[i]);
+	    }
+	}
+	pthread_mutex_unlock (&data_mutex);
+    }
+
+    return (NULL);
+}
+
+
+/**
+ *  DTS_DATAROUTE -- Read the header of a new connection and pass it to
+ *  the stream waiting for it, or hold it until the stream registers.
+ */
+static void
+dts_dataRoute (int sock)
+{
+    register int i;
+    dtsDataSess *s = (dtsDataSess *) NULL, *free_s = (dtsDataSess *) NULL;
+    struct timeval tv;
+    dtsDataHdr hdr;
+    int    session, stripe;
+
+
+    /*  Don't let a slow or bogus client hold up the port.
+    */
+    tv.tv_sec  = DATA_HDR_TIME;
+    tv.tv_usec = 0;
+    setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof (tv));
+    if (recv (sock, &hdr, sizeof (hdr), MSG_WAITALL) != sizeof (hdr) ||
+	ntohl (hdr.magic) != DATA_MAGIC) {
+	    dtsErrLog (NULL, "dataRoute: bad data connection header\n");
+	    close (sock);
+	    return;
+    }
+    tv.tv_sec = 0;
+    setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof (tv));
+
+    session = ntohl (hdr.session);
+    stripe  = ntohl (hdr.stripe);
+    if (SOCK_DEBUG)
+	dtsErrLog (NULL, "dataRoute: session %d:%d sock=%d\n",
+	    session, stripe, sock);
+
+    pthread_mutex_lock (&data_mutex);
+    for (i=0; i < MAX_DATA_SESS; i++) {
+	if ((sess[i].rfd > 0 || sess[i].sock > 0) &&
+	    sess[i].session == session && sess[i].stripe == stripe) {
+		s = &sess[i];
+		break;
+	} else if (sess[i].rfd <= 0 && sess[i].sock <= 0 && !free_s)
+	    free_s = &sess[i];
+    }
+
+    if (s && s->rfd > 0) {
+	if (dts_dataPass (s->rfd, sock) == OK) {
+	    pthread_mutex_unlock (&data_mutex);
+	    close (sock);
+	    return;
+	}
+	close (s->rfd);				/* stream has gone away	  */
+	s->rfd = 0;
+    }
+
+    /*  Nobody waiting yet, hold the connection.  A newer connection for
+    **  the stream replaces an older one.
+    */
+    if (!s && !(s = free_s)) {
+	pthread_mutex_unlock (&data_mutex);
+	dtsErrLog (NULL, "dataRoute: no room for stream %d:%d\n",
+	    session, stripe);
+	close (sock);
+	return;
+    }
+    if (s->sock > 0)
+	close (s->sock);
+    s->session = session;
+    s->stripe  = stripe;
+    s->sock    = sock;
+    s->last    = time ((time_t) 0);
+    pthread_mutex_unlock (&data_mutex);
+}
+
+
+/**
+ *  DTS_DATAPASS -- Pass a connection to a waiting stream.
+ */
+static int
+dts_dataPass (int rfd, int sock)
+{
+    struct msghdr  msg;
+    struct iovec   iov;
+    struct cmsghdr *cm;
+    char   c = 0, cbuf[CMSG_SPACE(sizeof(int))];
+
+
+    memset (&msg, 0, sizeof (msg));
+    memset (cbuf, 0, sizeof (cbuf));
+    iov.iov_base       = &c;
+    iov.iov_len        = 1;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof (cbuf);
+
+    cm = CMSG_FIRSTHDR (&msg);
+    cm->cmsg_level     = SOL_SOCKET;
+    cm->cmsg_type      = SCM_RIGHTS;
+    cm->cmsg_len       = CMSG_LEN (sizeof (int));
+    memcpy (CMSG_DATA (cm), &sock, sizeof (int));
+
+    return (sendmsg (rfd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT) == 1 ? OK : ERR);
+}
+
+
+/**
+ *  DTS_DATAPRUNE -- Drop registrations whose stream has closed its end.
+ *  Must be called with the sessions locked.
+ */
+static void
+dts_dataPrune (void)
+{
+    register int i;
+    char  c;
+
+
+    for (i=0; i < MAX_DATA_SESS; i++) {
+	if (sess[i].rfd > 0 &&
+	    recv (sess[i].rfd, &c, 1, MSG_PEEK|MSG_DONTWAIT) == 0)
+		dts_dataClear (&sess[i]);
+    }
+}
+
+
+/**
+ *  DTS_DATACLEAR -- Close a session's descriptors and clear the slot.
+ *  Must be called with the sessions locked.
+ */
+static void
+dts_dataClear (dtsDataSess *s)
+{
+    if (s->rfd > 0)
+	close (s->rfd);
+    if (s->sock > 0)
+	close (s->sock);
+    memset (s, 0, sizeof (dtsDataSess));
+}
@@ -0,0 +1,542 @@
+/**
+ *  DTSFANOUT.C -- Shared reads of an object sent to several destinations.
+ *
+ *  A fan-out queue sends each object to all of its destinations at once.
+ *  Rather than have the senders for each destination read the spooled
+ *  file separately, the queue manager opens the object as a fan-out
+ *  source and each sender attaches to it as a reader.  Reads are served
+ *  from a cache of FAN_BLOCK sized blocks, each read from disk once and
+ *  freed when every reader has taken all of it.  The cache is bounded by
+ *  FAN_MAX_CACHE: when it is full the oldest block is dropped and any
+ *  reader which hasn't yet taken it (i.e. the slowest destination) reads
+ *  that part of the spool file itself, so a slow destination never holds
+ *  back the others.
+ *
+ *  Readers are real descriptors open on the file, so a reader is also a
+ *  valid fallback for any code which doesn't know about fan-out, and
+ *  dts_filePRead() dispatches to dts_fanoutRead() for them.
+ *
+ *	handle = dts_fanoutOpen (path, nreaders)
+ *	    fd = dts_fanoutAttach (path)
+ *	 stat = dts_fanoutIsReader (fd)
+ *	nread = dts_fanoutRead (fd, buf, nbytes, offset)
+ *	         dts_fanoutDetach (fd)
+ *	nread = dts_fanoutClose (handle)
+ *
+ *  @file       dtsFanout.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  Shared reads of an object sent to several destinations.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "dts.h"
+
+
+typedef struct {
+    fanSource  *src;			/* source being read		*/
+    int		reader;			/* reader number		*/
+} fanReader;
+
+static fanSource *fan_source[MAX_QUEUES];	/* open sources		*/
+static fanReader  fan_reader[FAN_MAX_FD];	/* attached readers	*/
+
+static pthread_mutex_t fan_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int   dts_fanoutPRead (int fd, char *buf, long nbytes, off_t offset);
+static void  dts_fanoutRelease (fanSource *fs, int b);
+static int   dts_fanoutEvict (fanSource *fs, int b);
+static void  dts_fanoutFree (fanSource *fs);
+
+
+#ifdef UNIT_TEST
+/*  Push a file to two destinations through the fan-out cache, as the queue
+ *  manager does for a fan-out queue:  each reader must see the plain file
+ *  (not a tar stream, so dts_xferPushFile sends no 'stream' flag) and get
+ *  the same bytes, with the file read from disk only once.
+ */
+DTS  *dts = (DTS *) NULL;
+
+int
+main (int argc, char *argv[])
+{
+    char   *path = (argc > 1 ? argv[1] : "/tmp/dtsFanout.test");
+    char   *buf = malloc (FAN_BLOCK), *chk = malloc (FAN_BLOCK);
+    long    size = (argc > 2 ? atol (argv[2]) : 3 * FAN_BLOCK + 17), off, n;
+    int     i, fd, handle, rfd[2], stat = 0;
+
+
+    if ((fd = open (path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+	fprintf (stderr, "cannot create '%s'\n", path);
+	return (1);
+    }
+    for (off=0; off < size; off += n) {
+	n = min (size - off, FAN_BLOCK);
+	for (i=0; i < n; i++)
+	    buf[i] = (char) ((off + i) * 31 + 7);
+	if (write (fd, buf, n) != n) {
+	    fprintf (stderr, "write failed\n");
+	    return (1);
+	}
+    }
+    close (fd);
+
+    if ((handle = dts_fanoutOpen (path, 2)) < 0) {
+	fprintf (stderr, "fanoutOpen failed\n");
+	return (1);
+    }
+    for (i=0; i < 2; i++) {
+	if ((rfd[i] = dts_fanoutAttach (path)) < 0 || 
+	    !dts_fanoutIsReader (rfd[i]) || dts_tarIsStream (rfd[i])) {
+		fprintf (stderr, "reader %d: bad descriptor %d\n", i, rfd[i]);
+		stat = 1;
+	}
+    }
+
+    /*  Both readers take each block in turn, like two push threads.
+     */
+    for (off=0; !stat && off < size; off += n) {
+	n = min (size - off, FAN_BLOCK);
+	for (i=0; i < n; i++)
+	    chk[i] = (char) ((off + i) * 31 + 7);
+	for (i=0; i < 2; i++) {
+	    if (dts_filePRead (rfd[i], buf, (int) n, (off_t) off) != n ||
+		memcmp (buf, chk, n) != 0) {
+		    fprintf (stderr, "reader %d: bad data at %ld\n", i, off);
+		    stat = 1;
+	    }
+	}
+    }
+
+    for (i=0; i < 2; i++)
+	if (rfd[i] >= 0)
+	    dts_fanoutDetach (rfd[i]);
+    if (!stat && (n = dts_fanoutClose (handle)) != size) {
+	fprintf (stderr, "read %ld bytes from disk for %ld\n", n, size);
+	stat = 1;
+    }
+
+    unlink (path);
+    free (buf);
+    free (chk);
+    fprintf (stderr, "fanout test: %s\n", (stat ? "FAILED" : "OK"));
+
+    return (stat);
+}
+#endif
+
+
+
+
+/**
+ *  DTS_FANOUTOPEN -- Open a file to be read by several readers at once.
+ *
+ *  @brief	Open a file to be read by several readers at once.
+ *  @fn		int dts_fanoutOpen (char *path, int nreaders)
+ *
+ *  @param  path	path to the file
+ *  @param  nreaders	number of readers expected
+ *  @return		source handle, or -1 on error
+ */
+int
+dts_fanoutOpen (char *path, int nreaders)
+{
+    fanSource *fs = (fanSource *) NULL;
+    struct stat st;
+    int    i, fd, handle = -1;
+
+
+    if (nreaders < 2 || nreaders > MAX_FANOUT)
+	return (-1);
+    if (stat (path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	return (-1);
+    if ((fd = open (path, O_RDONLY)) < 0)
+	return (-1);
+
+    if ((fs = calloc (1, sizeof (fanSource))) == (fanSource *) NULL) {
+	close (fd);
+	return (-1);
+    }
+    fs->dev      = st.st_dev;
+    fs->ino      = st.st_ino;
+    fs->fd       = fd;
+    fs->size     = (long) st.st_size;
+    fs->nreaders = nreaders;
+    fs->nblocks  = (int) ((fs->size + FAN_BLOCK - 1) / FAN_BLOCK);
+    if ((fs->blk = calloc (fs->nblocks, sizeof (fanBlock))) == NULL) {
+	close (fd);
+	free ((void *) fs);
+	return (-1);
+    }
+    pthread_mutex_init (&fs->mutex, NULL);
+    pthread_cond_init (&fs->cond, NULL);
+
+    pthread_mutex_lock (&fan_mutex);
+    for (i=0; i < MAX_QUEUES; i++) {
+	if (fan_source[i] == (fanSource *) NULL) {
+	    fan_source[i] = fs;
+	    handle = i;
+	    break;
+	}
+    }
+    pthread_mutex_unlock (&fan_mutex);
+
+    if (handle < 0)
+	dts_fanoutFree (fs);
+    return (handle);
+}
+
+
+/**
+ *  DTS_FANOUTATTACH -- Attach a reader to an open fan-out source.  Readers
+ *  beyond the number the source was opened for aren't attached (e.g. a
+ *  retry of a failed transfer), they read the file as usual.
+ *
+ *  @brief	Attach a reader to an open fan-out source.
+ *  @fn		int dts_fanoutAttach (char *path)
+ *
+ *  @param  path	path to the file
+ *  @return		reader descriptor, or -1 if not a fan-out source
+ */
+int
+dts_fanoutAttach (char *path)
+{
+    fanSource *fs = (fanSource *) NULL;
+    struct stat st;
+    int    i, fd = -1;
+
+
+    if (stat (path, &st) < 0)
+	return (-1);
+
+    pthread_mutex_lock (&fan_mutex);
+    for (i=0; i < MAX_QUEUES; i++) {
+	fs = fan_source[i];
+	if (fs && fs->dev == st.st_dev && fs->ino == st.st_ino &&
+	    fs->nattached < fs->nreaders)
+		break;
+    }
+    if (i < MAX_QUEUES && (fd = open (path, O_RDONLY)) >= 0) {
+	if (fd < FAN_MAX_FD) {
+	    pthread_mutex_lock (&fs->mutex);
+	    fan_reader[fd].src = fs;
+	    fan_reader[fd].reader = fs->nattached++;
+	    pthread_mutex_unlock (&fs->mutex);
+	} else {
+	    close (fd);
+	    fd = -1;
+	}
+    }
+    pthread_mutex_unlock (&fan_mutex);
+
+    return (fd);
+}
+
+
+/**
+ *  DTS_FANOUTISREADER -- See whether a descriptor is a fan-out reader.
+ *
+ *  @brief	See whether a descriptor is a fan-out reader.
+ *  @fn		int dts_fanoutIsReader (int fd)
+ *
+ *  @param  fd		file descriptor
+ *  @return		1 if a reader, 0 otherwise
+ */
+int
+dts_fanoutIsReader (int fd)
+{
+    return ((fd >= 0 && fd < FAN_MAX_FD) ? (fan_reader[fd].src != NULL) : 0);
+}
+
+
+/**
+ *  DTS_FANOUTREAD -- Read part of a fan-out source.  Several threads of
+ *  each reader may read at once.
+ *
+ *  @brief	Read part of a fan-out source.
+ *  @fn		int dts_fanoutRead (int fd, void *buf, int nbytes,
+ *			off_t offset)
+ *
+ *  @param  fd		reader descriptor
+ *  @param  buf		data buffer
+ *  @param  nbytes	number of bytes to read
+ *  @param  offset	file offset of first byte
+ *  @return		number of bytes read, or -1 on error
+ */
+int
+dts_fanoutRead (int fd, void *buf, int nbytes, off_t offset)
+{
+    fanSource *fs = (fanSource *) NULL;
+    fanBlock  *blk;
+    char  *op = buf, *data;
+    long   pos, rel, blen, nb, n, nread = 0;
+    int    b, k;
+
+
+    if (!dts_fanoutIsReader (fd)) {
+	errno = EBADF;
+	return (-1);
+    }
+    fs = fan_reader[fd].src;
+    k  = fan_reader[fd].reader;
+
+    if ((long) offset >= fs->size)
+	return (0);
+    n = min ((long) nbytes, (fs->size - (long) offset));
+
+    pthread_mutex_lock (&fs->mutex);
+    while (nread < n) {
+	pos  = (long) offset + nread;
+	b    = (int) (pos / FAN_BLOCK);
+	rel  = pos - ((long) b * FAN_BLOCK);
+	blen = min ((long) FAN_BLOCK, (fs->size - (long) b * FAN_BLOCK));
+	nb   = min ((blen - rel), (n - nread));
+	blk  = &fs->blk[b];
+
+	while (blk->state == FB_LOADING)
+	    pthread_cond_wait (&fs->cond, &fs->mutex);
+
+	/*  First reader to reach the block reads it for everyone, if it
+	**  fits in the cache.
+	*/
+	if (blk->state == FB_EMPTY && dts_fanoutEvict (fs, b) == OK &&
+	    (data = malloc (blen))) {
+		blk->state = FB_LOADING;
+		fs->ncached += blen;
+		pthread_mutex_unlock (&fs->mutex);
+
+		if (dts_fanoutPRead (fs->fd, data, blen,
+		    (off_t) b * FAN_BLOCK) != blen) {
+			free ((void *) data);
+			data = NULL;
+		}
+
+		pthread_mutex_lock (&fs->mutex);
+		if (data) {
+		    blk->buf = data;
+		    blk->state = FB_CACHED;
+		    fs->nfill += blen;
+		} else {
+		    blk->state = FB_SPILLED;
+		    fs->ncached -= blen;
+		}
+		pthread_cond_broadcast (&fs->cond);
+	}
+
+	if (blk->state == FB_CACHED) {
+	    memcpy (&op[nread], &blk->buf[rel], nb);
+	    blk->used[k] += nb;
+	    dts_fanoutRelease (fs, b);
+
+	} else {
+	    /*  Dropped from the cache, or there was no room for it.
+	    */
+	    if (blk->state == FB_EMPTY)
+		blk->state = FB_SPILLED;
+	    pthread_mutex_unlock (&fs->mutex);
+	    if (dts_fanoutPRead (fd, &op[nread], nb, (off_t) pos) != nb) {
+		dtsErrLog (NULL, "dts_fanoutRead: read fails at %ld\n", pos);
+		return (-1);
+	    }
+	    pthread_mutex_lock (&fs->mutex);
+	    blk->used[k] += nb;
+	    fs->nspill += nb;
+	}
+	nread += nb;
+    }
+    pthread_mutex_unlock (&fs->mutex);
+
+    return ((int) nread);
+}
+
+
+/**
+ *  DTS_FANOUTDETACH -- Detach a reader from its source.  Blocks held only
+ *  for this reader are freed.
+ *
+ *  @brief	Detach a reader from its source.
+ *  @fn		void dts_fanoutDetach (int fd)
+ *
+ *  @param  fd		reader descriptor
+ *  @return		nothing
+ */
+void
+dts_fanoutDetach (int fd)
+{
+    fanSource *fs = (fanSource *) NULL;
+    int    b, last = 0;
+
+
+    if (!dts_fanoutIsReader (fd))
+	return;
+
+    pthread_mutex_lock (&fan_mutex);
+    fs = fan_reader[fd].src;
+    pthread_mutex_lock (&fs->mutex);
+    fs->done[fan_reader[fd].reader] = 1;
+    fs->ndetached++;
+    for (b=0; b < fs->nblocks; b++)
+	dts_fanoutRelease (fs, b);
+    last = (fs->closed && fs->ndetached == fs->nattached);
+    pthread_mutex_unlock (&fs->mutex);
+
+    fan_reader[fd].src = (fanSource *) NULL;
+    close (fd);
+    pthread_mutex_unlock (&fan_mutex);
+
+    if (last)
+	dts_fanoutFree (fs);
+}
+
+
+/**
+ *  DTS_FANOUTCLOSE -- Close a fan-out source.  No more readers may attach,
+ *  the source is freed when the last attached reader detaches.
+ *
+ *  @brief	Close a fan-out source.
+ *  @fn		long dts_fanoutClose (int handle)
+ *
+ *  @param  handle	source handle
+ *  @return		number of bytes read from disk for all readers
+ */
+long
+dts_fanoutClose (int handle)
+{
+    fanSource *fs = (fanSource *) NULL;
+    long   nread = 0;
+    int    last = 0;
+
+
+    if (handle < 0 || handle >= MAX_QUEUES)
+	return (0);
+
+    pthread_mutex_lock (&fan_mutex);
+    if ((fs = fan_source[handle])) {
+	fan_source[handle] = (fanSource *) NULL;
+
+	pthread_mutex_lock (&fs->mutex);
+	fs->closed = 1;
+	nread = fs->nfill + fs->nspill;
+	last = (fs->ndetached == fs->nattached);
+	pthread_mutex_unlock (&fs->mutex);
+    }
+    pthread_mutex_unlock (&fan_mutex);
+
+    if (last)
+	dts_fanoutFree (fs);
+    return (nread);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ *****************************************************************************/
+
+/**
+ *  DTS_FANOUTPREAD -- Read exactly 'nbytes' from a file offset.
+ */
+static int
+dts_fanoutPRead (int fd, char *buf, long nbytes, off_t offset)
+{
+    long  nread = 0, nb;
+
+    while (nread < nbytes) {
+	if ((nb = pread (fd, &buf[nread], (nbytes - nread),
+	    offset + nread)) < 0) {
+		if (errno == EINTR)
+		    continue;
+		return (-1);
+	} else if (nb == 0)
+	    break;
+	nread += nb;
+    }
+    return ((int) nread);
+}
+
+
+/**
+ *  DTS_FANOUTRELEASE -- Free a cached block once every reader still
+ *  running has taken all of it.  Called with the source locked.
+ */
+static void
+dts_fanoutRelease (fanSource *fs, int b)
+{
+    fanBlock *blk = &fs->blk[b];
+    long  blen;
+    int   k;
+
+
+    if (blk->state != FB_CACHED)
+	return;
+
+    blen = min ((long) FAN_BLOCK, (fs->size - (long) b * FAN_BLOCK));
+    for (k=0; k < fs->nreaders; k++)
+	if (!fs->done[k] && blk->used[k] < blen)
+	    return;
+
+    free ((void *) blk->buf);
+    blk->buf = NULL;
+    blk->state = FB_SPILLED;		/* any re-read comes from disk	*/
+    fs->ncached -= blen;
+}
+
+
+/**
+ *  DTS_FANOUTEVICT -- Make room in the cache for block 'b', dropping the
+ *  oldest blocks if needed.  Called with the source locked.
+ */
+static int
+dts_fanoutEvict (fanSource *fs, int b)
+{
+    long  need = min ((long) FAN_BLOCK, (fs->size - (long) b * FAN_BLOCK));
+    long  blen;
+    int   i;
+
+
+    for (i=0; i < fs->nblocks && (fs->ncached + need) > FAN_MAX_CACHE; i++) {
+	if (i == b || fs->blk[i].state != FB_CACHED)
+	    continue;
+
+	blen = min ((long) FAN_BLOCK, (fs->size - (long) i * FAN_BLOCK));
+	free ((void *) fs->blk[i].buf);
+	fs->blk[i].buf = NULL;
+	fs->blk[i].state = FB_SPILLED;
+	fs->ncached -= blen;
+    }
+    return (((fs->ncached + need) > FAN_MAX_CACHE) ? ERR : OK);
+}
+
+
+/**
+ *  DTS_FANOUTFREE -- Free a fan-out source.
+ */
+static void
+dts_fanoutFree (fanSource *fs)
+{
+    int  b;
+
+    for (b=0; b < fs->nblocks; b++)
+	if (fs->blk[b].buf)
+	    free ((void *) fs->blk[b].buf);
+    free ((void *) fs->blk);
+
+    close (fs->fd);
+    pthread_mutex_destroy (&fs->mutex);
+    pthread_cond_destroy (&fs->cond);
+    free ((void *) fs);
+}
@@ -4,6 +4,9 @@
  *	dts_fopen (char *fname, char *flags)
  *	dts_fclose (FILE *fd)
  *	dts_fileOpen (char *fname, int flags)
+ *	dts_fileOpenDirect (char *fname, int flags, long fsize)
+ *	dts_fileIsDirect (int fd)
+ *	dts_fileBuffered (int fd)
  *	dts_fileClose (int fd)
  *	dts_preAlloc (char *fname, long fsize)
  *	dts_fileSize (int fd)
@@ -13,6 +16,10 @@
  *	dts_getBuffer (int fd, unsigned char **buf, long chunkSize, int tnum)
  *	dts_fileRead (int fd, void *vptr, int nbytes)
  *	dts_fileWrite (int fd, void *vptr, int nbytes)
+ *	dts_filePRead (int fd, void *vptr, int nbytes, off_t offset)
+ *	dts_filePWrite (int fd, void *vptr, int nbytes, off_t offset)
+ *	dts_dioAlloc (void)
+ *	dts_dioFree (void *buf)
  *	dts_fileCopy (char *in, char *out)
  *	dts_isDir (char *path)
  *	dts_isLink (char *path)
@@ -35,6 +42,11 @@
  *
  */
 
+/* needed for posix_fadvise() and O_DIRECT
+*/
+#define  _GNU_SOURCE
+#define  _XOPEN_SOURCE 600
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -49,12 +61,8 @@
 #include <sys/time.h>			
  #include <sys/statvfs.h>
 #include <sys/mman.h>		
-
-/* needed for posix_fadvise()
-*/
-#define  _GNU_SOURCE
-#define  _XOPEN_SOURCE 600
 #include <fcntl.h>
+#include <pthread.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX	4096
@@ -63,6 +71,21 @@
 #include "dts.h"
 
 
+/*  Direct I/O descriptors.  For each descriptor opened with O_DIRECT we
+**  keep a second, buffered descriptor on the same file (stored +1 so zero
+**  means not direct) for the parts of a request that can't be aligned.
+*/
+static int    dio_shadow[DIO_MAX_FD];
+
+static void  *dio_pool[DIO_NBUF];		/* free aligned buffers	*/
+static int    dio_npool = 0;
+static pthread_mutex_t dio_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int    dts_fileDirectIO (int fd, void *vptr, int nbytes, off_t offset,
+			int write);
+static int    dts_preadAll (int fd, void *vptr, int nbytes, off_t offset);
+static int    dts_pwriteAll (int fd, void *vptr, int nbytes, off_t offset);
+
 static int    statfs_count = 0;
 static char   statfs_path[SZ_FNAME];
 #ifdef LINUX
@@ -164,6 +187,89 @@ dts_fileOpen (char *fname, int flags)
 }
 
 
+/**
+ *  DTS_FILEOPENDIRECT -- Open a file for positional I/O, using O_DIRECT if
+ *  it is large enough to bypass the page cache.  Files smaller than 
+ *  DIO_MIN_FSIZE, or on a filesystem without O_DIRECT support, are opened
+ *  as usual.  Only dts_filePRead()/dts_filePWrite() may be used on a 
+ *  direct descriptor; requests are split so the aligned part goes direct
+ *  and any unaligned remainder (e.g. the tail of the file) is done through
+ *  the page cache.
+ *
+ *  @brief  Open a file, bypassing the page cache if large.
+ *  @fn     int dts_fileOpenDirect (char *fname, int flags, long fsize)
+ *
+ *  @param  fname	file name to open
+ *  @param  flags	file open flags
+ *  @param  fsize	expected size of the file
+ *
+ *  @return		file descriptor
+ */
+int 
+dts_fileOpenDirect (char *fname, int flags, long fsize)
+{
+#ifdef O_DIRECT
+    int fd = -1, bfd = -1;
+
+    if (fsize < DIO_MIN_FSIZE || DTS_NODIRECT)
+	return (dts_fileOpen (fname, flags));
+
+    if ((fd = open ((const char *)fname, flags|O_DIRECT, DTS_FILE_MODE)) < 0) {
+	if (errno == EINVAL)		/* not supported, use page cache */
+	    return (dts_fileOpen (fname, flags));
+	fprintf (stderr, "dts_fileOpen: '%s': %s\n", fname, strerror(errno));
+	return (-1);
+    }
+
+    /*  The file now exists, so don't create or truncate it again.
+    */
+    if (fd >= DIO_MAX_FD ||
+	(bfd = open ((const char *)fname, flags & ~(O_CREAT|O_TRUNC))) < 0) {
+	    close (fd);
+	    return (dts_fileOpen (fname, flags & ~O_TRUNC));
+    }
+    dio_shadow[fd] = bfd + 1;
+
+    return (fd);
+#else
+    return (dts_fileOpen (fname, flags));
+#endif
+}
+
+
+/**
+ *  DTS_FILEISDIRECT -- See whether a descriptor was opened for direct I/O.
+ *
+ *  @brief  See whether a descriptor was opened for direct I/O.
+ *  @fn     int dts_fileIsDirect (int fd)
+ *
+ *  @param  fd		file descriptor
+ *  @return		1 if direct, else 0
+ */
+int 
+dts_fileIsDirect (int fd)
+{
+    return ((fd >= 0 && fd < DIO_MAX_FD) ? (dio_shadow[fd] > 0) : 0);
+}
+
+
+/**
+ *  DTS_FILEBUFFERED -- Get a buffered descriptor for the file, i.e. the
+ *  shadow descriptor of a direct descriptor, or the descriptor itself.
+ *
+ *  @brief  Get a buffered descriptor for the file.
+ *  @fn     int dts_fileBuffered (int fd)
+ *
+ *  @param  fd		file descriptor
+ *  @return		buffered file descriptor
+ */
+int 
+dts_fileBuffered (int fd)
+{
+    return (dts_fileIsDirect (fd) ? (dio_shadow[fd] - 1) : fd);
+}
+
+
 /**
  *  DTS_FILECLOSE -- Close the file descriptor.
  *
@@ -176,6 +282,10 @@ dts_fileOpen (char *fname, int flags)
 int 
 dts_fileClose (int fd)
 {
+    if (dts_fileIsDirect (fd)) {
+	close (dio_shadow[fd] - 1);
+	dio_shadow[fd] = 0;
+    }
     return (close (fd));
 }
 
@@ -192,6 +302,8 @@ dts_fileClose (int fd)
 int 
 dts_fileSync (int fd)
 {
+    if (dts_fileIsDirect (fd))
+	fsync (dio_shadow[fd] - 1);		/* unaligned writes	*/
     return (fsync (fd));
 }
 
@@ -426,6 +538,220 @@ dts_fileWrite (int fd, void *vptr, int nbytes)
 }
 
 
+/**
+ *  DTS_FILEPREAD -- Read exactly "n" bytes from a file descriptor starting
+ *  at the given offset.  The file position is not changed, so several
+ *  threads may safely read from the same descriptor at once.
+ *
+ *  @brief  Read exactly "n" bytes from a file offset.
+ *  @fn     int dts_filePRead (int fd, void *vptr, int nbytes, off_t offset)
+ *
+ *  @param  fd		file descriptor
+ *  @param  vptr	data buffer to be read
+ *  @param  nbytes	number of bytes to read
+ *  @param  offset	file offset of first byte
+ *  @return		number of bytes read
+ */
+int
+dts_filePRead (int fd, void *vptr, int nbytes, off_t offset)
+{
+    if (dts_fileIsDirect (fd))
+	return (dts_fileDirectIO (fd, vptr, nbytes, offset, 0));
+    if (dts_tarIsStream (fd))
+	return (dts_tarRead (fd, vptr, nbytes, offset));
+    if (dts_fanoutIsReader (fd))
+	return (dts_fanoutRead (fd, vptr, nbytes, offset));
+    if (dts_cutIsReader (fd))
+	return (dts_cutRead (fd, vptr, nbytes, offset));
+    return (dts_preadAll (fd, vptr, nbytes, offset));
+}
+
+
+/**
+ *  DTS_PREADALL -- Read exactly "n" bytes from the given offset.
+ */
+static int
+dts_preadAll (int fd, void *vptr, int nbytes, off_t offset)
+{
+    char    *ptr = vptr;
+    int     nread = 0, nleft = nbytes, nb = 0;
+
+    while (nleft > 0) {
+        if ((nb = pread (fd, ptr, nleft, offset + nread)) < 0) {
+            if (errno == EINTR)
+                nb = 0;             /* and call pread() again */
+            else
+                return(-1);
+        } else if (nb == 0)
+            break;                  /* EOF */
+
+        nleft -= nb;
+        ptr   += nb;
+        nread += nb;
+    }
+
+    return (nread);                 /* return no. of bytes read */
+}
+
+
+/**
+ *  DTS_FILEPWRITE -- Write exactly "n" bytes to a file descriptor starting
+ *  at the given offset.  The file position is not changed, so several
+ *  threads may safely write disjoint regions of the same descriptor.
+ *
+ *  @brief  Write exactly "n" bytes to a file offset.
+ *  @fn     int dts_filePWrite (int fd, void *vptr, int nbytes, off_t offset)
+ *
+ *  @param  fd		file descriptor
+ *  @param  vptr	data buffer to be written
+ *  @param  nbytes	number of bytes to write
+ *  @param  offset	file offset of first byte
+ *  @return		number of bytes written
+ */
+int
+dts_filePWrite (int fd, void *vptr, int nbytes, off_t offset)
+{
+    if (dts_fileIsDirect (fd))
+	return (dts_fileDirectIO (fd, vptr, nbytes, offset, 1));
+    if (dts_tarIsStream (fd))
+	return (dts_tarWrite (fd, vptr, nbytes, offset));
+    return (dts_pwriteAll (fd, vptr, nbytes, offset));
+}
+
+
+/**
+ *  DTS_PWRITEALL -- Write exactly "n" bytes at the given offset.
+ */
+static int
+dts_pwriteAll (int fd, void *vptr, int nbytes, off_t offset)
+{
+    char    *ptr = vptr;
+    int     nwritten = 0,  nleft = nbytes, nb = 0;
+
+    while (nleft > 0) {
+        if ((nb = pwrite (fd, ptr, nleft, offset + nwritten)) <= 0) {
+            if (errno == EINTR)
+                nb = 0;             /* and call pwrite() again */
+            else
+                return(-1);         /* error */
+        }
+        nleft    -= nb;
+        ptr      += nb;
+        nwritten += nb;
+    }
+
+    return (nwritten);
+}
+
+
+/**
+ *  DTS_FILEDIRECTIO -- Do a positional read/write on a direct descriptor.
+ *  The whole blocks at an aligned offset go direct, from the caller's
+ *  buffer if it is aligned or else through pooled aligned buffers.  The
+ *  remainder, normally just the tail of the file, uses the buffered
+ *  shadow descriptor.
+ */
+static int
+dts_fileDirectIO (int fd, void *vptr, int nbytes, off_t offset, int write)
+{
+    char   *ptr = vptr, *buf = NULL;
+    int     bfd = dio_shadow[fd] - 1;
+    int     body = 0, done = 0, n = 0, nb = 0;
+
+
+    if ((offset % DIO_ALIGN) == 0)
+	body = nbytes - (nbytes % DIO_ALIGN);
+
+    if (body > 0 && ((unsigned long) ptr % DIO_ALIGN) == 0) {
+	nb = (write ? dts_pwriteAll (fd, ptr, body, offset) :
+		      dts_preadAll (fd, ptr, body, offset));
+	if (nb < 0)
+	    return (-1);
+	done = nb;
+
+    } else if (body > 0) {
+	if ((buf = dts_dioAlloc ()) == NULL)
+	    return (-1);
+	for (done=0; done < body; done += nb) {
+	    n = min (body - done, DIO_BUFSIZE);
+	    if (write) {
+		memcpy (buf, ptr + done, n);
+		nb = dts_pwriteAll (fd, buf, n, offset + done);
+	    } else if ((nb = dts_preadAll (fd, buf, n, offset + done)) > 0)
+		memcpy (ptr + done, buf, nb);
+
+	    if (nb < 0) {
+		dts_dioFree (buf);
+		return (-1);
+	    } else if (nb < n) {
+		done += nb;			/* EOF			*/
+		break;
+	    }
+	}
+	dts_dioFree (buf);
+    }
+
+    if (done < body || done == nbytes)
+	return (done);
+
+    nb = (write ? dts_pwriteAll (bfd, ptr + done, nbytes - done, offset+done) :
+		  dts_preadAll (bfd, ptr + done, nbytes - done, offset+done));
+
+    return (nb < 0 ? -1 : done + nb);
+}
+
+
+/**
+ *  DTS_DIOALLOC -- Get an aligned DIO_BUFSIZE buffer from the pool.
+ *
+ *  @brief  Get an aligned buffer from the pool.
+ *  @fn     void *dts_dioAlloc (void)
+ *
+ *  @return		aligned buffer, or NULL on error
+ */
+void *
+dts_dioAlloc (void)
+{
+    void  *buf = NULL;
+
+    pthread_mutex_lock (&dio_mutex);
+    if (dio_npool > 0)
+	buf = dio_pool[--dio_npool];
+    pthread_mutex_unlock (&dio_mutex);
+
+    if (!buf && posix_memalign (&buf, DIO_ALIGN, DIO_BUFSIZE) != 0)
+	return ((void *) NULL);
+    return (buf);
+}
+
+
+/**
+ *  DTS_DIOFREE -- Return an aligned buffer to the pool.
+ *
+ *  @brief  Return an aligned buffer to the pool.
+ *  @fn     void dts_dioFree (void *buf)
+ *
+ *  @param  buf		buffer from dts_dioAlloc()
+ *  @return		nothing
+ */
+void
+dts_dioFree (void *buf)
+{
+    if (!buf)
+	return;
+
+    pthread_mutex_lock (&dio_mutex);
+    if (dio_npool < DIO_NBUF) {
+	dio_pool[dio_npool++] = buf;
+	buf = NULL;
+    }
+    pthread_mutex_unlock (&dio_mutex);
+
+    if (buf)
+	free (buf);
+}
+
+
 /**
  *  DTS_FILECOPY -- Copy and input file to an output file.
  *
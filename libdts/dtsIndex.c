@@ -0,0 +1,314 @@
+/**
+ *  DTSINDEX.C -- Content index of the objects received by a queue.
+ *
+ *  Each queue keeps an '_index' file in its spool directory listing the
+ *  objects it has received and delivered, keyed by the MD5 sum from the
+ *  control file.  Entries are lines of the form
+ *
+ *	<md5>  <fsize>  <mtime>  <path>
+ *
+ *  with the newest at the end.  When a sender offers an object with the
+ *  same MD5 and size as one still present on disk (and unchanged since it
+ *  was indexed), initTransfer links the existing copy into the new queue
+ *  directory rather than having the bytes sent again.  The usual check-
+ *  sum validation in endTransfer still applies to the linked copy, and
+ *  an entry is dropped whenever an object with that MD5 fails to validate.
+ *
+ *	  stat = dts_indexAdd (qname, md5, fsize, path)
+ *	  path = dts_indexLookup (qname, md5, fsize)
+ *	         dts_indexRemove (qname, md5)
+ *	  stat = dts_indexLink (src, dst)
+ *
+ *  @file       dtsIndex.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  Content index of the objects received by a queue.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "dts.h"
+
+
+extern  DTS  *dts;
+
+static  pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static FILE  *dts_indexOpen (char *qname, char *mode);
+static void   dts_indexClose (FILE *fd);
+static int    dts_indexKey (char *md5);
+static void   dts_indexRewrite (FILE *fd, char *md5, int keep);
+
+
+
+
+/**
+ *  DTS_INDEXADD -- Add a delivered object to the queue's content index.
+ *
+ *  @brief	Add a delivered object to the queue's content index.
+ *  @fn		int dts_indexAdd (char *qname, char *md5, long fsize,
+ *			char *path)
+ *
+ *  @param  qname	queue name
+ *  @param  md5		MD5 sum of the object
+ *  @param  fsize	size of the object
+ *  @param  path	local path to the object
+ *  @return		OK or ERR
+ */
+int
+dts_indexAdd (char *qname, char *md5, long fsize, char *path)
+{
+    FILE   *fd;
+    struct  stat st;
+    char    line[SZ_LINE];
+    int     nlines = 0;
+
+
+    if (!dts_indexKey (md5) || !path || stat (path, &st) < 0)
+	return (ERR);
+    if (!S_ISREG(st.st_mode) || (long) st.st_size != fsize)
+	return (ERR);
+
+    pthread_mutex_lock (&index_mutex);
+    if ((fd = dts_indexOpen (qname, "a+")) == (FILE *) NULL) {
+        pthread_mutex_unlock (&index_mutex);
+	return (ERR);
+    }
+
+    fprintf (fd, "%s %ld %ld %s\n", md5, fsize, (long) st.st_mtime, path);
+    fflush (fd);
+
+    /*  Trim the index to the newest half once it grows too large.
+     */
+    rewind (fd);
+    while (fgets (line, SZ_LINE, fd))
+	nlines++;
+    if (nlines > DTS_INDEX_MAX)
+	dts_indexRewrite (fd, NULL, DTS_INDEX_MAX / 2);
+
+    dts_indexClose (fd);
+    pthread_mutex_unlock (&index_mutex);
+
+    return (OK);
+}
+
+
+/**
+ *  DTS_INDEXLOOKUP -- Find a local copy of an object from its MD5 and size.
+ *  Only copies still on disk and unchanged since they were indexed match.
+ *
+ *  @brief	Find a local copy of an object from its MD5 and size.
+ *  @fn		char *dts_indexLookup (char *qname, char *md5, long fsize)
+ *
+ *  @param  qname	queue name
+ *  @param  md5		MD5 sum of the object
+ *  @param  fsize	size of the object
+ *  @return		path to the object or NULL (caller frees ptr)
+ */
+char *
+dts_indexLookup (char *qname, char *md5, long fsize)
+{
+    FILE   *fd;
+    struct  stat st;
+    char    line[SZ_LINE], sum[SZ_LINE], path[SZ_LINE], *found = NULL;
+    long    size, mtime;
+
+
+    if (!dts_indexKey (md5))
+	return ((char *) NULL);
+
+    pthread_mutex_lock (&index_mutex);
+    if ((fd = dts_indexOpen (qname, "r")) == (FILE *) NULL) {
+        pthread_mutex_unlock (&index_mutex);
+	return ((char *) NULL);
+    }
+
+    /*  Newer entries come later in the file, the last valid one wins.
+     */
+    while (fgets (line, SZ_LINE, fd)) {
+	memset (path, 0, SZ_LINE);
+	if (sscanf (line, "%s %ld %ld %[^\n]", sum, &size, &mtime, path) != 4)
+	    continue;
+	if (strcmp (sum, md5) != 0 || size != fsize)
+	    continue;
+	if (stat (path, &st) < 0 || !S_ISREG(st.st_mode))
+	    continue;
+	if ((long) st.st_size != fsize || (long) st.st_mtime != mtime)
+	    continue;
+
+	if (found)
+	    free ((void *) found);
+	found = strdup (path);
+    }
+
+    dts_indexClose (fd);
+    pthread_mutex_unlock (&index_mutex);
+
+    return (found);
+}
+
+
+/**
+ *  DTS_INDEXREMOVE -- Remove all entries for an MD5 from the index.
+ *
+ *  @brief	Remove all entries for an MD5 from the index.
+ *  @fn		void dts_indexRemove (char *qname, char *md5)
+ *
+ *  @param  qname	queue name
+ *  @param  md5		MD5 sum of the object
+ *  @return		nothing
+ */
+void
+dts_indexRemove (char *qname, char *md5)
+{
+    FILE   *fd;
+
+
+    if (!dts_indexKey (md5))
+	return;
+
+    pthread_mutex_lock (&index_mutex);
+    if ((fd = dts_indexOpen (qname, "r+"))) {
+	dts_indexRewrite (fd, md5, DTS_INDEX_MAX);
+        dts_indexClose (fd);
+    }
+    pthread_mutex_unlock (&index_mutex);
+}
+
+
+/**
+ *  DTS_INDEXLINK -- Make a copy of an indexed object in a new location,
+ *  as a hard link if possible.
+ *
+ *  @brief	Make a copy of an indexed object in a new location.
+ *  @fn		int dts_indexLink (char *src, char *dst)
+ *
+ *  @param  src		path to the existing object
+ *  @param  dst		path to the new copy
+ *  @return		OK or ERR
+ */
+int
+dts_indexLink (char *src, char *dst)
+{
+    unlink (dst);
+    if (link (src, dst) == 0)
+	return (OK);
+
+    /*  Different filesystem, or links aren't supported.
+     */
+    if (dts_fileCopy (src, dst) == ERR || access (dst, F_OK) < 0)
+	return (ERR);
+    return (OK);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ ****************************************************************************/
+
+/**
+ *  DTS_INDEXOPEN -- Open and lock the index file for a queue.
+ */
+static FILE *
+dts_indexOpen (char *qname, char *mode)
+{
+    FILE  *fd;
+    char   path[SZ_PATH];
+
+
+    memset (path, 0, SZ_PATH);
+    sprintf (path, "%s_index", dts_getQueuePath (dts, qname));
+
+    if ((fd = fopen (path, mode)) == (FILE *) NULL)
+	return ((FILE *) NULL);
+    flock (fileno (fd), (*mode == 'r' && !mode[1]) ? LOCK_SH : LOCK_EX);
+
+    return (fd);
+}
+
+
+/**
+ *  DTS_INDEXCLOSE -- Unlock and close the index file.
+ */
+static void
+dts_indexClose (FILE *fd)
+{
+    fflush (fd);
+    flock (fileno (fd), LOCK_UN);
+    fclose (fd);
+}
+
+
+/**
+ *  DTS_INDEXKEY -- See whether an MD5 string may be used as a key.  The
+ *  control file has a blank MD5 when it wasn't computed at ingest.
+ */
+static int
+dts_indexKey (char *md5)
+{
+    int  i;
+
+    if (!md5 || strlen (md5) != 32)
+	return (0);
+    for (i=0; md5[i]; i++)
+	if (!isxdigit ((int) md5[i]))
+	    return (0);
+    return (1);
+}
+
+
+/**
+ *  DTS_INDEXREWRITE -- Rewrite the (locked) index in place, keeping at
+ *  most the newest 'keep' entries and dropping any for the given MD5.
+ */
+static void
+dts_indexRewrite (FILE *fd, char *md5, int keep)
+{
+    char  **lines = calloc (DTS_INDEX_MAX + 1, sizeof (char *));
+    char    line[SZ_LINE];
+    int     i, n = 0, first = 0, len = (md5 ? strlen (md5) : 0);
+
+
+    if (lines == NULL)
+	return;
+
+    /*  Keep a ring of the newest entries.
+     */
+    rewind (fd);
+    while (fgets (line, SZ_LINE, fd)) {
+	if (md5 && strncmp (line, md5, len) == 0 && line[len] == ' ')
+	    continue;
+	if (n == keep) {
+	    free ((void *) lines[first]);
+	    lines[first] = strdup (line);
+	    first = (first + 1) % keep;
+	} else
+	    lines[n++] = strdup (line);
+    }
+
+    rewind (fd);
+    if (ftruncate (fileno (fd), (off_t) 0) == 0) {
+	for (i=0; i < n; i++)
+	    fputs (lines[(first + i) % n], fd);
+    }
+    fflush (fd);
+
+    for (i=0; i < n; i++)
+	free ((void *) lines[i]);
+    free ((void *) lines);
+}
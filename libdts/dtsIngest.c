@@ -226,9 +226,11 @@ dts_Ingest (dtsQueue *dtsq, Control *ctrl, char *fpath, char *cpath, int *stat)
 	    ctrl->sum32 = ctrl->crc32 = 0;
  	    strcpy (ctrl->md5, " \0");
 	} else {
-	    ctrl->sum32 = dts_fileCRCChecksum (newpath, &ctrl->crc32);
-            md5 = dts_fileMD5 (newpath);
- 	    strcpy (ctrl->md5, md5);
+	    dts_fileDigest (newpath, DTS_DIGEST_ALL, &ctrl->sum32,
+		&ctrl->crc32, ctrl->md5);
+	    if (md5)
+		free ((char *) md5);
+	    md5 = strdup (ctrl->md5);
 	}
     }
 
@@ -533,20 +533,20 @@ dts_localTouch (char *path)
  *  DTS_LOCALPREALLOC -- Pre-allocate a local file.
  *
  *  @brief	Pre-allocate a local file.
- *  @fn 	int dts_localPrealloc (char *path, int size)
+ *  @fn 	int dts_localPrealloc (char *path, long size)
  *
  *  @param  path	filename path to prealloc
  *  @param  size	file size
  *  @return		status code or errno
  */
 int 
-dts_localPrealloc (char *path, int size)
+dts_localPrealloc (char *path, long size)
 {
     int    res  = 0;
 
     /* Preallocate a file of the given size.
     */
-    res = dts_preAlloc (path, (long) size);
+    res = dts_preAlloc (path, size);
 
     return (res);
 }
@@ -144,11 +144,15 @@
 #include "dts.h"
 #include "dtsdb.h"
 #include "dtsMethods.h"
+#include "dtsPSock.h"
 
 
 extern  DTS  *dts;
 extern  char *build_version;
 
+static int dts_initDup (char *qname, char *md5, long fsize, char *fname,
+		char *resp);
+
 
 
 /*******************************************************************************
@@ -665,18 +669,16 @@ dts_Checksum (void *data)
 {
     char  *arg   = xr_getStringFromParam (data, 0);
     char  *path  = dts_sandboxPath (arg);
-    char  *md5 = NULL;
+    char   md5[SZ_MD5_HEX];
     int    snum = 0;
     uint   sum32 = 0, crc32 = 0;
 
 
     if (dts->verbose) dtsLog (dts, "CHECKSUM: %s", path);
 
-    /* Read the file and set the result struct.
+    /* Read the file once for all the sums and set the result struct.
     */
-    md5   = dts_fileMD5 (path);
-    sum32 = dts_fileChecksum (path, 1);
-    crc32 = dts_fileCRC32 (path);
+    dts_fileDigest (path, DTS_DIGEST_ALL, &sum32, &crc32, md5);
 
     snum = xr_newStruct ();
 	xr_setIntInStruct (snum, "sum32",  (int) sum32);
@@ -685,7 +687,6 @@ dts_Checksum (void *data)
     xr_setStructInResult (data, snum);
     xr_freeStruct (snum);
 
-    if (md5)  free ((char *) md5);
     if (arg)  free ((char *) arg);
     if (path) free ((char *) path);
 
@@ -1240,9 +1241,9 @@ dts_DiskFree (void *data)
     res = statfs (dir, &fs);
     size = (fs.f_bavail * (fs.f_bsize / 1024.));
 
-    xr_setIntInResult (data, (int) size);		/* set result	*/
+    xr_setLongLongInResult (data, (long long) size);	/* set result	*/
 
-    if (dts->verbose) dtsLog (dts, "DFREE: %s  %d", dir, size);
+    if (dts->verbose) dtsLog (dts, "DFREE: %s  %ld", dir, size);
 
     if (arg) free ((char *) arg);
     if (dir) free ((char *) dir);
@@ -1275,9 +1276,9 @@ dts_DiskUsed (void *data)
     res = statfs (dir, &fs);
     size = ((fs.f_blocks - fs.f_bavail) * (fs.f_bsize / 1024.));
 
-    xr_setIntInResult (data, (int) size);		/* set result	*/
+    xr_setLongLongInResult (data, (long long) size);	/* set result	*/
 
-    if (dts->verbose) dtsLog (dts, "DUSED: %s  %d", dir, size);
+    if (dts->verbose) dtsLog (dts, "DUSED: %s  %ld", dir, size);
 
     if (arg) free ((char *) arg);
     if (dir) free ((char *) dir);
@@ -1333,9 +1334,9 @@ dts_FSize (void *data)
     /* Get the file size.
     */
     size = dts_du (path);
-    xr_setIntInResult (data, (int) size);
+    xr_setLongLongInResult (data, (long long) size);
 
-    if (dts->verbose) dtsLog (dts, "FSIZE: %s", path, (int)size);
+    if (dts->verbose) dtsLog (dts, "FSIZE: %s  %ld", path, size);
 
     if (arg)  free ((char *) arg);
     if (path) free ((char *) path);
@@ -1911,16 +1912,17 @@ dts_Read (void *data)
 {
     char  *arg  = xr_getStringFromParam (data, 0);
     char  *path = dts_sandboxPath (arg);
-    int    offset = xr_getIntFromParam (data, 1);
+    long   offset = (long) xr_getLongLongFromParam (data, 1);
     int    nbytes = xr_getIntFromParam (data, 2);
     char  *res = NULL, *eres = NULL, *emsg = "Error reading file";
-    int    fd = 0, elen = strlen (emsg), size, off, snum, nread = 0;
+    int    fd = 0, elen = strlen (emsg), size, snum, nread = 0;
+    long   off;
     struct stat st;
     long   fsize;
 
 
     if (dts->verbose > 2) 
-	dtsLog (dts, "READ: %s off=%d nb=%d", path, offset, nbytes);
+	dtsLog (dts, "READ: %s off=%ld nb=%d", path, offset, nbytes);
 	
     if ((fd = open (path, O_RDONLY)) < 0) {
         xr_setStringInResult (data, "Cannot open file");
@@ -1936,7 +1938,7 @@ dts_Read (void *data)
 	*/
         snum = xr_newStruct ();
 	    xr_setIntInStruct (snum, "size",   (int) EOF);
-	    xr_setIntInStruct (snum, "offset", (int) 0);
+	    xr_setLongLongInStruct (snum, "offset", 0LL);
 	    xr_setStringInStruct (snum, "data",  "");
         xr_setStructInResult (data, snum);
         xr_freeStruct (snum);
@@ -1976,7 +1978,7 @@ dts_Read (void *data)
     */
     snum = xr_newStruct ();
 	xr_setIntInStruct (snum, "size",   (int) nread);
-	xr_setIntInStruct (snum, "offset", (int) off);
+	xr_setLongLongInStruct (snum, "offset", (long long) off);
 	xr_setStringInStruct (snum, "data", eres);
     xr_setStructInResult (data, snum);
     xr_freeStruct (snum);
@@ -2033,15 +2035,15 @@ dts_Prealloc (void *data)
     int    res  = 0;
     char  *arg  = xr_getStringFromParam (data, 0);
     char  *path = dts_sandboxPath (arg);
-    int    size = xr_getIntFromParam (data, 1);   	/* file size	  */
+    long   size = (long) xr_getLongLongFromParam (data, 1);   /* file size */
 
 
     /* Preallocate a file of the given size.
     */
-    res = dts_preAlloc (path, (long) size);
+    res = dts_preAlloc (path, size);
     xr_setIntInResult (data, (int) res);		/* set result	*/
 
-    if (dts->verbose) dtsLog (dts, "PREALLOC: %s %d %d", path, size, res);
+    if (dts->verbose) dtsLog (dts, "PREALLOC: %s %ld %d", path, size, res);
 
     if (arg)  free ((char *) arg);
     if (path) free ((char *) path);
@@ -2151,7 +2153,7 @@ dts_StatVal (void *data)
     } else if (strcmp (val, "st_rdev") == 0) {
         xr_setIntInResult (data, st.st_rdev);
     } else if (strcmp (val, "st_size") == 0) {
-        xr_setIntInResult (data, (int) st.st_size);
+        xr_setLongLongInResult (data, (long long) st.st_size);
     } else if (strcmp (val, "st_blksize") == 0) {
         xr_setIntInResult (data, st.st_blksize);
     } else if (strcmp (val, "st_blocks") == 0) {
@@ -2868,7 +2870,11 @@ dts_printQueueCfg (void *data)
     doprnt (buf, "       mode:  %s\n", dts_cfgQModeStr(dtsq->mode));
     doprnt (buf, "     method:  %s\n", dts_cfgQMethodStr(dtsq->method));
     doprnt (buf, "   udt_rate:  %d\n", dtsq->udt_rate);
+    doprnt (buf, "   max_rate:  %d (min %d, weight %d, now %.1f Mbps)\n", 
+	dtsq->max_rate, dtsq->min_rate, dtsq->rate_weight, 
+	dts_shapeRate (dtsq->name));
     doprnt (buf, "   nthreads:  %d\n", dtsq->nthreads);
+    doprnt (buf, "      dedup:  %s\n", (dtsq->dedup ? "yes" : "no"));
     doprnt (buf, "      nerrs:  %d\n", dtsq->qstat->failedxfers);
     doprnt (buf, "       port:  %d -> %d\n", lo, hi);
     doprnt (buf, "\n");
@@ -3096,7 +3102,7 @@ dts_queueAccept (void *data)
     struct statfs fs;
     int   i, stat = 0, res = 0, valid = 0;
     char *qname = xr_getStringFromParam (data, 0);
-    int   fsize = xr_getIntFromParam (data, 1);
+    long  fsize = (long) xr_getLongLongFromParam (data, 1);
     char  *dir, resp[SZ_LINE];
 
 
@@ -3410,7 +3416,8 @@ dts_queueSetControl (void *data)
     FILE  *fd;
     char  *qPath, *qHost, *qName, *fileName, *xferName, *dfname;
     char  *srcpath, *igstpath, *md5, ctrl_fname[SZ_FNAME];
-    unsigned int  isDir, fileSize, sum32, crc32, epoch;
+    unsigned int  isDir, sum32, crc32, epoch;
+    long   fileSize;
     unsigned int  i, ifd, pars, npars;
     int    status = OK, snum=0;
     char  *param = calloc (1, SZ_FNAME), 
@@ -3431,7 +3438,7 @@ dts_queueSetControl (void *data)
     md5       = xr_getStringFromParam (data, 7);
     dfname    = xr_getStringFromParam (data, 8);
     isDir     = xr_getIntFromParam    (data, 9);
-    fileSize  = xr_getIntFromParam    (data, 10);
+    fileSize  = (long) xr_getLongLongFromParam (data, 10);
     sum32     = xr_getIntFromParam    (data, 11);
     crc32     = xr_getIntFromParam    (data, 12);
     epoch     = xr_getIntFromParam    (data, 13);
@@ -3445,7 +3452,7 @@ dts_queueSetControl (void *data)
 	fprintf (stderr, "         xferName='%s'\n", xferName);
 	fprintf (stderr, "         igstpath='%s'\n", igstpath);
 	fprintf (stderr, "         dir=%d md5='%s' sum32=%d\n",isDir,md5,sum32);
-	fprintf (stderr, "         epoch=%d fileSize=%d\n", epoch, fileSize);
+	fprintf (stderr, "         epoch=%d fileSize=%ld\n", epoch, fileSize);
     }
 
 
@@ -3485,7 +3492,7 @@ dts_queueSetControl (void *data)
         fprintf (fd, "xfername     = %s\n", xferName);
         fprintf (fd, "srcpath      = %s\n", srcpath    );
         fprintf (fd, "path         = %s\n", igstpath);
-        fprintf (fd, "fsize        = %d\n", fileSize);
+        fprintf (fd, "fsize        = %ld\n", fileSize);
         fprintf (fd, "sum32        = %u\n", sum32);
         fprintf (fd, "crc32        = %u\n", crc32);
         fprintf (fd, "md5          = %s\n", md5);
@@ -3512,6 +3519,24 @@ dts_queueSetControl (void *data)
         fclose (fd);
     }
 
+    /*  A transfer node with cut-through enabled may forward the object
+     *  while it is still arriving (see dtsCut.c).
+     */
+    if (status == OK && dtsq && dtsq->cut_through && dtsq->dest[0] &&
+	dtsq->node == QUEUE_TRANSFER && dtsq->type == QUEUE_NORMAL &&
+	dtsq->method == TM_PSOCK && !isDir) {
+	    char  path[SZ_PATH];
+
+	    qp = dts_sandboxPath (qPath);
+	    memset (path, 0, SZ_PATH);
+	    snprintf (path, SZ_PATH-1, "%s%s", qp, xferName);
+	    if (dts_cutOpen (qp, path, fileSize, sum32, crc32, md5) == OK &&
+		dts->verbose > 1)
+		    dtsLog (dts, "%6.6s <  XFER: cut-through '%s'",
+			dts_queueNameFmt (dtsq->name), xferName);
+	    free ((void *) qp);
+    }
+
 
     xr_setIntInResult (data, (int) status);		/* set result	*/
     if (dts->verbose > 2) 
@@ -3560,7 +3585,7 @@ dts_queueUpdateStats (void *data)
         if ((dtsq = dts_queueLookup (qname))) {
 
 	    memset (&xfs, 0, sizeof (xferStat));
-	    xfs.fsize   = xr_getIntFromParam (data, 1);
+	    xfs.fsize   = (long) xr_getLongLongFromParam (data, 1);
 	    xfs.tput_mb = xr_getDoubleFromParam (data, 2);
 	    xfs.time    = xr_getDoubleFromParam (data, 3);
 
@@ -3600,14 +3625,23 @@ dts_initTransfer (void *data)
     struct statfs fs;
     int   i, stat = 0, res = 0, valid = 0;
     char *qname = xr_getStringFromParam (data, 0);
-    int   fsize = xr_getIntFromParam (data, 1);
-    char  *dir, resp[SZ_LINE];
+    long  fsize = (long) xr_getLongLongFromParam (data, 1);
+    char  *md5 = NULL, *fname = NULL;
+    char  *dir, *rdir = NULL, resp[SZ_LINE];
     dtsQueue *dtsq;
     int   semval = -1;
  
 
     memset (resp, 0, SZ_LINE);
 
+    /*  Newer senders also give the MD5 and name of the object so we may
+     *  tell them when we already have it.
+     */
+    if (xr_getParamCount (data) > 3) {
+        md5   = xr_getStringFromParam (data, 2);
+        fname = xr_getStringFromParam (data, 3);
+    }
+
     /*  Get the parameters for the current queue.
      */
     
@@ -3634,6 +3668,8 @@ dts_initTransfer (void *data)
 	sprintf (resp, "Error(initTransfer): Invalid queue name '%s'", qname);
         xr_setStringInResult (data, "Error(initTransfer): Invalid queue name");
         if (qname) free ((char *) qname);
+        if (md5)   free ((char *) md5);
+        if (fname) free ((char *) fname);
         dtsLog (dts, resp);
 
         return (OK);
@@ -3652,7 +3688,7 @@ dts_initTransfer (void *data)
     }
 
     if (STAT_DEBUG) {
-	fprintf (stderr, "dir = '%s'  fsize=%d\n", dir, fsize);
+	fprintf (stderr, "dir = '%s'  fsize=%ld\n", dir, fsize);
 	fprintf (stderr, "f_bsize=%ld  f_bavail=%ld  f_bfree=%ld\n", 
 	    (long)fs.f_bsize, (long)fs.f_bavail, (long)fs.f_bfree);
     }
@@ -3666,14 +3702,37 @@ dts_initTransfer (void *data)
 	    dtsLog (dts, resp);
 	    stat = ERR;
         } else {
-            if (PERF_DEBUG) 
-		dtsLog (dts, "%6.6s <  XFER: init: getting next queue dir", 
-		    dts_queueNameFmt (qname));
-	    strcpy (resp, dts_getNextQueueDir (dts, qname));
-            if (PERF_DEBUG) 
-		dtsLog (dts, "%6.6s <  XFER: init: got next dir '%s'",
-		    dts_queueNameFmt (qname), resp);
 	    stat = OK;
+
+	    /*  A retry of a large object whose transfer failed, possibly
+	     *  before either daemon was restarted, goes back to the queue
+	     *  dir holding the partial file so it may resume.
+	     */
+	    if (md5 && fname &&
+		(rdir = psMapFind (qname, fname, fsize, md5))) {
+		    strcpy (resp, rdir);
+		    if (dts->verbose)
+			dtsLog (dts, "%6.6s <  XFER: init: resuming in '%s'",
+			    dts_queueNameFmt (qname), resp);
+
+	    } else {
+                if (PERF_DEBUG) 
+		    dtsLog (dts, "%6.6s <  XFER: init: getting next queue dir",
+		        dts_queueNameFmt (qname));
+	        strcpy (resp, dts_getNextQueueDir (dts, qname));
+                if (PERF_DEBUG) 
+		    dtsLog (dts, "%6.6s <  XFER: init: got next dir '%s'",
+		        dts_queueNameFmt (qname), resp);
+
+	        /*  If we already hold the object, put a copy in the new
+	         *  queue dir and tell the sender it needn't send the data.
+	         *  Otherwise tag the dir so a retry may find it.
+	         */
+	        if (md5 && fname && 
+		    (!dtsq->dedup || dts_initDup (qname, md5, fsize, fname, 
+		        resp) != OK))
+			    (void) psMapTag (resp, fname, fsize, md5);
+	    }
         }
     } else {
 	sprintf (resp, "Error: statfs() return zero blocksize on %s", dir);
@@ -3690,6 +3749,8 @@ err_ret:
 	    dts_queueNameFmt (qname), resp);
 
     if (qname) free ((char *) qname), qname = NULL;
+    if (md5)   free ((char *) md5),   md5 = NULL;
+    if (fname) free ((char *) fname), fname = NULL;
 
 /*  dts_queueUnlock (dtsq); */
 
@@ -3697,6 +3758,54 @@ err_ret:
 }
 
 
+/**
+ *  DTS_INITDUP -- Link a copy of an object we already hold into the queue
+ *  dir for a new transfer.  On success the queue dir in 'resp' is tagged
+ *  so the sender knows to skip the data.
+ *
+ *  @brief	Link a held copy of an object into a new queue dir.
+ *  @fn		int dts_initDup (char *qname, char *md5, long fsize,
+ *			char *fname, char *resp)
+ *
+ *  @param  qname	queue name
+ *  @param  md5		MD5 sum of the object
+ *  @param  fsize	size of the object
+ *  @param  fname	name of the object
+ *  @param  resp	queue dir response string
+ *  @return		OK if a copy was made, ERR otherwise
+ */
+static int
+dts_initDup (char *qname, char *md5, long fsize, char *fname, char *resp)
+{
+    char  *src = NULL, *qp = NULL, *bp = NULL, dst[SZ_LINE], tmp[SZ_LINE];
+    int   stat = ERR;
+
+
+    if ((src = dts_indexLookup (qname, md5, fsize)) == (char *) NULL)
+	return (ERR);
+
+    bp = ((bp = strrchr (fname, (int) '/')) ? bp+1 : fname);
+    qp = dts_sandboxPath (resp);
+    memset (dst, 0, SZ_LINE);
+    sprintf (dst, "%s%s", qp, bp);
+
+    if (*bp && dts_indexLink (src, dst) == OK) {
+	memset (tmp, 0, SZ_LINE);
+	sprintf (tmp, "%s%s", DTS_DUP_TAG, resp);
+	strcpy (resp, tmp);
+	stat = OK;
+
+	if (dts->verbose)
+	    dtsLog (dts, "%6.6s <  XFER: init: have '%s' as %s", 
+		dts_queueNameFmt (qname), bp, src);
+    }
+
+    free ((void *) qp);
+    free ((void *) src);
+    return (stat);
+}
+
+
 /**
  *  DTS_ENDTRANSFER -- Clean up and terminate a transfer operation.
  *
@@ -3812,7 +3921,8 @@ dts_endTransfer (void *data)
 	    break;
 
 	case QUEUE_TRANSFER:
-	    /* FIXME -- need to handle queue transfer/tee
+	    /* The object is forwarded by the queue manager, a fan-out queue
+	     * tees it to all of its destinations (see dts_queueFanout()).
 	     */
 #ifdef USE_DTS_DB
 	    key = dts_dbNewEntry (dtsq->name, dtsq->src, dtsq->dest,
@@ -3864,7 +3974,8 @@ dts_endTransfer (void *data)
 	    valid = ERR;
     	    if (dts->verbose > 1)
 		dtsLog (dts, "ERROR: %s\n", emsg);
-	}
+	} else if (stat == OK && dtsq->dedup)
+	    dts_indexAdd (qname, ctrl->md5, ctrl->fsize, fpath);
 
 	/*  Remove the lockfile on the queue directory.
 	 */
@@ -3883,8 +3994,17 @@ dts_endTransfer (void *data)
 	dtsLog (dts, "%6.6s <  XFER: file=%s   status=%s %s",
 	    dts_queueNameFmt (qname), fpath, 
 	    "ERROR", " transfer checksum failed");
+
+	/*  Don't offer any copy we hold under this sum again.
+	 */
+	dts_indexRemove (qname, ctrl->md5);
     }
 
+    /*  Let the queue manager commit or drop a cut-through object it is
+     *  already forwarding.
+     */
+    dts_cutDone (qp, valid);
+
     gettimeofday (&t3, NULL);
 
     if (dts->verbose) {
@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include <sys/errno.h>
 #include <sys/socket.h>
@@ -44,8 +45,6 @@ pthread_mutex_t svc_mutex = PTHREAD_MUTEX_INITIALIZER;
  *   FIXME -- CS_STRIPE and CS_PACKET not working......
  */
 int	psock_checksum_policy	= CS_CHUNK;
-int	err_return		= -1;
-int	thread_sem		= 0;
     
 extern struct timeval io_tv;
 extern int   queue_delay;
@@ -53,18 +52,29 @@ extern int   first_write;	/* keep track of whether thread has written   */
 extern DTS  *dts;
 
 void dts_printPHdr (char *s, phdr *h);
+void psReadAhead (void *data);
+void psReleaseBuf (psBuf *pb, int slot);
+void psPathUpdate (psArg *arg, long nbytes, struct timeval tv);
+void psCodeChunk (psBuf *pb, int slot, long foff, long nb);
+int  psPutHello (int sock);
+int  psGetHello (int sock);
+long psSendChunk (int sock, psBuf *pb, int slot, unsigned int sum32, 
+		long choff);
 
 
 
 /**
- *  PSSPAWNTHREADS -- Spawn a worker thread for the transfer.  All we do here
- *  is start a thread to run the function passed in.  This may be used to
- *  either read or write the data.
+ *  PSSPAWNTHREADS -- Spawn the worker threads for the transfer.  All we do
+ *  here is queue the function passed in for each stream in the worker
+ *  pool (see dtsWorker.c).  This may be used to either read or write the
+ *  data.  If not every stream can be queued the group is cancelled and
+ *  ERR returned, the caller should wait for the group before giving up.
  *
- *  @brief  Spawn a worker thread for the transfer.
+ *  @brief  Spawn the worker threads for the transfer.
  *  @fn     int psSpawnThreads (void *worker, int nthreads, char *dir, 
- *		char *fname, long fsize, int mode, int port, char *host, 
- *		int verbose, pthread_t *tids)
+ *		char *fname, long fsize, int mode, int port, int session,
+ *		int dport, char *host, int verbose, int fd, 
+ *		dtsWorkGroup *grp)
  *
  *  @param  worker	worker function 
  *  @param  nthreads	number of threads to create
@@ -73,31 +83,69 @@ void dts_printPHdr (char *s, phdr *h);
  *  @param  fsize	file size
  *  @param  mode	transfer mode (push or pull)
  *  @param  port	client base port number
+ *  @param  session	transfer session on the data port
+ *  @param  dport	listener's shared data port (0 for none)
  *  @param  host	client host name
  *  @param  verbose	verbose output flag
- *  @param  tids	thread id array
+ *  @param  fd		shared file descriptor (or -1)
+ *  @param  grp		work group for the transfer
  *
  *  @return		status code
  */
 int
 psSpawnThreads (void *worker, int nthreads, char *dir, char *fname, long fsize, 
-	int mode, int port, char *host, int verbose, pthread_t  *tids)
+	int mode, int port, int session, int dport, char *host, int verbose, 
+	int fd, dtsWorkGroup *grp)
 {
-    int    t, rc;
+    int    t, keepalive = 0, sockbuf = 0;
+    int    path[MAX_THREADS], nshare[MAX_THREADS];
     long   start, end, stripeSize;
+    char   qname[SZ_FNAME];
+    psSched *sched = (psSched *) NULL;
+    dtsQueue *dtsq = (dtsQueue *) NULL;
 #ifdef STATIC_ARG
     static psArg  arg[MAX_THREADS];
 #else
     psArg  *arg = (psArg *) NULL, *argP = (psArg *) NULL;
 #endif
-    pthread_attr_t  attr;                       /* thread attributes    */
 
 
-    /* Initialize the service processing thread attribute.
+    /*  See whether the queue wants the connections kept open.
     */
-    pthread_attr_init (&attr);
-    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_JOINABLE);
+    memset (qname, 0, SZ_FNAME);
+    keepalive = dts_poolKeepalive (dir, qname);
 
+    /*  The streams share a scheduler handing out the units of the file.
+    */
+    nthreads = min (nthreads, MAX_THREADS);
+    if ((sched = psSchedInit (fsize, nthreads)) == NULL) {
+	dtsErrLog (NULL, "psSpawnThreads: cannot alloc scheduler\n");
+	return (ERR);
+    }
+
+    /*  Use the chunk and socket buffer size tuned for the peer, if any.
+    */
+    dts_tuneSocket (host, &sched->chunk, &sockbuf);
+
+    /*  See whether the queue wants the data compressed in transit.
+    */
+    if (qname[0] && (dtsq = dts_queueLookup (qname)))
+	sched->codec = dtsq->compress;
+    strcpy (sched->qname, qname);
+
+    /*  Send the stripes without chunk checksums, using the zero-copy path
+    **  (see dts_sockSendFile), if asked to.  The policy is kept with the
+    **  transfer and sent in each stripe header for the receiver to follow,
+    **  so only the sending end needs the flag.  The file is still
+    **  validated against its sums when the transfer ends.
+    */
+    if (DTS_NOSUM)
+	sched->policy = CS_NONE;
+
+    /*  Spread the streams over the network paths to the peer, if it has
+    **  more than one (see dtsPath.c).
+    */
+    dts_pathAlloc (host, nthreads, path, nshare);
 
     /* Do the actual file transfer.
     */
@@ -111,16 +159,28 @@ psSpawnThreads (void *worker, int nthreads, char *dir, char *fname, long fsize,
 #ifdef STATIC_ARG
 	argp = &arg[t];
 #else
-        argP = (psArg *) calloc (1, sizeof(psArg));
+        if ((argP = (psArg *) calloc (1, sizeof(psArg))) == NULL) {
+            dtsErrLog (NULL, "ERROR: cannot alloc transfer thread %d\n", t);
+	    goto cleanup;
+	}
         arg = argP;
 #endif
 	argP->tnum   = t;		/* setup thread argument	*/
 	argP->port   = port + t;
+	argP->session = session;
+	argP->dport  = dport;
 	argP->mode   = mode;
 	strcpy (argP->host, host);
 	strcpy (argP->fname, fname);
 	strcpy (argP->dir, dir);
 	argP->fsize  = fsize;
+	argP->fd     = fd;
+	argP->keepalive = keepalive;
+	argP->sockbuf = sockbuf;
+	argP->path   = path[t];
+	argP->pshare = nshare[t];
+	strcpy (argP->qname, qname);
+	argP->sched  = sched;
 	argP->nbytes = stripeSize;
 	argP->start  = start;
 	argP->end    = end;
@@ -129,62 +189,339 @@ psSpawnThreads (void *worker, int nthreads, char *dir, char *fname, long fsize,
 	    dtsErrLog (NULL, "Spawning thread %2d ...%10ld to %10ld\n", 
 		t, argP->start, argP->end);
 	    
-        if ((rc = pthread_create (&tids[t], &attr, (void *)worker, 
-		(void *)argP))) {
-                    dtsErrLog (NULL, 
-			"ERROR: pthread_create() fails, code: %d\n", rc);
-                    return (ERR);
+        if (dts_workSubmit (grp, t, worker, (void *)argP) != OK) {
+            dtsErrLog (NULL, "ERROR: cannot queue transfer thread %d\n", t);
+#ifndef STATIC_ARG
+	    free ((void *) argP);
+#endif
+	    goto cleanup;
         }
     }
 
-    pthread_attr_destroy (&attr);
     return (OK);
+
+    /*  Drop the scheduler references of the streams we didn't queue and
+    **  tell those we did to give up.  Our caller must still wait for them.
+    */
+cleanup:
+    for ( ; t < nthreads; t++)
+	psSchedRelease (sched);
+    dts_workCancel (grp);
+    return (ERR);
 }
 
 
 /**
  *  PSCOLLECTTHREADS -- Collect the worker threads for the transfer.  Our
- *  onl job  here is start a thread to rejoin the previously createed
- *  threads.
+ *  only job here is to wait for the streams queued in the group to
+ *  complete.
  *
  *  @brief  Collect worker threads for the transfer.
- *  @fn     int psCollectThreads (int nthreads, pthread_t *tids)
+ *  @fn     int *psCollectThreads (dtsWorkGroup *grp)
  *
- *  @param  nthreads	number of threads to create
- *  @param  tids	thread IDs
- *  @return		status code
+ *  @param  grp		work group for the transfer
+ *  @return		array of thread status if any failed, else NULL
  *
  */
+int *
+psCollectThreads (dtsWorkGroup *grp)
+{
+    return (dts_workWait (grp));
+}
 
-#define USE_PTHREAD_JOIN
 
-int *
-psCollectThreads (int nthreads, pthread_t *tids)
+
+/** 
+ *  psServerConnect -- Get a data connection for a stream on which we act
+ *  as the server.  Normally we register the stream on the data port (see
+ *  dtsDemux.c), tell our parent we're ready and wait for the client to
+ *  connect.  If the queue keeps its connections alive we first look in
+ *  the pool for a connection to this peer and listen on both that and the
+ *  (still open) listening socket:  the client either greets us on the
+ *  pooled connection or, if it no longer has one, makes a new connection
+ *  which replaces ours.  The greeting is exchanged on every connection,
+ *  pooled or not, so the two ends needn't agree on whether connections
+ *  are kept.  We give up if the client doesn't show up in SOCK_IO_TIMEOUT
+ *  or the transfer is cancelled.
+ *
+ *  @brief  Get a data connection as the server
+ *  @fn     int psServerConnect (psArg *arg, int *lsock)
+ *
+ *  @param  arg		thread argument
+ *  @param  lsock	listening socket (output)
+ *  @return		connected socket, or -1 on error
+ *
+ */
+int
+psServerConnect (psArg *arg, int *lsock)
 {
-#ifdef USE_PTHREAD_JOIN
-    int  nerrs = 0;
-    void *s;
-#endif
-    int  t, rc;
-    //static int stat[MAX_THREADS];
-    int *stat = calloc (MAX_THREADS, sizeof (int));
+    int    sock = 0, ps = 0, ns = 0, nfds = 0, n = 0, pooled = 0, nsec = 0;
+    struct pollfd  pfd[2];
 
 
-    memset (stat, 0, (sizeof(int) * MAX_THREADS));
-    /* Free attribute and wait for the threads to complete.
+    if (arg->keepalive)
+	dts_poolGet (arg->host, arg->qname, arg->port, &sock, &ps);
+
+    /*  A pooled registration on the data port was for the session of an
+    **  earlier transfer, a new connection will come for this one.
     */
-#ifdef USE_PTHREAD_JOIN
-    for (t=0; t < nthreads; t++) {
-        if ((rc = pthread_join (tids[t], (void **)&s)) ) {
-            stat[t] =  *((int *) s);
-	    nerrs++;
-        }
+    if (ps > 0 && arg->dport > 0) {
+	close (ps);
+	ps = 0;
     }
-#else
 
-#endif
+    if (ps <= 0 && (ps = dts_dataRegister (arg->dport, arg->session, 
+	arg->tnum, arg->port, arg->sockbuf)) < 0) {
+	if (sock > 0)
+	    close (sock);
+	*lsock = 0;
+	return (-1);
+    }
+    *lsock = ps;
+    pooled = (sock > 0);
+
+    dts_workReady ();				/* tell parent we're ready */
+
+    /*  Wait for the client to greet us on the pooled connection, or to
+    **  make a new one.
+    */
+    while (1) {
+	pfd[0].fd = ps;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	pfd[1].fd = sock;
+	pfd[1].events = POLLIN;
+	pfd[1].revents = 0;
+	nfds = (sock > 0 ? 2 : 1);
+	if ((n = poll (pfd, nfds, 1000)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	} else if (n == 0) {
+	    if (dts_workCancelled ())
+		break;				/* transfer not started	  */
+	    if (++nsec < SOCK_IO_TIMEOUT)
+		continue;
+	    dtsErrLog (NULL, "psServerConnect: no connection from %s:%d\n",
+		arg->host, arg->port);
+	    break;
+	}
+
+	if (pfd[0].revents) {
+	    if ((ns = dts_dataAccept (ps, arg->sockbuf)) < 0) {
+                dtsErrLog (NULL, "psServerConnect: accept: %s\n", 
+		    strerror(errno));
+		break;
+	    }
+	    if (sock > 0)
+		close (sock);
+	    sock = ns;
+	    pooled = 0;
+	}
+
+	if (psGetHello (sock) == OK && psPutHello (sock) == OK)
+	    return (sock);
+
+	close (sock);
+	sock = 0;
+	if (!pooled) {
+	    dtsErrLog (NULL, "psServerConnect: no greeting from %s:%d\n",
+		arg->host, arg->port);
+	    break;
+	}
+	pooled = 0;				/* stale connection	  */
+    }
+
+    if (sock > 0)
+	close (sock);
+    return (-1);
+}
+
+
+/** 
+ *  psClientConnect -- Get a data connection for a stream on which we act
+ *  as the client.  If the queue keeps its connections alive we first try
+ *  a pooled connection to the peer, falling back to a new connection if
+ *  the server doesn't answer our greeting on it.  New connections to a
+ *  peer on several networks are made over the stream's path.  We greet
+ *  the server on every connection (see psServerConnect).
+ *
+ *  @brief  Get a data connection as the client
+ *  @fn     int psClientConnect (psArg *arg, int retry)
+ *
+ *  @param  arg		thread argument
+ *  @param  retry	connection retry count
+ *  @return		connected socket, or -1 on error
+ *
+ */
+int
+psClientConnect (psArg *arg, int retry)
+{
+    int  sock = 0, ps = 0, i, path;
+    char local[SZ_FNAME], remote[SZ_FNAME];
+
+
+    if (dts_workCancelled ())
+	return (-1);				/* transfer not started	  */
+
+    if (arg->keepalive &&
+	dts_poolGet (arg->host, arg->qname, arg->port, &sock, &ps) == OK) {
+	    if (psPutHello (sock) == OK && psGetHello (sock) == OK)
+		return (sock);
+	    close (sock);			/* stale connection	  */
+	    if (ps > 0)
+		close (ps);
+    }
+
+    /*  Connect over our network path, or the next one up if that fails.
+    **  Without paths, or if none will connect, use the usual address.
+    */
+    for (i=0, sock = -1; arg->path >= 0 && i < MAX_NET_PATHS; i++) {
+	path = (arg->path + i) % MAX_NET_PATHS;
+	if (dts_pathAddr (arg->host, path, local, remote) != OK)
+	    continue;
+	if ((sock = dts_dataConnectVia (remote, local, arg->dport, 
+	    arg->session, arg->tnum, arg->port, retry, arg->sockbuf)) >= 0) {
+		arg->path = path;
+		break;
+	}
+	dts_pathFail (arg->host, path);
+    }
+    if (sock < 0) {
+	arg->path = -1;
+        if ((sock = dts_dataConnect (arg->host, arg->dport, arg->session,
+	    arg->tnum, arg->port, retry, arg->sockbuf)) < 0)
+	        return (-1);
+    }
+
+    if (psPutHello (sock) != OK || psGetHello (sock) != OK) {
+	dtsErrLog (NULL, "psClientConnect: no greeting from %s:%d\n",
+	    arg->host, arg->port);
+	close (sock);
+	return (-1);
+    }
+
+    return (sock);
+}
+
+
+/** 
+ *  psReleaseConnect -- Finish with a stream's data connection.  Sockets
+ *  are returned to the pool if the queue keeps its connections alive and
+ *  the transfer succeeded, otherwise they're closed.
+ *
+ *  @brief  Release a data connection
+ *  @fn     void psReleaseConnect (psArg *arg, int sock, int lsock, 
+ *		int status)
+ *
+ *  @param  arg		thread argument
+ *  @param  sock	connected socket
+ *  @param  lsock	listening socket (server side, else 0)
+ *  @param  status	transfer status
+ *  @return		nothing
+ *
+ */
+void
+psReleaseConnect (psArg *arg, int sock, int lsock, int status)
+{
+    dts_wanDetach (sock);
+
+    if (arg->keepalive && status == OK && sock > 0) {
+	dts_poolPut (arg->host, arg->qname, arg->port, sock, lsock, 
+	    arg->keepalive);
+
+    } else {
+        if (sock > 0 && (close (sock) < 0) )
+            dtsError ("psReleaseConnect: Socket (sock) shutdown fails");
+        if (lsock > 0 && (close (lsock) < 0) )
+            dtsError ("psReleaseConnect: Socket (lsock) shutdown fails");
+    }
+}
+
+
+/** 
+ *  psPathUpdate -- Note how a stream did on its network path.  Only the
+ *  client knows which path was used, it gives the path a throughput
+ *  sample or, if the stream failed, marks the path as down.
+ *
+ *  @brief  Note how a stream did on its network path
+ *  @fn     void psPathUpdate (psArg *arg, long nbytes, struct timeval tv)
+ *
+ *  @param  arg		thread argument
+ *  @param  nbytes	bytes moved by the stream, or -1 on error
+ *  @param  tv		stream start time
+ *  @return		nothing
+ *
+ */
+void
+psPathUpdate (psArg *arg, long nbytes, struct timeval tv)
+{
+    if (arg->path < 0)
+	return;
+
+    if (nbytes < 0)
+	dts_pathFail (arg->host, arg->path);
+    else
+	dts_pathUpdate (arg->host, arg->path, arg->pshare, nbytes, 
+	    dts_tstop (tv));
+}
+
+
+/** 
+ *  psPutHello -- Send the pooled connection greeting.  We use MSG_NOSIGNAL
+ *  since the peer may have closed a pooled connection while it was idle.
+ */
+int
+psPutHello (int sock)
+{
+    phdr  h;
+    char *ptr = (char *) &h;
+    int   nb = 0, nleft = sizeof (h);
+
+
+    memset (&h, 0, sizeof (h));
+    h.chunkSize = PS_HELLO;
+    h.sum32     = PS_MAGIC;
+
+    while (nleft > 0) {
+        if ((nb = send (sock, ptr, nleft, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+		continue;
+	    return (ERR);
+	}
+	nleft -= nb;
+	ptr   += nb;
+    }
+    return (OK);
+}
+
+
+/** 
+ *  psGetHello -- Wait for the pooled connection greeting.
+ */
+int
+psGetHello (int sock)
+{
+    phdr  h;
+    char *ptr = (char *) &h;
+    int   nb = 0, nleft = sizeof (h);
+
 
-    return ( nerrs ? stat : NULL );
+    while (nleft > 0) {
+	if (dts_sockWait (sock, POLLIN, PS_HELLO_TIME) <= 0)
+	    return (ERR);			/* timeout or error	  */
+
+        if ((nb = recv (sock, ptr, nleft, 0)) < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+		continue;
+	    return (ERR);
+	} else if (nb == 0)
+	    return (ERR);			/* EOF			  */
+	nleft -= nb;
+	ptr   += nb;
+    }
+
+    return ((h.chunkSize == PS_HELLO && h.sum32 == PS_MAGIC) ? OK : ERR);
 }
 
 
@@ -210,9 +547,9 @@ psCollectThreads (int nthreads, pthread_t *tids)
 void
 psSendFile (void *data)
 {
-    int   fd, ps=0, ps2=0, sock = 0, lock, status = OK, nread;
+    int   fd, ps=0, ps2=0, sock = 0, status = OK;
+    long  nsent = 0;
     char  *fp = NULL;
-    unsigned char *buf = NULL;
     psArg  *arg = data;
 
     struct timeval tv1, tv2;
@@ -233,32 +570,23 @@ psSendFile (void *data)
     }
 
     if (arg->mode == XFER_PUSH) {
-        ps = dts_openServerSocket (arg->port);		  /* open as "server" */
-	if (ps < 0) {
+	if ((sock = ps2 = psServerConnect (arg, &ps)) < 0) {
             dtsErrLog (NULL, 
 		"psSendFile: cannot open server socket %d\n", arg->port);
+	    psSchedRelease (arg->sched);
+	    dts_workStatus (ERR);
 	    return;
 	}
 
-        dts_semDecr (thread_sem);
-
-        /* Accept a connection on the port.
-        */
-        if ((ps2 = accept (ps, NULL, NULL)) < 0) {
-            dtsErrLog (NULL, "errno: %s", errno, strerror(errno));
-            dtsError ("psSendFile accept() fails");
-	}
-	sock = ps2;
-
     } else if (arg->mode == XFER_PULL) {
-        ps = dts_openClientSocket (arg->host, arg->port, 1);
-	if (ps < 0) {
+	if ((sock = ps2 = psClientConnect (arg, 1)) < 0) {
             dtsErrLog (NULL, 
 		"psSendFile: cannot open client socket to %s:%d ps=%d\n",
-		arg->host, arg->port, ps);
+		arg->host, arg->port, sock);
+	    psSchedRelease (arg->sched);
+	    dts_workStatus (ERR);
 	    return;
 	}
-	sock = ps;
     }
 
 
@@ -269,6 +597,10 @@ psSendFile (void *data)
     }
 
 
+    /*  Emulate a WAN link on the connection if asked to (testing only).
+    */
+    dts_wanAttach (sock, arg->qname);
+
     /*  Disable the Nagle algorithm to make persistant connections faster.
     if (psock_checksum_policy == CS_NONE && (!DTS_NAGLE)) {
     */
@@ -281,65 +613,69 @@ psSendFile (void *data)
     }
                 
 
-    /*  Create a lock on the thread so we have exclusive access to the
-    **  file.  Read the chunk we're going to send into memory and release
-    **  the lock.
+    /*  Open our own descriptor on the file.  Each thread reads only the
+    **  units it takes with positional reads, so no lock is needed and the
+    **  data are streamed from disk rather than staged in memory.  A
+    **  descriptor given by our parent (e.g. a tar stream) is shared.
     */
-    dts_tstart (&tv1);
-    lock = pthread_mutex_lock (&svc_mutex);
-
-    if ((fd = dts_fileOpen ((fp=dts_sandboxPath(arg->fname)),
-	O_RDONLY|O_NONBLOCK )) > 0) {
-
-        lseek (fd, (off_t) arg->start, SEEK_SET);
-	if (arg->nbytes) {
-            buf = calloc (1, arg->nbytes + 1);
-	} else {
-	    dtsErrLog (NULL, "psSendFile: cannot alloc %d bytes, quitting\n", 
-    	        arg->nbytes);
-	    free ((void *) fp);
-            lock = pthread_mutex_unlock (&svc_mutex);
-            pthread_exit (&err_return);
-	}
-
-        nread = dts_fileRead (fd, buf, arg->nbytes);	/* read stripe	*/
-        dts_fileClose (fd);
-	free ((void *) fp);
-
-    } else { 
+    if (arg->fd >= 0)
+	fd = arg->fd;
+    else if ((fd = dts_fileOpenDirect ((fp=dts_sandboxPath(arg->fname)), 
+	O_RDONLY, arg->fsize)) < 0) {
 	/* Cannot open file.
 	*/
 	dtsErrLog (NULL, "psSendFile:  cannot open '%s' (%s), quitting\n", 
-    	    dts_sandboxPath(arg->fname), arg->fname);
+    	    fp, arg->fname);
 	free ((void *) fp);
-        lock = pthread_mutex_unlock (&svc_mutex);
-        pthread_exit (&err_return);
+	psReleaseConnect (arg, ps2, ps, ERR);
+	psSchedRelease (arg->sched);
+	dts_workStatus (ERR);
+	return;
     }
+    if (fp)
+	free ((void *) fp);
 
-    lock = pthread_mutex_unlock (&svc_mutex);
+#ifdef Linux
+    if (fd != arg->fd)
+	posix_fadvise (fd, (off_t) 0, (off_t) 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
+    /*  Find out what the receiver already has from an earlier attempt.
+    */
+    if (psMapRecv (sock, arg->sched, fd) != OK) {
+	dtsErrLog (NULL, "psSendFile: no resume map for '%s'\n", arg->fname);
+	if (fd != arg->fd)
+	    dts_fileClose (fd);
+	psReleaseConnect (arg, ps2, ps, ERR);
+	psSchedRelease (arg->sched);
+	dts_workStatus (ERR);
+	return;
+    }
+    psSchedImages (arg->sched, fd);
 
     if (PTCP_VERB) {
-        dtsTimeLog ("psSend: file read time: %.4g sec\n", tv1);
         dtsErrLog (NULL, 
-	    "Send t %d, fsize=%10d  offset=%10d  stripe=%10d port=%d fd=%d\n",
-	    arg->tnum, (int)arg->fsize, (int)arg->start, (int)arg->nbytes, 
-	    arg->port, sock);
+	    "Send t %d, fsize=%10ld  offset=%10ld  stripe=%10ld port=%d fd=%d\n",
+	    arg->tnum, arg->fsize, arg->start, arg->nbytes, arg->port, sock);
     }
         
     /* Initialize the I/O time counters.
     */
     gettimeofday (&tv1, NULL);
 
-    /* Send the file stripe.
+    /* Send units of the file until there are none left.
     */
-    if (buf) {
-        status = psSendStripe (sock, buf, arg->start, arg->tnum, arg->nbytes);
-	if (dts->debug > 2)
-	    fprintf (stderr, "Stripe %d:  status=%d\n", arg->tnum, status);
-    }
+    nsent = psSendUnits (sock, fd, arg->sched, arg->tnum);
+    status = (nsent < 0 ? -1 : OK);
+    if (arg->mode == XFER_PULL)
+	psPathUpdate (arg, nsent, tv1);
+    if (dts->debug > 2)
+	fprintf (stderr, "Stream %d:  sent %ld bytes\n", arg->tnum, nsent);
+    psSchedRelease (arg->sched);
     if (PTCP_VERB)
         dtsTimeLog ("psSend: stripe send time: %.4g sec\n", tv1);
+    if (fd != arg->fd)
+	dts_fileClose (fd);
 
 
     /* Update the I/O time counters.
@@ -354,23 +690,14 @@ psSendFile (void *data)
     }
 
 
-    /* Free the data buffer in memory, close our part of the socket.
+    /* Close our part of the socket, or keep it for the next file.
     */
-    if (buf) {
-	if (buf[arg->nbytes] != 0)
-            dtsError ("psSendFile: Buffer overflow");
-        free ((char *) buf);
-    }
-
-    if (ps2 && (close (ps2) < 0) )
-        dtsError ("psSendFile: Socket (ps2) shutdown fails");
-    if (ps && (close (ps) < 0) )
-        dtsError ("psSendFile: Socket (ps) shutdown fails");
+    psReleaseConnect (arg, ps2, ps, (status < 0 ? ERR : OK));
+    dts_workStatus ((status < 0 ? ERR : OK));
 
 #ifndef STATIC_ARG
     if (arg) free ((void *) arg);
 #endif
-    pthread_exit (NULL);
 }
 
 
@@ -396,54 +723,40 @@ psSendFile (void *data)
 void
 psReceiveFile (void *data)
 {
-    int    ps=0, ps2=0, sock = 0, fd = 0, lock, nwrote;
-    unsigned char *dbuf;
+    int    ps=0, ps2=0, sock = 0, status = OK;
+    long   nread = 0;
     psArg *arg = data;
     struct timeval tv1, tv2;
 
 
-    /* We are running in a thread, so change the working directory.
+    /*  The output file was opened by our parent (see psOpenReceiveFile)
+    **  so there's no need to change the working directory here.
     */
-    if (strcmp (arg->dir, "./") != 0) {
-        char *pdir  = dts_sandboxPath (arg->dir);
-
-	if (access (pdir, F_OK) != 0)
-	    dts_makePath (pdir, TRUE);
-        chdir (pdir);
-	free ((void *) pdir);
-    }
-
-
     if (arg->mode == XFER_PUSH) {
-        ps = dts_openClientSocket (arg->host, arg->port, 3);
-        if (ps < 0) {
+	if ((sock = ps2 = psClientConnect (arg, 3)) < 0) {
             dtsErrLog (NULL, 
 		"psReceiveFile: cannot open client socket to %s:%d\n",
                 arg->host, arg->port);
+	    psSchedRelease (arg->sched);
+	    dts_workStatus (ERR);
             return;
         }
-	sock = ps;
 
     } else if (arg->mode == XFER_PULL) {
-        ps = dts_openServerSocket (arg->port);		  /* open as "server" */
-        if (ps < 0) {
+	if ((sock = ps2 = psServerConnect (arg, &ps)) < 0) {
             dtsErrLog (NULL, "psReceiveFile: cannot open server socket %d\n",
 		arg->port);
+	    psSchedRelease (arg->sched);
+	    dts_workStatus (ERR);
             return;
         }
-
-	dts_semDecr (thread_sem);
-
-        /* Accept a connection on the port.
-        */
-        if ((ps2 = accept (ps, NULL, NULL)) < 0) {
-            dtsErrLog (NULL, "errno: %s", errno, strerror(errno));
-            dtsError ("psReceiveFile accept() fails");
-	}
-	sock = ps2;
     }
 
 
+    /*  Emulate a WAN link on the connection if asked to (testing only).
+    */
+    dts_wanAttach (sock, arg->qname);
+
     /*  Disable the Nagle algorithm to make persistant connections faster.
     if (psock_checksum_policy == CS_NONE && (!DTS_NAGLE)) {
     */
@@ -454,13 +767,22 @@ psReceiveFile (void *data)
 	    sizeof(flag));
 	fcntl (sock, F_SETFL, O_NDELAY);
     }
-                
+
+    /*  Tell the sender which blocks we already have.
+    */
+    if (psMapSend (sock, psMapLookup (arg->fd)) != OK) {
+	dtsErrLog (NULL, "psReceiveFile: cannot send resume map\n");
+	psReleaseConnect (arg, ps2, ps, ERR);
+	psSchedRelease (arg->sched);
+	dts_workStatus (ERR);
+	return;
+    }
                 
     if (PTCP_VERB) {
         dtsErrLog (NULL, 
-	    "Recv t %d, fsize=%10d  offset=%10d  chunk=%10d  %d/%d %d\n",
-	    arg->tnum, (int)arg->fsize, (int)arg->start, (int)arg->nbytes,
-	    arg->port, sock, fd);
+	    "Recv t %d, fsize=%10ld  offset=%10ld  chunk=%10ld  %d/%d %d\n",
+	    arg->tnum, arg->fsize, arg->start, arg->nbytes,
+	    arg->port, sock, arg->fd);
     }
 
 
@@ -471,83 +793,23 @@ psReceiveFile (void *data)
     gettimeofday (&tv1, NULL);
 
 
-    /* Receive the file stripe.
+    /*  Receive units of the file until the sender says we're done.  Each
+    **  unit carries its own offset, and each chunk is written to its
+    **  final place in the shared output descriptor as soon as it is
+    **  verified, so no lock is needed and only one chunk is held in memory.
     */
-    dbuf = psReceiveStripe (sock, arg->start, arg->tnum);
+    nread = psReceiveUnits (sock, arg->fd, 
+	(dts_tarIsStream (arg->fd) ? -1L : arg->fsize), arg->tnum);
+    psSchedRelease (arg->sched);
+    if (arg->mode == XFER_PUSH)
+	psPathUpdate (arg, nread, tv1);
 
     if (dts->debug > 2)
         dtsLog (dts, "psReceive: file recv time: %.4g sec\n", dts_tstop (tv1));
 
-    /* Check for a special NULL name to indicate we don't want to save
-     * the data.
-     */
-    if (strcmp (arg->fname, "DTSNull") != 0) {
-
-        /*  Create a lock on the thread so we have exclusive access to the 
-        **  output file.  Once we write our data to the file, free the data
-        **  buffer and unlock the thread.
-        */
-        lock = pthread_mutex_lock (&svc_mutex);
-
-        if (access (arg->fname, W_OK) != 0) {
-            struct timeval t1 = {0, 0};
-
-            /* File doesn't exist, pre-allocate it.
-	    */
-	    dts_tstart (&t1);
-	    if (dts_preAlloc (arg->fname, arg->fsize) != OK) {
-	        if (dbuf) free ((void *) dbuf);
-                lock = pthread_mutex_unlock (&svc_mutex);
-                pthread_exit (&err_return);
-	    }
-            if (dts->debug > 2)
-                dtsLog (dts, "psReceive: file prealloc time: %.4g sec\n",
-                    dts_tstop (t1));
-
-        } else {
-	    /* File exists, check the size, decide whether we want to 
-	    ** allow overwrite, etc. ....
-	    */
-	    ;
-        }
-
-
-        if (first_write) {
-            /*  First write gets rid of existing file.
-            */ 
-            fd = dts_fileOpen ( arg->fname, O_WRONLY|O_CREAT|O_TRUNC);
-            first_write = 0;
-        } else
-            fd = dts_fileOpen ( arg->fname, O_WRONLY|O_CREAT|O_NONBLOCK);
-
-        if ( (fd) > 0 ) {
-	    struct timeval t1 = {0, 0};
-	    extern DTS *dts;
-
-	    dts_tstart (&t1);
-            lseek (fd, (off_t) arg->start, SEEK_SET); /* write data stripe */
-
-	    if (dts->debug > 2)
-		dtsLog (dts, "psRcvFile:  tnum=%d  off=%d  nbytes=%d\n",
-		    arg->tnum, arg->start, arg->nbytes);
-            nwrote = dts_fileWrite (fd, dbuf, arg->nbytes);
-	    fsync (fd);				/* sync to disk		   */
-            
-	    if (TIME_DEBUG)
-		dtsTimeLog ("  disk i/o:  %.4g sec\n", t1);
-	    if (dbuf) 
-		free ((void *) dbuf);
-
-        } else {
-	    /* Cannot open file.
-	    */
-	    dtsError ("psReceiveFile cannot open file");
-	    if (dbuf) free ((void *) dbuf);
-            lock = pthread_mutex_unlock (&svc_mutex);
-            pthread_exit (&err_return);
-        }
-
-        lock = pthread_mutex_unlock (&svc_mutex);
+    if (nread < 0) {
+	dtsErrLog (NULL, "psReceiveFile: thread %d failed\n", arg->tnum);
+	status = ERR;
     }
 
 
@@ -563,16 +825,136 @@ psReceiveFile (void *data)
     }
 
 
-    if (ps2 && (close (ps2) < 0) )
-        dtsError ("psSendFile: Socket (ps2) shutdown fails");
-    if (ps && (close (ps) < 0) )
-        dtsError ("psSendFile: Socket (ps) shutdown fails");
+    /* Close our part of the socket, or keep it for the next file.
+    */
+    psReleaseConnect (arg, ps2, ps, status);
+    dts_workStatus (status);
 
 #ifndef STATIC_ARG
     if (arg) free ((void *) arg);
 #endif
+}
+
+
+/** 
+ *  psSendUnits -- Send units of a file on a stream connection until the
+ *  scheduler has none left.  Each unit is sent as a stripe (see
+ *  psSendStripeFd) whose header gives its offset in the file.  We finish
+ *  with an end-of-stream header giving the number of bytes we sent so
+ *  the receiver can check it got them all.
+ *
+ *  @brief  Send units of a file until there are none left
+ *  @fn     long psSendUnits (int sock, int fd, psSched *sched, int tnum)
+ *
+ *  @param  sock	socket descriptor
+ *  @param  fd		input file descriptor
+ *  @param  sched	work unit scheduler
+ *  @param  tnum	thread number
+ *
+ *  @return		number of bytes sent, or -1 on error
+ *
+ */
+long
+psSendUnits (int sock, int fd, psSched *sched, int tnum)
+{
+    long  offset = 0, nbytes = 0, total = 0;
+    int   nunits = 0;
+    phdr  ip;
+
+
+    while (psSchedNext (sched, &offset, &nbytes) == OK) {
+	if (psSendStripeFd (sock, fd, offset, tnum, nbytes, sched) < 0) {
+	    dtsErrLog (NULL, "psSendUnits: thread %d failed at offset %ld\n",
+		tnum, offset);
+	    return (-1);
+	}
+	total += nbytes;
+	nunits++;
+    }
+
+    /*  Tell the receiver we're done.
+    */
+    memset (&ip, 0, sizeof (ip));
+    ip.chunkSize = PS_EOS;
+    ip.maxbytes  = total;
+    if (dts_sockWrite (sock, &ip, sizeof(ip)) < 0) {
+        dtsError ("dts_sockWrite() fails to terminate stream");
+	return (-1);
+    }
+
+    if (PTCP_VERB)
+	dtsErrLog (NULL, "Thread[%2d] sent %d units, %ld bytes\n", 
+	    tnum, nunits, total);
+
+    return (total);
+}
+
+
+/** 
+ *  psReceiveUnits -- Receive units of a file on a stream connection until
+ *  the sender's end-of-stream header.  Units are written at the offset
+ *  given in their header, so it doesn't matter which stream carries them.
+ *  A unit which doesn't lie wholly within the file is refused.  The size
+ *  of a tar stream isn't known in advance, it is given as -1.
+ *
+ *  @brief  Receive units of a file until the end of the stream
+ *  @fn     long psReceiveUnits (int sock, int fd, long fsize, int tnum)
+ *
+ *  @param  sock	socket descriptor
+ *  @param  fd		output file descriptor
+ *  @param  fsize	file size (-1 if unknown)
+ *  @param  tnum	thread number
+ *
+ *  @return		number of bytes received, or -1 on error
+ *
+ */
+long
+psReceiveUnits (int sock, int fd, long fsize, int tnum)
+{
+    long  nr = 0, total = 0;
+    int   nunits = 0;
+    phdr  ip;
+
+
+    while (1) {
+	memset (&ip, 0, sizeof (ip));
+	if (dts_sockRead (sock, &ip, sizeof(ip)) != sizeof(ip)) {
+            dtsError ("dts_sockRead() fails to read unit header");
+	    return (-1);
+	}
+	if (ip.chunkSize == PS_EOS)
+	    break;
 
-    pthread_exit (NULL);
+	if (ip.offset < 0 || ip.maxbytes <= 0 || ip.sum32 > CS_STRIPE ||
+	    (fsize >= 0 && ip.maxbytes > fsize - ip.offset)) {
+	    dtsErrLog (NULL, "psReceiveUnits: bad unit hdr off=%ld sz=%ld\n",
+		(long) ip.offset, (long) ip.maxbytes);
+	    return (-1);
+	}
+	if ((nr = psReceiveStripeHdr (sock, fd, &ip, ip.offset, tnum)) != 
+	    ip.maxbytes) {
+		dtsErrLog (NULL, 
+		    "psReceiveUnits: thread %d got %ld of %ld bytes at %ld\n",
+		    tnum, nr, (long) ip.maxbytes, (long) ip.offset);
+		return (-1);
+	}
+	psMapMark (fd, ip.offset, nr);
+	dts_cutMark (fd, ip.offset, nr);
+	total += nr;
+	nunits++;
+    }
+
+    if (ip.maxbytes != total) {
+	dtsErrLog (NULL, "psReceiveUnits: thread %d got %ld of %ld bytes\n",
+	    tnum, total, (long) ip.maxbytes);
+	return (-1);
+    }
+
+    if (PTCP_VERB)
+	dtsErrLog (NULL, "Thread[%2d] recv %d units, %ld bytes\n", 
+	    tnum, nunits, total);
+
+    return (total);
 }
 
 
@@ -661,6 +1043,7 @@ resend:
         if (psock_checksum_policy == CS_CHUNK) {
             memset (&ip, 0, sizeof (ip));
 	    ip.chunkSize = chunkSize;
+	    ip.offset    = nwrote;
 	    ip.maxbytes  = maxbytes;
 	    ip.sum32     = addcheck32 (sbuf, nbytes);
 
@@ -762,38 +1145,507 @@ resend:
 
 
 /** 
- *  psReceiveStripe -- Do the actual transfer of the data stripe to the
- *  client connection.  A 'stripe' of data is actually transferred in 
- *  much smaller 'chunks' which can be tuned to be optimal for the 
- *  given connection.  The checksum policy allows us to perform a checksum
- *  of the data either for the entire stripe, or for each individual chunk.
- *  The former is generally more efficient as it involves fewer round-trips
- *  to the client (i.e. send the checksum and wait for verification before
- *  sending next chunk).  File-level checksum policy is enforced by our
- *  parent.
+ *  psSendStripeFd -- Stream a data stripe from an open file to the client
+ *  connection.  Rather than requiring the entire stripe in memory we keep
+ *  a small ring of chunk-sized buffers which a read-ahead thread fills 
+ *  with pread() while earlier chunks are being written to the socket.
+ *  Memory use is therefore bounded by the ring size, not the stripe size,
+ *  and no lock is needed since each thread reads only its own part of 
+ *  the file.  When the checksum policy is CS_NONE the data are instead 
+ *  sent with dts_sockSendFile() and never copied into user space at all.
+ *  The policy is that of the transfer (see psSpawnThreads) and is sent
+ *  in the stripe header so the receiver frames the data the same way.
  *
- *  @brief  Read data stripe from the socket connection
- *  @fn     uchar *psReceiveStripe (int sock, long offset, int tnum)
+ *  Under CS_CHUNK the ring doubles as a sliding window:  up to PS_WINDOW
+ *  chunks are sent before we wait for a reply.  Each chunk header carries
+ *  the chunk's offset within the stripe and its sum32.  The receiver
+ *  replies to every chunk with its own sum32 (a selective ack) and the
+ *  number of contiguous bytes verified so far (a cumulative ack).  A
+ *  buffer is reused only once its chunk is acknowledged, and only chunks
+ *  which fail verification are sent again.
+ *
+ *  When the file has integer FITS images to be compressed (see dtsRice.c)
+ *  the stripe is marked as coded and every chunk gets a header, whatever
+ *  the checksum policy, saying whether it was coded and its coded size.
+ *  The read-ahead thread codes the chunks as it reads them, checksums are
+ *  always of the original data.
+ *
+ *  @brief  Stream a data stripe from a file to the socket
+ *  @fn     int psSendStripeFd (int sock, int fd, long offset, 
+ *		int tnum, long maxbytes, psSched *sched)
  *
  *  @param  sock	socket descriptor
+ *  @param  fd		input file descriptor
  *  @param  offset	file offset for this stripe
- *  @param  tnum	thread (i.e. stripe) number
+ *  @param  tnum	thread number
+ *  @param  maxbytes	max bytes to transfer
+ *  @param  sched	work unit scheduler (chunk size and images to code)
  *
- *  @return		a pointer to the data read
+ *  @return		number of chunks sent, or -1 on error
  *
  */
-unsigned char *
-psReceiveStripe (int sock, long offset, int tnum)
+int
+psSendStripeFd (int sock, int fd, long offset, int tnum, long maxbytes,
+		psSched *sched)
 {
     register int npack = 0;
-    long     nread, chunkSize, maxbytes, nr = 0, nleft = 0;
+    long     nb = 0, nw = 0, nwrote = 0, nresend = 0, nwire = 0, chunkSize;
+    long     chunk = (sched ? sched->chunk : 0);
+    int      coded = (sched && sched->nimg > 0);
+    int      policy = (sched ? sched->policy : psock_checksum_policy);
+    long     next = 0, nacked = 0, inflight = 0, nchunks = 0, k;
+    int      slot = 0, rc, window = 2, status = OK, stale = 0;
+    int      ntry[PS_WINDOW];
+    unsigned int sum[PS_WINDOW];
     phdr     ip, op;
-    unsigned char  *rcvbuf = NULL, *dbuf = NULL;
+    psBuf    pb;
+    pthread_t rtid;
     char     tfmt[SZ_FNAME];
     struct timeval t1 = {0, 0};
-	
 
-    if (dts_debugLevel() > 2)
+
+    if (dts_debugLevel() > 3)
+	fprintf (stderr, "psSendStripeFd begins\n");
+
+    chunkSize = min (maxbytes, (chunk > 0 ? chunk : SZ_XFER_CHUNK));
+    nchunks   = (maxbytes + chunkSize - 1) / chunkSize;
+    memset (&pb, 0, sizeof (pb));
+    memset (&ip, 0, sizeof (ip));
+    memset (&op, 0, sizeof (op));
+
+    /*  Send the chunk size and file offset as the first packet to the 
+    **  receiver, along with the checksum policy it must follow.
+    */
+    ip.offset    = offset;
+    ip.chunkSize = min(chunkSize,maxbytes);
+    ip.maxbytes  = max(chunkSize,maxbytes);
+    ip.sum16     = (coded ? PS_CODED : 0);
+    ip.sum32     = (unsigned int) policy;
+    if ((nb = dts_sockWrite (sock, &ip, sizeof(ip))) < 0) {
+        dtsError ("dts_sockWrite() fails to init stripe");
+	return (-1);
+    }
+
+    /*  With no checksums there's nothing for us to look at in the data,
+    **  so send the stripe straight from the page cache to the socket.
+    **  The receiver sees exactly the same byte stream.
+    */
+    if (policy == CS_NONE && !coded) {
+	for (nwrote=0; nwrote < maxbytes; nwrote += nb) {
+	    nb = min (chunkSize, maxbytes - nwrote);
+	    dts_shapeWait ((sched ? sched->qname : NULL), nb);
+	    if (dts_sockSendFile (sock, fd, (off_t) (offset + nwrote), nb) != nb)
+		break;
+	}
+	npack = (int) ((nwrote + chunkSize - 1) / chunkSize);
+
+	if (PTCP_VERB)
+	    dtsErrLog (NULL, "Thread[%2d] %ld bytes zero-copy\n", tnum, nwrote);
+	return ((nwrote == maxbytes) ? npack : -1);
+    }
+
+    /*  Initialize the read-ahead ring and start the reader.  Double
+    **  buffering is enough when we don't wait for replies.
+    */
+    if (policy == CS_CHUNK)
+	window = min (PS_WINDOW, nchunks);
+
+    pb.fd        = fd;
+    pb.offset    = offset;
+    pb.maxbytes  = maxbytes;
+    pb.chunkSize = chunkSize;
+    pb.nbuf      = max (window, 1);
+    pb.policy    = policy;
+    pb.qname     = (sched ? sched->qname : (char *) NULL);
+    pb.img       = (coded ? sched->img : (dtsFitsImg *) NULL);
+    pb.nimg      = (coded ? sched->nimg : 0);
+    pthread_mutex_init (&pb.mutex, NULL);
+    pthread_cond_init (&pb.cond, NULL);
+    memset (ntry, 0, sizeof (ntry));
+    memset (sum, 0, sizeof (sum));
+
+    for (slot=0; slot < pb.nbuf; slot++) {
+	if (posix_memalign ((void **) &pb.buf[slot], DIO_ALIGN, chunkSize) ||
+	    (coded && !(pb.zbuf[slot] = malloc (chunkSize)))) {
+	        dtsErrLog (NULL, "psSendStripeFd: cannot alloc %ld bytes\n", 
+		    chunkSize);
+	        npack = -1;
+	        goto cleanup;
+	}
+    }
+    if ((rc = pthread_create (&rtid, NULL, (void *)psReadAhead, &pb))) {
+	dtsErrLog (NULL, "ERROR: pthread_create() fails, code: %d\n", rc);
+	npack = -1;
+	goto cleanup;
+    }
+
+    if (TIME_DEBUG) {
+	memset (tfmt, 0, SZ_FNAME);
+	sprintf (tfmt, "psSendStripeFd[%d]: ", tnum);
+	strcat (tfmt, " network transfer = %.4g sec\n");
+	dts_tstart (&t1);
+    }
+
+    /* Send the data.
+    */
+    while (nacked < nchunks && status == OK) {
+
+	/*  Fill the window.  Without acks a chunk is done once it is sent.
+	*/
+	while (next < nchunks && inflight < window && status == OK) {
+	    slot = next % pb.nbuf;
+
+	    /*  Wait for the reader to fill the next buffer.  If the buffer
+	    **  still holds an earlier chunk waiting to be resent, go and
+	    **  collect replies first.
+	    */
+	    pthread_mutex_lock (&pb.mutex);
+	    if (pb.full[slot] && pb.seq[slot] != next) {
+	        pthread_mutex_unlock (&pb.mutex);
+		break;
+	    }
+	    while (!pb.full[slot])
+	        pthread_cond_wait (&pb.cond, &pb.mutex);
+	    nb = pb.nbytes[slot];
+	    pthread_mutex_unlock (&pb.mutex);
+
+	    if (nb <= 0) {
+	        dtsErrLog (NULL, "psSendStripeFd: read error at offset %ld\n", 
+		    offset + next * chunkSize);
+		status = ERR;
+	        break;
+	    }
+	    if (policy == CS_CHUNK)
+	        sum[slot] = addcheck32 (pb.buf[slot], nb);
+	    ntry[slot] = 0;
+
+	    if ((nw = psSendChunk (sock, &pb, slot, sum[slot], 
+		next * chunkSize)) < 0) {
+		    status = ERR;
+		    break;
+	    }
+	    nwire += nw;
+	    npack++;
+	    next++;
+
+	    if (policy == CS_CHUNK) {
+		inflight++;
+	    } else {
+		nwrote += nb;
+		nacked++;
+		psReleaseBuf (&pb, slot);
+	    }
+	}
+	if (status != OK || policy != CS_CHUNK)
+	    continue;
+
+	/*  Get the next reply from the client.  The offset tells us which
+	**  chunk is being acknowledged.
+	*/
+        memset (&op, 0, sizeof (op));
+        if (dts_sockRead (sock, &op, sizeof(op)) != sizeof(op)) {
+            dtsError ("dts_sockRead() fails to read chunk checksum");
+	    status = ERR;
+	    break;
+	}
+	k = op.offset / chunkSize;
+	if (k < 0 || k >= next)
+	    continue;			/* stale or duplicate reply	*/
+	slot = k % pb.nbuf;
+	pthread_mutex_lock (&pb.mutex);
+	stale = (pb.seq[slot] != k || !pb.full[slot]);
+	pthread_mutex_unlock (&pb.mutex);
+	if (stale)
+	    continue;
+
+	/*  Check the 32-bit checksum as a simple error.
+	 */
+	if (op.sum32 == sum[slot]) {
+	    nwrote += pb.nbytes[slot];
+	    nacked++;
+	    inflight--;
+	    psReleaseBuf (&pb, slot);
+
+	} else {
+	    dtsErrLog (NULL, "Resending[%d:%d] packet %6ld  %10u != %10u\n", 
+		tnum, sock, k, sum[slot], op.sum32);
+	    nresend++;
+	    if (ntry[slot]++ > MAXTRIES) {
+		dtsError ("maxtries resend overflow");
+		status = ERR;
+		break;
+	    }
+	    if (psSendChunk (sock, &pb, slot, sum[slot], k * chunkSize) < 0)
+		status = ERR;
+	    npack++;
+	}
+
+	if (PTCP_DEBUG && op.maxbytes < nwrote)
+	    dtsErrLog (NULL, "Thread[%2d] cumulative ack %ld < %ld\n", 
+		tnum, (long) op.maxbytes, nwrote);
+    }
+
+    /*  Stop the reader in case we quit early, and wait for it to finish.
+    */
+    pthread_mutex_lock (&pb.mutex);
+    pb.abort = 1;
+    pthread_cond_broadcast (&pb.cond);
+    pthread_mutex_unlock (&pb.mutex);
+    pthread_join (rtid, NULL);
+
+    /*  Log debug timing info.
+     */
+    if (TIME_DEBUG)
+	dtsTimeLog (tfmt, t1);
+      
+    if (PTCP_VERB)
+	dtsErrLog (NULL, "Thread[%2d] %ld bytes in %d chunks, %ld resends\n", 
+	    tnum, nwrote, npack, nresend);
+    if (PTCP_VERB && coded)
+	dtsErrLog (NULL, "Thread[%2d] %ld bytes sent as %ld\n", 
+	    tnum, nwrote, nwire);
+    if (policy == CS_CHUNK && nresend > 0)
+	dtsErrLog (NULL, "Thread[%2d:%d] %ld bytes %d chunks, %ld resends\n", 
+	    tnum, sock, nwrote, npack, nresend);
+
+#ifdef LAST_PACKET
+    /*  Terminate the data transfer by sending a header packet with a 
+    **  negative chunk size.
+    */
+    memset (&ip, 0, sizeof (ip));
+    ip.chunkSize = -1;
+    ip.maxbytes  = -1;
+    if ((nb = dts_sockWrite (sock, &ip, sizeof(ip))) < 0)
+        dtsError ("dts_sockWrite() fails to terminate stripe");
+#endif
+    if (status != OK)
+	npack = -1;
+
+    /* Clean up.
+    */
+cleanup:
+    for (slot=0; slot < pb.nbuf; slot++) {
+	if (pb.buf[slot]) 
+	    free ((char *) pb.buf[slot]);
+	if (pb.zbuf[slot]) 
+	    free ((char *) pb.zbuf[slot]);
+    }
+    pthread_mutex_destroy (&pb.mutex);
+    pthread_cond_destroy (&pb.cond);
+
+    if (dts_debugLevel() > 3)
+	fprintf (stderr, "psSendStripeFd done\n");
+
+    return (npack);			/* return number of chunks sent	*/
+}
+
+
+/** 
+ *  psSendChunk -- Send one chunk from the read-ahead ring, preceeded by a
+ *  header giving its offset in the stripe and checksum if required.  The
+ *  chunks of a coded stripe always have a header, 'sum16' giving the
+ *  bytes per pixel of a coded chunk and 'chunkSize' the size sent.
+ *
+ *  @brief  Send one chunk from the read-ahead ring
+ *  @fn     long psSendChunk (int sock, psBuf *pb, int slot, 
+ *		unsigned int sum32, long choff)
+ *
+ *  @param  sock	socket descriptor
+ *  @param  pb		read-ahead ring
+ *  @param  slot	ring slot to send
+ *  @param  sum32	32-bit checksum of the chunk
+ *  @param  choff	chunk offset within the stripe
+ *
+ *  @return		number of data bytes sent, or -1 on error
+ *
+ */
+long
+psSendChunk (int sock, psBuf *pb, int slot, unsigned int sum32, long choff)
+{
+    phdr  ip;
+    long  nb = 0;
+    int   zpix = (pb->nimg > 0 ? pb->zpix[slot] : 0);
+
+
+    if (pb->policy == CS_CHUNK || pb->nimg > 0) {
+        memset (&ip, 0, sizeof (ip));
+	ip.chunkSize = (int) (zpix ? pb->zlen[slot] : pb->nbytes[slot]);
+	ip.offset    = choff;
+	ip.maxbytes  = pb->maxbytes;
+	ip.sum32     = sum32;
+	ip.sum16     = (unsigned short) zpix;
+
+	/* Send the packet header with the size and checksums.
+	*/
+        if (dts_sockWrite (sock, &ip, sizeof(ip)) < 0) {
+            dtsError ("dts_sockWrite() chunk checksum failure");
+	    return (-1);
+	}
+    }
+
+    /* Send the data chunk, at the rate the queue is allowed.
+    */
+    dts_shapeWait (pb->qname, (zpix ? pb->zlen[slot] : pb->nbytes[slot]));
+    if (zpix)
+        nb = dts_sockWrite (sock, pb->zbuf[slot], pb->zlen[slot]);
+    else
+        nb = dts_sockWrite (sock, pb->buf[slot], pb->nbytes[slot]);
+    if (nb < 0)
+        dtsError ("dts_sockWrite() data chunk failure");
+
+    return (nb);
+}
+
+
+/** 
+ *  psReleaseBuf -- Return a ring buffer to the read-ahead thread.
+ *
+ *  @brief  Return a ring buffer to the read-ahead thread
+ *  @fn     void psReleaseBuf (psBuf *pb, int slot)
+ *
+ *  @param  pb		read-ahead ring
+ *  @param  slot	ring slot to release
+ *
+ *  @return		nothing
+ *
+ */
+void
+psReleaseBuf (psBuf *pb, int slot)
+{
+    pthread_mutex_lock (&pb->mutex);
+    pb->full[slot] = 0;
+    pthread_cond_broadcast (&pb->cond);
+    pthread_mutex_unlock (&pb->mutex);
+}
+
+
+/** 
+ *  psReadAhead -- Read-ahead thread for psSendStripeFd().  Chunks of the
+ *  stripe are read in turn into the ring buffers, blocking whenever the
+ *  next buffer has not yet been released by the sender.  A short read is
+ *  posted as a negative byte count so the sender can quit.  Chunks of a
+ *  coded stripe are coded here, so it overlaps with sending the last.
+ *
+ *  @brief  Read-ahead thread for the streaming stripe sender
+ *  @fn     void psReadAhead (void *data)
+ *
+ *  @param  data	psBuf read-ahead state
+ *  @return		nothing
+ *
+ */
+void
+psReadAhead (void *data)
+{
+    psBuf *pb = data;
+    long   pos = 0, nb = 0, nread = 0, seq = 0;
+    int    slot = 0;
+
+
+    for (seq=0; pos < pb->maxbytes; seq++) {
+	slot = seq % pb->nbuf;
+
+	/*  Wait for the sender to release this buffer.
+	*/
+	pthread_mutex_lock (&pb->mutex);
+	while (pb->full[slot] && !pb->abort)
+	    pthread_cond_wait (&pb->cond, &pb->mutex);
+	if (pb->abort) {
+	    pthread_mutex_unlock (&pb->mutex);
+	    break;
+	}
+	pthread_mutex_unlock (&pb->mutex);
+
+	nb = min (pb->chunkSize, (pb->maxbytes - pos));
+	nread = dts_filePRead (pb->fd, pb->buf[slot], (int) nb, 
+	    (off_t) (pb->offset + pos));
+	if (pb->nimg > 0 && nread == nb)
+	    psCodeChunk (pb, slot, pb->offset + pos, nb);
+
+	pthread_mutex_lock (&pb->mutex);
+	pb->nbytes[slot] = (nread == nb ? nread : -1);
+	pb->seq[slot] = seq;
+	pb->full[slot] = 1;
+	pthread_cond_broadcast (&pb->cond);
+	pthread_mutex_unlock (&pb->mutex);
+
+	if (nread != nb)
+	    break;
+	pos += nb;
+    }
+}
+
+
+/** 
+ *  psCodeChunk -- Rice code a chunk in the read-ahead ring if it lies
+ *  wholly within one of the integer images of the file.  A chunk which
+ *  doesn't, or which doesn't get any smaller, is sent as is.
+ *
+ *  @brief  Code a chunk in the read-ahead ring
+ *  @fn     void psCodeChunk (psBuf *pb, int slot, long foff, long nb)
+ *
+ *  @param  pb		read-ahead ring
+ *  @param  slot	ring slot to code
+ *  @param  foff	file offset of the chunk
+ *  @param  nb		size of the chunk
+ *
+ *  @return		nothing
+ *
+ */
+void
+psCodeChunk (psBuf *pb, int slot, long foff, long nb)
+{
+    dtsFitsImg *im;
+    int    i;
+
+
+    pb->zpix[slot] = 0;
+    for (i=0; i < pb->nimg; i++) {
+	im = &pb->img[i];
+	if (foff < im->start || foff + nb > im->start + im->nbytes)
+	    continue;
+
+	if (((foff - im->start) % im->bytepix) == 0 &&
+	    (pb->zlen[slot] = dts_riceEncode (pb->buf[slot], nb, 
+		pb->zbuf[slot], nb - 1, im->bytepix)) > 0)
+		    pb->zpix[slot] = im->bytepix;
+	break;
+    }
+}
+
+
+/** 
+ *  psReceiveStripe -- Do the actual transfer of the data stripe to the
+ *  client connection.  A 'stripe' of data is actually transferred in 
+ *  much smaller 'chunks' which can be tuned to be optimal for the 
+ *  given connection.  The checksum policy allows us to perform a checksum
+ *  of the data either for the entire stripe, or for each individual chunk.
+ *  The former is generally more efficient as it involves fewer round-trips
+ *  to the client (i.e. send the checksum and wait for verification before
+ *  sending next chunk).  File-level checksum policy is enforced by our
+ *  parent.
+ *
+ *  @brief  Read data stripe from the socket connection
+ *  @fn     uchar *psReceiveStripe (int sock, long offset, int tnum)
+ *
+ *  @param  sock	socket descriptor
+ *  @param  offset	file offset for this stripe
+ *  @param  tnum	thread (i.e. stripe) number
+ *
+ *  @return		a pointer to the data read
+ *
+ */
+unsigned char *
+psReceiveStripe (int sock, long offset, int tnum)
+{
+    register int npack = 0;
+    long     nread, chunkSize, maxbytes, nr = 0, nleft = 0;
+    phdr     ip, op;
+    unsigned char  *rcvbuf = NULL, *dbuf = NULL;
+    char     tfmt[SZ_FNAME];
+    struct timeval t1 = {0, 0};
+	
+
+    if (dts_debugLevel() > 2)
 	fprintf (stderr, "psReceiveStripe begins\n");
 
 
@@ -907,6 +1759,379 @@ psReceiveStripe (int sock, long offset, int tnum)
 
 
 
+/** 
+ *  psReceiveStripeFd -- Read a data stripe from the socket connection and
+ *  write it directly to the output file.  Each chunk is written with 
+ *  pwrite() to its final offset as soon as it has been verified.  The 
+ *  descriptor may be shared by all threads of the transfer since the
+ *  stripes don't overlap.  A descriptor of PS_NULLFD means the data are
+ *  read and discarded.  We use whatever checksum policy the sender gives
+ *  in the stripe header.
+ *
+ *  Under CS_CHUNK the sender keeps several chunks in flight (see
+ *  psSendStripeFd), so chunks may arrive out of order when one has to be
+ *  resent.  Each header gives the chunk's offset in the stripe and we 
+ *  reply to each with the sum32 we computed and the count of contiguous
+ *  bytes verified from the start of the stripe.
+ *
+ *  @brief  Read data stripe from the socket connection to a file
+ *  @fn     long psReceiveStripeFd (int sock, int fd, long offset, int tnum)
+ *
+ *  @param  sock	socket descriptor
+ *  @param  fd		output file descriptor
+ *  @param  offset	file offset for this stripe
+ *  @param  tnum	thread (i.e. stripe) number
+ *
+ *  @return		number of bytes received, or -1 on error
+ *
+ */
+long
+psReceiveStripeFd (int sock, int fd, long offset, int tnum)
+{
+    phdr  ip;
+
+
+    /* Get the chunk size and file offset.
+    */
+    memset (&ip, 0, sizeof (ip));
+    if (dts_sockRead (sock, &ip, sizeof(ip)) < 0) {
+        dtsError ("dts_sockRead() fails to init chunk/offset");
+	return (-1);
+    }
+
+    return (psReceiveStripeHdr (sock, fd, &ip, offset, tnum));
+}
+
+
+/** 
+ *  psReceiveStripeHdr -- Read a data stripe whose initial header has 
+ *  already been read from the socket.  See psReceiveStripeFd().  Coded
+ *  chunks of a coded stripe are decoded before they're checked.
+ *
+ *  @brief  Read data stripe given its header
+ *  @fn     long psReceiveStripeHdr (int sock, int fd, phdr *hdr, 
+ *		long offset, int tnum)
+ *
+ *  @param  sock	socket descriptor
+ *  @param  fd		output file descriptor
+ *  @param  hdr		stripe header
+ *  @param  offset	file offset for this stripe
+ *  @param  tnum	thread (i.e. stripe) number
+ *
+ *  @return		number of bytes received, or -1 on error
+ *
+ */
+long
+psReceiveStripeHdr (int sock, int fd, phdr *hdr, long offset, int tnum)
+{
+    register int npack = 0;
+    long     nread, chunkSize, maxbytes, bufsize, nr = 0, nleft = 0;
+    long     k, nchunks = 0, ncum = 0, rlen = 0;
+    int      coded = (hdr->sum16 == PS_CODED);
+    int      policy = (int) hdr->sum32;
+    int      chdr = (policy == CS_CHUNK || coded);
+    phdr     ip, op;
+    unsigned char  *dbuf = NULL, *done = NULL, *zbuf = NULL;
+    char     tfmt[SZ_FNAME];
+    struct timeval t1 = {0, 0};
+	
+
+    if (dts_debugLevel() > 2)
+	fprintf (stderr, "psReceiveStripeFd begins\n");
+
+    /*  The sender may be using a chunk size tuned for the path.
+    */
+    memcpy (&ip, hdr, sizeof (ip));
+    if (ip.chunkSize > 0 && ip.chunkSize <= TUNE_MAX_CHUNK)
+	chunkSize = min (ip.maxbytes, ip.chunkSize);
+    else
+	chunkSize = min (ip.maxbytes,SZ_XFER_CHUNK);
+    maxbytes  = ip.maxbytes;
+    nchunks   = (maxbytes + chunkSize - 1) / chunkSize;
+
+    if (PTCP_VERB)
+        dtsErrLog (NULL, "recv T[%2d]  sz=%d  off=%ld  max=%ld\n", tnum,
+            (int)ip.chunkSize, (long)ip.offset, (long)ip.maxbytes);
+
+    bufsize   = chunkSize;
+    if (posix_memalign ((void **) &dbuf, DIO_ALIGN, bufsize + 1)) {
+	dtsErrLog (NULL, "psReceiveStripeFd: cannot alloc %ld bytes\n", 
+	    chunkSize);
+	return (-1);
+    }
+    dbuf[bufsize] = 0xFF;
+    if (coded && (zbuf = malloc (bufsize)) == NULL) {
+	dtsErrLog (NULL, "psReceiveStripeFd: cannot alloc %ld bytes\n", 
+	    chunkSize);
+	free ((void *) dbuf);
+	return (-1);
+    }
+
+    if (TIME_DEBUG) {
+	memset (tfmt, 0, SZ_FNAME);
+	sprintf (tfmt, "psReceiveStripeFd[%d]: ", tnum);
+	strcat (tfmt, " net i/o:  %.4g sec\n");
+	dts_tstart (&t1);
+    }
+
+    nleft = maxbytes;
+    if (policy == CS_NONE && fd != PS_NULLFD && !coded) {
+	/*  Without checksums the stripe can be moved from the socket to 
+	**  the file without a copy through our buffer.
+	*/
+	nr = dts_sockRecvFile (sock, fd, (off_t) offset, maxbytes);
+	nleft = 0;			/* short count reported by caller  */
+
+    } else if (policy == CS_CHUNK) {
+	/*  Keep track of which chunks have been verified so we can tell
+	**  a resend from a duplicate and compute the cumulative ack.
+	*/
+	if ((done = calloc (1, nchunks + 1)) == NULL) {
+	    dtsErrLog (NULL, "psReceiveStripeFd: cannot alloc %ld bytes\n", 
+		nchunks + 1);
+	    free ((void *) dbuf);
+	    if (zbuf)
+		free ((void *) zbuf);
+	    return (-1);
+	}
+    }
+
+    /* Start reading the data.
+    */
+    while (nleft > 0) {
+
+        if (chdr) {
+	    /* Get the header giving the chunk offset, size and checksums.
+	    */
+	    memset (&ip, 0, sizeof (ip));
+            if (dts_sockRead (sock, &ip, sizeof(ip)) != sizeof(ip)) {
+                dtsError ("dts_sockRead() fails header checksum");
+		break;
+	    }
+	    if (ip.chunkSize < 0)
+	        break;
+	    if (ip.chunkSize > bufsize || ip.offset < 0 || 
+		ip.offset >= maxbytes || (ip.offset % bufsize) != 0) {
+		    dtsErrLog (NULL, 
+			"psReceiveStripeFd: bad chunk hdr off=%ld sz=%d\n",
+			(long) ip.offset, ip.chunkSize);
+		    nr = -1;
+		    break;
+	    }
+	    chunkSize = ip.chunkSize;
+	}
+
+	/* Read the chunk to the local data buffer, decoding it if needed.
+	*/
+	if (coded && ip.sum16) {
+	    rlen = min (bufsize, maxbytes - ip.offset);
+	    if (dts_sockRead (sock, zbuf, chunkSize) != chunkSize) {
+		dtsError ("dts_sockRead() fails");
+		break;
+	    }
+	    if ((nread = dts_riceDecode (zbuf, chunkSize, dbuf, rlen, 
+		(int) ip.sum16)) != rlen) {
+		    dtsErrLog (NULL, 
+			"psReceiveStripeFd: bad coded chunk at %ld\n",
+			offset + ip.offset);
+		    nr = -1;
+		    break;
+	    }
+        } else if ((nread = dts_sockRead (sock, dbuf, chunkSize)) <= 0) {
+            dtsError ("dts_sockRead() fails");
+	    break;
+	}
+
+        if (policy == CS_CHUNK) {
+	    if (TIME_DEBUG && npack % 100 == 0)
+	        dtsErrLog (NULL, 
+		    "Thread[%2d] recv  packet %4d nread %ld  nleft %ld\n", 
+		    tnum, npack, nread, nleft);
+
+	    /* Compute the local checksum for the block and write it to its
+	    ** place in the output file if it's valid and new.
+	    */
+	    memset (&op, 0, sizeof (op));
+	    op.chunkSize = nread;
+	    op.offset    = ip.offset;
+	    op.sum32     = addcheck32 (dbuf, nread);
+
+	    k = ip.offset / bufsize;
+	    if (ip.sum32 == op.sum32 && !done[k]) {
+		if (fd != PS_NULLFD && dts_filePWrite (fd, dbuf, nread, 
+		    (off_t)(offset + ip.offset)) != nread) {
+		        dtsErrLog (NULL, 
+			    "psReceiveStripeFd: write error at %ld\n",
+			    offset + ip.offset);
+		        nr = -1;
+		        break;
+		}
+		done[k] = 1;
+		nleft  -= nread;
+		nr     += nread;
+		while (ncum < nchunks && done[ncum])
+		    ncum++;
+
+	    } else if (ip.sum32 != op.sum32) {
+               dtsErrLog (NULL, 
+		    "Requesting resend[%d:%d] packet %6ld  %10u != %10u\n",
+                    tnum, sock, k, ip.sum32, op.sum32);
+	    }
+
+	    /* Reply to the server with values based on what we got.
+	    */
+	    op.maxbytes = min (ncum * bufsize, maxbytes);
+            if (dts_sockWrite (sock, &op, sizeof(op)) < 0)
+                dtsError ("psReceiveStripeFd send() fails");
+
+	} else {
+	    /* No chunk checksums, data arrive in order.
+	    */
+	    if (fd != PS_NULLFD && 
+		dts_filePWrite (fd, dbuf, nread, (off_t)(offset+nr)) != nread) {
+		    dtsErrLog (NULL, "psReceiveStripeFd: write error at %ld\n",
+			offset + nr);
+		    nr = -1;
+		    break;
+	    }
+	    nleft -= nread;
+	    nr    += nread;
+	    if (nleft < chunkSize)
+		chunkSize = nleft;
+	}
+
+	npack++;
+    }
+
+    /* Log timing info.
+     */
+    if (TIME_DEBUG)
+	dtsTimeLog (tfmt, t1);
+      
+    if (PTCP_VERB)
+	dtsErrLog (NULL, "Thread %d read %ld bytes\n", tnum, nr);
+
+    if (dbuf[bufsize] != 0xFF)
+        dtsError ("psReceiveStripeFd: Data buffer overflow");
+    free ((void *) dbuf);
+    if (zbuf)
+	free ((void *) zbuf);
+    if (done)
+	free ((void *) done);
+
+    if (dts_debugLevel() > 2)
+	fprintf (stderr, "psReceiveStripeFd done\n");
+    return (nr);
+}
+
+
+/** 
+ *  psOpenReceiveFile -- Open the output file for a parallel socket transfer.
+ *  The file is created (or truncated) and pre-allocated to the full size
+ *  once by the caller before the receive threads are spawned, all of which
+ *  then share the descriptor.  The special name "DTSNull" means the data
+ *  are to be discarded, in which case PS_NULLFD is returned.  A large file
+ *  left partly received by an earlier attempt is kept along with its
+ *  resume map (see dtsResume.c) rather than truncated.
+ *
+ *  @brief  Open the output file for a parallel socket transfer
+ *  @fn     int psOpenReceiveFile (char *dir, char *fname, long fsize)
+ *
+ *  @param  dir		working directory
+ *  @param  fname	file name
+ *  @param  fsize	file size
+ *
+ *  @return		file descriptor, or -1 on error
+ *
+ */
+int
+psOpenReceiveFile (char *dir, char *fname, long fsize)
+{
+    int   fd = -1;
+    char  path[SZ_PATH];
+    psMap *map = (psMap *) NULL;
+
+
+    /* Check for a special NULL name to indicate we don't want to save
+     * the data.
+     */
+    if (strcmp (fname, "DTSNull") == 0)
+	return (PS_NULLFD);
+
+    memset (path, 0, SZ_PATH);
+    if (strcmp (dir, "./") != 0 && fname[0] != '/') {
+        char *pdir  = dts_sandboxPath (dir);
+
+	if (access (pdir, F_OK) != 0)
+	    dts_makePath (pdir, TRUE);
+	snprintf (path, SZ_PATH-1, "%s/%s", pdir, fname);
+	free ((void *) pdir);
+    } else
+	strncpy (path, fname, SZ_PATH-1);
+
+    /*  Replace any existing file and pre-allocate the space, unless we're
+    **  resuming.  The file is opened for reading too so we can check the
+    **  blocks we kept.
+    */
+    if ((fd = dts_fileOpenDirect (path, O_RDWR|O_CREAT, fsize)) < 0) {
+	dtsErrLog (NULL, "psOpenReceiveFile: cannot open '%s'\n", path);
+	return (-1);
+    }
+    if ((map = psMapOpen (path, fsize)) && psMapAttach (map, fd) != OK)
+	map = (psMap *) NULL;
+
+    if (((!map || map->ndone <= 0) && ftruncate (fd, (off_t) 0) < 0) ||
+	ftruncate (fd, (off_t) fsize) < 0) {
+	    dtsErrLog (NULL, "psOpenReceiveFile: cannot allocate '%s'\n", path);
+	    psCloseReceiveFile (fd, ERR);
+	    return (-1);
+    }
+
+    /*  On a cut-through queue the next hop may read the blocks as they
+    **  arrive, starting with those we kept from an earlier attempt.
+    */
+    dts_cutBind (fd);
+    if (map && map->ndone > 0) {
+	int  b;
+
+	for (b=0; b < map->hdr.nblocks; b++)
+	    if (map->ent[b].done)
+		dts_cutMark (fd, b * map->hdr.block,
+		    min (map->hdr.block, map->hdr.fsize - b * map->hdr.block));
+    }
+
+    return (fd);
+}
+
+
+/** 
+ *  psCloseReceiveFile -- Flush and close the output file of a parallel
+ *  socket transfer.  The resume map is removed if the transfer succeeded
+ *  and kept for a retry otherwise.
+ *
+ *  @brief  Close the output file for a parallel socket transfer
+ *  @fn     void psCloseReceiveFile (int fd, int status)
+ *
+ *  @param  fd		output file descriptor
+ *  @param  status	transfer status
+ *
+ *  @return		nothing
+ *
+ */
+void
+psCloseReceiveFile (int fd, int status)
+{
+    if (fd < 0)
+	return;
+
+    dts_fileSync (fd);
+    psMapClose (fd, status);
+    dts_cutUnbind (fd, status);
+    dts_fileClose (fd);
+}
+
+
+
 /**
  *  PSCOMPUTESTRIPE -- Compute the parameters of a data stripe given the 
  *  file size and number of worker threads.
@@ -938,8 +2163,8 @@ psComputeStripe (long fsize, int nthreads, int tnum,
 
     } else {
 
-        size = (int) (fsize / nthreads);
-        remain = (int) (fsize  - ( nthreads * size));
+        size = fsize / nthreads;
+        remain = fsize  - ( nthreads * size);
 
         if (tnum < remain) {
             size++;
@@ -957,6 +2182,169 @@ psComputeStripe (long fsize, int nthreads, int tnum,
 }
 
 
+/**
+ *  PSSCHEDINIT -- Create the work unit scheduler for a transfer.  We aim
+ *  for at least PS_UNIT_MIN units per stream so there's something to
+ *  balance, but keep units large enough that the per-unit header and
+ *  window drain don't matter.
+ *
+ *  @brief	Create the work unit scheduler for a transfer
+ *  @fn 	psSched *psSchedInit (long fsize, int nthreads)
+ *
+ *  @param  fsize	file size
+ *  @param  nthreads	number of streams sharing the scheduler
+ *
+ *  @return		scheduler, or NULL on error
+ *
+ */
+psSched *
+psSchedInit (long fsize, int nthreads)
+{
+    psSched *sched = (psSched *) NULL;
+    long     unit = 0;
+
+
+    if ((sched = (psSched *) calloc (1, sizeof (psSched))) == NULL)
+	return ((psSched *) NULL);
+
+    unit = fsize / (max (nthreads, 1) * PS_UNIT_MIN);
+    unit = ((unit + PS_UNIT_ALIGN - 1) / PS_UNIT_ALIGN) * PS_UNIT_ALIGN;
+    unit = max (PS_UNIT_ALIGN, min (unit, PS_UNIT_SIZE));
+
+    sched->fsize = fsize;
+    sched->unit  = unit;
+    sched->next  = 0;
+    sched->nref  = max (nthreads, 1);
+    sched->policy = psock_checksum_policy;
+    pthread_mutex_init (&sched->mutex, NULL);
+
+    if (PTCP_DEBUG)
+        dtsErrLog (NULL, "sched: fsize = %ld  unit = %ld  nthreads = %d\n",
+            fsize, unit, nthreads);
+
+    return (sched);
+}
+
+
+/**
+ *  PSSCHEDNEXT -- Take the next work unit.
+ *
+ *  @brief	Take the next work unit
+ *  @fn 	int psSchedNext (psSched *sched, long *offset, long *nbytes)
+ *
+ *  @param  sched	work unit scheduler
+ *  @param  offset	file offset of the unit (output)
+ *  @param  nbytes	size of the unit (output)
+ *
+ *  @return		OK if a unit was taken, ERR when none are left
+ *
+ */
+int
+psSchedNext (psSched *sched, long *offset, long *nbytes)
+{
+    long b, end;
+    int  status = ERR;
+
+
+    pthread_mutex_lock (&sched->mutex);
+
+    /*  When resuming, step over the blocks the receiver already has and
+    **  end the unit at the next of them.
+    */
+    if (sched->skip) {
+	while (sched->next < sched->fsize && 
+	    sched->skip[sched->next / sched->block])
+		sched->next = min (sched->fsize,
+		    (sched->next / sched->block + 1) * sched->block);
+    }
+
+    if (sched->next < sched->fsize) {
+	*offset = sched->next;
+	*nbytes = min (sched->unit, sched->fsize - sched->next);
+	if (sched->skip) {
+	    end = sched->next + *nbytes;
+	    for (b = sched->next / sched->block + 1; b * sched->block < end; b++)
+		if (sched->skip[b]) {
+		    *nbytes = b * sched->block - sched->next;
+		    break;
+		}
+	}
+	sched->next += *nbytes;
+	status = OK;
+    }
+    pthread_mutex_unlock (&sched->mutex);
+
+    return (status);
+}
+
+
+/**
+ *  PSSCHEDRELEASE -- Release a stream's reference to the scheduler, the
+ *  last stream to finish frees it.
+ *
+ *  @brief	Release a reference to the scheduler
+ *  @fn 	void psSchedRelease (psSched *sched)
+ *
+ *  @param  sched	work unit scheduler
+ *
+ *  @return		nothing
+ *
+ */
+void
+psSchedRelease (psSched *sched)
+{
+    int  nref = 0;
+
+
+    if (!sched)
+	return;
+
+    pthread_mutex_lock (&sched->mutex);
+    nref = --sched->nref;
+    pthread_mutex_unlock (&sched->mutex);
+
+    if (nref <= 0) {
+	pthread_mutex_destroy (&sched->mutex);
+	if (sched->skip)
+	    free ((void *) sched->skip);
+	if (sched->img)
+	    free ((void *) sched->img);
+	free ((void *) sched);
+    }
+}
+
+
+/**
+ *  PSSCHEDIMAGES -- Find the images to compress in transit, if the queue
+ *  wants them compressed.  The first stream to get here looks for them.
+ *
+ *  @brief	Find the images to compress in transit
+ *  @fn 	void psSchedImages (psSched *sched, int fd)
+ *
+ *  @param  sched	work unit scheduler
+ *  @param  fd		input file descriptor
+ *
+ *  @return		nothing
+ *
+ */
+void
+psSchedImages (psSched *sched, int fd)
+{
+    if (!sched || sched->codec != CODEC_RICE)
+	return;
+
+    pthread_mutex_lock (&sched->mutex);
+    if (!sched->img && 
+	(sched->img = calloc (FITS_MAX_IMG, sizeof (dtsFitsImg)))) {
+	    sched->nimg = dts_fitsImages (fd, sched->fsize, sched->img,
+		FITS_MAX_IMG);
+	    if (PTCP_VERB)
+		dtsErrLog (NULL, "sched: %d images to compress\n", sched->nimg);
+    }
+    pthread_mutex_unlock (&sched->mutex);
+}
+
+
 /**
  *  DTS_PRINTHDR -- Debug Utility.
  */
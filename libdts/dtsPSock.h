@@ -19,6 +19,15 @@
 #define	PS_PUSH		XFER_PUSH	/* push transfer model		*/
 #define	PS_PULL		XFER_PULL	/* pull transfer model		*/
 
+#define	PS_NULLFD	(-2)		/* discard received data	*/
+
+#define	PS_HELLO	(-2)		/* pooled connection handshake	*/
+#define	PS_MAGIC	0x44545330	/* handshake magic ("DTS0")	*/
+#define	PS_HELLO_TIME	30		/* handshake timeout (sec)	*/
+#define	PS_EOS		(-3)		/* end of stream header		*/
+#define	PS_MAP		(-4)		/* resume map header		*/
+#define	PS_CODED	1		/* stripe has coded chunks	*/
+
 
 #define SZ_XFER_BUFFER	(1024 * 1025 * 4) /* transfer buffer size	*/
 
@@ -59,6 +68,66 @@ typedef struct {
     long   	    maxbytes;		/* max bytes to transfer	*/
 } phdr, *phdrP;
 
+
+/*  Work unit scheduler shared by the streams of a transfer.  Rather than
+**  each stream sending a fixed stripe, the file is cut into units which
+**  the streams take in turn as they finish the last, so a slow stream
+**  simply ends up sending fewer units.
+*/
+#define	PS_UNIT_SIZE	(SZ_XFER_CHUNK * 8)  /* max work unit size	*/
+#define	PS_UNIT_MIN	4		/* min units per stream		*/
+#define	PS_UNIT_ALIGN	65536		/* work unit size alignment	*/
+
+typedef struct {
+    long     fsize;			/* file size			*/
+    long     unit;			/* work unit size		*/
+    long     next;			/* offset of next unit		*/
+    long     chunk;			/* send chunk size (0=default)	*/
+    int      nref;			/* streams using the scheduler	*/
+    unsigned char *skip;		/* blocks the receiver has	*/
+    long     block;			/* skip block size		*/
+    int      nblocks;			/* number of skip blocks	*/
+    int      codec;			/* in-transit compression	*/
+    int      policy;			/* chunk checksum policy	*/
+    dtsFitsImg *img;			/* images to code (once scanned)*/
+    int      nimg;			/* number of images to code	*/
+    char     qname[SZ_FNAME];		/* queue name (for shaping)	*/
+    pthread_mutex_t mutex;		/* scheduler lock		*/
+} psSched, *psSchedP;
+
+
+/*  Resume map kept by the receiver of a large file, so a failed transfer
+**  can be retried sending only the blocks it's missing (see dtsResume.c).
+*/
+#define	PS_MAP_MAGIC	0x44545331	/* map file magic ("DTS1")	*/
+#define	PS_MAP_BLOCK	(4*1024*1024)	/* map block size		*/
+#define	PS_MAP_MIN	(64*1024*1024)	/* min file size to map		*/
+#define	PS_MAX_MAPS	64		/* max maps open at once	*/
+#define	PS_MAP_MAXAGE	(3*86400)	/* reap unfinished maps (sec)	*/
+
+typedef struct {
+    int      magic;			/* map file magic		*/
+    int      nblocks;			/* number of blocks		*/
+    long     fsize;			/* file size			*/
+    long     block;			/* block size			*/
+} psMapHdr, *psMapHdrP;
+
+typedef struct {
+    int      done;			/* block has been written	*/
+    unsigned int sum32;			/* CRC32 when last verified	*/
+} psMapEnt, *psMapEntP;
+
+typedef struct {
+    char     path[SZ_PATH];		/* map file path		*/
+    int      mfd;			/* map file descriptor		*/
+    int      fd;			/* receive file descriptor	*/
+    psMapHdr hdr;			/* map header			*/
+    int      ndone;			/* blocks we had when opened	*/
+    psMapEnt *ent;			/* block entries		*/
+    long    *nrecv;			/* bytes received per block	*/
+    pthread_mutex_t mutex;		/* map lock			*/
+} psMap, *psMapP;
+
 	
 /*  Data structure used to pass information into parallel socket worker
 **  thread.
@@ -67,19 +136,62 @@ typedef struct {
     char     fname[256];		/* file name			*/
     char     dir[256];			/* working directory		*/
     long     fsize;			/* file size			*/
+    int      fd;			/* shared file descriptor	*/
 
     char     host[256];			/* remote host name		*/
     int      port;			/* remote port number		*/
+    int      session;			/* transfer session		*/
+    int      dport;			/* listener's data port (0=none)*/
     int      mode;			/* push or pull mode		*/
+    char     qname[256];		/* queue name			*/
+    int      keepalive;			/* pool connection (idle sec)	*/
+    int      sockbuf;			/* socket buffer size (0=kernel)*/
+    int      path;			/* network path (-1 for none)	*/
+    int      pshare;			/* streams sharing the path	*/
 
     int      tnum;			/* processing thread number	*/
     int      rate;			/* UDT transfer rate		*/
     long     nbytes;			/* number of bytes to transfer	*/
     long     start;			/* start byte number		*/
     long     end;			/* ending byte number		*/
+    psSched *sched;			/* work unit scheduler		*/
 } psArg, *psArgP;
 
 
+/*  Read-ahead ring used by the streaming stripe sender.  A reader thread
+**  fills the buffers from the file while the sender drains them, so disk
+**  and network I/O overlap and the memory used is bounded by the ring
+**  size regardless of the stripe size.  Under CS_CHUNK the ring is also
+**  the send window, a buffer is released only once its chunk is acked.
+*/
+#define	PS_WINDOW	8		/* max chunks in flight		*/
+
+typedef struct {
+    int      fd;			/* input file descriptor	*/
+    long     offset;			/* file offset of stripe	*/
+    long     maxbytes;			/* stripe size			*/
+    long     chunkSize;			/* transfer 'chunk' size	*/
+    int      nbuf;			/* number of buffers in use	*/
+    int      policy;			/* chunk checksum policy	*/
+
+    unsigned char *buf[PS_WINDOW];	/* chunk buffers		*/
+    long     nbytes[PS_WINDOW];		/* valid bytes in each buffer	*/
+    long     seq[PS_WINDOW];		/* chunk number in each buffer	*/
+    int      full[PS_WINDOW];		/* buffer ready to send?	*/
+    int      abort;			/* sender has quit		*/
+
+    char    *qname;			/* queue name (for shaping)	*/
+    dtsFitsImg *img;			/* images to code (coded stripe)*/
+    int      nimg;			/* number of images		*/
+    unsigned char *zbuf[PS_WINDOW];	/* coded chunk buffers		*/
+    long     zlen[PS_WINDOW];		/* coded size of each chunk	*/
+    int      zpix[PS_WINDOW];		/* bytes/pixel (0 = not coded)	*/
+
+    pthread_mutex_t mutex;		/* buffer state lock		*/
+    pthread_cond_t  cond;		/* buffer state change		*/
+} psBuf, *psBufP;
+
+
 /*
 pthread_mutex_t svc_mutex = PTHREAD_MUTEX_INITIALIZER;
 */
@@ -88,9 +200,10 @@ int     psSpawnWorker (void *worker, int nthreads, char *dir, char *fname,
 			long fsize, int mode, int port, char *host, 
 			int verbose);
 int     psSpawnThreads (void *worker, int nthreads, char *dir, char *fname, 
-			long fsize, int mode, int port, char *host, 
-			int verbose, pthread_t *tids);
-int    *psCollectThreads (int nthreads, pthread_t *tids);
+			long fsize, int mode, int port, int session, 
+			int dport, char *host, int verbose, int fd, 
+			dtsWorkGroup *grp);
+int    *psCollectThreads (dtsWorkGroup *grp);
 
 void 	psSendFile (void *data);
 void 	psReceiveFile (void *data);
@@ -100,7 +213,34 @@ void 	psComputeStripe (long fsize, int nthreads, int tnum,
 
 int 	psSendStripe (int s, unsigned char *dbuf, long offset, int tnum,
     		long maxbytes);
+int 	psSendStripeFd (int s, int fd, long offset, int tnum,
+    		long maxbytes, psSched *sched);
 unsigned char *psReceiveStripe (int s, long offset, int tnum);
+long 	psReceiveStripeFd (int s, int fd, long offset, int tnum);
+long 	psReceiveStripeHdr (int s, int fd, phdr *hdr, long offset, int tnum);
+long 	psSendUnits (int s, int fd, psSched *sched, int tnum);
+long 	psReceiveUnits (int s, int fd, long fsize, int tnum);
+
+psSched *psSchedInit (long fsize, int nthreads);
+int 	psSchedNext (psSched *sched, long *offset, long *nbytes);
+void 	psSchedRelease (psSched *sched);
+void 	psSchedImages (psSched *sched, int fd);
+int 	psOpenReceiveFile (char *dir, char *fname, long fsize);
+void 	psCloseReceiveFile (int fd, int status);
+
+psMap  *psMapOpen (char *path, long fsize);
+int 	psMapAttach (psMap *map, int fd);
+psMap  *psMapLookup (int fd);
+int 	psMapSend (int sock, psMap *map);
+int 	psMapRecv (int sock, psSched *sched, int fd);
+void 	psMapMark (int fd, long offset, long nbytes);
+void 	psMapClose (int fd, int status);
+int 	psMapTag (char *qdir, char *fname, long fsize, char *md5);
+char   *psMapFind (char *qname, char *fname, long fsize, char *md5);
+
+int 	psServerConnect (psArg *arg, int *lsock);
+int 	psClientConnect (psArg *arg, int retry);
+void 	psReleaseConnect (psArg *arg, int sock, int lsock, int status);
 
 
 #ifdef _PSOCK_SRC_
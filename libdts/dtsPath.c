@@ -0,0 +1,363 @@
+/**
+ *  DTSPATH.C -- Multi-network striping of PSock transfers.
+ *
+ *  A host on more than one network (e.g. a research link and a backup
+ *  link) lists its address on each with the 'path' keyword in its config
+ *  block, in the same order on every host:
+ *
+ *	dts
+ *	    name      mtn
+ *	    host      mtn.example.edu
+ *	    path      10.10.0.5			# research 10G
+ *	    path      192.168.1.5		# backup 1G
+ *	    ...
+ *
+ *  Path 'i' to a peer connects from our i'th address to the peer's i'th
+ *  address, so the streams of a transfer leave on that interface whatever
+ *  the routing table would otherwise pick.  The streams are spread over
+ *  the paths in proportion to the throughput each has shown on earlier
+ *  transfers (paths not yet measured are assumed average), and since the
+ *  streams take work units as they finish the last (see psSchedNext) the
+ *  streams on a faster path also end up carrying more of the file.
+ *
+ *  A path whose connection fails is skipped for a while, a stream then
+ *  connects over the next path that is up.  A transfer whose stream dies
+ *  mid-way still fails, but the queue's retry resends only the blocks
+ *  the receiver is missing (see dtsResume.c) over the remaining paths.
+ *  Hosts without paths are reached at their usual address as before.
+ *
+ *	npaths = dts_pathAlloc (host, nthreads, path, nshare)
+ *	  stat = dts_pathAddr (host, path, local, remote)
+ *	         dts_pathUpdate (host, path, nshare, nbytes, secs)
+ *	         dts_pathFail (host, path)
+ *
+ *  @file       dtsPath.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  Multi-network striping of PSock transfers.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "dts.h"
+
+
+extern  DTS  *dts;
+
+static  dtsPathPeer  peers[MAX_PATH_PEERS];	/* measured peers	*/
+static  pthread_mutex_t path_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static dtsClient   *dts_pathClient (char *host);
+static dtsPathPeer *dts_pathFind (char *name);
+
+
+
+/**
+ *  DTS_PATHALLOC -- Assign the streams of a transfer to the network paths
+ *  to a peer.  Each path that is up gets at least one stream if there are
+ *  enough, the rest are shared in proportion to the path throughput.
+ *
+ *  @brief  Assign the streams of a transfer to network paths.
+ *  @fn     int dts_pathAlloc (char *host, int nthreads, int *path,
+ *		int *nshare)
+ *
+ *  @param  host	peer host name (or IP string)
+ *  @param  nthreads	number of streams
+ *  @param  path	path for each stream, or -1 (output)
+ *  @param  nshare	number of streams on each stream's path (output)
+ *  @return		number of paths to the peer (0 if none)
+ */
+int
+dts_pathAlloc (char *host, int nthreads, int *path, int *nshare)
+{
+    dtsClient   *c = (dtsClient *) NULL;
+    dtsPathPeer *p = (dtsPathPeer *) NULL;
+    double  w[MAX_NET_PATHS], frac[MAX_NET_PATHS], sum = 0.0, total = 0.0;
+    int     n[MAX_NET_PATHS], i, j, t, npaths, nlive = 0, nmeas = 0, left;
+    time_t  now = time ((time_t) 0);
+
+
+    for (t=0; t < nthreads; t++)
+	path[t] = -1, nshare[t] = 0;
+
+    pthread_mutex_lock (&path_mutex);
+    if (!(c = dts_pathClient (host)) || (npaths = c->clientNPaths) <= 0 ||
+	!(p = dts_pathFind (c->clientName))) {
+	    pthread_mutex_unlock (&path_mutex);
+	    return (0);
+    }
+    p->last = now;
+
+    /*  If every path is down we may as well try them all again.
+    */
+    for (i=0; i < npaths; i++)
+	if (p->down[i] <= now)
+	    nlive++;
+    if (nlive == 0) {
+	for (i=0; i < npaths; i++)
+	    p->down[i] = 0;
+	nlive = npaths;
+    }
+
+    for (i=0; i < npaths; i++) {
+	if (p->down[i] <= now && p->nsamp[i]) {
+	    sum += p->tput[i];
+	    nmeas++;
+	}
+    }
+    for (i=0; i < npaths; i++) {
+	if (p->down[i] > now)
+	    w[i] = 0.0;
+	else
+	    w[i] = (p->nsamp[i] ? p->tput[i] : (nmeas ? sum / nmeas : 1.0));
+	total += w[i];
+	n[i] = 0;
+    }
+    if (total <= 0.0) {
+	for (i=0; i < npaths; i++)
+	    total += (w[i] = (p->down[i] > now ? 0.0 : 1.0));
+    }
+
+    /*  One stream per live path, then the rest by largest remainder.
+    */
+    left = nthreads;
+    if (nthreads >= nlive) {
+	for (i=0; i < npaths; i++)
+	    if (w[i] > 0.0)
+		n[i] = 1, left--;
+    }
+    for (i=0, t=left; i < npaths; i++) {
+	frac[i] = (double) t * w[i] / total;
+	n[i] += (int) frac[i];
+	left -= (int) frac[i];
+	frac[i] -= (int) frac[i];
+    }
+    while (left > 0) {
+	for (j=-1, i=0; i < npaths; i++) {
+	    if (w[i] <= 0.0)
+		continue;
+	    if (j < 0 || frac[i] > frac[j] || 
+		(frac[i] == frac[j] && w[i] > w[j]))
+		    j = i;
+	}
+	n[j]++, left--;
+	frac[j] -= 1.0;
+    }
+
+    for (i=0, t=0; i < npaths; i++) {
+	for (j=0; j < n[i] && t < nthreads; j++, t++) {
+	    path[t] = i;
+	    nshare[t] = n[i];
+	}
+    }
+
+    if (PERF_DEBUG) {
+	for (i=0; i < npaths; i++)
+	    dtsErrLog (NULL, "path: %s %d %s %.1f Mb/s -> %d streams\n",
+		c->clientName, i, c->clientPath[i], w[i], n[i]);
+    }
+    pthread_mutex_unlock (&path_mutex);
+
+    return (npaths);
+}
+
+
+/**
+ *  DTS_PATHADDR -- Get the addresses for a path to a peer, if it is up.
+ *  The local address is empty if we don't have one on that network, the
+ *  kernel then picks it from the route to the peer's address.
+ *
+ *  @brief  Get the addresses for a path to a peer.
+ *  @fn     int dts_pathAddr (char *host, int path, char *local,
+ *		char *remote)
+ *
+ *  @param  host	peer host name (or IP string)
+ *  @param  path	path number
+ *  @param  local	local (source) address (output)
+ *  @param  remote	peer address (output)
+ *  @return		OK, or ERR if there's no such path or it's down
+ */
+int
+dts_pathAddr (char *host, int path, char *local, char *remote)
+{
+    dtsClient   *c = (dtsClient *) NULL;
+    dtsPathPeer *p = (dtsPathPeer *) NULL;
+    int     stat = ERR;
+
+
+    local[0] = remote[0] = '\0';
+    if (path < 0)
+	return (ERR);
+
+    pthread_mutex_lock (&path_mutex);
+    if ((c = dts_pathClient (host)) && path < c->clientNPaths &&
+	(p = dts_pathFind (c->clientName)) &&
+	p->down[path] <= time ((time_t) 0)) {
+	    strcpy (remote, c->clientPath[path]);
+	    if (dts->self && path < dts->self->clientNPaths)
+		strcpy (local, dts->self->clientPath[path]);
+	    stat = OK;
+    }
+    pthread_mutex_unlock (&path_mutex);
+
+    return (stat);
+}
+
+
+/**
+ *  DTS_PATHUPDATE -- Add a throughput sample for a path from a completed
+ *  stream.  The stream's rate times the number of streams sharing the
+ *  path estimates what the path as a whole carried.
+ *
+ *  @brief  Add a throughput sample for a path.
+ *  @fn     void dts_pathUpdate (char *host, int path, int nshare,
+ *		long nbytes, double secs)
+ *
+ *  @param  host	peer host name (or IP string)
+ *  @param  path	path number
+ *  @param  nshare	number of streams on the path
+ *  @param  nbytes	bytes moved by the stream
+ *  @param  secs	stream transfer time (sec)
+ *  @return		nothing
+ */
+void
+dts_pathUpdate (char *host, int path, int nshare, long nbytes, double secs)
+{
+    dtsClient   *c = (dtsClient *) NULL;
+    dtsPathPeer *p = (dtsPathPeer *) NULL;
+    double  mbps = 0.0;
+
+
+    if (path < 0 || path >= MAX_NET_PATHS || nbytes < PATH_MIN_BYTES ||
+	secs <= 0.0)
+	    return;
+
+    mbps = ((double) nbytes * 8.0 * max (nshare, 1)) / (secs * 1000000.0);
+
+    pthread_mutex_lock (&path_mutex);
+    if ((c = dts_pathClient (host)) && (p = dts_pathFind (c->clientName))) {
+	p->tput[path] = (p->nsamp[path] ?
+	    (0.5 * p->tput[path] + 0.5 * mbps) : mbps);
+	p->nsamp[path]++;
+	p->down[path] = 0;
+
+	if (PERF_DEBUG)
+	    dtsErrLog (NULL, "path: %s %d  %.1f Mb/s (%d str) -> %.1f Mb/s\n",
+		c->clientName, path, mbps, nshare, p->tput[path]);
+    }
+    pthread_mutex_unlock (&path_mutex);
+}
+
+
+/**
+ *  DTS_PATHFAIL -- Mark a path to a peer as down, new streams avoid it
+ *  for PATH_DOWN_TIME seconds.
+ *
+ *  @brief  Mark a path to a peer as down.
+ *  @fn     void dts_pathFail (char *host, int path)
+ *
+ *  @param  host	peer host name (or IP string)
+ *  @param  path	path number
+ *  @return		nothing
+ */
+void
+dts_pathFail (char *host, int path)
+{
+    dtsClient   *c = (dtsClient *) NULL;
+    dtsPathPeer *p = (dtsPathPeer *) NULL;
+
+
+    if (path < 0 || path >= MAX_NET_PATHS)
+	return;
+
+    pthread_mutex_lock (&path_mutex);
+    if ((c = dts_pathClient (host)) && (p = dts_pathFind (c->clientName))) {
+	p->down[path] = time ((time_t) 0) + PATH_DOWN_TIME;
+	dtsErrLog (NULL, "path: %s %d (%s) down\n", c->clientName, path,
+	    c->clientPath[path]);
+    }
+    pthread_mutex_unlock (&path_mutex);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ ****************************************************************************/
+
+/**
+ *  DTS_PATHCLIENT -- Find the config entry for a peer from its name, host
+ *  name, or any of its addresses.  Only other hosts with paths are
+ *  returned.
+ */
+static dtsClient *
+dts_pathClient (char *host)
+{
+    register int i, j;
+    dtsClient *c = (dtsClient *) NULL;
+    char   name[SZ_FNAME], *ip;
+
+
+    if (!dts || !host || !host[0])
+	return ((dtsClient *) NULL);
+
+    /*  Remove any port information from the host specification.
+    */
+    memset (name, 0, SZ_FNAME);
+    strncpy (name, host, SZ_FNAME-1);
+    if ((ip = strchr (name, (int) ':')))
+	*ip = '\0';
+
+    for (i=0; i < dts->nclients; i++) {
+	if (!(c = dts->clients[i]) || c == dts->self || c->clientNPaths <= 0)
+	    continue;
+	if (strcmp (c->clientName, name) == 0 ||
+	    strcmp (c->clientHost, name) == 0 ||
+	    strcmp (c->clientIP, name) == 0)
+		return (c);
+	for (j=0; j < c->clientNPaths; j++)
+	    if (strcmp (c->clientPath[j], name) == 0)
+		return (c);
+    }
+
+    return ((dtsClient *) NULL);
+}
+
+
+/**
+ *  DTS_PATHFIND -- Find (or create) the path measurements for a peer,
+ *  reusing the least recently used entry when the table is full.
+ */
+static dtsPathPeer *
+dts_pathFind (char *name)
+{
+    register int i;
+    dtsPathPeer *p = (dtsPathPeer *) NULL, *old = &peers[0];
+
+
+    for (i=0; i < MAX_PATH_PEERS; i++) {
+	if (peers[i].host[0] && strcmp (peers[i].host, name) == 0)
+	    return (&peers[i]);
+	if (!p && !peers[i].host[0])
+	    p = &peers[i];
+	if (peers[i].last < old->last)
+	    old = &peers[i];
+    }
+
+    if (!p)
+	p = old;
+    memset (p, 0, sizeof (dtsPathPeer));
+    strncpy (p->host, name, SZ_FNAME-1);
+    p->last = time ((time_t) 0);
+
+    return (p);
+}
@@ -0,0 +1,270 @@
+/**
+ *  DTSPOOL.C -- DTS transfer connection pool.
+ *
+ *  Queues with the 'keepalive' option set keep their data connections
+ *  open between files rather than opening and tearing down a socket for
+ *  each stream of every transfer.  Connections are kept in a pool keyed
+ *  by the peer host, the queue and the stream port.  An idle connection
+ *  is closed once it has not been used for the queue's keepalive time.
+ *
+ *	dts_poolKeepalive (char *path, char *qname)
+ *	dts_poolGet (char *host, char *qname, int port, int *sock, 
+ *			int *lsock)
+ *	dts_poolPut (char *host, char *qname, int port, int sock, int lsock,
+ *			int idle)
+ *	dts_poolExpire (void)
+ *	dts_poolFlush (void)
+ *
+ *  @file       dtsPool.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  DTS transfer connection pool.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "dts.h"
+
+
+extern  DTS  *dts;
+
+static  dtsConn  pool[MAX_POOL_CONN];	/* pooled connections		*/
+static  pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void dts_poolClose (dtsConn *c);
+
+
+
+/**
+ *  DTS_POOLKEEPALIVE -- Get the connection keepalive time for the queue
+ *  owning the given spool path.  A queue 'keepalive' value of 1 means to
+ *  use the default idle time, larger values are the idle time in seconds.
+ *
+ *  @brief  Get the connection keepalive time for a spool path.
+ *  @fn     int dts_poolKeepalive (char *path, char *qname)
+ *
+ *  @param  path	spool path of the transfer
+ *  @param  qname	queue name (output, may be NULL)
+ *  @return		idle seconds to keep connections, or 0
+ */
+int
+dts_poolKeepalive (char *path, char *qname)
+{
+    char  name[SZ_FNAME], *ip, *op;
+    dtsQueue *dtsq = (dtsQueue *) NULL;
+
+
+    if (!dts || !path || (ip = strstr (path, "spool/")) == NULL)
+	return (0);
+
+    /*  The full queue name is the directory following the spool dir.
+    */
+    memset (name, 0, SZ_FNAME);
+    for (ip+=6, op=name; *ip && *ip != '/' && op < &name[SZ_FNAME-1]; )
+	*op++ = *ip++;
+
+    if (qname)
+	strcpy (qname, name);
+    if ((dtsq = dts_queueLookup (name)) == NULL || dtsq->keepalive <= 0)
+	return (0);
+
+    return ((dtsq->keepalive > 1) ? dtsq->keepalive : DEF_POOL_IDLE);
+}
+
+
+/**
+ *  DTS_POOLGET -- Take a connection for the given peer/queue/port out of
+ *  the pool.  The caller owns the sockets until they are returned with
+ *  dts_poolPut() or closed.
+ *
+ *  @brief  Take a connection out of the pool.
+ *  @fn     int dts_poolGet (char *host, char *qname, int port, int *sock,
+ *			int *lsock)
+ *
+ *  @param  host	peer host name
+ *  @param  qname	queue name
+ *  @param  port	stream port number
+ *  @param  sock	connected data socket (output)
+ *  @param  lsock	listening socket (output)
+ *  @return		OK if a connection was found, else ERR
+ */
+int
+dts_poolGet (char *host, char *qname, int port, int *sock, int *lsock)
+{
+    register int i;
+    int  status = ERR;
+
+
+    dts_poolExpire ();
+
+    *sock = *lsock = 0;
+    pthread_mutex_lock (&pool_mutex);
+    for (i=0; i < MAX_POOL_CONN; i++) {
+	if (pool[i].sock > 0 && pool[i].port == port &&
+	    strcmp (pool[i].host, host) == 0 &&
+	    strcmp (pool[i].qname, qname) == 0) {
+		*sock  = pool[i].sock;
+		*lsock = pool[i].lsock;
+		memset (&pool[i], 0, sizeof (dtsConn));
+		status = OK;
+		break;
+	}
+    }
+    pthread_mutex_unlock (&pool_mutex);
+
+    if (status == OK && SOCK_DEBUG)
+	dtsErrLog (NULL, "poolGet: %s:%d (%s) sock=%d lsock=%d\n",
+	    host, port, qname, *sock, *lsock);
+
+    return (status);
+}
+
+
+/**
+ *  DTS_POOLPUT -- Return a connection to the pool.  An existing entry is
+ *  updated (e.g. the connection was replaced), otherwise a free slot is
+ *  used.  If the pool is full the connection is simply closed.
+ *
+ *  @brief  Return a connection to the pool.
+ *  @fn     int dts_poolPut (char *host, char *qname, int port, int sock,
+ *			int lsock, int idle)
+ *
+ *  @param  host	peer host name
+ *  @param  qname	queue name
+ *  @param  port	stream port number
+ *  @param  sock	connected data socket
+ *  @param  lsock	listening socket (server side only, else 0)
+ *  @param  idle	max idle time (sec)
+ *  @return		OK if pooled, ERR if closed
+ */
+int
+dts_poolPut (char *host, char *qname, int port, int sock, int lsock, int idle)
+{
+    register int i;
+    dtsConn *c = (dtsConn *) NULL, *free_c = (dtsConn *) NULL;
+    int  flag = 1;
+
+
+    pthread_mutex_lock (&pool_mutex);
+    for (i=0; i < MAX_POOL_CONN; i++) {
+	if (pool[i].sock > 0 && pool[i].port == port &&
+	    strcmp (pool[i].host, host) == 0 &&
+	    strcmp (pool[i].qname, qname) == 0) {
+		c = &pool[i];
+		break;
+	} else if (pool[i].sock <= 0 && !free_c)
+	    free_c = &pool[i];
+    }
+
+    if (!c && !(c = free_c)) {
+	pthread_mutex_unlock (&pool_mutex);
+	if (sock > 0)  close (sock);
+	if (lsock > 0) close (lsock);
+	return (ERR);
+    }
+
+    /*  Close whatever the slot held before if it's been replaced.
+    */
+    if (c->sock > 0 && c->sock != sock)
+	close (c->sock);
+    if (c->lsock > 0 && c->lsock != lsock)
+	close (c->lsock);
+
+    memset (c, 0, sizeof (dtsConn));
+    strncpy (c->host, host, SZ_FNAME-1);
+    strncpy (c->qname, qname, SZ_FNAME-1);
+    c->port  = port;
+    c->sock  = sock;
+    c->lsock = lsock;
+    c->idle  = idle;
+    c->last  = time ((time_t) 0);
+    pthread_mutex_unlock (&pool_mutex);
+
+    /*  Let the kernel tell us about a dead peer while we're idle.
+    */
+    setsockopt (sock, SOL_SOCKET, SO_KEEPALIVE, (void *)&flag, sizeof(flag));
+
+    if (SOCK_DEBUG)
+	dtsErrLog (NULL, "poolPut: %s:%d (%s) sock=%d lsock=%d\n",
+	    host, port, qname, sock, lsock);
+
+    return (OK);
+}
+
+
+/**
+ *  DTS_POOLEXPIRE -- Close any pooled connections idle for too long.
+ *
+ *  @brief  Close any pooled connections idle for too long.
+ *  @fn     void dts_poolExpire (void)
+ *
+ *  @return		nothing
+ */
+void
+dts_poolExpire (void)
+{
+    register int i;
+    time_t  now = time ((time_t) 0);
+
+
+    pthread_mutex_lock (&pool_mutex);
+    for (i=0; i < MAX_POOL_CONN; i++) {
+	if (pool[i].sock > 0 && (now - pool[i].last) > pool[i].idle)
+		dts_poolClose (&pool[i]);
+    }
+    pthread_mutex_unlock (&pool_mutex);
+}
+
+
+/**
+ *  DTS_POOLFLUSH -- Close all pooled connections.
+ *
+ *  @brief  Close all pooled connections.
+ *  @fn     void dts_poolFlush (void)
+ *
+ *  @return		nothing
+ */
+void
+dts_poolFlush (void)
+{
+    register int i;
+
+
+    pthread_mutex_lock (&pool_mutex);
+    for (i=0; i < MAX_POOL_CONN; i++) {
+	if (pool[i].sock > 0)
+	    dts_poolClose (&pool[i]);
+    }
+    pthread_mutex_unlock (&pool_mutex);
+}
+
+
+/**
+ *  DTS_POOLCLOSE -- Close a pooled connection and clear the slot.  Must be
+ *  called with the pool locked.
+ */
+static void
+dts_poolClose (dtsConn *c)
+{
+    if (SOCK_DEBUG)
+	dtsErrLog (NULL, "poolClose: %s:%d (%s) sock=%d lsock=%d\n",
+	    c->host, c->port, c->qname, c->sock, c->lsock);
+
+    if (c->sock > 0)
+	close (c->sock);
+    if (c->lsock > 0)
+	close (c->lsock);
+    memset (c, 0, sizeof (dtsConn));
+}
@@ -66,10 +66,10 @@
 #include "dts.h"
 #include "dtsUDT.h"
 #include "dtsPSock.h"
+#include "dtsURing.h"
 
 
 extern  DTS  *dts;
-extern  int   thread_sem;
 extern  int   queue_delay;
 
 extern int dts_nullHandler();
@@ -85,11 +85,12 @@ extern int dts_nullHandler();
  *      xferId          S	transfer id
  *      method          S	transfer method
  *      fileName        S	file name
- *      fileSize        I	file size
+ *      fileSize        L	file size
  *      nthreads        I	num of transfer threads to open
  *      srcPort         I	starting port number
  *      destHost        S	FQDN of destination machine
  *      destCmdURL      S	destination xmlrpc URI
+ *      stream          I	pull a directory as a tar stream (optional)
  * 
  *  RPC Returns:
  *      tsec		I	transfer time seconds
@@ -110,16 +111,17 @@ dts_xferPullFile (void *data)
     char  *srcHost, *destHost, *srcCmdURL, *destCmdURL;
     char  *srcDir, *destDir, *srcFname, *destFname;
     char  *errMsg = "OK";
-    int   nthreads, srcPort, fileSize, res, tsec=0, tusec=0, count;
+    int   nthreads, srcPort, res, tsec=0, tusec=0;
+    long  fileSize;
     int   status = OK, verbose = 0, client = 0, t, async = 0, udt_rate = 0;
-    int  *tstat = NULL;
+    int  *tstat = NULL, ofd = -1, xstat = OK, stream = 0;
+    int   session = 0, dport = 0;
     char  resStr[SZ_CONFIG+1], tlog[SZ_PATH+1], qname[SZ_PATH];
 
     struct timeval tv1 = {0, 0};
     struct timeval tv2 = {0, 0};
 
-    /* static pthread_t  tids[MAX_THREADS];	*/        
-    pthread_t *tids = calloc (MAX_THREADS,sizeof(pthread_t));
+    dtsWorkGroup *grp = dts_workGroup ();	/* transfer threads	*/
 
 
     /* Get the RPC arguments to local variables.
@@ -127,7 +129,7 @@ dts_xferPullFile (void *data)
     xferID     = xr_getStringFromParam (data, 0);
     method     = xr_getStringFromParam (data, 1);
     fileName   = xr_getStringFromParam (data, 2);
-    fileSize   = xr_getIntFromParam    (data, 3);
+    fileSize   = (long) xr_getLongLongFromParam (data, 3);
     nthreads   = xr_getIntFromParam    (data, 4);
     udt_rate   = xr_getIntFromParam    (data, 5);
     srcPort    = xr_getIntFromParam    (data, 6);
@@ -139,6 +141,8 @@ dts_xferPullFile (void *data)
     destDir    = xr_getStringFromParam (data, 12);
     srcFname   = xr_getStringFromParam (data, 13);
     destFname  = xr_getStringFromParam (data, 14);
+    if (xr_getParamCount (data) > 15)
+        stream = xr_getIntFromParam (data, 15);
 
     /* Extract the queue name.
      */
@@ -149,7 +153,7 @@ dts_xferPullFile (void *data)
 
     if (dts->debug > 2) {
         fprintf (stderr, "Pull: xferID='%s'  method='%s'\n", xferID, method);
-        fprintf (stderr, "      name='%s'  (%d bytes)\n", fileName, fileSize);
+        fprintf (stderr, "      name='%s'  (%ld bytes)\n", fileName, fileSize);
         fprintf (stderr, "      Nthreads=%d port=%d srcHost=%s destHost=%s\n",
                                 nthreads, srcPort, srcHost, destHost);
         fprintf (stderr, "      srcCmd=%s\n", srcCmdURL);
@@ -166,11 +170,22 @@ dts_xferPullFile (void *data)
 
 
 
+    /*  Use the number of streams we've learned works best for the peer.
+    */
+    if (fileSize >= MIN_MULTI_FSIZE && strcasecmp (method, "psock") == 0)
+	nthreads = dts_tuneStreams (srcHost, srcCmdURL, nthreads);
+
     gettimeofday (&tv1, NULL);			/* start transfer timer */
 
     if (fileSize < MIN_MULTI_FSIZE)
 	nthreads = 1;
 
+    /*  The streams may be accepted on the daemon's shared data port, the
+    **  peer is told the port and our session for it in the RPC.
+    */
+    dport   = dts_dataPort ();
+    session = dts_dataSession ();
+
     /* Create the 'server' sockets.  We do this by creating a socket for each
     ** thread we wish to run, spawning a thread for each that waits for a
     ** connection.
@@ -179,18 +194,57 @@ dts_xferPullFile (void *data)
     if (strncasecmp (method, "psock", 5) == 0) {
         void (*func)(void *data) = psReceiveFile;   /* function to execute  */
 
-    	thread_sem = dts_semInit ((int)srcPort+PID_MAX, nthreads);
-
-        psSpawnThreads (func, nthreads, destDir, destFname, fileSize, 
-	    XFER_PULL, srcPort, srcHost, verbose, tids);
+	/*  Open the output file once, all threads write to it in place.
+	**  A tar stream is instead unpacked in the directory as it arrives.
+	*/
+	if (stream) {
+	    char *pdir = dts_sandboxPath (destDir);
+
+	    ofd = dts_tarOpenSink (pdir);
+	    free ((void *) pdir);
+	} else
+	    ofd = psOpenReceiveFile (destDir, destFname, fileSize);
+
+	if (ofd == -1) {
+	    errMsg = "Cannot open output file";
+	    status = ERR;
+	    goto ret_stat;
+	}
+        if (psSpawnThreads (func, nthreads, destDir, destFname, fileSize, 
+	    XFER_PULL, srcPort, session, dport, srcHost, verbose, ofd, 
+	    grp) != OK) {
+		(void) psCollectThreads (grp);
+		if (stream && dts_tarIsStream (ofd))
+		    (void) dts_tarClose (ofd);
+		else
+		    psCloseReceiveFile (ofd, ERR);
+		errMsg = "Cannot start transfer";
+		status = ERR;
+		goto ret_stat;
+	}
 
     } else if (strncasecmp (method, "udt", 3) == 0) {
         void (*func)(void *data) = udtReceiveFile;  /* function to execute  */
 
-    	thread_sem = dts_semInit ((int)srcPort+PID_MAX, nthreads);
-
         udtSpawnThreads (func, nthreads, destDir, destFname, fileSize, 
-	    XFER_PULL, udt_rate, srcPort, srcHost, verbose, tids);
+	    XFER_PULL, udt_rate, srcPort, srcHost, verbose, grp);
+
+    } else if (strncasecmp (method, "uring", 5) == 0) {
+        void (*func)(void *data) = urReceiveFile;   /* function to execute  */
+
+	if ((ofd = psOpenReceiveFile (destDir, destFname, fileSize)) == -1) {
+	    errMsg = "Cannot open output file";
+	    status = ERR;
+	    goto ret_stat;
+	}
+        if (urSpawnTransfer (func, nthreads, destDir, destFname, fileSize, 
+	    XFER_PULL, srcPort, session, dport, srcHost, verbose, ofd, 
+	    grp) != OK) {
+		psCloseReceiveFile (ofd, ERR);
+		errMsg = "Cannot start transfer";
+		status = ERR;
+		goto ret_stat;
+	}
 
     } else {
 	errMsg = "Unknown Transfer Method";
@@ -201,20 +255,12 @@ dts_xferPullFile (void *data)
 
     /* Wait for the threads to ready their sockets.
      */
-    count = dts_semGetVal (thread_sem);
     if (dts->verbose > 2) 
-	dtsLog (dts, "xferPullFile: threads started: waiting on %d\n", count);
-    while (count > 0) {
-        struct timespec delay = { (time_t) 0, (long) 5000 };
-
-        nanosleep (&delay, 0);
-        count = dts_semGetVal (thread_sem);
-        if (dts->verbose > 2) 
-	    dtsLog (dts, "xferPullFile: started: waiting on %d\n", count);
-    }
-    dts_semRemove (thread_sem);
+	dtsLog (dts, "xferPullFile: threads started: waiting on %d\n", 
+	    nthreads);
+    dts_workWaitReady (grp);
     if (dts->verbose > 2) 
-	dtsLog (dts, "xferPullFile:  threads started: starting send\n", count);
+	dtsLog (dts, "xferPullFile:  threads started: starting send\n");
 
 
     /* Sockets are now ready, initiate the message to the destination to make
@@ -232,12 +278,15 @@ dts_xferPullFile (void *data)
         xr_setStringInParam (async, xferID); 	/* set calling params	*/
         xr_setStringInParam (async, method); 
         xr_setStringInParam (async, fileName); 
-        xr_setIntInParam    (async, fileSize); 
+        xr_setLongLongInParam (async, (long long) fileSize);
         xr_setIntInParam    (async, nthreads); 
         xr_setIntInParam    (async, udt_rate); 
         xr_setIntInParam    (async, srcPort); 
         xr_setStringInParam (async, destHost); 
         xr_setStringInParam (async, srcDir); 
+        xr_setIntInParam    (async, (stream && dts_tarIsStream (ofd))); 
+        xr_setIntInParam    (async, session); 
+        xr_setIntInParam    (async, dport); 
 
         res = xr_callASync (async, "sendFile", dts_nullHandler);
 
@@ -247,12 +296,15 @@ dts_xferPullFile (void *data)
         xr_setStringInParam (client, xferID); 	/* set calling params	*/
         xr_setStringInParam (client, method); 
         xr_setStringInParam (client, fileName); 
-        xr_setIntInParam    (client, fileSize); 
+        xr_setLongLongInParam (client, (long long) fileSize);
         xr_setIntInParam    (client, nthreads); 
         xr_setIntInParam    (client, udt_rate); 
         xr_setIntInParam    (client, srcPort); 
         xr_setStringInParam (client, destHost); 
         xr_setStringInParam (client, srcDir); 
+        xr_setIntInParam    (client, (stream && dts_tarIsStream (ofd))); 
+        xr_setIntInParam    (client, session); 
+        xr_setIntInParam    (client, dport); 
 
         if (xr_callSync (client, "sendFile") == OK) {/* make the call	*/
 	    xr_getIntFromResult (client, &res);
@@ -265,22 +317,44 @@ dts_xferPullFile (void *data)
         xr_closeClient (client);
     }
 
-    if ((status = res) != OK)
+    if ((status = res) != OK) {
+	/*  The sender won't start, stop our streams waiting for it and
+	**  close the output as failed so a resume map is kept for the retry
+	**  and any tar sink is freed.
+	*/
+	dts_workCancel (grp);
+	(void) psCollectThreads (grp);
+	if (stream && dts_tarIsStream (ofd))
+	    (void) dts_tarClose (ofd);
+	else
+	    psCloseReceiveFile (ofd, ERR);
 	goto ret_stat;
+    }
 
 
     /* Wait for sending threads to complete.  A failure on any one thread will
     ** force the entire method to fail.  The use of psCollectThreads()
     ** shouldn't matter when using UDT for transport.
     */
-    if ((tstat = psCollectThreads (nthreads, tids))) {
+    if ((tstat = psCollectThreads (grp))) {
         for (t=0; t < nthreads; t++) {
-            if ( tstat[t] )
+            if ( tstat[t] ) {
                 dtsLog (dts, "%6.6s <  XFER: thread %d error: stat=%d\n", 
 		    dts_queueNameFmt (qname), t, tstat[t]);
+		xstat = ERR;
+	    }
         }
     }
 
+    /*  Flush and close the shared output file, keeping its resume map
+    **  if any stream failed.  A tar stream must have been unpacked whole.
+    */
+    if (stream && dts_tarIsStream (ofd)) {
+	if (dts_tarClose (ofd) != OK)
+	    status = ERR;
+    } else
+	psCloseReceiveFile (ofd, xstat);
+
 
     /*  Stop transfer timer and calculate the transfer time return values.
     */
@@ -292,6 +366,10 @@ dts_xferPullFile (void *data)
     } else if (tusec < 0) {
         tusec += 1000000; tsec--;
     }
+    if (!tstat && strcasecmp (method, "psock") == 0)
+	dts_tuneUpdate (srcHost, (long) fileSize, nthreads,
+	    ((double)tsec + (double)tusec / 1000000.0));
+
     memset (tlog, 0, SZ_PATH);
     sprintf (tlog, "%6.6s <  XFER: done[%d]: T=%.3f sec %.2f Mbs %.2f MB/s\n", 
 	dts_queueNameFmt (qname), nthreads,
@@ -324,8 +402,7 @@ ret_stat:
     free ((char *) srcFname);
     free ((char *) destFname);
 
-    free ((char *) tids);
-    free ((char *) tstat);
+    dts_workFree (grp);
 
     return (OK);
 }
@@ -338,10 +415,14 @@ ret_stat:
  *  RPC Params:
  *      xferId          S	transfer id
  *      fileName        S	file name
- *      fileSize        I	file size
+ *      fileSize        L	file size
  *      nthreads        I	num of transfer threads to open
  *      srcPort         I	starting port number
  *      srcIP		S	IP address of caller (string)
+ *      dir		S	source directory
+ *      stream          I	send fileName as a tar stream (optional)
+ *      session         I	transfer session on the data port (optional)
+ *      dataPort        I	destination's shared data port (optional)
  * 
  *  RPC Return:
  *      0		transfer succeeded
@@ -360,11 +441,12 @@ dts_xferSendFile (void *data)
 
     char  *xferID, *fileName, *destIP, *method, *dir, *errMsg, tlog[SZ_PATH];
     char   qname[SZ_PATH];
-    int   nthreads, destPort, fileSize, *tstat = NULL;
-    int   t, status = OK, verbose = 0, udt_rate = 0;
+    int   nthreads, destPort, *tstat = NULL;
+    long  fileSize;
+    int   t, status = OK, verbose = 0, udt_rate = 0, stream = 0, sfd = -1;
+    int   session, dport = 0;
     struct timeval  t1, t2, tv;
-    /* static pthread_t  tids[MAX_THREADS]; */
-    pthread_t *tids = calloc (MAX_THREADS, sizeof (pthread_t));
+    dtsWorkGroup *grp = dts_workGroup ();	/* transfer threads	*/
 
     extern double transferMb(), transferMB();
 
@@ -393,12 +475,19 @@ dts_xferSendFile (void *data)
     xferID     = xr_getStringFromParam (data, 0);
     method     = xr_getStringFromParam (data, 1);
     fileName   = xr_getStringFromParam (data, 2);
-    fileSize   = xr_getIntFromParam    (data, 3);
+    fileSize   = (long) xr_getLongLongFromParam (data, 3);
     nthreads   = xr_getIntFromParam    (data, 4);
     udt_rate   = xr_getIntFromParam    (data, 5);
     destPort   = xr_getIntFromParam    (data, 6);
     destIP     = xr_getStringFromParam (data, 7);
     dir        = xr_getStringFromParam (data, 8);
+    if (xr_getParamCount (data) > 9)
+        stream = xr_getIntFromParam (data, 9);
+    session    = destPort;
+    if (xr_getParamCount (data) > 11) {
+        session = xr_getIntFromParam (data, 10);
+        dport   = xr_getIntFromParam (data, 11);
+    }
 
     /* Extract the queue name.
      */
@@ -408,7 +497,7 @@ dts_xferSendFile (void *data)
 
     if (dts->debug > 2) {
         fprintf (stderr, "sendFile: xferID='%s'\n", xferID);
-        fprintf (stderr, "      name='%s'  (%d bytes)\n", fileName, fileSize);
+        fprintf (stderr, "      name='%s'  (%ld bytes)\n", fileName, fileSize);
         fprintf (stderr, "      Nthreads=%d port=%d  destIP=%s\n",
                                 nthreads, destPort, 
 				(destIP ? destIP : "none"));
@@ -427,14 +516,57 @@ dts_xferSendFile (void *data)
     if (strcasecmp (method, "psock") == 0) {
         void (*func)(void *data) = psSendFile;   /* function to execute  */
 
-        psSpawnThreads (func, nthreads, dir, fileName, fileSize, 
-	    XFER_PULL, destPort, destIP, verbose, tids);
+	/*  A directory is sent as a tar stream built as the threads read
+	**  it, the size we were given was only an estimate.
+	*/
+	if (stream) {
+	    char *spath = dts_sandboxPath (fileName);
+
+	    sfd = dts_tarOpenSource (spath, &fileSize);
+	    free ((void *) spath);
+	    if (sfd < 0) {
+		dtsErrLog (NULL, "sendFile: cannot stream '%s'\n", fileName);
+		errMsg = "Cannot open tar stream";
+		status = ERR;
+		goto ret_stat;
+	    }
+
+	} else {
+	    /*  Read an object a fan-out queue sends to several destinations
+	    **  through the cache shared with the other senders, and one still
+	    **  arriving on a cut-through queue as it comes in.
+	    */
+	    char *spath = dts_sandboxPath (fileName);
+
+	    if ((sfd = dts_fanoutAttach (spath)) < 0)
+		sfd = dts_cutAttach (spath);
+	    free ((void *) spath);
+	}
+        if (psSpawnThreads (func, nthreads, dir, fileName, fileSize, 
+	    XFER_PULL, destPort, session, dport, destIP, verbose, sfd, 
+	    grp) != OK) {
+		(void) psCollectThreads (grp);
+		errMsg = "Cannot start transfer";
+		status = ERR;
+		goto ret_stat;
+	}
 
     } else if (strcasecmp (method, "udt") == 0) {
         void (*func)(void *data) = udtSendFile;  /* function to execute  */
 
         udtSpawnThreads (func, nthreads, dir, fileName, fileSize, 
-	    XFER_PULL, udt_rate, destPort, destIP, verbose, tids);
+	    XFER_PULL, udt_rate, destPort, destIP, verbose, grp);
+
+    } else if (strcasecmp (method, "uring") == 0) {
+        void (*func)(void *data) = urSendFile;   /* function to execute  */
+
+        if (urSpawnTransfer (func, nthreads, dir, fileName, fileSize, 
+	    XFER_PULL, destPort, session, dport, destIP, verbose, -1, 
+	    grp) != OK) {
+		errMsg = "Cannot start transfer";
+		status = ERR;
+		goto ret_stat;
+	}
 
     } else {
 	errMsg = "Unknown Transfer Method";
@@ -446,7 +578,7 @@ dts_xferSendFile (void *data)
     /* Wait for sending threads to complete.  A failure on any one thread will
     ** force the entire method to fail.
     */
-    if ((tstat = psCollectThreads (nthreads, tids))) {
+    if ((tstat = psCollectThreads (grp))) {
         for (t=0; t < nthreads; t++) {
             if ( tstat[t] )
                 dtsLog (dts, "%6.6s >   XFER: thread %d error: stat=%d\n", 
@@ -477,6 +609,12 @@ dts_xferSendFile (void *data)
     /* Set the XML-RPC status return code.
     */
 ret_stat:
+    if (dts_fanoutIsReader (sfd))
+	dts_fanoutDetach (sfd);
+    else if (dts_cutIsReader (sfd))
+	dts_cutDetach (sfd);
+    else if (sfd >= 0)
+	dts_tarClose (sfd);
     xr_setIntInResult (data, status);
 
     /* Free memory allocate when we got the params.
@@ -487,8 +625,7 @@ ret_stat:
     free ((char *) destIP);
     free ((char *) dir);
 
-    free ((char *) tids);
-    free ((char *) tstat);
+    dts_workFree (grp);
 
 #ifdef USE_FORK
     exit (0);
@@ -67,10 +67,10 @@
 #include "dts.h"
 #include "dtsUDT.h"
 #include "dtsPSock.h"
+#include "dtsURing.h"
 
 
 extern  DTS  *dts;
-extern  int   thread_sem;
 extern  int   queue_delay;
 extern  int   first_write;
 
@@ -86,11 +86,12 @@ extern  int   dts_nullHandler();
  *      xferId          S	transfer id
  *      method          S	transfer method
  *      fileName        S	file name
- *      fileSize        I	file size
+ *      fileSize        L	file size
  *      nthreads        I	num of transfer threads to open
  *      srcPort         I	starting port number
  *      destHost        S	FQDN of destination machine
  *      destCmdURL      S	destination xmlrpc URI
+ *      stream          I	send a directory as a tar stream (optional)
  * 
  *  RPC Returns:
  *      tsec		I	transfer time seconds
@@ -111,8 +112,10 @@ dts_xferPushFile (void *data)
     char  *srcHost, *srcCmdURL, *destHost, *destCmdURL;
     char  *srcDir, *srcFname, *destDir, *destFname;
     char  *errMsg = "OK";
-    int   nthreads = 0, srcPort, fileSize, res, tsec = 0, tusec = 0;
-    int   status=OK, verbose=0, client=0, t, count, async = 0, udt_rate = 0;
+    int   nthreads = 0, srcPort, res, tsec = 0, tusec = 0;
+    long  fileSize;
+    int   status=OK, verbose=0, client=0, t, async = 0, udt_rate = 0;
+    int   stream = 0, sfd = -1, session = 0, dport = 0;
     int  *tstat = NULL;
     char  tlog[SZ_PATH], localIP[SZ_PATH];
     char  resStr[SZ_CONFIG+1], qname[SZ_PATH];
@@ -120,8 +123,7 @@ dts_xferPushFile (void *data)
     struct timeval tv1 = {0, 0};
     struct timeval tv2 = {0, 0};
 
-    /* static pthread_t  tids[MAX_THREADS]; */
-    pthread_t  *tids = calloc (MAX_THREADS, sizeof(pthread_t));
+    dtsWorkGroup *grp = dts_workGroup ();	/* transfer threads	*/
 
 
     /* Get the RPC arguments to local variables.
@@ -129,7 +131,7 @@ dts_xferPushFile (void *data)
     xferID     = xr_getStringFromParam (data, 0);
     method     = xr_getStringFromParam (data, 1);
     fileName   = xr_getStringFromParam (data, 2);
-    fileSize   = xr_getIntFromParam    (data, 3);
+    fileSize   = (long) xr_getLongLongFromParam (data, 3);
     nthreads   = xr_getIntFromParam    (data, 4);
     udt_rate   = xr_getIntFromParam    (data, 5);
     srcPort    = xr_getIntFromParam    (data, 6);
@@ -141,16 +143,45 @@ dts_xferPushFile (void *data)
     destDir    = xr_getStringFromParam (data, 12);
     srcFname   = xr_getStringFromParam (data, 13);
     destFname  = xr_getStringFromParam (data, 14);
+    if (xr_getParamCount (data) > 15)
+        stream = xr_getIntFromParam (data, 15);
 
     /* Extract the queue name.
      */
     memset (qname, 0, SZ_PATH);
     strcpy (qname, dts_queueFromPath (srcDir));
 
+    /*  A directory is sent as a tar stream built as the threads read it,
+    **  the size we were given was only an estimate.
+    */
+    if (stream && strcasecmp (method, "psock") == 0) {
+	char *spath = dts_sandboxPath (fileName);
+
+	sfd = dts_tarOpenSource (spath, &fileSize);
+	free ((void *) spath);
+	if (sfd < 0) {
+	    dtsErrLog (NULL, "xferPushFile: cannot stream '%s'\n", fileName);
+	    errMsg = "Cannot open tar stream";
+	    status = ERR;
+	    goto ret_stat;
+	}
+
+    } else if (strcasecmp (method, "psock") == 0) {
+	/*  An object a fan-out queue sends to several destinations at once
+	**  is read through a cache shared with the other senders, one still
+	**  arriving on a cut-through queue is read as it comes in.
+	*/
+	char *spath = dts_sandboxPath (fileName);
+
+	if ((sfd = dts_fanoutAttach (spath)) < 0)
+	    sfd = dts_cutAttach (spath);
+	free ((void *) spath);
+    }
+
 
     if (dts->debug > 2) {
 	fprintf (stderr, "Push: xferID='%s'  method='%s'\n", xferID, method);
-	fprintf (stderr, "      name='%s'  (%d bytes)\n", fileName, fileSize);
+	fprintf (stderr, "      name='%s'  (%ld bytes)\n", fileName, fileSize);
         fprintf (stderr, "      Nthreads=%d port=%d  srcHost=%s destHost=%s\n",
                                 nthreads, srcPort, srcHost, destHost);
         fprintf (stderr, "      srcCmd=%s\n", srcCmdURL);
@@ -171,6 +202,11 @@ dts_xferPushFile (void *data)
     */
     strcpy (localIP, dts_getLocalIP());
 
+    /*  Use the number of streams we've learned works best for the peer.
+    */
+    if (fileSize >= MIN_MULTI_FSIZE && strcasecmp (method, "psock") == 0)
+	nthreads = dts_tuneStreams (destHost, destCmdURL, nthreads);
+
     gettimeofday (&tv1, NULL);			/* start transfer timer */
 
     /* FIXME -- ?? Reset if needed for optimization ??
@@ -178,6 +214,12 @@ dts_xferPushFile (void *data)
     if (fileSize < MIN_MULTI_FSIZE)		
 	nthreads = 1;
 
+    /*  The streams may be accepted on the daemon's shared data port, the
+    **  peer is told the port and our session for it in the RPC.
+    */
+    dport   = dts_dataPort ();
+    session = dts_dataSession ();
+
 
     /* Create the 'server' sockets.  We do this by creating a socket for each
     ** thread we wish to run, spawning a thread for each that waits for a
@@ -186,18 +228,31 @@ dts_xferPushFile (void *data)
     if (strcasecmp (method, "psock") == 0) {
         void (*func)(void *data) = psSendFile;   /* function to execute  */
 
-        thread_sem = dts_semInit ((int)srcPort+PID_MAX, nthreads);
-
-        psSpawnThreads (func, nthreads, srcDir, fileName, fileSize, 
-	    XFER_PUSH, srcPort, destHost, verbose, tids);
+        if (psSpawnThreads (func, nthreads, srcDir, fileName, fileSize, 
+	    XFER_PUSH, srcPort, session, dport, destHost, verbose, sfd, 
+	    grp) != OK) {
+		(void) psCollectThreads (grp);
+		errMsg = "Cannot start transfer";
+		status = ERR;
+		goto ret_stat;
+	}
 
     } else if (strcasecmp (method, "udt") == 0) {
         void (*func)(void *data) = udtSendFile;  /* function to execute  */
 
-        thread_sem = dts_semInit ((int)srcPort+PID_MAX, nthreads);
-
         udtSpawnThreads (func, nthreads, srcDir, fileName, fileSize, 
-	    XFER_PUSH, udt_rate, srcPort, destHost, verbose, tids);
+	    XFER_PUSH, udt_rate, srcPort, destHost, verbose, grp);
+
+    } else if (strcasecmp (method, "uring") == 0) {
+        void (*func)(void *data) = urSendFile;   /* function to execute  */
+
+        if (urSpawnTransfer (func, nthreads, srcDir, fileName, fileSize, 
+	    XFER_PUSH, srcPort, session, dport, destHost, verbose, -1, 
+	    grp) != OK) {
+		errMsg = "Cannot start transfer";
+		status = ERR;
+		goto ret_stat;
+	}
 
     } else {
 	errMsg = "Unknown Transfer Method";
@@ -208,14 +263,7 @@ dts_xferPushFile (void *data)
 
     /* Wait for the threads to ready their sockets.
      */
-    count = dts_semGetVal (thread_sem);
-    while (count > 0) {
-        struct timespec delay = { (time_t) 0, (long) 500 };
-
-        nanosleep (&delay, 0);
-        count = dts_semGetVal (thread_sem);
-    }
-    dts_semRemove (thread_sem);
+    dts_workWaitReady (grp);
 
 
     /* Sockets are now ready, initiate the message to the destination to make
@@ -234,12 +282,15 @@ dts_xferPushFile (void *data)
         xr_setStringInParam (async, xferID); 	/* set calling params	*/
         xr_setStringInParam (async, method); 
         xr_setStringInParam (async, destFname); 
-        xr_setIntInParam    (async, fileSize); 
+        xr_setLongLongInParam (async, (long long) fileSize);
         xr_setIntInParam    (async, nthreads); 
         xr_setIntInParam    (async, udt_rate); 
         xr_setIntInParam    (async, srcPort); 
         xr_setStringInParam (async, localIP); 
         xr_setStringInParam (async, destDir); 
+        xr_setIntInParam    (async, (sfd >= 0 && dts_tarIsStream (sfd))); 
+        xr_setIntInParam    (async, session); 
+        xr_setIntInParam    (async, dport); 
 
         res = xr_callASync (async, "receiveFile", dts_nullHandler);
 
@@ -249,12 +300,15 @@ dts_xferPushFile (void *data)
         xr_setStringInParam (client, xferID); 	/* set calling params	*/
         xr_setStringInParam (client, method); 
         xr_setStringInParam (client, destFname); 
-        xr_setIntInParam    (client, fileSize); 
+        xr_setLongLongInParam (client, (long long) fileSize);
         xr_setIntInParam    (client, nthreads); 
         xr_setIntInParam    (client, udt_rate); 
         xr_setIntInParam    (client, srcPort); 
         xr_setStringInParam (client, localIP); 
         xr_setStringInParam (client, destDir); 
+        xr_setIntInParam    (client, (sfd >= 0 && dts_tarIsStream (sfd))); 
+        xr_setIntInParam    (client, session); 
+        xr_setIntInParam    (client, dport); 
 
         if (xr_callSync (client, "receiveFile") == OK) {/* make the call */
 	    xr_getIntFromResult (client, &res);
@@ -265,15 +319,20 @@ dts_xferPushFile (void *data)
         xr_closeClient (client);
     }
 
-    if ((status = res) != OK)
+    if ((status = res) != OK) {
+	/*  The receiver won't connect, don't leave our streams waiting.
+	*/
+	dts_workCancel (grp);
+	(void) psCollectThreads (grp);
 	goto ret_stat;
+    }
 
 
     /* Wait for sending threads to complete.  A failure on any one thread will
     ** force the entire method to fail.  The use of psCollectThreads() 
     ** shouldn't matter when using UDT for transport.
     */
-    if ((tstat = psCollectThreads (nthreads, tids))) {
+    if ((tstat = psCollectThreads (grp))) {
         for (t=0; t < nthreads; t++) {
             if ( tstat[t] )
                 dtsLog (dts, "%6.6s >  XFER: thread %d error: stat=%d\n", 
@@ -292,6 +351,10 @@ dts_xferPushFile (void *data)
     } else if (tusec < 0) {
         tusec += 1000000; tsec--;
     }
+    if (!tstat && strcasecmp (method, "psock") == 0)
+	dts_tuneUpdate (destHost, (long) fileSize, nthreads,
+	    ((double)tsec + (double)tusec / 1000000.0));
+
     memset (tlog, 0, SZ_PATH);
     sprintf (tlog, "%6.6s >  XFER: done[%d]: T=%.3f sec %.2f Mbs %.2f MB/s\n",
 	dts_queueNameFmt (qname), nthreads,
@@ -302,8 +365,8 @@ dts_xferPushFile (void *data)
 
     if (dts->debug > 2) {
 	fprintf (stderr, 
-	  "Push: transfer %d bytes complete (%d.%d sec, %g Mb/s, %g MB/s).\n", 
-	    (int) fileSize, tsec, tusec,
+	  "Push: transfer %ld bytes complete (%d.%d sec, %g Mb/s, %g MB/s).\n", 
+	    fileSize, tsec, tusec,
 	    transferMb (fileSize, tsec, tusec),
 	    transferMB (fileSize, tsec, tusec));
     }
@@ -312,6 +375,12 @@ dts_xferPushFile (void *data)
     /* Set the XML-RPC status return code.
     */
 ret_stat:
+    if (dts_fanoutIsReader (sfd))
+	dts_fanoutDetach (sfd);
+    else if (dts_cutIsReader (sfd))
+	dts_cutDetach (sfd);
+    else if (sfd >= 0)
+	dts_tarClose (sfd);
     memset (resStr, 0, SZ_LINE);
     sprintf (resStr, "%d %d %d", tsec, tusec, status);
     xr_setStringInResult (data, resStr);
@@ -331,8 +400,7 @@ ret_stat:
     free ((char *) srcFname);
     free ((char *) destFname);
 
-    free ((char *) tids);
-    free ((char *) tstat);
+    dts_workFree (grp);
 
     if (dts->debug > 2)
 	fprintf (stderr, "xferPushFile: returning (%d.%d sec) status=%d\n",
@@ -349,10 +417,14 @@ ret_stat:
  *  RPC Params:
  *      xferId          S	transfer id
  *      fileName        S	file name
- *      fileSize        I	file size
+ *      fileSize        L	file size
  *      nthreads        I	num of transfer threads to open
  *      srcPort         I	starting port number
  *      srcIP		S	IP address of caller (string)
+ *      dir		S	destination directory
+ *      stream          I	unpack a tar stream in dir (optional)
+ *      session         I	transfer session on the data port (optional)
+ *      dataPort        I	source's shared data port (optional)
  * 
  *  RPC Return:
  *      0		transfer succeeded
@@ -371,11 +443,12 @@ dts_xferReceiveFile (void *data)
 {
     char   *xferID, *fileName, *srcIP, *method, *dir, *errMsg, tlog[SZ_PATH];
     char    qname[SZ_PATH];
-    int     nthreads, srcPort, fileSize, *tstat = NULL;
-    int     t, status = OK, verbose = 0, udt_rate = 0;
+    int     nthreads, srcPort, *tstat = NULL, xstat = OK;
+    long    fileSize;
+    int     t, status = OK, verbose = 0, udt_rate = 0, ofd = -1, stream = 0;
+    int     session, dport = 0;
     struct timeval  t1, t2, tv;
-    /* static pthread_t  tids[MAX_THREADS]; */
-    pthread_t *tids = calloc (MAX_THREADS,sizeof(pthread_t));
+    dtsWorkGroup *grp = dts_workGroup ();	/* transfer threads	*/
 
     extern double transferMb(), transferMB();
 
@@ -403,12 +476,19 @@ dts_xferReceiveFile (void *data)
     xferID    = xr_getStringFromParam (data, 0);
     method    = xr_getStringFromParam (data, 1);
     fileName  = xr_getStringFromParam (data, 2);
-    fileSize  = xr_getIntFromParam    (data, 3);
+    fileSize  = (long) xr_getLongLongFromParam (data, 3);
     nthreads  = xr_getIntFromParam    (data, 4);
     udt_rate  = xr_getIntFromParam    (data, 5);
     srcPort   = xr_getIntFromParam    (data, 6);
     srcIP     = xr_getStringFromParam (data, 7);
     dir       = xr_getStringFromParam (data, 8);
+    if (xr_getParamCount (data) > 9)
+        stream = xr_getIntFromParam (data, 9);
+    session   = srcPort;
+    if (xr_getParamCount (data) > 11) {
+        session = xr_getIntFromParam (data, 10);
+        dport   = xr_getIntFromParam (data, 11);
+    }
 
     /* Extract the queue name.
      */
@@ -418,7 +498,7 @@ dts_xferReceiveFile (void *data)
 
     if (dts->debug > 2) {
 	fprintf (stderr, "receiveFile: xferID='%s'\n", xferID);
-	fprintf (stderr, "      name='%s'  (%d bytes)\n", fileName, fileSize);
+	fprintf (stderr, "      name='%s'  (%ld bytes)\n", fileName, fileSize);
 	fprintf (stderr, "      Nthreads=%d port=%d  srcIP=%s\n",
 				nthreads, srcPort, srcIP);
 	fprintf (stderr, "      dir='%s'\n", dir);
@@ -439,14 +519,57 @@ dts_xferReceiveFile (void *data)
     if (strcasecmp (method, "psock") == 0) {
         void (*func)(void *data) = psReceiveFile;   /* function to execute  */
 
-        psSpawnThreads (func, nthreads, dir, fileName, fileSize, 
-	    XFER_PUSH, srcPort, srcIP, verbose, tids);
+	/*  Open the output file once, all threads write to it in place.
+	**  A tar stream is instead unpacked in the directory as it arrives.
+	*/
+	if (stream) {
+	    char *pdir = dts_sandboxPath (dir);
+
+	    ofd = dts_tarOpenSink (pdir);
+	    free ((void *) pdir);
+	} else
+	    ofd = psOpenReceiveFile (dir, fileName, fileSize);
+
+	if (ofd == -1) {
+	    errMsg = "Cannot open output file";
+	    status = ERR;
+	    goto ret_stat;
+	}
+        if (psSpawnThreads (func, nthreads, dir, fileName, fileSize, 
+	    XFER_PUSH, srcPort, session, dport, srcIP, verbose, ofd, 
+	    grp) != OK) {
+		(void) psCollectThreads (grp);
+		if (stream && dts_tarIsStream (ofd))
+		    (void) dts_tarClose (ofd);
+		else
+		    psCloseReceiveFile (ofd, ERR);
+		errMsg = "Cannot start transfer";
+		status = ERR;
+		goto ret_stat;
+	}
 
     } else if (strcasecmp (method, "udt") == 0) {
         void (*func)(void *data) = udtReceiveFile;  /* function to execute  */
 
         udtSpawnThreads (func, nthreads, dir, fileName, fileSize, 
-	    XFER_PUSH, udt_rate, srcPort, srcIP, verbose, tids);
+	    XFER_PUSH, udt_rate, srcPort, srcIP, verbose, grp);
+
+    } else if (strcasecmp (method, "uring") == 0) {
+        void (*func)(void *data) = urReceiveFile;   /* function to execute  */
+
+	if ((ofd = psOpenReceiveFile (dir, fileName, fileSize)) == -1) {
+	    errMsg = "Cannot open output file";
+	    status = ERR;
+	    goto ret_stat;
+	}
+        if (urSpawnTransfer (func, nthreads, dir, fileName, fileSize, 
+	    XFER_PUSH, srcPort, session, dport, srcIP, verbose, ofd, 
+	    grp) != OK) {
+		psCloseReceiveFile (ofd, ERR);
+		errMsg = "Cannot start transfer";
+		status = ERR;
+		goto ret_stat;
+	}
 
     } else {
 	errMsg = "Unknown Transfer Method";
@@ -458,14 +581,25 @@ dts_xferReceiveFile (void *data)
     /* Wait for sending threads to complete.  A failure on any one thread will
     ** force the entire method to fail.
     */
-    if ((tstat = psCollectThreads (nthreads, tids))) {
+    if ((tstat = psCollectThreads (grp))) {
         for (t=0; t < nthreads; t++) {
-            if ( tstat[t] )
+            if ( tstat[t] ) {
                 dtsLog (dts, "%6.6s <  XFER: thread %d error: stat=%d\n", 
 		    dts_queueNameFmt (qname), t, tstat[t]);
+		xstat = ERR;
+	    }
         }
     }
 
+    /*  Flush and close the shared output file, keeping its resume map
+    **  if any stream failed.  A tar stream must have been unpacked whole.
+    */
+    if (stream && dts_tarIsStream (ofd)) {
+	if (dts_tarClose (ofd) != OK)
+	    status = ERR;
+    } else
+	psCloseReceiveFile (ofd, xstat);
+
 
     /*  Update the I/O time counters.
     */
@@ -500,8 +634,7 @@ ret_stat:
     free ((char *) srcIP);
     free ((char *) dir);
 
-    free ((char *) tids);
-    free ((char *) tstat);
+    dts_workFree (grp);
 
     if (dts->debug > 2)
 	fprintf (stderr, "receiveFile: returning status = %d\n", status);
@@ -37,6 +37,7 @@ extern  int   queue_delay;
  *  ****  Queue Methods  ****
  *
  *	initTransfer				dts_hostInitTransfer
+ *						dts_hostInitTransferMD5
  *	endTransfer				dts_hostEndTransfer
  *
  *	queueValid				dts_hostQueueValid
@@ -61,12 +62,40 @@ extern  int   queue_delay;
 int
 dts_hostInitTransfer (char *host, char *qname, char *fname, char *msg)
 {
-    int client = dts_getClient (host), stat = OK;
+    return (dts_hostInitTransferMD5 (host, qname, fname, NULL, msg, NULL));
+}
+
+
+/**
+ *  DTS_HOSTINITTRANSFERMD5 -- See if a queue will accept a new entry, 
+ *  offering the MD5 of the object.  If the queue already holds an object
+ *  with that sum it makes its own copy and sets the 'dup' flag, the data
+ *  then needn't be sent.
+ *
+ *  @brief  See if a queue will accept a new entry, offering its MD5.
+ *  @fn     stat = dts_hostInitTransferMD5 (char *host, char *qname, 
+ *			char *fname, char *md5, char *msg, int *dup)
+ *
+ *  @param  host	host machine name (or IP string)
+ *  @param  qname	name of queue
+ *  @param  fname	name of queue
+ *  @param  md5		MD5 sum of the object (or NULL)
+ *  @param  msg		returned message/path
+ *  @param  dup		set when the queue already has the object
+ *  @return		OK or ERR 
+ */
+int
+dts_hostInitTransferMD5 (char *host, char *qname, char *fname, char *md5,
+			char *msg, int *dup)
+{
+    int client = dts_getClient (host), stat = OK, len = strlen (DTS_DUP_TAG);
     long  size = (long) 0;
 
 
     dts_cmdInit();			/* initialize static variables	*/
 
+    if (dup)
+	*dup = 0;
     if (dts->debug > 2) 
 	dtsLog (dts, "{%s}: InitTransfer: %s:%s", qname, host, fname);
 
@@ -78,16 +107,22 @@ dts_hostInitTransfer (char *host, char *qname, char *fname, char *msg)
 	size = dts_du (fname); 		/* get size (works for dirs too) */
 
 
-    /* Make the service call.
+    /* Make the service call.  The MD5 and name are only sent when we can
+    ** use the answer, older servers only expect the first two params.
     */
     xr_setStringInParam (client, qname);
-    xr_setIntInParam (client, size);
+    xr_setLongLongInParam (client, (long long) size);
+    if (md5 && md5[0] && md5[0] != ' ' && dup) {
+        xr_setStringInParam (client, md5);
+        xr_setStringInParam (client, dts_pathFname (fname));
+    }
 
     if (xr_callSync (client, "initTransfer") == OK) {
         char  *sres = calloc (1, SZ_PATH);
 
 	/* If we got back a path, everything was OK, otherwise the string
-	** is an error message.
+	** is an error message.  A tagged path means the queue already
+	** has the object.
 	*/
         xr_getStringFromResult (client, &sres);
 	stat = ((strncmp (sres, "Error", 5) == 0) ? ERR : OK);
@@ -95,7 +130,11 @@ dts_hostInitTransfer (char *host, char *qname, char *fname, char *msg)
         if (dts->debug > 1)
 	    dtsLog (dts, "dts_hostInitTransfer: (%d) '%s'\n", stat, sres);
 
-	strcpy (msg, sres);
+	if (dup && strncmp (sres, DTS_DUP_TAG, len) == 0) {
+	    *dup = 1;
+	    strcpy (msg, &sres[len]);
+	} else
+	    strcpy (msg, sres);
 	free ((char *) sres);
 
 	dts_closeClient (client);
@@ -197,7 +236,7 @@ dts_hostQueueAccept (char *host, char *qname, char *fname, char *msg)
     /* Make the service call.
     */
     xr_setStringInParam (client, qname);
-    xr_setIntInParam (client, size);
+    xr_setLongLongInParam (client, (long long) size);
 
     if (xr_callSync (client, "queueAccept") == OK) {
         char  *sres = calloc (1, SZ_PATH);
@@ -376,7 +415,7 @@ dts_hostSetQueueControl (char *host, char *qPath, Control *ctrl)
     xr_setStringInParam (client, ctrl->md5);
     xr_setStringInParam (client, ctrl->deliveryName);
     xr_setIntInParam (client, ctrl->isDir);
-    xr_setIntInParam (client, ctrl->fsize);
+    xr_setLongLongInParam (client, (long long) ctrl->fsize);
     xr_setIntInParam (client, ctrl->sum32);
     xr_setIntInParam (client, ctrl->crc32);
     xr_setIntInParam (client, ctrl->epoch);
@@ -22,8 +22,8 @@
 #include <ctype.h>
 #include <stdarg.h>
 
-#include "dtsPSock.h"
 #include "dts.h"
+#include "dtsPSock.h"
 
 
 extern  DTS  *dts;
@@ -23,8 +23,8 @@
 #include <stdarg.h>
 #include <sys/file.h>
 
-#include "dtsPSock.h"
 #include "dts.h"
+#include "dtsPSock.h"
 
 
 extern  DTS  *dts;
@@ -32,8 +32,25 @@ extern  int   dts_monitor;
 
 #define	DEBUG		(dts&&dts->debug)
 
+/*  A destination of a fan-out queue, see dts_queueFanout().
+*/
+typedef struct {
+    dtsQueue   *dtsq;			/* queue			*/
+    Control    *ctrl;			/* spooled object control	*/
+    Control    *qctrl;			/* control sent to the dest	*/
+    char	dest[SZ_FNAME];		/* destination name		*/
+    char       *lpath;			/* local path to the object	*/
+    char	sent[SZ_PATH];		/* marker once delivered	*/
+    int		port;			/* base transfer port		*/
+    int		stat;			/* transfer status		*/
+} fanDest;
+
 static char *intstr (int val);
+static char *longstr (long val);
 static int   strsub (char *in, char *from, char *to, char *outstr, int maxch);
+static void  dts_queueMakeControl (char *qname, char *opath, char *lfname, 
+		char *fname, char *dfname, Control *ctrl);
+static void  dts_queueFanDest (void *data);
 
 
 
@@ -804,7 +821,7 @@ dts_fmtQueueCmd (dtsQueue *dtsq, Control *ctrl)
     (void) strsub (cmd, "$OH", ctrl->queueHost, op, SZ_CMD);
     (void) strcpy (cmd, out); op = out;
 
-    (void) strsub (cmd, "$S", intstr(ctrl->fsize), op, SZ_CMD);
+    (void) strsub (cmd, "$S", longstr(ctrl->fsize), op, SZ_CMD);
     (void) strcpy (cmd, out); op = out;
     (void) strsub (cmd, "$E", intstr((int)ctrl->epoch), op, SZ_CMD);
     (void) strcpy (cmd, out); op = out;
@@ -819,15 +836,18 @@ dts_fmtQueueCmd (dtsQueue *dtsq, Control *ctrl)
  *  DTS_VERIFYDTS -- Verify a DTS queue connection.
  *
  *  @brief	Verify a DTS queue connection.
- *  @fn		char *dts_verifyDTS (char *host, char *qname, char *fname)
+ *  @fn		char *dts_verifyDTS (char *host, char *qname, char *fname,
+ *			char *md5, int *dup)
  *
  *  @param  host	DTS host name
  *  @param  qname	queue name
  *  @param  fname	file name to transfer
+ *  @param  md5		MD5 of the file to offer (or NULL)
+ *  @param  dup		set when the DTS already has the file
  *  @return		remote path to queue directory (caller frees ptr)
  */
 char *
-dts_verifyDTS (char *host, char *qname, char *fname)
+dts_verifyDTS (char *host, char *qname, char *fname, char *md5, int *dup)
 {
     char  queuePath[SZ_PATH], chost[SZ_PATH];
 
@@ -864,7 +884,8 @@ dts_verifyDTS (char *host, char *qname, char *fname)
     if (dts->debug >= 3)
         dtsLog (dts, "....Init xfer 'h=%s  q=%s' ....\n", chost, qname);
         
-    if (dts_hostInitTransfer (chost, qname, fname, queuePath) != OK) {
+    if (dts_hostInitTransferMD5 (chost, qname, fname, md5, queuePath,
+	dup) != OK) {
         dtsLog (dts, "%s\n", queuePath);
         return ((char *) NULL);
     } else if (dts->debug >= 3)
@@ -892,12 +913,37 @@ dts_verifyDTS (char *host, char *qname, char *fname)
  */
 int
 dts_queueProcess (dtsQueue *dtsq, char *lpath, char *rpath, char *fname)
+{
+    return (dts_queueProcessTo (dtsq, dtsq->dest, dtsq->port, lpath, rpath,
+	fname));
+}
+
+
+/**
+ *  DTS_QPROCESSTO -- Process a file to submit it to the named queue on
+ *  the given destination, using the transfer ports from 'port'.
+ *
+ *  @brief	Process a file to submit it to a queue destination.
+ *  @fn		stat = dts_queueProcessTo (dtsQueue *dtsq, char *dest, 
+ *			int port, char *lpath, char *rpath, char *fname)
+ *
+ *  @param  dtsq	DTS queue pointer
+ *  @param  dest	destination name
+ *  @param  port	base transfer port
+ *  @param  lpath	local path
+ *  @param  rpath	remote path
+ *  @param  fname	filename to transfer
+ *  @return		status result
+ */
+int
+dts_queueProcessTo (dtsQueue *dtsq, char *dest, int port, char *lpath, 
+	char *rpath, char *fname)
 {
     //static xferStat  xfs;
     xferStat  xfs;
     char   log_msg[SZ_LINE], dhost[SZ_PATH], *xArgs[2], *dp = NULL, *lp = NULL;
-    int    loPort  = dtsq->port;
-    int    hiPort  = dtsq->port + dtsq->nthreads - 1;
+    int    loPort  = port;
+    int    hiPort  = port + dtsq->nthreads - 1;
     int    ntries = 3, res = OK;
     int    debug = 0, verbose = 0;
 
@@ -912,15 +958,15 @@ dts_queueProcess (dtsQueue *dtsq, char *lpath, char *rpath, char *fname)
     }
 
     memset (dhost, 0, SZ_PATH);
-    if ((dp = dts_resolveHost (dtsq->dest)))
+    if ((dp = dts_resolveHost (dest)))
 	strcpy (dhost, dp);
     else {
-	dtsErrLog (dtsq, "Cannot resolve host '%s'\n", dtsq->dest);
+	dtsErrLog (dtsq, "Cannot resolve host '%s'\n", dest);
 	return (ERR);
     }
 
 
-strcpy (dhost, (dp = dts_getAliasDest (dtsq->dest)));
+strcpy (dhost, (dp = dts_getAliasDest (dest)));
 free ((void *) dp);
     /* Finally, transfer the file.
     */
@@ -1009,8 +1055,8 @@ int
 dts_queueInitControl (char *qhost, char *qname, char *qpath, 
     char *opath, char *lfname, char *fname, char *dfname)
 {
-    char  *md5, chost[SZ_PATH], *cp;
-    unsigned int crc32 = 0, res;
+    char  chost[SZ_PATH], *cp;
+    unsigned int res;
     Control ctrl;
 
 
@@ -1026,31 +1072,7 @@ dts_queueInitControl (char *qhost, char *qname, char *qpath,
 
     /*  Initialize the queue control file on the target machine.
      */
-    memset (&ctrl, 0, sizeof ctrl);
-
-    strcpy (ctrl.queueHost, dts_getLocalHost());
-    strcpy (ctrl.queueName, qname);
-    strcpy (ctrl.filename, dts_pathFname (fname));
-    strcpy (ctrl.xferName, dts_pathFname (lfname));
-    strcpy (ctrl.srcPath, dts_pathDir (lfname));
-    strcpy (ctrl.igstPath, opath);
-    strcpy (ctrl.deliveryName, dfname);
-
-    ctrl.fsize = dts_du (lfname);
-    ctrl.epoch = time (NULL);
-    ctrl.isDir = dts_isDir (lfname);
-
-    if (ctrl.isDir == 1) {
-        ctrl.sum32 = ctrl.crc32 = 0;
-        strcpy (ctrl.md5, " ");
-    } else {
-        if ((md5 = dts_fileMD5 (lfname))) {
-            strcpy (ctrl.md5, md5);
-            free ((void *) md5);
-        }
-        ctrl.sum32 = dts_fileCRCChecksum (lfname, &crc32);
-        ctrl.crc32 = crc32;
-    }
+    dts_queueMakeControl (qname, opath, lfname, fname, dfname, &ctrl);
 
     /*  Call the method.
      */
@@ -1058,6 +1080,146 @@ dts_queueInitControl (char *qhost, char *qname, char *qpath,
 }
 
 
+/**
+ *  DTS_QUEUEDESTLIST -- Get the destinations of a queue.  A fan-out queue
+ *  names several destinations in its 'dest', separated by commas or 
+ *  spaces, other queues have just the one.
+ *
+ *  @brief	Get the destinations of a queue.
+ *  @fn		int dts_queueDestList (dtsQueue *dtsq, char dest[][SZ_FNAME])
+ *
+ *  @param  dtsq	DTS queue pointer
+ *  @param  dest	destination names (MAX_FANOUT), or NULL to count
+ *  @return		number of destinations
+ */
+int
+dts_queueDestList (dtsQueue *dtsq, char dest[][SZ_FNAME])
+{
+    char  *ip = dtsq->dest, *op;
+    char   name[SZ_FNAME];
+    int    ndest = 0;
+
+
+    while (*ip && ndest < MAX_FANOUT) {
+	while (*ip && (*ip == ',' || isspace ((int) *ip)))
+	    ip++;
+	memset ((op = name), 0, SZ_FNAME);
+	while (*ip && *ip != ',' && !isspace ((int) *ip) && 
+	    (op - name) < (SZ_FNAME - 1))
+		*op++ = *ip++;
+
+	if (name[0]) {
+	    if (dest)
+		strcpy (dest[ndest], name);
+	    ndest++;
+	}
+    }
+
+    return (ndest);
+}
+
+
+/**
+ *  DTS_QUEUEFANOUT -- Send a spooled object to each destination of a 
+ *  fan-out queue at once.  The object is read from the spool once into
+ *  a cache shared by the senders (see dtsFanout.c), and each destination
+ *  gets its own block of 'nthreads' transfer ports.  A destination that
+ *  succeeds is marked in the spool dir so a retry after a partial
+ *  failure only resends to those that didn't get it.
+ *
+ *  @brief	Send a spooled object to each destination of a queue.
+ *  @fn		stat = dts_queueFanout (dtsQueue *dtsq, Control *ctrl,
+ *			char *cpath, char *lpath)
+ *
+ *  @param  dtsq	DTS queue pointer
+ *  @param  ctrl	control for the spooled object
+ *  @param  cpath	spool directory of the object
+ *  @param  lpath	local path to the object
+ *  @return		OK if every destination has the object, else ERR
+ */
+int
+dts_queueFanout (dtsQueue *dtsq, Control *ctrl, char *cpath, char *lpath)
+{
+    char    dest[MAX_FANOUT][SZ_FNAME];
+    fanDest fd[MAX_FANOUT];
+    Control qctrl;
+    dtsWorkGroup *grp = (dtsWorkGroup *) NULL;
+    int     queued[MAX_FANOUT];
+    int     i, n, ndest, nsend = 0, handle = -1, stat = OK;
+    long    nread = 0;
+
+
+    if (access (lpath, R_OK) < 0) {
+        dtsLog (dts, "Error: Cannot access '%s'.\n", lpath);
+	return (ERR);
+    }
+    if ((ndest = dts_queueDestList (dtsq, dest)) == 0)
+	return (OK);
+
+    /*  The control (and its checksums) is the same for every destination.
+     */
+    dts_queueMakeControl (dtsq->name, ctrl->igstPath, lpath, ctrl->filename,
+	ctrl->deliveryName, &qctrl);
+
+    memset (fd, 0, sizeof (fd));
+    memset (queued, 0, sizeof (queued));
+    for (i=0; i < ndest; i++) {
+	fd[i].dtsq  = dtsq;
+	fd[i].ctrl  = ctrl;
+	fd[i].qctrl = &qctrl;
+	fd[i].lpath = lpath;
+	fd[i].port  = dtsq->port + (i * dtsq->nthreads);
+	fd[i].stat  = ERR;
+	strcpy (fd[i].dest, dest[i]);
+	snprintf (fd[i].sent, SZ_PATH, "%s/_sent.%s", cpath, dest[i]);
+
+	if (access (fd[i].sent, F_OK) == 0)
+	    fd[i].stat = OK;			/* sent on an earlier try */
+	else
+	    nsend++;
+    }
+    if (nsend == 0)
+	return (OK);
+
+    if (nsend > 1)
+	handle = dts_fanoutOpen (lpath, nsend);
+
+    if (nsend > 1 && (grp = dts_workGroup ())) {
+	for (i=0, n=0; i < ndest; i++) {
+	    if (fd[i].stat != OK && 
+		dts_workSubmit (grp, n, dts_queueFanDest, &fd[i]) == OK)
+		    queued[i] = ++n;
+	}
+	(void) dts_workWait (grp);
+	dts_workFree (grp);
+    }
+
+    /*  Anything we couldn't run in the pool is sent from here.
+     */
+    for (i=0; i < ndest; i++) {
+	if (fd[i].stat != OK && !queued[i])
+	    dts_queueFanDest (&fd[i]);
+    }
+
+    if (handle >= 0)
+	nread = dts_fanoutClose (handle);
+
+    for (i=0; i < ndest; i++) {
+	if (fd[i].stat != OK) {
+            dtsLog (dts, "%6.6s >  FANOUT: %s to %s failed\n", 
+		dts_queueNameFmt (dtsq->name), ctrl->xferName, fd[i].dest);
+	    stat = ERR;
+	}
+    }
+    if (dts->debug > 1 && handle >= 0)
+        dtsLog (dts, "%6.6s >  FANOUT: %s to %d dests, read %ld of %ld\n",
+	    dts_queueNameFmt (dtsq->name), ctrl->xferName, nsend, nread,
+	    (long) nsend * qctrl.fsize);
+
+    return (stat);
+}
+
+
 /**
  *  DTS_QUEUELOCK -- Set the mutex lock on the queue.
  *
@@ -1102,7 +1264,7 @@ dts_queueUnlock (dtsQueue *dtsq)
 char *
 dts_queueFromPath (char *path)
 {
-    static char  qname[SZ_PATH];
+    char  qname[SZ_PATH];
     char  *ip, *op, buf[SZ_PATH], str[SZ_PATH];
     int    len = 0;
 
@@ -1370,3 +1532,113 @@ intstr (int val)
     sprintf (str, "%d", val);
     return ( dts_strbuf (str) );
 }
+
+
+/**
+ *  LONGSTR - Convert a long value to a string.
+ */
+static char *
+longstr (long val)
+{
+    char str[SZ_LINE];
+
+    memset (str, 0, SZ_LINE);
+    sprintf (str, "%ld", val);
+    return ( dts_strbuf (str) );
+}
+
+
+
+/**
+ *  DTS_QUEUEMAKECONTROL -- Fill in the control sent to a destination.
+ */
+static void
+dts_queueMakeControl (char *qname, char *opath, char *lfname, char *fname,
+	char *dfname, Control *ctrl)
+{
+    memset (ctrl, 0, sizeof (Control));
+
+    strcpy (ctrl->queueHost, dts_getLocalHost());
+    strcpy (ctrl->queueName, qname);
+    strcpy (ctrl->filename, dts_pathFname (fname));
+    strcpy (ctrl->xferName, dts_pathFname (lfname));
+    strcpy (ctrl->srcPath, dts_pathDir (lfname));
+    strcpy (ctrl->igstPath, opath);
+    strcpy (ctrl->deliveryName, dfname);
+
+    ctrl->fsize = dts_du (lfname);
+    ctrl->epoch = time (NULL);
+    ctrl->isDir = dts_isDir (lfname);
+
+    /*  An object still arriving on a cut-through queue passes on the size
+     *  and sums it was sent with.
+     */
+    if (ctrl->isDir == 1) {
+        ctrl->sum32 = ctrl->crc32 = 0;
+        strcpy (ctrl->md5, " ");
+    } else if (dts_cutControl (lfname, ctrl) != OK) {
+        dts_fileDigest (lfname, DTS_DIGEST_ALL, &ctrl->sum32, &ctrl->crc32,
+	    ctrl->md5);
+    }
+}
+
+
+/**
+ *  DTS_QUEUEFANDEST -- Send a spooled object to one destination of a
+ *  fan-out queue:  verify the DTS, set the control, transfer the object
+ *  and end the transfer, as the queue manager does for a single dest.
+ */
+static void
+dts_queueFanDest (void *data)
+{
+    fanDest  *fd = (fanDest *) data;
+    dtsQueue *dtsq = fd->dtsq;
+    Control  *ctrl = fd->ctrl;
+    char     *host = dts_getAliasDest (fd->dest), *qpath = NULL;
+    int       i, dup = 0, sfd;
+
+
+    fd->stat = ERR;
+    for (i=3; i && !qpath; i--) {
+	qpath = dts_verifyDTS (host, dtsq->name, fd->lpath,
+	    (dtsq->dedup ? ctrl->md5 : NULL), &dup);
+	if (!qpath) {
+	    dtsLog (dts, "DTS verification failed to '%s'", fd->dest);
+	    if (i > 1)
+	        sleep (2);
+	}
+    }
+    if (!qpath)
+	goto done;
+
+    if (dts_hostSetQueueControl (host, qpath, fd->qctrl) != OK) {
+	dtsLog (dts, "%6.6s >  PROC: Cannot init transfer to %s '%s'\n",
+	    dts_queueNameFmt (dtsq->name), fd->dest, ctrl->xferName);
+	goto done;
+    }
+
+    if (dup)
+	dtsLog (dts, "%6.6s >  PROC: %s already at %s, not sent\n",
+	    dts_queueNameFmt (dtsq->name), ctrl->xferName, fd->dest);
+    else if (dts_queueProcessTo (dtsq, fd->dest, fd->port, ctrl->queuePath,
+	qpath, ctrl->xferName) != OK)
+	    goto done;
+
+    if (dts_hostEndTransfer (host, dtsq->name, qpath) != OK) {
+	dtsLog (dts, "%6.6s >  PROC: Error in endTransfer to %s '%s'\n",
+	    dts_queueNameFmt (dtsq->name), fd->dest, ctrl->xferName);
+	goto done;
+    }
+
+    /*  Mark the destination as done in case we have to resend to others.
+     */
+    if ((sfd = open (fd->sent, O_WRONLY|O_CREAT, DTS_FILE_MODE)) >= 0)
+	close (sfd);
+    fd->stat = OK;
+
+done:
+    if (qpath)
+	free ((void *) qpath);
+    free ((void *) host);
+    dts_workStatus (fd->stat);
+}
@@ -0,0 +1,633 @@
+/**
+ *  DTSRESUME.C -- Resumable PSock transfers.
+ *
+ *  The receiver of a large file keeps a map of which blocks of the file
+ *  it has written in a small file next to it ('<file>.dtsmap').  Should a
+ *  transfer fail, the map and the partial file are left in place.  When
+ *  the transfer is retried, possibly by a restarted daemon on either side,
+ *  the receiver checksums the blocks the map says it has and sends the
+ *  map on each stream before any data.  The sender compares the checksums
+ *  with those of its own copy of each block and the scheduler then skips
+ *  the blocks which match, so only the missing or bad ranges are sent
+ *  again.  The map is removed once the file is complete.
+ *
+ *  For the retry to find the map it must come to the same spool dir.  The
+ *  queue dir of a large object is tagged with the object's name, size and
+ *  MD5 when the transfer is initialized, and a later initTransfer for the
+ *  same object is given back the dir of an attempt that never completed.
+ *  Those left unfinished for PS_MAP_MAXAGE are reaped as we look.
+ *
+ *  Checksums are computed only when resuming, the normal data path just
+ *  counts bytes into each block and records it in the map once complete.
+ *
+ *	map = psMapOpen (path, fsize)
+ *	      psMapAttach (map, fd)
+ *	map = psMapLookup (fd)
+ *	      psMapSend (sock, map)
+ *	      psMapRecv (sock, sched, fd)
+ *	      psMapMark (fd, offset, nbytes)
+ *	      psMapClose (fd, status)
+ *	      psMapTag (qdir, fname, fsize, md5)
+ *	qdir = psMapFind (qname, fname, fsize, md5)
+ *
+ *  @file       dtsResume.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  Resumable PSock transfers.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "dts.h"
+#include "dtsPSock.h"
+
+
+extern  DTS  *dts;
+
+
+static  psMap  *maps[PS_MAX_MAPS];	/* maps of open receive files	*/
+static  pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void psMapFree (psMap *map);
+static int  psMapBusy (struct stat *st);
+static unsigned int psMapSum (int fd, unsigned char *buf, psMapHdr *hdr,
+		int blk, int *stat);
+
+
+
+/**
+ *  PSMAPOPEN -- Open the resume map for a file we're about to receive.  A
+ *  map left by an earlier attempt is loaded if it describes a file of the
+ *  same size, otherwise a new (empty) map is created.  Small files aren't
+ *  worth resuming and get no map.
+ *
+ *  @brief  Open the resume map for a receive file
+ *  @fn     psMap *psMapOpen (char *path, long fsize)
+ *
+ *  @param  path	path to the receive file
+ *  @param  fsize	file size
+ *  @return		map (ndone > 0 when resuming), or NULL
+ */
+psMap *
+psMapOpen (char *path, long fsize)
+{
+    psMap  *map = (psMap *) NULL;
+    psMapHdr hdr;
+    size_t  nb;
+    int     i;
+
+
+    if (fsize < PS_MAP_MIN || strlen (path) >= (SZ_PATH - 8))
+	return ((psMap *) NULL);
+
+    if ((map = (psMap *) calloc (1, sizeof (psMap))) == NULL)
+	return ((psMap *) NULL);
+    sprintf (map->path, "%s.dtsmap", path);
+    map->fd = -1;
+
+    map->hdr.magic   = PS_MAP_MAGIC;
+    map->hdr.fsize   = fsize;
+    map->hdr.block   = PS_MAP_BLOCK;
+    map->hdr.nblocks = (int) ((fsize + PS_MAP_BLOCK - 1) / PS_MAP_BLOCK);
+    nb = map->hdr.nblocks * sizeof (psMapEnt);
+
+    map->ent   = (psMapEnt *) calloc (map->hdr.nblocks, sizeof (psMapEnt));
+    map->nrecv = (long *) calloc (map->hdr.nblocks, sizeof (long));
+    if (!map->ent || !map->nrecv ||
+	(map->mfd = open (map->path, O_RDWR|O_CREAT, DTS_FILE_MODE)) < 0) {
+	    dtsErrLog (NULL, "psMapOpen: cannot open '%s'\n", map->path);
+	    psMapFree (map);
+	    return ((psMap *) NULL);
+    }
+
+    /*  Use what an earlier attempt left us if it's for the same file.
+    */
+    if (pread (map->mfd, &hdr, sizeof (hdr), (off_t) 0) == sizeof (hdr) &&
+	hdr.magic == map->hdr.magic && hdr.fsize == map->hdr.fsize &&
+	hdr.block == map->hdr.block && hdr.nblocks == map->hdr.nblocks &&
+	pread (map->mfd, map->ent, nb, (off_t) sizeof (hdr)) == nb) {
+	    for (i=0; i < map->hdr.nblocks; i++)
+		map->ndone += (map->ent[i].done != 0);
+
+    } else {
+	memset (map->ent, 0, nb);
+	if (ftruncate (map->mfd, (off_t) 0) < 0 ||
+	    pwrite (map->mfd, &map->hdr, sizeof (hdr), (off_t) 0) !=
+		sizeof (hdr) ||
+	    pwrite (map->mfd, map->ent, nb, (off_t) sizeof (hdr)) != nb) {
+		dtsErrLog (NULL, "psMapOpen: cannot write '%s'\n", map->path);
+		psMapFree (map);
+		return ((psMap *) NULL);
+	}
+    }
+    pthread_mutex_init (&map->mutex, NULL);
+
+    if (PTCP_VERB || map->ndone)
+	dtsErrLog (NULL, "psMapOpen: %s has %d of %d blocks\n", path,
+	    map->ndone, map->hdr.nblocks);
+
+    return (map);
+}
+
+
+/**
+ *  PSMAPATTACH -- Attach a map to the open receive file.  When resuming,
+ *  the blocks we have are checksummed so the sender can check them, a
+ *  block we can't read or whose checksum no longer matches the one we
+ *  recorded is simply marked as missing.
+ *
+ *  @brief  Attach a map to the open receive file
+ *  @fn     int psMapAttach (psMap *map, int fd)
+ *
+ *  @param  map		resume map
+ *  @param  fd		receive file descriptor
+ *  @return		OK or ERR (the map is freed on error)
+ */
+int
+psMapAttach (psMap *map, int fd)
+{
+    unsigned char *buf = (unsigned char *) NULL;
+    unsigned int sum;
+    int   i, stat = OK, slot = -1;
+
+
+    if (map->ndone > 0) {
+	if (posix_memalign ((void **) &buf, DIO_ALIGN, map->hdr.block)) {
+	    psMapFree (map);
+	    return (ERR);
+	}
+	for (i=0; i < map->hdr.nblocks; i++) {
+	    if (!map->ent[i].done)
+		continue;
+	    sum = psMapSum (fd, buf, &map->hdr, i, &stat);
+	    if (stat != OK ||
+		(map->ent[i].sum32 != 0 && map->ent[i].sum32 != sum)) {
+		    map->ent[i].done = 0;
+		    map->ndone--;
+	    }
+	    map->ent[i].sum32 = (map->ent[i].done ? sum : 0);
+	}
+	free ((void *) buf);
+	pwrite (map->mfd, map->ent, map->hdr.nblocks * sizeof (psMapEnt),
+	    (off_t) sizeof (psMapHdr));
+    }
+
+    pthread_mutex_lock (&map_mutex);
+    for (i=0; i < PS_MAX_MAPS; i++) {
+	if (!maps[i]) {
+	    slot = i;
+	    break;
+	}
+    }
+    if (slot >= 0) {
+	map->fd = fd;
+	maps[slot] = map;
+    }
+    pthread_mutex_unlock (&map_mutex);
+
+    if (slot < 0) {
+	dtsErrLog (NULL, "psMapAttach: too many open maps\n");
+	psMapFree (map);
+	return (ERR);
+    }
+    return (OK);
+}
+
+
+/**
+ *  PSMAPLOOKUP -- Find the map attached to a receive file.
+ *
+ *  @brief  Find the map attached to a receive file
+ *  @fn     psMap *psMapLookup (int fd)
+ *
+ *  @param  fd		receive file descriptor
+ *  @return		map, or NULL if the file has none
+ */
+psMap *
+psMapLookup (int fd)
+{
+    psMap *map = (psMap *) NULL;
+    int    i;
+
+
+    if (fd < 0)
+	return ((psMap *) NULL);
+
+    pthread_mutex_lock (&map_mutex);
+    for (i=0; i < PS_MAX_MAPS; i++) {
+	if (maps[i] && maps[i]->fd == fd) {
+	    map = maps[i];
+	    break;
+	}
+    }
+    pthread_mutex_unlock (&map_mutex);
+
+    return (map);
+}
+
+
+/**
+ *  PSMAPSEND -- Send the map to the sender at the start of a stream.  A
+ *  file with no map sends an empty one so the sender sends everything.
+ *
+ *  @brief  Send the map at the start of a stream
+ *  @fn     int psMapSend (int sock, psMap *map)
+ *
+ *  @param  sock	socket descriptor
+ *  @param  map		resume map (or NULL)
+ *  @return		OK or ERR
+ */
+int
+psMapSend (int sock, psMap *map)
+{
+    phdr  op;
+    int   stat = OK, nb;
+
+
+    memset (&op, 0, sizeof (op));
+    op.chunkSize = PS_MAP;
+
+    if (!map || map->ndone <= 0)
+	return (dts_sockWrite (sock, &op, sizeof (op)) < 0 ? ERR : OK);
+
+    pthread_mutex_lock (&map->mutex);
+    op.offset   = map->hdr.block;
+    op.maxbytes = map->hdr.nblocks;
+    nb = map->hdr.nblocks * sizeof (psMapEnt);
+    if (dts_sockWrite (sock, &op, sizeof (op)) < 0 ||
+	dts_sockWrite (sock, map->ent, nb) != nb)
+	    stat = ERR;
+    pthread_mutex_unlock (&map->mutex);
+
+    return (stat);
+}
+
+
+/**
+ *  PSMAPRECV -- Read the receiver's map at the start of a stream.  The
+ *  first stream to get it checks the receiver's checksums against our
+ *  own copy of the file and tells the scheduler which blocks to skip,
+ *  the others just discard their copy.  All streams wait for this before
+ *  taking any work.
+ *
+ *  @brief  Read the receiver's map at the start of a stream
+ *  @fn     int psMapRecv (int sock, psSched *sched, int fd)
+ *
+ *  @param  sock	socket descriptor
+ *  @param  sched	work unit scheduler
+ *  @param  fd		input file descriptor
+ *  @return		OK or ERR
+ */
+int
+psMapRecv (int sock, psSched *sched, int fd)
+{
+    psMapEnt *ent = (psMapEnt *) NULL;
+    psMapHdr  hdr;
+    unsigned char *buf = (unsigned char *) NULL;
+    int   i, stat = OK, nb, nskip = 0;
+    phdr  ip;
+
+
+    memset (&ip, 0, sizeof (ip));
+    if (dts_sockRead (sock, &ip, sizeof (ip)) != sizeof (ip) ||
+	ip.chunkSize != PS_MAP) {
+	    dtsErrLog (NULL, "psMapRecv: no map from receiver\n");
+	    return (ERR);
+    }
+    if (ip.maxbytes <= 0)
+	return (OK);				/* nothing to resume	*/
+
+    memset (&hdr, 0, sizeof (hdr));
+    hdr.fsize   = sched->fsize;
+    hdr.block   = ip.offset;
+    hdr.nblocks = (int) ip.maxbytes;
+    if (hdr.block <= 0 || hdr.block > TUNE_MAX_BUF ||
+	hdr.nblocks != (int) ((hdr.fsize + hdr.block - 1) / hdr.block)) {
+	    dtsErrLog (NULL, "psMapRecv: bad map  block=%ld nblocks=%d\n",
+		hdr.block, hdr.nblocks);
+	    return (ERR);
+    }
+
+    nb = hdr.nblocks * sizeof (psMapEnt);
+    if ((ent = (psMapEnt *) calloc (1, nb)) == NULL)
+	return (ERR);
+    if (dts_sockRead (sock, ent, nb) != nb) {
+	free ((void *) ent);
+	return (ERR);
+    }
+
+    pthread_mutex_lock (&sched->mutex);
+    if (!sched->skip && posix_memalign ((void **) &buf, DIO_ALIGN,
+	hdr.block) == 0) {
+	    sched->skip = (unsigned char *) calloc (1, hdr.nblocks);
+	    for (i=0; sched->skip && i < hdr.nblocks; i++) {
+		if (ent[i].done && psMapSum (fd, buf, &hdr, i, &stat) ==
+		    ent[i].sum32 && stat == OK) {
+			sched->skip[i] = 1;
+			nskip++;
+		}
+	    }
+	    sched->block   = hdr.block;
+	    sched->nblocks = hdr.nblocks;
+	    free ((void *) buf);
+
+	    dtsErrLog (NULL, "psMapRecv: resuming, %d of %d blocks to send\n",
+		hdr.nblocks - nskip, hdr.nblocks);
+    }
+    pthread_mutex_unlock (&sched->mutex);
+
+    free ((void *) ent);
+    return (OK);
+}
+
+
+/**
+ *  PSMAPMARK -- Count a received range into the map.  A block is recorded
+ *  as done once all its bytes have arrived in this attempt.
+ *
+ *  @brief  Count a received range into the map
+ *  @fn     void psMapMark (int fd, long offset, long nbytes)
+ *
+ *  @param  fd		receive file descriptor
+ *  @param  offset	file offset of the range
+ *  @param  nbytes	size of the range
+ *  @return		nothing
+ */
+void
+psMapMark (int fd, long offset, long nbytes)
+{
+    psMap *map = psMapLookup (fd);
+    long   b, lo, hi, blen, block;
+
+
+    if (!map || nbytes <= 0)
+	return;
+
+    block = map->hdr.block;
+    pthread_mutex_lock (&map->mutex);
+    for (b = offset / block; b <= (offset + nbytes - 1) / block &&
+	b < map->hdr.nblocks; b++) {
+	    lo   = max (offset, b * block);
+	    hi   = min (offset + nbytes, (b + 1) * block);
+	    blen = min (block, map->hdr.fsize - b * block);
+
+	    if ((map->nrecv[b] += (hi - lo)) >= blen) {
+		map->ent[b].done  = 1;
+		map->ent[b].sum32 = 0;
+		pwrite (map->mfd, &map->ent[b], sizeof (psMapEnt),
+		    (off_t) (sizeof (psMapHdr) + b * sizeof (psMapEnt)));
+	    }
+    }
+    pthread_mutex_unlock (&map->mutex);
+}
+
+
+/**
+ *  PSMAPCLOSE -- Detach the map from a receive file.  Once the file is
+ *  complete the map is removed, otherwise it's kept for the next attempt.
+ *
+ *  @brief  Detach the map from a receive file
+ *  @fn     void psMapClose (int fd, int status)
+ *
+ *  @param  fd		receive file descriptor
+ *  @param  status	transfer status
+ *  @return		nothing
+ */
+void
+psMapClose (int fd, int status)
+{
+    psMap *map = (psMap *) NULL;
+    int    i;
+
+
+    pthread_mutex_lock (&map_mutex);
+    for (i=0; fd >= 0 && i < PS_MAX_MAPS; i++) {
+	if (maps[i] && maps[i]->fd == fd) {
+	    map = maps[i];
+	    maps[i] = (psMap *) NULL;
+	    break;
+	}
+    }
+    pthread_mutex_unlock (&map_mutex);
+
+    if (!map)
+	return;
+
+    if (status == OK)
+	unlink (map->path);
+    else
+	fsync (map->mfd);
+    pthread_mutex_destroy (&map->mutex);
+    psMapFree (map);
+}
+
+
+/**
+ *  PSMAPTAG -- Tag a new queue dir with the object we're about to receive
+ *  into it, so a retry of a failed transfer may find it (see psMapFind).
+ *  Objects too small to have a map aren't tagged.
+ *
+ *  @brief  Tag a queue dir with the object it receives
+ *  @fn     int psMapTag (char *qdir, char *fname, long fsize, char *md5)
+ *
+ *  @param  qdir	queue dir (e.g. 'spool/<qname>/<n>/')
+ *  @param  fname	object file name
+ *  @param  fsize	object size
+ *  @param  md5		object MD5
+ *  @return		OK or ERR
+ */
+int
+psMapTag (char *qdir, char *fname, long fsize, char *md5)
+{
+    char  path[SZ_PATH], *qp = (char *) NULL;
+    FILE *fp = (FILE *) NULL;
+
+
+    if (fsize < PS_MAP_MIN || !md5 || !md5[0] || !fname || !fname[0] ||
+	strchr (fname, (int) '/'))
+	    return (ERR);
+
+    qp = dts_sandboxPath (qdir);
+    memset (path, 0, SZ_PATH);
+    snprintf (path, SZ_PATH-1, "%s/_resume", qp);
+    free ((void *) qp);
+
+    if ((fp = fopen (path, "w")) == (FILE *) NULL) {
+	dtsErrLog (NULL, "psMapTag: cannot write '%s'\n", path);
+	return (ERR);
+    }
+    fprintf (fp, "%s %ld %s\n", md5, fsize, fname);
+    fclose (fp);
+
+    return (OK);
+}
+
+
+/**
+ *  PSMAPFIND -- Find the queue dir of an earlier attempt to send us an
+ *  object which never completed, i.e. one tagged for the same object that
+ *  still holds the file's map and the dir lock.  A dir we're receiving
+ *  into right now is skipped.  Unfinished dirs whose map hasn't been
+ *  touched for PS_MAP_MAXAGE are deleted as we go.
+ *
+ *  @brief  Find the queue dir of an unfinished transfer
+ *  @fn     char *psMapFind (char *qname, char *fname, long fsize, 
+ *		char *md5)
+ *
+ *  @param  qname	queue name
+ *  @param  fname	object file name
+ *  @param  fsize	object size
+ *  @param  md5		object MD5
+ *  @return		queue dir ('spool/<qname>/<n>/'), or NULL
+ */
+char *
+psMapFind (char *qname, char *fname, long fsize, char *md5)
+{
+    char   qdir[SZ_PATH], path[SZ_LINE], line[SZ_LINE];
+    char   tmd5[SZ_LINE], tname[SZ_LINE], *sp = (char *) NULL;
+    char  *found = (char *) NULL;
+    long   tsize = 0;
+    time_t now = time ((time_t) 0);
+    struct stat st;
+    struct dirent *de;
+    DIR   *dp = (DIR *) NULL;
+    FILE  *fp = (FILE *) NULL;
+
+
+    if (fsize < PS_MAP_MIN || !md5 || !md5[0] || !fname || !fname[0])
+	return ((char *) NULL);
+
+    memset (qdir, 0, SZ_PATH);
+    snprintf (qdir, SZ_PATH-1, "spool/%s/", qname);
+    sp = dts_sandboxPath (qdir);
+    if ((dp = opendir (sp)) == (DIR *) NULL) {
+	free ((void *) sp);
+	return ((char *) NULL);
+    }
+
+    while ((de = readdir (dp))) {
+	if (!isdigit ((int) de->d_name[0]))
+	    continue;
+
+	/*  Only dirs tagged for a resumable object are of interest.
+	*/
+	memset (path, 0, SZ_LINE);
+	snprintf (path, SZ_LINE-1, "%s/%s/_resume", sp, de->d_name);
+	if ((fp = fopen (path, "r")) == (FILE *) NULL)
+	    continue;
+	memset (line, 0, SZ_LINE);
+	tmd5[0] = tname[0] = '\0';
+	if (fgets (line, SZ_LINE, fp) == NULL ||
+	    sscanf (line, "%s %ld %s", tmd5, &tsize, tname) != 3 ||
+	    strchr (tname, (int) '/')) {
+		fclose (fp);
+		continue;
+	}
+	fclose (fp);
+
+	/*  A dir without the map or lock was completed, or never started.
+	*/
+	snprintf (path, SZ_LINE-1, "%s/%s/_lock", sp, de->d_name);
+	if (access (path, F_OK) != 0)
+	    continue;
+	snprintf (path, SZ_LINE-1, "%s/%s/%s.dtsmap", sp, de->d_name, tname);
+	if (stat (path, &st) != 0 || psMapBusy (&st))
+	    continue;
+
+	if ((now - st.st_mtime) > PS_MAP_MAXAGE) {
+	    snprintf (path, SZ_LINE-1, "%s/%s", sp, de->d_name);
+	    dtsLog (dts, "%6.6s <  XFER: reaping unfinished %s/%s", 
+		dts_queueNameFmt (qname), path, tname);
+	    dts_queueDelete (dts, path);
+	    continue;
+	}
+
+	if (!found && tsize == fsize && strcmp (tmd5, md5) == 0 &&
+	    strcmp (tname, fname) == 0) {
+		snprintf (path, SZ_LINE-1, "%s%s/", qdir, de->d_name);
+		found = dts_strbuf (path);
+	}
+    }
+    closedir (dp);
+    free ((void *) sp);
+
+    return (found);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ *****************************************************************************/
+
+/**
+ *  PSMAPFREE -- Close the map file and free the map.
+ */
+static void
+psMapFree (psMap *map)
+{
+    if (map->mfd > 0)
+	close (map->mfd);
+    if (map->ent)
+	free ((void *) map->ent);
+    if (map->nrecv)
+	free ((void *) map->nrecv);
+    free ((void *) map);
+}
+
+
+/**
+ *  PSMAPBUSY -- See whether a map file is that of a file being received.
+ */
+static int
+psMapBusy (struct stat *st)
+{
+    struct stat mst;
+    int    i, busy = 0;
+
+
+    pthread_mutex_lock (&map_mutex);
+    for (i=0; i < PS_MAX_MAPS && !busy; i++) {
+	if (maps[i] && fstat (maps[i]->mfd, &mst) == 0 &&
+	    mst.st_dev == st->st_dev && mst.st_ino == st->st_ino)
+		busy++;
+    }
+    pthread_mutex_unlock (&map_mutex);
+
+    return (busy);
+}
+
+
+/**
+ *  PSMAPSUM -- Checksum one block of the file.
+ */
+static unsigned int
+psMapSum (int fd, unsigned char *buf, psMapHdr *hdr, int blk, int *stat)
+{
+    long  off = (long) blk * hdr->block;
+    int   len = (int) min (hdr->block, hdr->fsize - off);
+
+
+    if (dts_filePRead (fd, buf, len, (off_t) off) != len) {
+	*stat = ERR;
+	return (0);
+    }
+    *stat = OK;
+    return (dts_memCRC32 (buf, (size_t) len));
+}
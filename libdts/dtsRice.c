@@ -0,0 +1,510 @@
+/**
+ *  DTSRICE.C -- Rice compression of FITS integer images in transit.
+ *
+ *  Most of what we move is uncompressed integer FITS straight from the
+ *  cameras.  A queue with 'compress = rice' has the PSock sender code the
+ *  chunks lying within an integer image HDU with the Rice algorithm used
+ *  by fpack (first differences in blocks of 32 pixels, each block coded
+ *  with the split size best suited to it), and the receiver decodes them
+ *  before they're written.  Coding is lossless on the raw big-endian
+ *  words, so the delivered file is byte-identical to the original and
+ *  the usual checksums still apply.
+ *
+ *	 nimg = dts_fitsImages (fd, fsize, img, maximg)
+ *	 nout = dts_riceEncode (in, nbytes, out, maxout, bytepix)
+ *	   nb = dts_riceDecode (in, nin, out, nbytes, bytepix)
+ *
+ *  @file       dtsRice.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  Rice compression of FITS integer images in transit.
+ */
+
+
+/*****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dts.h"
+
+
+/*  Bit stream for the Rice coder.  Bits are packed most significant bit
+**  first and never more than 24 are added or taken at once, so the
+**  accumulator fits in 32 bits.
+*/
+typedef struct {
+    unsigned char *p;			/* next byte			*/
+    unsigned char *end;			/* end of the buffer		*/
+    unsigned int   acc;			/* bit accumulator		*/
+    int            nbits;		/* bits in the accumulator	*/
+} riceBits;
+
+static int  rice_put (riceBits *b, unsigned int val, int nbits);
+static int  rice_get (riceBits *b, int nbits, unsigned int *val);
+static int  rice_putBits (riceBits *b, unsigned int val, int nbits);
+static int  rice_getBits (riceBits *b, int nbits, unsigned int *val);
+static int  rice_getTop (riceBits *b, long *top);
+static unsigned int rice_word (unsigned char *p, int bytepix);
+static void rice_setWord (unsigned char *p, unsigned int val, int bytepix);
+static long fits_keyval (char *card);
+static char *fits_keystr (char *card);
+
+
+
+
+/**
+ *  DTS_FITSIMAGES -- Find the integer image data in a FITS file.  The
+ *  headers of each HDU are read in turn and the data of the primary array
+ *  and IMAGE extensions with an 8, 16 or 32-bit integer BITPIX are noted.
+ *  A file which isn't FITS has no images.
+ *
+ *  @brief  Find the integer image data in a FITS file
+ *  @fn     int dts_fitsImages (int fd, long fsize, dtsFitsImg *img,
+ *			int maximg)
+ *
+ *  @param  fd		file descriptor
+ *  @param  fsize	file size
+ *  @param  img		image data ranges (output)
+ *  @param  maximg	max ranges to return
+ *  @return		number of images found
+ */
+int
+dts_fitsImages (int fd, long fsize, dtsFitsImg *img, int maximg)
+{
+    char   blk[FITS_BLOCK+1], *card;
+    long   off = 0, naxis = 0, pcount = 0, gcount = 1, npix = 1, dsize;
+    int    bitpix = 0, image = 0, end = 0, nimg = 0, nhdu = 0, i;
+
+
+    while (off + FITS_BLOCK <= fsize && nimg < maximg &&
+	nhdu < FITS_MAX_HDU) {
+
+	/*  Read the header of the next HDU.
+	*/
+	bitpix = end = 0;
+	naxis = pcount = 0;
+	gcount = npix = 1;
+	for (image = -1; !end && off + FITS_BLOCK <= fsize; off += FITS_BLOCK) {
+	    if (dts_filePRead (fd, blk, FITS_BLOCK, (off_t) off) != FITS_BLOCK)
+		return (nimg);
+
+	    for (i=0; i < FITS_BLOCK && !end; i += FITS_CARD) {
+		card = &blk[i];
+		if (image < 0) {		/* first card of the HDU   */
+		    if (nhdu == 0 && strncmp (card, "SIMPLE  =", 9) == 0)
+			image = 1;
+		    else if (nhdu > 0 && strncmp (card, "XTENSION=", 9) == 0)
+			image = (strncmp (fits_keystr (card), "'IMAGE ", 7) == 0);
+		    else
+			return (nimg);		/* not FITS, or junk	   */
+
+		} else if (strncmp (card, "BITPIX  =", 9) == 0) {
+		    bitpix = (int) fits_keyval (card);
+		} else if (strncmp (card, "NAXIS   =", 9) == 0) {
+		    naxis = fits_keyval (card);
+		    npix = (naxis > 0);
+		} else if (strncmp (card, "NAXIS", 5) == 0 && card[8] == '=') {
+		    npix *= fits_keyval (card);
+		} else if (strncmp (card, "PCOUNT  =", 9) == 0) {
+		    pcount = fits_keyval (card);
+		} else if (strncmp (card, "GCOUNT  =", 9) == 0) {
+		    gcount = fits_keyval (card);
+		} else if (strncmp (card, "END     ", 8) == 0) {
+		    end = 1;
+		}
+	    }
+	}
+	if (!end || bitpix == 0 || npix < 0 || pcount < 0 || gcount < 0)
+	    return (nimg);
+
+	/*  Note the data if it's an integer image, then skip to the next
+	**  HDU past the padding.
+	*/
+	dsize = (abs (bitpix) / 8) * gcount * (pcount + npix);
+	if (image && naxis > 0 && dsize > 0 && off + dsize <= fsize &&
+	    (bitpix == 8 || bitpix == 16 || bitpix == 32)) {
+		img[nimg].start   = off;
+		img[nimg].nbytes  = dsize;
+		img[nimg].bytepix = bitpix / 8;
+		nimg++;
+	}
+	off += ((dsize + FITS_BLOCK - 1) / FITS_BLOCK) * FITS_BLOCK;
+	nhdu++;
+    }
+
+    return (nimg);
+}
+
+
+/**
+ *  DTS_RICEENCODE -- Rice code a buffer of big-endian integer pixels.  The
+ *  first pixel is written as is, followed by blocks of RICE_NBLOCK pixel
+ *  differences.  Each block starts with a code giving the number of low
+ *  bits ('fs') sent as is for each difference, the high bits being sent
+ *  in unary.  Code 0 means all differences are zero and the largest code
+ *  means the block is sent uncoded.  Any bytes left over after the last
+ *  whole pixel follow the coded data.
+ *
+ *  @brief  Rice code a buffer of integer pixels
+ *  @fn     long dts_riceEncode (unsigned char *in, long nbytes,
+ *			unsigned char *out, long maxout, int bytepix)
+ *
+ *  @param  in		input pixels
+ *  @param  nbytes	size of the input
+ *  @param  out		output buffer
+ *  @param  maxout	size of the output buffer
+ *  @param  bytepix	bytes per pixel (1, 2 or 4)
+ *  @return		size of the coded data, or -1 if it won't fit
+ */
+long
+dts_riceEncode (unsigned char *in, long nbytes, unsigned char *out,
+		long maxout, int bytepix)
+{
+    riceBits b;
+    unsigned int diff[RICE_NBLOCK], mask, v, d, last, top, psum;
+    int    bbits = bytepix * 8, fsbits, fsmax, fs, nb, j;
+    long   npix = nbytes / bytepix, tail = nbytes % bytepix, i;
+    double pixsum, dpsum;
+
+
+    if (npix <= 0 || (bytepix != 1 && bytepix != 2 && bytepix != 4))
+	return (-1);
+
+    fsbits = (bytepix == 4 ? 5 : (bytepix == 2 ? 4 : 3));
+    fsmax  = (bytepix == 4 ? 25 : (bytepix == 2 ? 14 : 6));
+    mask   = (bytepix == 4 ? 0xffffffff : ((1U << bbits) - 1));
+
+    b.p = out;
+    b.end = out + maxout - tail;
+    b.acc = 0;
+    b.nbits = 0;
+
+    last = rice_word (in, bytepix);
+    if (rice_putBits (&b, last, bbits) != OK)
+	return (-1);
+
+    for (i=0; i < npix; i += RICE_NBLOCK) {
+	nb = (int) min (RICE_NBLOCK, npix - i);
+
+	/*  Map the differences to unsigned values, interleaving positive
+	**  and negative, and pick the split for the block from their mean.
+	*/
+	pixsum = 0.0;
+	for (j=0; j < nb; j++) {
+	    v = rice_word (&in[(i + j) * bytepix], bytepix);
+	    d = (v - last) & mask;
+	    last = v;
+	    diff[j] = ((d << 1) ^ (0 - (d >> (bbits - 1)))) & mask;
+	    pixsum += diff[j];
+	}
+	dpsum = (pixsum - (nb / 2) - 1) / nb;
+	psum = (dpsum < 0.0 ? 0 : ((unsigned int) dpsum) >> 1);
+	for (fs=0; psum > 0; fs++)
+	    psum >>= 1;
+
+	if (fs >= fsmax) {
+	    if (rice_put (&b, fsmax + 1, fsbits) != OK)
+		return (-1);
+	    for (j=0; j < nb; j++)
+		if (rice_putBits (&b, diff[j], bbits) != OK)
+		    return (-1);
+
+	} else if (fs == 0 && pixsum == 0.0) {
+	    if (rice_put (&b, 0, fsbits) != OK)
+		return (-1);
+
+	} else {
+	    if (rice_put (&b, fs + 1, fsbits) != OK)
+		return (-1);
+	    for (j=0; j < nb; j++) {
+		top = diff[j] >> fs;
+		if (top + 1 + fs <= 24) {	/* the usual case	*/
+		    if (rice_put (&b, (1U << fs) | (diff[j] & ((1U << fs) - 1)),
+			top + 1 + fs) != OK)
+			    return (-1);
+		    continue;
+		}
+		if ((long) top >= (b.end - b.p) * 8)
+		    return (-1);
+		for ( ; top >= 16; top -= 16)
+		    if (rice_put (&b, 0, 16) != OK)
+			return (-1);
+		if (rice_put (&b, 1, top + 1) != OK)
+		    return (-1);
+		if (fs > 0 && rice_putBits (&b, diff[j], fs) != OK)
+		    return (-1);
+	    }
+	}
+    }
+
+    /*  Flush the last partial byte and append the leftover bytes.
+    */
+    if (b.nbits > 0) {
+	if (b.p >= b.end)
+	    return (-1);
+	*b.p++ = (unsigned char) (b.acc << (8 - b.nbits));
+    }
+    memcpy (b.p, &in[npix * bytepix], tail);
+
+    return ((long) (b.p - out) + tail);
+}
+
+
+/**
+ *  DTS_RICEDECODE -- Decode a buffer coded by dts_riceEncode().  The size
+ *  of the decoded data must be known.
+ *
+ *  @brief  Decode a Rice coded buffer
+ *  @fn     long dts_riceDecode (unsigned char *in, long nin,
+ *			unsigned char *out, long nbytes, int bytepix)
+ *
+ *  @param  in		coded data
+ *  @param  nin		size of the coded data
+ *  @param  out		output pixels
+ *  @param  nbytes	size of the output
+ *  @param  bytepix	bytes per pixel (1, 2 or 4)
+ *  @return		nbytes, or -1 if the data are bad
+ */
+long
+dts_riceDecode (unsigned char *in, long nin, unsigned char *out,
+		long nbytes, int bytepix)
+{
+    riceBits b;
+    unsigned int mask, code, last, z, bit = 0;
+    int    bbits = bytepix * 8, fsbits, fsmax, fs, nb, j;
+    long   npix = nbytes / bytepix, tail = nbytes % bytepix, i, top;
+
+
+    if (npix <= 0 || (bytepix != 1 && bytepix != 2 && bytepix != 4))
+	return (-1);
+
+    fsbits = (bytepix == 4 ? 5 : (bytepix == 2 ? 4 : 3));
+    fsmax  = (bytepix == 4 ? 25 : (bytepix == 2 ? 14 : 6));
+    mask   = (bytepix == 4 ? 0xffffffff : ((1U << bbits) - 1));
+
+    b.p = in;
+    b.end = in + nin - tail;
+    b.acc = 0;
+    b.nbits = 0;
+
+    if (rice_getBits (&b, bbits, &last) != OK)
+	return (-1);
+
+    for (i=0; i < npix; i += RICE_NBLOCK) {
+	nb = (int) min (RICE_NBLOCK, npix - i);
+	if (rice_get (&b, fsbits, &code) != OK || (int) code > fsmax + 1)
+	    return (-1);
+	fs = (int) code - 1;
+
+	for (j=0; j < nb; j++) {
+	    if (code == 0) {			/* all zero		*/
+		z = 0;
+
+	    } else if ((int) code == fsmax + 1) {	/* uncoded	*/
+		if (rice_getBits (&b, bbits, &z) != OK)
+		    return (-1);
+
+	    } else {
+		if (rice_getTop (&b, &top) != OK || top > (long) (mask >> fs))
+		    return (-1);
+		z = (unsigned int) top << fs;
+		if (fs > 0) {
+		    if (rice_getBits (&b, fs, &bit) != OK)
+			return (-1);
+		    z |= bit;
+		}
+	    }
+
+	    last = (last + ((z >> 1) ^ (0 - (z & 1)))) & mask;
+	    rice_setWord (&out[(i + j) * bytepix], last, bytepix);
+	}
+    }
+
+    /*  What's left after the last partial byte are the leftover bytes.
+    */
+    if (b.p != b.end)
+	return (-1);
+    memcpy (&out[npix * bytepix], b.p, tail);
+
+    return (nbytes);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ *****************************************************************************/
+
+/**
+ *  RICE_PUT -- Add up to 24 bits to the stream.
+ */
+static int
+rice_put (riceBits *b, unsigned int val, int nbits)
+{
+    b->acc = (b->acc << nbits) | (val & ((1U << nbits) - 1));
+    b->nbits += nbits;
+
+    while (b->nbits >= 8) {
+	if (b->p >= b->end)
+	    return (ERR);
+	b->nbits -= 8;
+	*b->p++ = (unsigned char) (b->acc >> b->nbits);
+    }
+    b->acc &= ((1U << b->nbits) - 1);
+
+    return (OK);
+}
+
+
+/**
+ *  RICE_GET -- Take up to 24 bits from the stream.
+ */
+static int
+rice_get (riceBits *b, int nbits, unsigned int *val)
+{
+    while (b->nbits < nbits) {
+	if (b->p >= b->end)
+	    return (ERR);
+	b->acc = (b->acc << 8) | *b->p++;
+	b->nbits += 8;
+    }
+    b->nbits -= nbits;
+    *val = (b->acc >> b->nbits) & ((1U << nbits) - 1);
+    b->acc &= ((1U << b->nbits) - 1);
+
+    return (OK);
+}
+
+
+/**
+ *  RICE_PUTBITS -- Add up to 32 bits to the stream.
+ */
+static int
+rice_putBits (riceBits *b, unsigned int val, int nbits)
+{
+    if (nbits > 24) {
+	if (rice_put (b, val >> 16, nbits - 16) != OK)
+	    return (ERR);
+	nbits = 16;
+    }
+    return (rice_put (b, val, nbits));
+}
+
+
+/**
+ *  RICE_GETBITS -- Take up to 32 bits from the stream.
+ */
+static int
+rice_getBits (riceBits *b, int nbits, unsigned int *val)
+{
+    unsigned int hi = 0, lo = 0;
+
+    if (nbits <= 24)
+	return (rice_get (b, nbits, val));
+    if (rice_get (b, nbits - 16, &hi) != OK || rice_get (b, 16, &lo) != OK)
+	return (ERR);
+    *val = (hi << 16) | lo;
+
+    return (OK);
+}
+
+
+/**
+ *  RICE_GETTOP -- Take a unary value (zero bits ending with a one) from
+ *  the stream.
+ */
+static int
+rice_getTop (riceBits *b, long *top)
+{
+    static int nbits[16] = { 0,1,2,2,3,3,3,3,4,4,4,4,4,4,4,4 };
+    unsigned int w;
+    int   k;
+
+
+    for (*top = 0; ; ) {
+	if (b->nbits == 0) {
+	    if (b->p >= b->end)
+		return (ERR);
+	    b->acc = *b->p++;
+	    b->nbits = 8;
+	}
+	if ((w = b->acc) == 0) {		/* all zero, keep going	*/
+	    *top += b->nbits;
+	    b->nbits = 0;
+	    continue;
+	}
+
+	/*  Find the leading one.
+	*/
+	for (k=0; w >= 16; k += 4)
+	    w >>= 4;
+	k += nbits[w];
+	*top += b->nbits - k;
+	b->nbits = k - 1;
+	b->acc &= ((1U << b->nbits) - 1);
+	return (OK);
+    }
+}
+
+
+/**
+ *  RICE_WORD -- Get a big-endian pixel.
+ */
+static unsigned int
+rice_word (unsigned char *p, int bytepix)
+{
+    if (bytepix == 4)
+	return (((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16) |
+		((unsigned int) p[2] << 8) | p[3]);
+    else if (bytepix == 2)
+	return (((unsigned int) p[0] << 8) | p[1]);
+    return (p[0]);
+}
+
+
+/**
+ *  RICE_SETWORD -- Store a big-endian pixel.
+ */
+static void
+rice_setWord (unsigned char *p, unsigned int val, int bytepix)
+{
+    if (bytepix == 4) {
+	*p++ = (unsigned char) (val >> 24);
+	*p++ = (unsigned char) (val >> 16);
+    }
+    if (bytepix >= 2)
+	*p++ = (unsigned char) (val >> 8);
+    *p = (unsigned char) val;
+}
+
+
+/**
+ *  FITS_KEYVAL -- Get the integer value of a header card.
+ */
+static long
+fits_keyval (char *card)
+{
+    char  val[FITS_CARD-9];
+
+    memcpy (val, &card[10], FITS_CARD-10);
+    val[FITS_CARD-10] = '\0';
+    return (atol (val));
+}
+
+
+/**
+ *  FITS_KEYSTR -- Get the start of the value of a header card.
+ */
+static char *
+fits_keystr (char *card)
+{
+    char  *ip = &card[10];
+
+    while (*ip == ' ' && ip < &card[FITS_CARD-1])
+	ip++;
+    return (ip);
+}
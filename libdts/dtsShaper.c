@@ -0,0 +1,248 @@
+/**
+ *  DTSSHAPER.C -- Bandwidth shaping of outbound transfers.
+ *
+ *  Every socket transfer sent by the daemon paces itself through a token
+ *  bucket kept for its queue, so that queues running at the same time
+ *  share the link rather than saturating it.  The overall rate comes from
+ *  the 'maxRate' entries of the DTS config, each giving a rate in Mbps
+ *  and optionally the time of day it applies, e.g.
+ *
+ *	maxRate   1000			# full rate by day
+ *	maxRate    200  18:00-07:00	# capped at night while observing
+ *
+ *  A rate of zero means no limit.  The overall rate is split between the
+ *  queues active at the moment according to their 'rate_weight', each
+ *  queue then getting at least its 'min_rate' and at most its 'max_rate'
+ *  (Mbps, zero for no bound).  A queue with only a 'max_rate' is capped
+ *  even when there's no overall limit.
+ *
+ *	dts_shapeWait (qname, nbytes)
+ *	 mbps = dts_shapeRate (qname)
+ *
+ *  @file       dtsShaper.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  Bandwidth shaping of outbound transfers.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "dts.h"
+
+
+extern  DTS  *dts;
+
+static  dtsShape  shape[MAX_SHAPE];	/* per-queue token buckets	*/
+static  int       nshape = 0;
+static  pthread_mutex_t shape_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double     dts_shapeTotal (time_t now);
+static double     dts_shapeShare (dtsShape *s, double now);
+static dtsShape  *dts_shapeFind (char *qname);
+static double     dts_shapeNow (void);
+
+
+
+
+/**
+ *  DTS_SHAPEWAIT -- Wait until the queue may send the given number of
+ *  bytes.  The bucket is allowed to go into debt for a send larger than
+ *  what it holds, the next send then waits for the debt to be repaid,
+ *  so the average rate is kept whatever the size of the sends.
+ *
+ *  @brief  Wait until the queue may send some bytes
+ *  @fn     void dts_shapeWait (char *qname, long nbytes)
+ *
+ *  @param  qname	queue name (may be empty)
+ *  @param  nbytes	number of bytes about to be sent
+ *  @return		nothing
+ */
+void
+dts_shapeWait (char *qname, long nbytes)
+{
+    dtsShape *s = (dtsShape *) NULL;
+    double    now, rate, wait = 0.0;
+
+
+    if (!dts || nbytes <= 0)
+	return;
+
+    pthread_mutex_lock (&shape_mutex);
+    now = dts_shapeNow ();
+    if ((s = dts_shapeFind (qname)) == NULL) {
+	pthread_mutex_unlock (&shape_mutex);
+	return;
+    }
+    s->used = now;
+
+    if ((rate = dts_shapeShare (s, now)) > 0.0) {
+	/*  Refill the bucket for the time since the last send, it may only
+	**  save up a short burst, and take what we need.
+	*/
+	s->tokens = min (s->tokens + rate * (now - s->last),
+	    rate * SHAPE_BURST);
+	s->tokens -= nbytes;
+	if (s->tokens < 0.0)
+	    wait = -s->tokens / rate;
+    } else
+	s->tokens = 0.0;
+    s->last = now;
+    pthread_mutex_unlock (&shape_mutex);
+
+    if (wait > 0.0)
+	usleep ((useconds_t) (wait * 1.0e6));
+}
+
+
+/**
+ *  DTS_SHAPERATE -- Get the rate a queue may send at right now.
+ *
+ *  @brief  Get the rate a queue may send at
+ *  @fn     double dts_shapeRate (char *qname)
+ *
+ *  @param  qname	queue name (may be empty)
+ *  @return		rate in Mbps, or 0.0 if not limited
+ */
+double
+dts_shapeRate (char *qname)
+{
+    dtsShape *s = (dtsShape *) NULL;
+    double    rate = 0.0;
+
+
+    if (!dts)
+	return (0.0);
+
+    pthread_mutex_lock (&shape_mutex);
+    if ((s = dts_shapeFind (qname)))
+	rate = dts_shapeShare (s, dts_shapeNow ());
+    pthread_mutex_unlock (&shape_mutex);
+
+    return (rate * 8.0 / 1.0e6);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ *****************************************************************************/
+
+/**
+ *  DTS_SHAPETOTAL -- Get the overall rate (bytes/sec) for the time of
+ *  day.  The first 'maxRate' whose time window holds is used, one with no
+ *  window holds at any time.
+ */
+static double
+dts_shapeTotal (time_t now)
+{
+    struct tm tm;
+    dtsRate  *r;
+    int   i, mins;
+
+
+    localtime_r (&now, &tm);
+    mins = tm.tm_hour * 60 + tm.tm_min;
+
+    for (i=0; i < dts->nrates; i++) {
+	r = &dts->rates[i];
+	if (r->start < 0 ||
+	    (r->start <= r->end && mins >= r->start && mins < r->end) ||
+	    (r->start >  r->end && (mins >= r->start || mins < r->end)))
+		return (r->mbps * 1.0e6 / 8.0);
+    }
+    return (0.0);
+}
+
+
+/**
+ *  DTS_SHAPESHARE -- Get the queue's share (bytes/sec) of the overall
+ *  rate, split by weight between the queues which have sent recently.
+ */
+static double
+dts_shapeShare (dtsShape *s, double now)
+{
+    double total = dts_shapeTotal ((time_t) now), rate = 0.0, wsum = 0.0;
+    int    i;
+
+
+    if (total > 0.0) {
+	for (i=0; i < nshape; i++)
+	    if (&shape[i] == s || now - shape[i].used < SHAPE_IDLE)
+		wsum += shape[i].weight;
+	rate = total * s->weight / max (wsum, 1.0);
+    }
+
+    if (s->minRate > 0.0 && rate > 0.0)
+	rate = max (rate, s->minRate);
+    if (s->maxRate > 0.0)
+	rate = (rate > 0.0 ? min (rate, s->maxRate) : s->maxRate);
+
+    return (rate);
+}
+
+
+/**
+ *  DTS_SHAPEFIND -- Find the bucket for a queue, adding one if needed.
+ *  The weight and bounds are taken from the queue config each time so a
+ *  reconfigured queue is picked up.
+ */
+static dtsShape *
+dts_shapeFind (char *qname)
+{
+    dtsShape *s = (dtsShape *) NULL;
+    dtsQueue *dtsq = (dtsQueue *) NULL;
+    char     *name = (qname ? qname : "");
+    int       i;
+
+
+    for (i=0; i < nshape; i++) {
+	if (strcmp (shape[i].qname, name) == 0) {
+	    s = &shape[i];
+	    break;
+	}
+    }
+    if (!s) {
+	if (nshape >= MAX_SHAPE)
+	    return ((dtsShape *) NULL);
+	s = &shape[nshape++];
+	memset (s, 0, sizeof (dtsShape));
+	strncpy (s->qname, name, SZ_FNAME-1);
+	s->last = dts_shapeNow ();
+    }
+
+    s->weight  = 1.0;
+    s->minRate = s->maxRate = 0.0;
+    if (name[0] && (dtsq = dts_queueLookup (name))) {
+	if (dtsq->rate_weight > 0)
+	    s->weight  = (double) dtsq->rate_weight;
+	s->minRate = dtsq->min_rate * 1.0e6 / 8.0;
+	s->maxRate = dtsq->max_rate * 1.0e6 / 8.0;
+    }
+
+    return (s);
+}
+
+
+/**
+ *  DTS_SHAPENOW -- Get the time in seconds.
+ */
+static double
+dts_shapeNow (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return ((double) tv.tv_sec + (double) tv.tv_usec / 1.0e6);
+}
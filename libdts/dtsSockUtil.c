@@ -9,6 +9,8 @@
  */
 
 
+#define  _GNU_SOURCE			/* needed for splice()		*/
+
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -20,7 +22,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
@@ -30,6 +32,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#ifdef Linux
+#include <sys/sendfile.h>
+#endif
+
 
 #include "dts.h"
 #include "dtsUDT.h"
@@ -48,6 +54,72 @@ pthread_mutex_t ss_mut = PTHREAD_MUTEX_INITIALIZER; /* server socket mutex */
  */
 void 	dts_setNonBlock (int sock);
 void 	dts_setBlock (int sock);
+static int dts_sockAgain (int fd, int events, char *what);
+
+
+#ifdef UNIT_TEST
+/*  Send part of a file over a loopback socket with dts_sockSendFile() and
+ *  write it into the same place of another file with dts_sockRecvFile(),
+ *  i.e. one stripe of a transfer under the CS_NONE (DTS_NOSUM) policy.
+ */
+DTS  *dts = (DTS *) NULL;
+
+typedef struct { int sock, fd; off_t off; long n, nread; } sfTest;
+
+static void *
+sf_recv (void *data)
+{
+    sfTest *t = (sfTest *) data;
+    t->nread = dts_sockRecvFile (t->sock, t->fd, t->off, t->n);
+    return ((void *) NULL);
+}
+
+int
+main (int argc, char *argv[])
+{
+    char   *in  = "/tmp/dtsSockUtil.in", *out = "/tmp/dtsSockUtil.out";
+    long    size = (argc > 1 ? atol (argv[1]) : 5*1024*1024 + 13), i;
+    long    off = size / 3, n = size / 2, nsent = 0;
+    char   *ibuf = malloc (size), *obuf = calloc (1, size);
+    int     sv[2], ifd, ofd, stat = 0;
+    pthread_t tid;
+    sfTest  t;
+
+
+    for (i=0; i < size; i++)
+	ibuf[i] = (char) (i * 13 + 5);
+    if ((ifd = open (in, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0 ||
+	write (ifd, ibuf, size) != size ||
+	(ofd = open (out, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0 ||
+	ftruncate (ofd, (off_t) size) < 0 ||
+	socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	    fprintf (stderr, "setup failed\n");
+	    return (1);
+    }
+
+    t.sock = sv[1], t.fd = ofd, t.off = (off_t) off, t.n = n, t.nread = 0;
+    pthread_create (&tid, NULL, sf_recv, (void *) &t);
+    nsent = dts_sockSendFile (sv[0], ifd, (off_t) off, n);
+    pthread_join (tid, NULL);
+
+    if (nsent != n || t.nread != n) {
+	fprintf (stderr, "sent %ld, received %ld of %ld\n", nsent, t.nread, n);
+	stat = 1;
+    } else if (pread (ofd, obuf, size, (off_t) 0) != size ||
+	memcmp (obuf + off, ibuf + off, n) != 0) {
+	    fprintf (stderr, "stripe data differ\n");
+	    stat = 1;
+    }
+
+    close (sv[0]), close (sv[1]);
+    close (ifd), close (ofd);
+    unlink (in), unlink (out);
+    free (ibuf), free (obuf);
+    fprintf (stderr, "sendfile test: %s\n", (stat ? "FAILED" : "OK"));
+
+    return (stat);
+}
+#endif
 
 
 
@@ -63,6 +135,27 @@ void 	dts_setBlock (int sock);
  */
 int
 dts_openServerSocket (int port)
+{
+    return (dts_openServerSocketBuf (port, 0));
+}
+
+
+/** 
+ *  dts_openServerSocketBuf -- Open a 'server' socket with the given socket
+ *  buffer size.  The buffers must be set before the listen() so the window
+ *  scale is negotiated for the connection, a size of zero leaves them to
+ *  the kernel.
+ *
+ *  @brief  Open a 'server' socket with the given buffer size
+ *  @fn     int dts_openServerSocketBuf (int port, int bufsz)
+ *
+ *  @param  port	port number to open
+ *  @param  bufsz	SO_SNDBUF/SO_RCVBUF size (0 for default)
+ *  @return		socket descriptor
+ *
+ */
+int
+dts_openServerSocketBuf (int port, int bufsz)
 {
     struct  sockaddr_in servaddr; 	/* server address 		*/
     int     ps = 0;                    	/* parallel socket descriptor	*/
@@ -80,14 +173,21 @@ dts_openServerSocket (int port)
     */
     if ((ps = socket (AF_INET, SOCK_STREAM, 0)) < 0) {
 	fprintf (stderr, "openServerSocket(%d): %s\n", errno, strerror(errno));
+        pthread_mutex_unlock (&ss_mut);
         dtsError ("serverSocket: socket()");
 	return (-1);
     }
 
     setsockopt (ps, SOL_SOCKET, SO_REUSEADDR, (void *)&yes,   sizeof(yes));
+    if (bufsz > 0) {
+	setsockopt (ps, SOL_SOCKET, SO_SNDBUF, (void *)&bufsz, sizeof(int));
+	setsockopt (ps, SOL_SOCKET, SO_RCVBUF, (void *)&bufsz, sizeof(int));
+    }
 #ifdef TCP_APPTUNE
-    setsockopt (ps, SOL_SOCKET, SO_SNDBUF,    (void *)&sndsz, sizeof(int));
-    setsockopt (ps, SOL_SOCKET, SO_RCVBUF,    (void *)&rcvsz, sizeof(int));
+    else {
+	setsockopt (ps, SOL_SOCKET, SO_SNDBUF, (void *)&sndsz, sizeof(int));
+	setsockopt (ps, SOL_SOCKET, SO_RCVBUF, (void *)&rcvsz, sizeof(int));
+    }
 #endif
 
     if (DEBUG || SOCK_DEBUG)
@@ -108,15 +208,21 @@ dts_openServerSocket (int port)
         if (bind (ps, (struct sockaddr*)&servaddr, sizeof servaddr) < 0) {
             dtsErrLog (NULL, "serverSock: bind(%d:%s)", port, strerror (errno));
             /*dtsError ("serverSocket: bind(%d)", port); */
-	    if (!ntries)
+	    if (!ntries) {
+		close (ps);
+		pthread_mutex_unlock (&ss_mut);
 	        return (-1);
+	    }
         } else {
             if ((listen (ps, SOMAXCONN)) < 0) {
                 dtsErrLog (NULL, 
 		    "serverSock: listen(%d:%s)", port, strerror(errno));
                 /*dtsError ("serverSocket: listen(%d)", port); */
-	        if (!ntries)
+	        if (!ntries) {
+		    close (ps);
+		    pthread_mutex_unlock (&ss_mut);
 	            return (-1);
+		}
             } else { 
 	        break;
             }
@@ -220,9 +326,58 @@ dts_getOpenPort (int port, int maxTries)
  */
 int
 dts_openClientSocket (char *host, int port, int retry)
+{
+    return (dts_openClientSocketBuf (host, port, retry, 0));
+}
+
+
+/** 
+ *  dts_openClientSocketBuf -- Open a 'client' socket with the given socket
+ *  buffer size.  A size of zero leaves the buffers to the kernel.
+ *
+ *  @brief  Open a 'client' socket with the given buffer size
+ *  @fn     int dts_openClientSocketBuf (char *host, int port, int retry,
+ *		int bufsz)
+ *
+ *  @param  host	host name
+ *  @param  port	port number to open
+ *  @param  retry	attempt to reconnect?
+ *  @param  bufsz	SO_SNDBUF/SO_RCVBUF size (0 for default)
+ *  @return		socket descriptor
+ *
+ */
+int
+dts_openClientSocketBuf (char *host, int port, int retry, int bufsz)
+{
+    return (dts_openClientSocketVia (host, NULL, port, retry, bufsz));
+}
+
+
+/** 
+ *  dts_openClientSocketVia -- Open a 'client' socket from the given local
+ *  address, so the connection leaves on that interface when the host is
+ *  on more than one network.  A NULL or empty address lets the kernel
+ *  choose as usual.
+ *
+ *  @brief  Open a 'client' socket from the given local address
+ *  @fn     int dts_openClientSocketVia (char *host, char *local, int port,
+ *		int retry, int bufsz)
+ *
+ *  @param  host	host name
+ *  @param  local	local (source) IP address, or NULL
+ *  @param  port	port number to open
+ *  @param  retry	attempt to reconnect?
+ *  @param  bufsz	SO_SNDBUF/SO_RCVBUF size (0 for default)
+ *  @return		socket descriptor
+ *
+ */
+int
+dts_openClientSocketVia (char *host, char *local, int port, int retry, 
+		int bufsz)
 {
     char    *ip, lhost[SZ_PATH];
     struct  sockaddr_in servaddr; 	/* server address 		*/
+    struct  sockaddr_in srcaddr; 	/* local address 		*/
     int     ps = 0;                    	/* parallel socket descriptor	*/
     int     sndsz = TCP_WINDOW_SZ, rcvsz = TCP_WINDOW_SZ;
     //socklen_t yes = 1;
@@ -253,11 +408,32 @@ dts_openClientSocket (char *host, int port, int retry)
     }
 
     //setsockopt (ps, SOL_SOCKET, SO_REUSEADDR, (void *)&yes,   sizeof(yes));
+    if (bufsz > 0) {
+	setsockopt (ps, SOL_SOCKET, SO_SNDBUF, (void *)&bufsz, sizeof(int));
+	setsockopt (ps, SOL_SOCKET, SO_RCVBUF, (void *)&bufsz, sizeof(int));
+    }
 #ifdef TCP_APPTUNE
-    setsockopt (ps, SOL_SOCKET, SO_SNDBUF,    (void *)&sndsz, sizeof(int));
-    setsockopt (ps, SOL_SOCKET, SO_RCVBUF,    (void *)&rcvsz, sizeof(int));
+    else {
+	setsockopt (ps, SOL_SOCKET, SO_SNDBUF, (void *)&sndsz, sizeof(int));
+	setsockopt (ps, SOL_SOCKET, SO_RCVBUF, (void *)&rcvsz, sizeof(int));
+    }
 #endif
 
+    /* Bind the source address if we were given one.
+    */
+    if (local && local[0]) {
+        memset (&srcaddr, 0, sizeof (struct sockaddr_in));
+        srcaddr.sin_family = AF_INET;
+        srcaddr.sin_port   = htons(0);
+        if (!inet_aton (local, &srcaddr.sin_addr) ||
+            bind (ps, (struct sockaddr *)&srcaddr, sizeof srcaddr) < 0) {
+	        fprintf (stderr, "openClientSocket: cannot bind '%s': %s\n",
+		    local, strerror(errno));
+	        close (ps);
+	        return (-1);
+        }
+    }
+
 
     /* Set server address.
     */
@@ -516,60 +692,55 @@ dts_sockRead (int fd, void *vptr, int nbytes)
     char    *ptr = vptr;
     int     nread = 0, nb = 0;
     long    nleft = nbytes;
-    fd_set  allset, fds;
     extern  int psock_checksum_policy;
     unsigned int sum, nl = sizeof (int);
     char *s = (char *) &sum;
 	
 
-    /*  Set non-blocking mode on the descriptor.
+    /*  Set non-blocking mode on the descriptor.  We try the recv() first
+     *  and only wait for the socket when there's nothing to read yet.
      */
     dts_setNonBlock (fd);
 
-    FD_ZERO (&allset);
-    FD_SET (fd, &allset);
-    memcpy (&fds, &allset, sizeof(allset));
-
     if (psock_checksum_policy == CS_PACKET) {
-        if (select (SELWIDTH, &fds, NULL, NULL, NULL)) {
-	  for (nl = sizeof (int); nl > 0; ) {
-            if ( (nb = recv (fd, s, nl, 0)) < 0 )
-                if (errno == EINTR || errno == EAGAIN)
-                    nb = 0;             /* and call recv() again */
+	for (nl = sizeof (int); nl > 0; ) {
+            if ( (nb = recv (fd, s, nl, 0)) <= 0 ) {
+		if (nb == 0 || dts_sockAgain (fd, POLLIN, "dts_sockRead") != OK)
+                    return (-1);
+		continue;		/* and call recv() again */
+	    }
 	    nl -= nb;
 	    s  += nb;
-          }
-	}
+        }
     }
 
     while (nleft > 0) {
-      memcpy (&fds, &allset, sizeof(allset));
-      if (select (SELWIDTH, &fds, NULL, NULL, NULL)) {
         if ( (nb = recv (fd, ptr, nleft, 0)) < 0) {
-            if (errno == EINTR || errno == EAGAIN)
-                nb = 0;             /* and call recv() again */
-            else {
-		dtsErrLog (NULL, "dts_sockRead: %s\n", strerror (errno));
+	    if (dts_sockAgain (fd, POLLIN, "dts_sockRead") != OK)
                 return (-1);
-	    }
+	    continue;			/* and call recv() again */
         } else if (nb == 0)
             break;                  /* EOF */
 
         nleft -= nb;
         ptr   += nb;
         nread += nb;
-      }
     }
+    if (nread > 0)
+	dts_wanRecv (fd);		/* WAN emulation (testing only)	*/
 
     if (psock_checksum_policy == CS_PACKET) {
 	unsigned int rsum = dts_memCRC32 ((unsigned char *)vptr,(size_t)nbytes);
 	int resend = (rsum != sum);
 	char *s = (char *) &resend;
 
+	dts_wanSend (fd, (long) sizeof (int));
 	for (nl = sizeof(int); nl > 0; ) {
-            if ( (nb = send (fd, s, nl, 0)) < 0 )
-                if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
-                    nb = 0;             /* and call send() again */
+            if ( (nb = send (fd, s, nl, 0)) < 0 ) {
+		if (dts_sockAgain (fd, POLLOUT, "dts_sockRead") != OK)
+                    return (-1);
+		continue;		/* and call send() again */
+	    }
 	    nl -= nb;
 	    s += nb;
 	}
@@ -596,7 +767,6 @@ dts_sockRead (int fd, void *vptr, int nbytes)
 int
 dts_sockWrite (int fd, void *vptr, int nbytes)
 {
-    fd_set   allset, fds;
     char    *ptr = vptr;
     int      nwritten = 0,  nb = 0, nl = sizeof (int);
     long     nleft = nbytes;
@@ -605,62 +775,54 @@ dts_sockWrite (int fd, void *vptr, int nbytes)
     extern  int psock_checksum_policy;
 
 
-    /*  Set non-blocking mode on the descriptor.
+    /*  Set non-blocking mode on the descriptor.  We try the send() first
+     *  and only wait for the socket when its buffer is full.
      */
     dts_setNonBlock (fd);
 
 resend_packet:
-    FD_ZERO (&allset);
-    FD_SET (fd, &allset);
-    memcpy (&fds, &allset, sizeof(allset));
-
     if (psock_checksum_policy == CS_PACKET) {
         unsigned int sum = dts_memCRC32 ((unsigned char *)vptr, (size_t)nbytes);
 	char *s = (char *) &sum;
 	
 	for (nl = sizeof (int); nl > 0; ) {
-          if (select (SELWIDTH, NULL, &fds, NULL, NULL)) {
-            if ( (nb = send (fd, s, nl, 0)) < 0 )
-                if (errno == EINTR || errno == EAGAIN)
-                    nb = 0;             /* and call send() again */
+            if ( (nb = send (fd, s, nl, 0)) < 0 ) {
+		if (dts_sockAgain (fd, POLLOUT, "dts_sockWrite") != OK)
+                    return (-1);
+		continue;		/* and call send() again */
+	    }
 	    nl -= nb;
 	    s += nb;
-          }
 	}
     }
 
     while (nleft > 0) {
-      memcpy (&fds, &allset, sizeof(allset));
-      if (select (SELWIDTH, NULL, &fds, NULL, NULL)) {
-        if ( (nb = send (fd, ptr, nleft, 0)) < 0 ) {
-            if (errno == EINTR || errno == EAGAIN)
-                nb = 0;             /* and call send() again */
-            else {
-		dtsErrLog (NULL, "dts_sockWrite: %s\n", strerror (errno));
+        if ( (nb = send (fd, ptr, dts_wanSend (fd, nleft), 0)) < 0 ) {
+	    if (dts_sockAgain (fd, POLLOUT, "dts_sockWrite") != OK)
                 return (-1);
-	    }
+	    continue;			/* and call send() again */
 
         } else if (nb > 0) {
+	    dts_wanSent (fd, (long) nb);
             nleft    -= nb;
             ptr      += nb;
             nwritten += nb;
         }
-      }
     }
 
     if (psock_checksum_policy == CS_PACKET) {
 	char *s = (char *) &resend;
 
 	for (nl = sizeof (int); nl > 0; ) {
-          memcpy (&fds, &allset, sizeof(allset));
-          if (select (SELWIDTH, &fds, NULL, NULL, NULL)) {
-            if ( (nb = recv (fd, s, nl, 0)) < 0 )
-                if (errno == EINTR || errno == EAGAIN)
-                    nb = 0;             /* and call recv() again */
+            if ( (nb = recv (fd, s, nl, 0)) <= 0 ) {
+		if (nb == 0 || dts_sockAgain (fd, POLLIN, "dts_sockWrite") != OK)
+                    return (-1);
+		continue;		/* and call recv() again */
+	    }
 	    nl -= nb;
 	    s  += nb;
-          }
 	}
+	dts_wanRecv (fd);
 
 	if (resend) {
 	    dtsErrLog (NULL, "sockWrite: resending packet ....\n");
@@ -675,6 +837,200 @@ resend_packet:
 }
 
 
+/**
+ *  DTS_SOCKSENDFILE -- Send exactly "n" bytes from a file to a socket 
+ *  descriptor.  On Linux this uses sendfile() so the data move from the
+ *  page cache to the socket without a copy through user space.  No
+ *  packet checksums are possible, so callers should use this only when
+ *  the checksum policy is CS_NONE.  A file opened for direct I/O can't
+ *  go through the page cache so it's read into an aligned buffer instead,
+ *  as is a tar stream (see dtsTar.c) which has no file behind it.
+ *
+ *  @brief  Send exactly "n" bytes from a file to a socket descriptor. 
+ *  @fn     long dts_sockSendFile (int sock, int fd, off_t offset, long nbytes)
+ *
+ *  @param  sock        socket descriptor
+ *  @param  fd          input file descriptor
+ *  @param  offset      file offset of first byte
+ *  @param  nbytes      number of bytes to send
+ *  @return             number of bytes sent
+ */
+long
+dts_sockSendFile (int sock, int fd, off_t offset, long nbytes)
+{
+    long     nleft = nbytes, nwritten = 0, nb = 0;
+    unsigned char *buf = (unsigned char *) NULL;
+#ifdef Linux
+    off_t    off = offset;
+
+    if (dts_fileIsDirect (fd) || dts_tarIsStream (fd) || 
+	dts_fanoutIsReader (fd) || dts_cutIsReader (fd))
+#endif
+	if ((buf = dts_dioAlloc ()) == NULL)
+	    return (-1);
+
+
+    /*  Set non-blocking mode on the descriptor.
+     */
+    dts_setNonBlock (sock);
+
+    while (nleft > 0) {
+#ifdef Linux
+	if (!buf) {
+	    if ((nb = sendfile (sock, fd, &off, 
+		(size_t) dts_wanSend (sock, nleft))) > 0)
+		    dts_wanSent (sock, nb);
+	} else
+#endif
+	{
+	    nb = dts_filePRead (fd, buf, (int) min(nleft,DIO_BUFSIZE), 
+		(offset + nwritten));
+	    if (nb > 0)
+		nb = dts_sockWrite (sock, buf, (int) nb);
+	}
+        if (nb < 0) {
+	    /*  dts_sockWrite() has already waited for the socket.
+	    */
+	    if (!buf && dts_sockAgain (sock, POLLOUT, "dts_sockSendFile") == OK)
+                continue;           /* and call sendfile() again */
+	    if (buf)
+		dtsErrLog (NULL, "dts_sockSendFile: %s\n", strerror (errno));
+            break;
+
+        } else if (nb == 0) {
+	    break;		    /* EOF on the file */
+
+        } else {
+            nleft    -= nb;
+            nwritten += nb;
+        }
+    }
+
+    dts_dioFree (buf);
+    if (nleft != 0)
+	dtsErrLog (NULL, "dts_sockSendFile: Error  nleft = %ld\n", nleft);
+
+    return (nwritten);
+}
+
+
+/**
+ *  DTS_SOCKRECVFILE -- Receive exactly "n" bytes from a socket descriptor
+ *  and write them to a file at the given offset.  On Linux the data are
+ *  splice()d from the socket through a pipe to the file, so they never
+ *  pass through user space.  As with dts_sockSendFile() this can only be
+ *  used when the checksum policy is CS_NONE.  A file opened for direct
+ *  I/O is instead written from an aligned buffer, filled completely each
+ *  time so the writes stay aligned.  A tar stream is written the same way.
+ *
+ *  @brief  Recv exactly "n" bytes from a socket descriptor to a file. 
+ *  @fn     long dts_sockRecvFile (int sock, int fd, off_t offset, long nbytes)
+ *
+ *  @param  sock        socket descriptor
+ *  @param  fd          output file descriptor
+ *  @param  offset      file offset of first byte
+ *  @param  nbytes      number of bytes to receive
+ *  @return             number of bytes written to the file
+ */
+long
+dts_sockRecvFile (int sock, int fd, off_t offset, long nbytes)
+{
+    long     nleft = nbytes, nread = 0, nb = 0;
+    unsigned char *buf = (unsigned char *) NULL;
+#ifdef Linux
+    long     np = 0, n = 0;
+    int      pfd[2];
+    off_t    off = offset;
+
+    if (!dts_fileIsDirect (fd) && !dts_tarIsStream (fd)) {
+	if (pipe (pfd) < 0) {
+	    dtsErrLog (NULL, "dts_sockRecvFile: pipe: %s\n", strerror (errno));
+	    return (-1);
+	}
+    } else
+#endif
+	if ((buf = dts_dioAlloc ()) == NULL)
+	    return (-1);
+
+    if (buf) {
+	/*  Read whole buffers and write them at aligned offsets.
+	*/
+	while (nleft > 0) {
+	    if ((nb = dts_sockRead (sock, buf, (int) min(nleft,DIO_BUFSIZE))) <= 0)
+		break;
+	    if (dts_filePWrite (fd, buf, (int) nb, (offset + nread)) != nb) {
+		dtsErrLog (NULL, "dts_sockRecvFile: write: %s\n", 
+		    strerror (errno));
+		break;
+	    }
+	    nleft -= nb;
+	    nread += nb;
+	}
+	dts_dioFree (buf);
+	if (nleft != 0)
+	    dtsErrLog (NULL, "dts_sockRecvFile: Error  nleft = %ld\n", nleft);
+	return (nread);
+    }
+
+
+    /*  Set non-blocking mode on the descriptor.
+     */
+    dts_setNonBlock (sock);
+
+    while (nleft > 0) {
+#ifdef Linux
+        nb = splice (sock, NULL, pfd[1], NULL, (size_t) min(nleft,SZ_XFER_CHUNK),
+	    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+#else
+        nb = recv (sock, buf, (size_t) min(nleft,SZ_XFER_CHUNK), 0);
+#endif
+        if (nb < 0) {
+	    if (dts_sockAgain (sock, POLLIN, "dts_sockRecvFile") == OK)
+                continue;           /* and call splice() again */
+	    break;
+        } else if (nb == 0)
+            break;                  /* EOF */
+	dts_wanRecv (sock);
+
+	/*  Drain what we got to the file.
+	*/
+#ifdef Linux
+	for (np = nb; np > 0; np -= n) {
+	    if ((n = splice (pfd[0], NULL, fd, &off, (size_t) np, 
+		SPLICE_F_MOVE)) <= 0) {
+		    if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		    }
+		    dtsErrLog (NULL, "dts_sockRecvFile: write: %s\n", 
+			strerror (errno));
+		    nleft = -1;
+		    break;
+	    }
+	}
+	if (nleft < 0)
+	    break;
+#else
+	if (dts_filePWrite (fd, buf, (int) nb, (offset + nread)) != nb) {
+	    dtsErrLog (NULL, "dts_sockRecvFile: write: %s\n", strerror (errno));
+	    break;
+	}
+#endif
+        nleft -= nb;
+        nread += nb;
+    }
+
+#ifdef Linux
+    close (pfd[0]);
+    close (pfd[1]);
+#endif
+    if (nleft != 0)
+	dtsErrLog (NULL, "dts_sockRecvFile: Error  nleft = %ld\n", nleft);
+
+    return (nread);
+}
+
+
 /** 
  *  DTS_SETNONBLOCK -- Set a non-blocking mode on the descriptor.
  */
@@ -690,6 +1046,8 @@ dts_setNonBlock (int sock)
         /* Handle error */
 	return;
     }
+    if (flags & O_NONBLOCK)
+	return;				/* already set, save the syscall */
     if (fcntl (sock, F_SETFL, flags | O_NONBLOCK) < 0) {
         /* Handle error */
 	return;
@@ -719,6 +1077,44 @@ dts_setBlock (int sock)
 }
 
 
+/** 
+ *  DTS_SOCKWAIT -- Wait for a descriptor to become readable (POLLIN) or
+ *  writable (POLLOUT).  We use poll() rather than select() so there's no
+ *  FD_SETSIZE limit on the descriptor, and the cost doesn't grow with the
+ *  number of descriptors the daemon has open.  An error or hangup on the
+ *  descriptor counts as ready, the caller's next read or write reports it.
+ *
+ *  @brief  Wait for a descriptor to become ready.
+ *  @fn     int dts_sockWait (int fd, int events, int timeout)
+ *
+ *  @param  fd          descriptor
+ *  @param  events      POLLIN and/or POLLOUT
+ *  @param  timeout     max wait (sec), negative to wait forever
+ *  @return             1 if ready, 0 on timeout, -1 on error
+ */
+int
+dts_sockWait (int fd, int events, int timeout)
+{
+    struct pollfd  pfd;
+    int   n = 0;
+
+
+    pfd.fd      = fd;
+    pfd.events  = events;
+    pfd.revents = 0;
+
+    while ((n = poll (&pfd, 1, (timeout < 0 ? -1 : timeout * 1000))) < 0)
+	if (errno != EINTR)
+	    return (-1);
+
+    if (n > 0 && (pfd.revents & POLLNVAL)) {
+	errno = EBADF;
+	return (-1);
+    }
+    return (n > 0 ? 1 : 0);
+}
+
+
 /**
  *  DTS_UDTREAD -- Read exactly "n" bytes from a UDT socket descriptor. 
  *
@@ -858,3 +1254,35 @@ resend_packet:
 
     return (nwritten);
 }
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ ****************************************************************************/
+
+/**
+ *  DTS_SOCKAGAIN -- Decide whether to retry a non-blocking socket call that
+ *  failed.  After EINTR we retry at once, after EAGAIN once the socket is
+ *  ready, giving up if it stays idle for SOCK_IO_TIMEOUT seconds.  Returns
+ *  OK to retry, or ERR (logged) if the call should fail.
+ */
+static int
+dts_sockAgain (int fd, int events, char *what)
+{
+    int  n = 0;
+
+
+    if (errno == EINTR)
+	return (OK);
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+	dtsErrLog (NULL, "%s: %s\n", what, strerror (errno));
+	return (ERR);
+    }
+
+    if ((n = dts_sockWait (fd, events, SOCK_IO_TIMEOUT)) > 0)
+	return (OK);
+    dtsErrLog (NULL, "%s: %s\n", what, 
+	(n == 0 ? "timed out waiting for peer" : strerror (errno)));
+    return (ERR);
+}
@@ -36,13 +36,30 @@
  * description of each file extracted.  If an exclude filename does not end
  * with a $ all files with the given string as a prefix are excluded.
  *
+ * Directories may also be moved as a tar stream, one transfer of a single
+ * archive which is never written to disk.  The source stream is built on
+ * the fly from the directory tree as it is read, the sink stream unpacks
+ * the archive as it is written.  Either is used through a descriptor like
+ * a file, with positional reads or writes (see dts_filePRead/PWrite):
+ *
+ *	  fd = dts_tarOpenSource (path, &size)
+ *	  fd = dts_tarOpenSink (dir)
+ *	 yes = dts_tarIsStream (fd)
+ *	  nb = dts_tarRead (fd, buf, nbytes, offset)
+ *	  nb = dts_tarWrite (fd, buf, nbytes, offset)
+ *	stat = dts_tarClose (fd)
+ *	size = dts_tarSize (path)
+ *
  *****************************************************************************/
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <strings.h>
@@ -86,6 +103,8 @@ static char	tapeblock[SZ_TAPEBUFFER];
 static void  dts_PutFiles (char *dir, int out, char *path);
 static void  dts_TarfileOut (char *fname, int out, int ftype, char *path);
 static int   dts_PutHeader (struct fheader *fh, int out);
+static void  dts_EncodeHeader (struct fheader *fh, union hblock *hb);
+static void  dts_DecodeHeader (union hblock *hb, struct fheader *fh);
 
 static int   dts_GetHeader (int in, struct fheader *fh);
 static void  dts_StripBlanks (int in, int out, long nbytes);
@@ -103,6 +122,17 @@ static int   dts_PutBlock (int out, char *buf);
 static void  dts_EndTar (int out);
 static char *dts_DName (char  *dir);
 
+static int   dts_tarWalk (tarStream *ts, char *path, char *name);
+static int   dts_tarFind (tarStream *ts, long offset);
+static void  dts_tarUnpack (tarStream *ts, char *buf, int nbytes);
+static void  dts_tarBegin (tarStream *ts);
+static void  dts_tarEnd (tarStream *ts);
+static int   dts_tarSafeName (char *name);
+static void  dts_tarFree (tarStream *ts);
+
+static tarStream *tar_stream[TAR_MAX_FD];
+static pthread_mutex_t tar_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 
 
 
@@ -582,37 +612,79 @@ dts_PutHeader (
     struct fheader *fh,			/* (input) file header		*/
     int	   out				/* output file descriptor	*/
 )
+{
+    union	hblock	hb;
+
+    dts_EncodeHeader (fh, &hb);
+
+    if (debug) {
+	printf ("File header:\n");
+	printf ("      name = %s\n", hb.dbuf.name);
+	printf ("      mode = %s\n", hb.dbuf.mode);
+	printf ("       uid = %s\n", hb.dbuf.uid);
+	printf ("       gid = %s\n", hb.dbuf.gid);
+	printf ("      size = %-12.12s\n", hb.dbuf.size);
+	printf ("     mtime = %-12.12s\n", hb.dbuf.mtime);
+	printf ("    chksum = %s\n", hb.dbuf.chksum);
+	printf ("  linkflag = %c\n", hb.dbuf.linkflag);
+	printf ("  linkname = %s\n", hb.dbuf.linkname);
+	fflush (stdout);
+    }
+
+    /* Write the header to the tarfile.
+     */
+    return (dts_PutBlock (out, hb.dummy));
+}
+
+
+/**
+ *  DTS_ENCODEHEADER -- Encode a file header into a header block.
+ */
+static void
+dts_EncodeHeader (
+    struct fheader *fh,			/* (input) file header		*/
+    union hblock   *hb			/* (output) header block	*/
+)
 {
     register char	*ip;
     register int	n;
-    union	hblock	hb;
     char	chksum[10];
 
     /* Clear the header block. */
     for (n=0;  n < TBLOCK;  n++)
-        hb.dummy[n] = '\0';
+        hb->dummy[n] = '\0';
 
     /* Encode the file header.
      */
-    strcpy  (hb.dbuf.name,  fh->name);
-    sprintf (hb.dbuf.mode,  "%6o ",   fh->mode);
-    sprintf (hb.dbuf.uid,   "%6o ",   fh->uid);
-    sprintf (hb.dbuf.gid,   "%6o ",   fh->gid);
-    sprintf (hb.dbuf.size,  "%11lo ", fh->size);
-    sprintf (hb.dbuf.mtime, "%11lo ", fh->mtime);
+    strcpy  (hb->dbuf.name,  fh->name);
+    sprintf (hb->dbuf.mode,  "%6o ",   fh->mode);
+    sprintf (hb->dbuf.uid,   "%6o ",   fh->uid);
+    sprintf (hb->dbuf.gid,   "%6o ",   fh->gid);
+    if (fh->size > SZ_MAXOCT) {
+	/*  Too big for the octal field, store it base-256 with the high
+	**  bit of the first byte set as GNU tar does.
+	*/
+	long  sz = fh->size;
+
+	hb->dbuf.size[0] = (char) 0x80;
+	for (n=11;  n > 0;  n--, sz >>= 8)
+	    hb->dbuf.size[n] = (char) (sz & 0xff);
+    } else
+        sprintf (hb->dbuf.size,  "%11lo ", fh->size);
+    sprintf (hb->dbuf.mtime, "%11lo ", fh->mtime);
 
     switch (fh->linkflag) {
     case LF_SYMLINK:
-	hb.dbuf.linkflag = '2';
+	hb->dbuf.linkflag = '2';
 	break;
     case LF_DIR:
-	hb.dbuf.linkflag = '5';
+	hb->dbuf.linkflag = '5';
 	break;
     default:
-	hb.dbuf.linkflag = '0';
+	hb->dbuf.linkflag = '0';
 	break;
     }
-    strcpy (hb.dbuf.linkname, fh->linkname);
+    strcpy (hb->dbuf.linkname, fh->linkname);
 
     /* Encode the checksum value for the file header and then
      * write the field.  Calculate the checksum with the checksum
@@ -621,29 +693,11 @@ dts_PutHeader (
      * end of the tar file.
      */
     for (n=0;  n < 8;  n++)
-        hb.dbuf.chksum[n] = ' ';
+        hb->dbuf.chksum[n] = ' ';
 
-    sprintf (chksum, "%6o", dts_Chksum (hb.dummy, TBLOCK));
+    sprintf (chksum, "%6o", dts_Chksum (hb->dummy, TBLOCK));
     for (n=0, ip=chksum;  n < 8;  n++)
-        hb.dbuf.chksum[n] = *ip++;
-
-    if (debug) {
-	printf ("File header:\n");
-	printf ("      name = %s\n", hb.dbuf.name);
-	printf ("      mode = %s\n", hb.dbuf.mode);
-	printf ("       uid = %s\n", hb.dbuf.uid);
-	printf ("       gid = %s\n", hb.dbuf.gid);
-	printf ("      size = %-12.12s\n", hb.dbuf.size);
-	printf ("     mtime = %-12.12s\n", hb.dbuf.mtime);
-	printf ("    chksum = %s\n", hb.dbuf.chksum);
-	printf ("  linkflag = %c\n", hb.dbuf.linkflag);
-	printf ("  linkname = %s\n", hb.dbuf.linkname);
-	fflush (stdout);
-    }
-
-    /* Write the header to the tarfile.
-     */
-    return (dts_PutBlock (out, hb.dummy));
+        hb->dbuf.chksum[n] = *ip++;
 }
 
 
@@ -693,7 +747,7 @@ dts_GetHeader (
     struct fheader *fh		/* decoded file header (output)	*/
 )
 {
-    register char *ip, *op;
+    register char *ip;
     register int n;
     union	hblock *hb;
     int	checksum, ntrys;
@@ -736,17 +790,39 @@ dts_GetHeader (
     if (ntrys > 1)
         fprintf (stderr, "found next file following checksum error\n");
 
-    /* Decode the ascii header fields into the output file header
-     * structure.
-     */
-    for (ip=hb->dbuf.name, op=fh->name;  (*op++ = *ip++);  )
-        ;
-    fh->isdir = (*(op-2) == '/');
+    dts_DecodeHeader (hb, fh);
+    return (TBLOCK);
+}
+
+
+/**
+ *  DTS_DECODEHEADER -- Decode the ascii fields of a (checked) header block
+ *  into the binary file header structure.
+ */
+static void
+dts_DecodeHeader (
+    union hblock   *hb,			/* (input) header block		*/
+    struct fheader *fh			/* (output) decoded file header	*/
+)
+{
+    register char *ip, *op;
+    register int n;
+
+    for (ip=hb->dbuf.name, op=fh->name;
+	(op - fh->name) < NAMSIZ-1 && (*op = *ip++);  op++)
+            ;
+    *op = EOS;
+    fh->isdir = (op > fh->name && *(op-1) == '/');
 
     sscanf (hb->dbuf.mode,     "%o",  &fh->mode);
     sscanf (hb->dbuf.uid,      "%o",  &fh->uid);
     sscanf (hb->dbuf.gid,      "%o",  &fh->gid);
-    sscanf (hb->dbuf.size,     "%lo", &fh->size);
+    if (hb->dbuf.size[0] & 0x80) {
+	fh->size = 0;				/* base-256 size	*/
+	for (n=1;  n < 12;  n++)
+	    fh->size = (fh->size << 8) | (unsigned char) hb->dbuf.size[n];
+    } else
+        sscanf (hb->dbuf.size,     "%lo", &fh->size);
     sscanf (hb->dbuf.mtime,    "%lo", &fh->mtime);
 
     n = hb->dbuf.linkflag;
@@ -755,10 +831,11 @@ dts_GetHeader (
     else
         fh->linkflag = 0;
 
-    if (fh->linkflag)
-        strcpy (fh->linkname, hb->dbuf.linkname);
-	
-    return (TBLOCK);
+    if (fh->linkflag) {
+        strncpy (fh->linkname, hb->dbuf.linkname, NAMSIZ-1);
+        fh->linkname[NAMSIZ-1] = EOS;
+    } else
+        fh->linkname[0] = EOS;
 }
 
 
@@ -774,7 +851,7 @@ dts_Chksum (
     register int	sum;
 
     for (sum=0;  --nbytes >= 0;  )
-        sum += *p++;
+        sum += (unsigned char) *p++;
 
     return (sum);
 }
@@ -1043,7 +1120,8 @@ dts_CopyToTar (
 {
     register char   *bp;
     register int    i;
-    int     nbytes, nleft, blocks, fd, count, total, ch;
+    int     nbytes, nleft, fd, count, ch;
+    long    blocks, total;
     char    buf[TBLOCK*2];
 
     bp     = buf;
@@ -1291,3 +1369,698 @@ dts_DName (
 
     return (path);
 }
+
+
+
+/*****************************************************************************
+ *  Tar streams.
+ ****************************************************************************/
+
+/**
+ *  DTS_TAROPENSOURCE -- Open a directory as a tar stream to be read.  The
+ *  tree is walked once here to fix the layout of the archive, the data
+ *  are read from the member files only as the stream is read.  Member
+ *  names are relative to the parent of the directory.  Trees with names
+ *  too long for a tar header can't be streamed.
+ *
+ *  @brief	Open a directory as a tar stream to be read.
+ *  @fn		int dts_tarOpenSource (char *path, long *size)
+ *
+ *  @param  path	directory path
+ *  @param  size	size of the stream (output)
+ *  @return		stream descriptor, or -1 on error
+ */
+int
+dts_tarOpenSource (char *path, long *size)
+{
+    tarStream *ts = (tarStream *) NULL;
+    char   dir[SZ_PATH], *ip;
+    int    fd, i;
+    long   off = 0;
+
+
+    memset (dir, 0, SZ_PATH);
+    strncpy (dir, path, SZ_PATH-1);
+    for (i=strlen (dir); i > 1 && dir[i-1] == '/'; )
+	dir[--i] = EOS;
+
+    if ((fd = open (dir, O_RDONLY)) < 0)
+	return (-1);
+    if (fd >= TAR_MAX_FD || !(ts = calloc (1, sizeof (tarStream)))) {
+	close (fd);
+	return (-1);
+    }
+
+    if ((ip = strrchr (dir, '/')))
+	ip++;
+    else
+	ip = dir;
+    strncpy (ts->root, dir, (ip - dir));
+
+    if (dts_tarWalk (ts, dir, ip) != OK) {
+	dts_tarFree (ts);
+	close (fd);
+	return (-1);
+    }
+
+    /*  Lay out the members, each a header record followed by the data
+    **  padded to a whole record.  Two zero records end the archive.
+    */
+    for (i=0; i < ts->nmem; i++) {
+	ts->mem[i].hoff = off;
+	off += TAR_RECORD + (ts->mem[i].hdr.size + TAR_RECORD - 1) / 
+	    TAR_RECORD * TAR_RECORD;
+    }
+    ts->size = off + 2 * TAR_RECORD;
+
+    pthread_mutex_lock (&tar_mutex);
+    tar_stream[fd] = ts;
+    pthread_mutex_unlock (&tar_mutex);
+
+    if (size)
+	*size = ts->size;
+    return (fd);
+}
+
+
+/**
+ *  DTS_TAROPENSINK -- Open a tar stream to be unpacked in a directory as
+ *  it is written.
+ *
+ *  @brief	Open a tar stream to be unpacked in a directory.
+ *  @fn		int dts_tarOpenSink (char *dir)
+ *
+ *  @param  dir		directory in which to unpack
+ *  @return		stream descriptor, or -1 on error
+ */
+int
+dts_tarOpenSink (char *dir)
+{
+    tarStream *ts = (tarStream *) NULL;
+    int    fd;
+
+
+    if (access (dir, F_OK) != 0)
+	dts_makePath (dir, TRUE);
+
+    if ((fd = open (dir, O_RDONLY)) < 0)
+	return (-1);
+    if (fd >= TAR_MAX_FD || !(ts = calloc (1, sizeof (tarStream)))) {
+	close (fd);
+	return (-1);
+    }
+
+    ts->sink  = 1;
+    ts->ofd   = -1;
+    ts->state = TS_HEADER;
+    snprintf (ts->root, SZ_PATH, "%s%s", dir, 
+	(dir[0] && dir[strlen (dir)-1] == '/') ? "" : "/");
+    pthread_mutex_init (&ts->mutex, NULL);
+    pthread_cond_init (&ts->cond, NULL);
+
+    pthread_mutex_lock (&tar_mutex);
+    tar_stream[fd] = ts;
+    pthread_mutex_unlock (&tar_mutex);
+
+    return (fd);
+}
+
+
+/**
+ *  DTS_TARISSTREAM -- See whether a descriptor is a tar stream.
+ *
+ *  @brief	See whether a descriptor is a tar stream.
+ *  @fn		int dts_tarIsStream (int fd)
+ *
+ *  @param  fd		descriptor
+ *  @return		1 if a tar stream, 0 otherwise
+ */
+int
+dts_tarIsStream (int fd)
+{
+    return ((fd >= 0 && fd < TAR_MAX_FD) ? (tar_stream[fd] != NULL) : 0);
+}
+
+
+/**
+ *  DTS_TARREAD -- Read part of a source tar stream.  Headers and padding
+ *  are made as needed, member data are read from the files.  Several
+ *  threads may read the stream at once.
+ *
+ *  @brief	Read part of a source tar stream.
+ *  @fn		int dts_tarRead (int fd, void *buf, int nbytes, off_t offset)
+ *
+ *  @param  fd		stream descriptor
+ *  @param  buf		data buffer
+ *  @param  nbytes	number of bytes to read
+ *  @param  offset	stream offset of first byte
+ *  @return		number of bytes read, or -1 on error
+ */
+int
+dts_tarRead (int fd, void *buf, int nbytes, off_t offset)
+{
+    tarStream *ts = (tarStream *) NULL;
+    tarMember *m;
+    union  hblock hb;
+    char  *op = buf;
+    long   pos, rel, dsize, nb, n, nread = 0;
+    int    i, mfd;
+
+
+    if (!dts_tarIsStream (fd) || (ts = tar_stream[fd])->sink) {
+	errno = EBADF;
+	return (-1);
+    }
+    if (offset >= ts->size)
+	return (0);
+    n = min ((long) nbytes, (ts->size - (long) offset));
+
+    while (nread < n) {
+	pos = (long) offset + nread;
+
+	if ((i = dts_tarFind (ts, pos)) < 0) {
+	    memset (&op[nread], 0, (n - nread));	/* end of archive */
+	    break;
+	}
+	m = &ts->mem[i];
+	rel = pos - m->hoff;
+	dsize = (m->hdr.size + TAR_RECORD - 1) / TAR_RECORD * TAR_RECORD;
+
+	if (rel < TAR_RECORD) {
+	    dts_EncodeHeader (&m->hdr, &hb);
+	    nb = min ((TAR_RECORD - rel), (n - nread));
+	    memcpy (&op[nread], &hb.dummy[rel], nb);
+
+	} else if ((rel -= TAR_RECORD) < m->hdr.size) {
+	    nb = min ((m->hdr.size - rel), (n - nread));
+	    if ((mfd = open (m->path, O_RDONLY)) < 0) {
+		dtsErrLog (NULL, "dts_tarRead: cannot open '%s'\n", m->path);
+		return (-1);
+	    }
+	    if (dts_filePRead (mfd, &op[nread], (int) nb, (off_t) rel) != nb) {
+		dtsErrLog (NULL, "dts_tarRead: '%s' changed size\n", m->path);
+		close (mfd);
+		return (-1);
+	    }
+	    close (mfd);
+
+	} else {
+	    nb = min ((dsize - rel), (n - nread));	/* padding	*/
+	    memset (&op[nread], 0, nb);
+	}
+	nread += nb;
+    }
+
+    return ((int) n);
+}
+
+
+/**
+ *  DTS_TARWRITE -- Write part of a sink tar stream.  The archive is unpacked
+ *  in order, so data ahead of what has been unpacked are held until the
+ *  gap is filled.  Writers ahead of the others are slowed once too much
+ *  is held.  Data already unpacked (e.g. resent) are ignored.
+ *
+ *  @brief	Write part of a sink tar stream.
+ *  @fn		int dts_tarWrite (int fd, void *buf, int nbytes, off_t offset)
+ *
+ *  @param  fd		stream descriptor
+ *  @param  buf		data buffer
+ *  @param  nbytes	number of bytes to write
+ *  @param  offset	stream offset of first byte
+ *  @return		number of bytes written, or -1 on error
+ */
+int
+dts_tarWrite (int fd, void *buf, int nbytes, off_t offset)
+{
+    tarStream *ts = (tarStream *) NULL;
+    tarPend *p, **pp;
+    struct timeval  now;
+    struct timespec ts_wait;
+    long   off = (long) offset, skip;
+    int    ntry;
+
+
+    if (!dts_tarIsStream (fd) || !(ts = tar_stream[fd])->sink) {
+	errno = EBADF;
+	return (-1);
+    }
+    if (nbytes <= 0)
+	return (0);
+
+    pthread_mutex_lock (&ts->mutex);
+
+    /*  Wait a while for the data before ours when too much is held.
+    */
+    for (ntry=0; off > ts->next && ts->state != TS_ERR && 
+	ts->npend + nbytes > TAR_MAX_PEND && ntry < TAR_MAX_WAIT; ntry++) {
+	    gettimeofday (&now, NULL);
+	    now.tv_usec += TAR_WAIT_MSEC * 1000;
+	    ts_wait.tv_sec  = now.tv_sec + now.tv_usec / 1000000;
+	    ts_wait.tv_nsec = (now.tv_usec % 1000000) * 1000;
+	    pthread_cond_timedwait (&ts->cond, &ts->mutex, &ts_wait);
+    }
+
+    if (ts->state == TS_ERR) {
+	pthread_mutex_unlock (&ts->mutex);
+	errno = EIO;
+	return (-1);
+    }
+
+    if (off > ts->next) {
+	/*  Hold the data, in order of offset, until we get to them.
+	*/
+	if (!(p = calloc (1, sizeof (tarPend))) || !(p->buf = malloc (nbytes))) {
+	    if (p) free ((void *) p);
+	    pthread_mutex_unlock (&ts->mutex);
+	    errno = ENOMEM;
+	    return (-1);
+	}
+	memcpy (p->buf, buf, nbytes);
+	p->offset = off;
+	p->nbytes = nbytes;
+	for (pp = &ts->pend; *pp && (*pp)->offset <= off; pp = &(*pp)->next)
+	    ;
+	p->next = *pp;
+	*pp = p;
+	ts->npend += nbytes;
+
+    } else {
+	if ((skip = ts->next - off) < nbytes)
+	    dts_tarUnpack (ts, (char *) buf + skip, (int) (nbytes - skip));
+
+	/*  Unpack whatever we were holding that now follows.
+	*/
+	while ((p = ts->pend) && p->offset <= ts->next) {
+	    if ((skip = ts->next - p->offset) < p->nbytes)
+		dts_tarUnpack (ts, p->buf + skip, (int) (p->nbytes - skip));
+	    ts->pend = p->next;
+	    ts->npend -= p->nbytes;
+	    free ((void *) p->buf);
+	    free ((void *) p);
+	}
+	pthread_cond_broadcast (&ts->cond);
+    }
+
+    if (ts->state == TS_ERR) {
+	pthread_mutex_unlock (&ts->mutex);
+	errno = EIO;
+	return (-1);
+    }
+    pthread_mutex_unlock (&ts->mutex);
+
+    return (nbytes);
+}
+
+
+/**
+ *  DTS_TARCLOSE -- Close a tar stream.  For a sink the directory times are
+ *  restored, and it is an error if the archive wasn't completely unpacked.
+ *
+ *  @brief	Close a tar stream.
+ *  @fn		int dts_tarClose (int fd)
+ *
+ *  @param  fd		stream descriptor
+ *  @return		OK or ERR
+ */
+int
+dts_tarClose (int fd)
+{
+    tarStream *ts;
+    struct timeval tvp[2];
+    int    i, status = OK;
+
+
+    if (!dts_tarIsStream (fd))
+	return (ERR);
+
+    pthread_mutex_lock (&tar_mutex);
+    ts = tar_stream[fd];
+    tar_stream[fd] = (tarStream *) NULL;
+    pthread_mutex_unlock (&tar_mutex);
+
+    if (ts->sink) {
+	if (ts->ofd >= 0)
+	    close (ts->ofd);
+	if (ts->state != TS_DONE) {
+	    dtsErrLog (NULL, "dts_tarClose: incomplete archive in '%s'\n",
+		ts->root);
+	    status = ERR;
+	}
+
+	/*  Deepest directories first, so setting their times doesn't 
+	**  change those of their parents.
+	*/
+	for (i=ts->nmem - 1; i >= 0; i--) {
+	    tvp[0].tv_sec  = tvp[1].tv_sec  = ts->mem[i].hdr.mtime;
+	    tvp[0].tv_usec = tvp[1].tv_usec = 0L;
+	    utimes (ts->mem[i].path, tvp);
+	}
+	pthread_mutex_destroy (&ts->mutex);
+	pthread_cond_destroy (&ts->cond);
+    }
+
+    dts_tarFree (ts);
+    close (fd);
+
+    return (status);
+}
+
+
+/**
+ *  DTS_TARSIZE -- Get the size of the tar stream for a directory.
+ *
+ *  @brief	Get the size of the tar stream for a directory.
+ *  @fn		long dts_tarSize (char *path)
+ *
+ *  @param  path	directory path
+ *  @return		size of the stream, or -1 if it can't be streamed
+ */
+long
+dts_tarSize (char *path)
+{
+    long  size = -1;
+    int   fd;
+
+    if ((fd = dts_tarOpenSource (path, &size)) < 0)
+	return (-1);
+    dts_tarClose (fd);
+
+    return (size);
+}
+
+
+/**
+ *  DTS_TARWALK -- Add a directory tree to the members of a source stream.
+ */
+static int
+dts_tarWalk (tarStream *ts, char *path, char *name)
+{
+    struct stat st;
+    struct fheader *fh;
+    tarMember *m;
+    DIR   *dp;
+    struct dirent *entry;
+    char   npath[SZ_PATH], nname[SZ_PATH];
+    int    len, status = OK;
+
+
+    if (lstat (path, &st) < 0)
+	return (ERR);
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
+	return (OK);				/* skip devices, fifos, etc */
+
+    len = strlen (name) + (S_ISDIR(st.st_mode) ? 1 : 0);
+    if (len >= NAMSIZ || strlen (path) >= SZ_PATH) {
+	dtsErrLog (NULL, "dts_tarWalk: name too long to stream '%s'\n", path);
+	return (ERR);
+    }
+
+    if (ts->nmem == ts->maxmem) {
+	ts->maxmem += 256;
+	if (!(m = realloc (ts->mem, ts->maxmem * sizeof (tarMember))))
+	    return (ERR);
+	ts->mem = m;
+    }
+    m = &ts->mem[ts->nmem++];
+    memset (m, 0, sizeof (tarMember));
+    strcpy (m->path, path);
+
+    fh = &m->hdr;
+    sprintf (fh->name, "%s%s", name, (S_ISDIR(st.st_mode) ? "/" : ""));
+    fh->mode  = (int) (st.st_mode & 07777);
+    fh->uid   = (int) st.st_uid;
+    fh->gid   = (int) st.st_gid;
+    fh->mtime = (long) st.st_mtime;
+
+    if (S_ISREG(st.st_mode)) {
+	fh->size = (long) st.st_size;
+
+    } else if (S_ISLNK(st.st_mode)) {
+	fh->linkflag = LF_SYMLINK;
+	if (readlink (path, fh->linkname, NAMSIZ-1) < 0 || 
+	    fh->linkname[NAMSIZ-2]) {
+		dtsErrLog (NULL, "dts_tarWalk: cannot stream link '%s'\n", path);
+		return (ERR);
+	}
+
+    } else {
+	fh->linkflag = LF_DIR;
+	fh->isdir = 1;
+	if (!(dp = opendir (path)))
+	    return (ERR);
+	while (status == OK && (entry = readdir (dp))) {
+	    if (strcmp (entry->d_name, ".") == 0 || 
+		strcmp (entry->d_name, "..") == 0)
+		    continue;
+	    if (snprintf (npath, SZ_PATH, "%s/%s", path, 
+		entry->d_name) >= SZ_PATH || snprintf (nname, SZ_PATH, 
+		"%s/%s", name, entry->d_name) >= SZ_PATH) {
+		    dtsErrLog (NULL, "dts_tarWalk: path too long '%s'\n", path);
+		    status = ERR;
+	    } else
+	        status = dts_tarWalk (ts, npath, nname);
+	}
+	closedir (dp);
+    }
+
+    return (status);
+}
+
+
+/**
+ *  DTS_TARFIND -- Find the member of a source stream holding an offset.
+ */
+static int
+dts_tarFind (tarStream *ts, long offset)
+{
+    tarMember *m;
+    int   lo = 0, hi = ts->nmem - 1, mid;
+
+
+    if (ts->nmem <= 0 || offset < 0)
+	return (-1);
+
+    while (lo < hi) {
+	mid = (lo + hi + 1) / 2;
+	if (ts->mem[mid].hoff <= offset)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+
+    m = &ts->mem[lo];
+    if (offset >= m->hoff + TAR_RECORD + 
+	(m->hdr.size + TAR_RECORD - 1) / TAR_RECORD * TAR_RECORD)
+	    return (-1);			/* in the trailer	*/
+    return (lo);
+}
+
+
+/**
+ *  DTS_TARUNPACK -- Unpack the next bytes of a sink stream.  Called with
+ *  the stream locked.
+ */
+static void
+dts_tarUnpack (tarStream *ts, char *buf, int nbytes)
+{
+    union  hblock hb;
+    int    i, nb, chksum;
+
+
+    ts->next += nbytes;
+
+    while (nbytes > 0 && ts->state != TS_ERR && ts->state != TS_DONE) {
+	switch (ts->state) {
+	case TS_HEADER:
+	    nb = min (nbytes, (TAR_RECORD - ts->nrec));
+	    memcpy (&ts->rec[ts->nrec], buf, nb);
+	    if ((ts->nrec += nb) < TAR_RECORD)
+		break;
+	    ts->nrec = 0;
+
+	    /*  Two zero records end the archive.
+	    */
+	    for (i=0; i < TAR_RECORD && !ts->rec[i]; i++)
+		;
+	    if (i == TAR_RECORD) {
+		if (++ts->nzero == 2)
+		    ts->state = TS_DONE;
+		break;
+	    }
+	    ts->nzero = 0;
+
+	    memset (&hb, 0, sizeof (hb));
+	    memcpy (hb.dummy, ts->rec, TAR_RECORD);
+	    sscanf (hb.dbuf.chksum, "%o", &chksum);
+	    for (i=0; i < 8; i++)
+		hb.dbuf.chksum[i] = ' ';
+	    if (dts_Chksum (hb.dummy, TAR_RECORD) != chksum) {
+		dtsErrLog (NULL, "dts_tarUnpack: header checksum error\n");
+		ts->state = TS_ERR;
+		break;
+	    }
+	    memset (&ts->cur, 0, sizeof (ts->cur));
+	    dts_DecodeHeader (&hb, &ts->cur);
+	    dts_tarBegin (ts);
+	    break;
+
+	case TS_DATA:
+	    nb = (int) min ((long) nbytes, ts->left);
+	    if (ts->ofd >= 0 && dts_fileWrite (ts->ofd, buf, nb) != nb) {
+		dtsErrLog (NULL, "dts_tarUnpack: cannot write '%s'\n",
+		    ts->opath);
+		ts->state = TS_ERR;
+		break;
+	    }
+	    if ((ts->left -= nb) == 0)
+		dts_tarEnd (ts);
+	    break;
+
+	case TS_PAD:
+	    nb = (int) min ((long) nbytes, ts->pad);
+	    if ((ts->pad -= nb) == 0)
+		ts->state = TS_HEADER;
+	    break;
+
+	default:
+	    nb = nbytes;
+	    break;
+	}
+	buf += nb;
+	nbytes -= nb;
+    }
+}
+
+
+/**
+ *  DTS_TARBEGIN -- Create the member of a sink stream whose header we've
+ *  just read.
+ */
+static void
+dts_tarBegin (tarStream *ts)
+{
+    struct fheader *fh = &ts->cur;
+    tarMember *m;
+
+
+    if (!dts_tarSafeName (fh->name)) {
+	dtsErrLog (NULL, "dts_tarBegin: unsafe name '%s'\n", fh->name);
+	ts->state = TS_ERR;
+	return;
+    }
+    memset (ts->opath, 0, SZ_PATH);
+    snprintf (ts->opath, SZ_PATH, "%s%s", ts->root, fh->name);
+
+    ts->left = fh->size;
+    ts->pad  = (fh->size + TAR_RECORD - 1) / TAR_RECORD * TAR_RECORD - 
+	fh->size;
+    ts->ofd  = -1;
+
+    if (fh->linkflag == LF_DIR || fh->isdir) {
+	if (dts_makePath (ts->opath, TRUE) != OK) {
+	    dtsErrLog (NULL, "dts_tarBegin: cannot mkdir '%s'\n", ts->opath);
+	    ts->state = TS_ERR;
+	    return;
+	}
+	chmod (ts->opath, (fh->mode & 07777) | 0700);
+
+	/*  Save the directory to restore its time at the end.
+	*/
+	if (ts->nmem == ts->maxmem) {
+	    ts->maxmem += 256;
+	    if (!(m = realloc (ts->mem, ts->maxmem * sizeof (tarMember)))) {
+		ts->state = TS_ERR;
+		return;
+	    }
+	    ts->mem = m;
+	}
+	m = &ts->mem[ts->nmem++];
+	memcpy (&m->hdr, fh, sizeof (struct fheader));
+	strcpy (m->path, ts->opath);
+
+    } else {
+	dts_makePath (ts->opath, FALSE);
+	unlink (ts->opath);
+
+	if (fh->linkflag == LF_SYMLINK) {
+	    if (symlink (fh->linkname, ts->opath) < 0)
+		dtsErrLog (NULL, "dts_tarBegin: cannot link '%s'\n", ts->opath);
+	} else if ((ts->ofd = open (ts->opath, O_WRONLY|O_CREAT|O_TRUNC, 
+	    0600)) < 0) {
+		dtsErrLog (NULL, "dts_tarBegin: cannot create '%s'\n", 
+		    ts->opath);
+		ts->state = TS_ERR;
+		return;
+	}
+    }
+
+    ts->state = TS_DATA;
+    if (ts->left == 0)
+	dts_tarEnd (ts);
+}
+
+
+/**
+ *  DTS_TAREND -- Finish the member of a sink stream we've just
+ *  unpacked.
+ */
+static void
+dts_tarEnd (tarStream *ts)
+{
+    struct fheader *fh = &ts->cur;
+    struct timeval  tvp[2];
+
+
+    if (ts->ofd >= 0) {
+	close (ts->ofd);
+	ts->ofd = -1;
+	chmod (ts->opath, fh->mode & 07777);
+	tvp[0].tv_sec  = tvp[1].tv_sec  = fh->mtime;
+	tvp[0].tv_usec = tvp[1].tv_usec = 0L;
+	utimes (ts->opath, tvp);
+    }
+
+    ts->state = (ts->pad > 0 ? TS_PAD : TS_HEADER);
+}
+
+
+/**
+ *  DTS_TARSAFENAME -- Check a member name stays below the sink directory.
+ */
+static int
+dts_tarSafeName (char *name)
+{
+    char  *ip = name;
+
+    if (!name[0] || name[0] == '/')
+	return (0);
+
+    while (*ip) {
+	if (ip[0] == '.' && ip[1] == '.' && (ip[2] == '/' || ip[2] == EOS))
+	    return (0);
+	if ((ip = strchr (ip, '/')) == NULL)
+	    break;
+	ip++;
+    }
+    return (1);
+}
+
+
+/**
+ *  DTS_TARFREE -- Free a tar stream.
+ */
+static void
+dts_tarFree (tarStream *ts)
+{
+    tarPend *p;
+
+    while ((p = ts->pend)) {
+	ts->pend = p->next;
+	free ((void *) p->buf);
+	free ((void *) p);
+    }
+    if (ts->mem)
+	free ((void *) ts->mem);
+    free ((void *) ts);
+}
@@ -19,6 +19,7 @@
 #define	MAX_LINELEN	256
 
 #define	SZ_PADBUF	8196
+#define	SZ_MAXOCT	077777777777L	/* max size as 11 octal digits	*/
 #define	SZ_TAPEBUFFER	(TBLOCK * NBLOCK)
 
 #define	EOS		'\0'
@@ -72,6 +73,61 @@ struct fheader {
 
 
 
+/*  Tar streams.  A directory is sent as a tar archive which is built on
+ *  the fly as it is read and unpacked as it is written (see dtsTar.c).
+ *  Streams use standard 512 byte records.
+ */
+#define	TAR_RECORD	512		/* stream record size		*/
+#define	TAR_MAX_FD	4096		/* max stream descriptor	*/
+#define	TAR_MAX_PEND	(64*1024*1024)	/* max data held out of order	*/
+#define	TAR_WAIT_MSEC	100		/* wait for in-order data	*/
+#define	TAR_MAX_WAIT	50		/* ... this many times		*/
+
+#define	TS_HEADER	0		/* sink states			*/
+#define	TS_DATA		1
+#define	TS_PAD		2
+#define	TS_DONE		3
+#define	TS_ERR		4
+
+typedef struct tarMember {
+    struct fheader hdr;			/* member header		*/
+    char   path[SZ_PATH];		/* local path to member		*/
+    long   hoff;			/* stream offset of header	*/
+} tarMember;
+
+typedef struct tarPend {
+    long   offset;			/* stream offset of data	*/
+    int    nbytes;			/* size of data			*/
+    char  *buf;				/* data				*/
+    struct tarPend *next;
+} tarPend;
+
+typedef struct tarStream {
+    int    sink;			/* unpacking stream?		*/
+    char   root[SZ_PATH];		/* archive root directory	*/
+    long   size;			/* stream size (source only)	*/
+
+    tarMember *mem;			/* archive members		*/
+    int    nmem, maxmem;
+
+    pthread_mutex_t mutex;		/* sink state ...		*/
+    pthread_cond_t  cond;
+    long   next;			/* next stream offset to unpack	*/
+    long   npend;			/* bytes held out of order	*/
+    tarPend *pend;			/* data held out of order	*/
+    char   rec[TAR_RECORD];		/* header being assembled	*/
+    int    nrec;
+    int    state;			/* unpacking state		*/
+    int    nzero;			/* zero records seen		*/
+    struct fheader cur;			/* current member		*/
+    char   opath[SZ_PATH];		/* path of current member	*/
+    int    ofd;				/* output file descriptor	*/
+    long   left;			/* data left in current member	*/
+    long   pad;				/* padding after current member	*/
+} tarStream;
+
+
+
 /* Map TAR file mode bits into characters for printed output.
  */
 struct _modebits {
@@ -0,0 +1,403 @@
+/**
+ *  DTSTUNE.C -- DTS transfer auto-tuning.
+ *
+ *  The stream count, chunk size and socket buffer size used for PSock
+ *  transfers to a peer are learned from earlier transfers rather than
+ *  being fixed in the queue config.  On first contact we measure the RTT
+ *  to the peer, each completed transfer then gives a throughput sample
+ *  from which we:
+ *
+ *    - grow the socket buffers while the per-stream bandwidth-delay
+ *	product shows the streams are window limited,
+ *    - grow chunks so the CS_CHUNK send window covers the BDP,
+ *    - try fewer streams than configured, keeping the smallest count
+ *	which is (nearly) as fast as the best seen.
+ *
+ *  Once settled we watch for the throughput drifting away from what we
+ *  tuned for and start again.  The configured stream count is an upper
+ *  bound since it also sets the queue's port range.  Setting DTS_NOTUNE
+ *  disables tuning.
+ *
+ *	n = dts_tuneStreams (host, url, nthreads)
+ *	    dts_tuneSocket (host, &chunk, &sockbuf)
+ *	    dts_tuneUpdate (host, fsize, nthreads, secs)
+ *    rtt = dts_tuneProbeRTT (host, port)
+ *
+ *  @file       dtsTune.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  DTS transfer auto-tuning.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "dts.h"
+#include "dtsPSock.h"
+
+
+#define	TUNE_PROBE_TRIES	3	/* RTT probes to make		*/
+#define	TUNE_PROBE_TIME		2	/* RTT probe timeout (sec)	*/
+#define	TUNE_AUTO_BUF	(4*1024*1024)	/* BDP the kernel handles	*/
+
+
+static  dtsTune  tune[MAX_TUNE_PEERS];	/* tuned peers			*/
+static  pthread_mutex_t tune_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static dtsTune *dts_tuneFind (char *host, int create);
+static int      dts_tuneBuffers (dtsTune *t);
+
+
+
+/**
+ *  DTS_TUNESTREAMS -- Get the number of streams to use for a transfer to
+ *  the given peer.  The first call for a peer measures the RTT to its
+ *  command port.
+ *
+ *  @brief  Get the number of streams to use for a peer.
+ *  @fn     int dts_tuneStreams (char *host, char *url, int nthreads)
+ *
+ *  @param  host	peer host name
+ *  @param  url		peer command URL (for the RTT probe)
+ *  @param  nthreads	configured number of streams
+ *  @return		number of streams to use
+ */
+int
+dts_tuneStreams (char *host, char *url, int nthreads)
+{
+    dtsTune *t = (dtsTune *) NULL;
+    char     phost[SZ_FNAME];
+    int      n = nthreads, port = DTS_PORT, probe = 0;
+    double   rtt = 0.0;
+
+
+    if (DTS_NOTUNE || !host || nthreads <= 1)
+	return (nthreads);
+
+    pthread_mutex_lock (&tune_mutex);
+    if ((t = dts_tuneFind (host, 1))) {
+	if (nthreads > t->maxthreads) {
+	    /*  New (or larger) stream limit, start over from the top.
+	    */
+	    t->maxthreads = t->nthreads = t->best_nthreads = nthreads;
+	    t->state = TUNE_PROBE;
+	    t->nsamp = 0;
+	}
+	n = min (t->nthreads, nthreads);
+	probe = (t->rtt <= 0.0);
+    }
+    pthread_mutex_unlock (&tune_mutex);
+
+    /*  Measure the RTT if we don't know it yet.
+    */
+    if (probe && url) {
+	memset (phost, 0, SZ_FNAME);
+	if (sscanf (url, "http://%159[^:/]:%d", phost, &port) >= 1 &&
+	    (rtt = dts_tuneProbeRTT (phost, port)) > 0.0) {
+		pthread_mutex_lock (&tune_mutex);
+		t->rtt = rtt;
+		pthread_mutex_unlock (&tune_mutex);
+
+		if (PERF_DEBUG)
+		    dtsErrLog (NULL, "tune: %s rtt = %.3f ms\n", host,
+			rtt * 1000.0);
+	}
+    }
+
+    return (n);
+}
+
+
+/**
+ *  DTS_TUNESOCKET -- Get the chunk and socket buffer size for a peer.  A
+ *  value of zero means use the default (for the socket buffers, leave it
+ *  to the kernel).
+ *
+ *  @brief  Get the chunk and socket buffer size for a peer.
+ *  @fn     void dts_tuneSocket (char *host, long *chunk, int *sockbuf)
+ *
+ *  @param  host	peer host name
+ *  @param  chunk	transfer chunk size (output)
+ *  @param  sockbuf	socket buffer size (output)
+ *  @return		nothing
+ */
+void
+dts_tuneSocket (char *host, long *chunk, int *sockbuf)
+{
+    dtsTune *t = (dtsTune *) NULL;
+
+
+    *chunk = 0;
+    *sockbuf = 0;
+    if (DTS_NOTUNE || !host)
+	return;
+
+    pthread_mutex_lock (&tune_mutex);
+    if ((t = dts_tuneFind (host, 0))) {
+	*chunk   = t->chunk;
+	*sockbuf = t->sockbuf;
+    }
+    pthread_mutex_unlock (&tune_mutex);
+}
+
+
+/**
+ *  DTS_TUNEUPDATE -- Add a throughput sample from a completed transfer
+ *  and adjust the settings for the peer.  Small files are ignored since
+ *  their time is mostly setup.
+ *
+ *  @brief  Add a throughput sample for a peer.
+ *  @fn     void dts_tuneUpdate (char *host, long fsize, int nthreads,
+ *		double secs)
+ *
+ *  @param  host	peer host name
+ *  @param  fsize	file size
+ *  @param  nthreads	number of streams used
+ *  @param  secs	transfer time (sec)
+ *  @return		nothing
+ */
+void
+dts_tuneUpdate (char *host, long fsize, int nthreads, double secs)
+{
+    dtsTune *t = (dtsTune *) NULL;
+    double   mbps = 0.0;
+
+
+    if (DTS_NOTUNE || !host || fsize < TUNE_MIN_FSIZE || secs <= 0.0)
+	return;
+
+    pthread_mutex_lock (&tune_mutex);
+    if ((t = dts_tuneFind (host, 0)) == NULL || nthreads != t->nthreads) {
+	pthread_mutex_unlock (&tune_mutex);	/* not ours to judge	*/
+	return;
+    }
+
+    mbps = ((double) fsize * 8.0) / (secs * 1000000.0);
+    t->tput = (t->nsamp ? (0.5 * t->tput + 0.5 * mbps) : mbps);
+    t->nsamp++;
+    t->last = time ((time_t) 0);
+
+    if (t->state == TUNE_SETTLED) {
+	/*  Start over if throughput has moved well away from what we tuned
+	**  for, e.g. the path or the load on it has changed.
+	*/
+	if (fabs (t->tput - t->best_tput) > (TUNE_DRIFT * t->best_tput)) {
+	    if (++t->ndrift >= TUNE_NSAMP) {
+		t->nthreads = t->best_nthreads = t->maxthreads;
+		t->state  = TUNE_PROBE;
+		t->nsamp  = t->ndrift = 0;
+		t->rtt    = 0.0;		/* re-probe the path	*/
+		t->best_tput = 0.0;
+	    }
+	} else
+	    t->ndrift = 0;
+	goto done_;
+    }
+
+    if (t->nsamp < TUNE_NSAMP)
+	goto done_;
+
+    /*  Fix the buffers first, a change means measuring this setting again.
+    */
+    if (dts_tuneBuffers (t)) {
+	t->state = TUNE_PROBE;
+	t->nsamp = 0;
+	goto done_;
+    }
+
+    if (t->state == TUNE_PROBE) {
+	t->best_tput = t->tput;
+	t->best_nthreads = t->nthreads;
+	if (t->nthreads > 1) {
+	    t->nthreads = max (1, t->nthreads / 2);
+	    t->state = TUNE_SEARCH;
+	} else
+	    t->state = TUNE_SETTLED;
+
+    } else if (t->tput * TUNE_GAIN >= t->best_tput) {
+	/*  Fewer streams are (nearly) as fast, keep going down.
+	*/
+	t->best_tput = max (t->best_tput, t->tput);
+	t->best_nthreads = t->nthreads;
+	if (t->nthreads > 1)
+	    t->nthreads = max (1, t->nthreads / 2);
+	else
+	    t->state = TUNE_SETTLED;
+
+    } else {
+	/*  Too few streams, go back to the best we found.
+	*/
+	t->nthreads = t->best_nthreads;
+	t->tput = t->best_tput;
+	t->state = TUNE_SETTLED;
+    }
+    t->nsamp = 0;
+
+done_:
+    if (PERF_DEBUG)
+	dtsErrLog (NULL,
+	    "tune: %s %.1f Mb/s (%d str) -> state=%d n=%d buf=%d chunk=%ld\n",
+	    host, mbps, nthreads, t->state, t->nthreads, t->sockbuf, t->chunk);
+    pthread_mutex_unlock (&tune_mutex);
+}
+
+
+/**
+ *  DTS_TUNEPROBERTT -- Measure the RTT to a peer as the time taken by a
+ *  TCP connect to the given port.  We take the best of a few tries.
+ *
+ *  @brief  Measure the RTT to a peer.
+ *  @fn     double dts_tuneProbeRTT (char *host, int port)
+ *
+ *  @param  host	peer host name (or IP string)
+ *  @param  port	port number to connect to
+ *  @return		RTT in seconds, or 0.0 on error
+ */
+double
+dts_tuneProbeRTT (char *host, int port)
+{
+    struct sockaddr_in addr;
+    struct hostent *he = (struct hostent *) NULL;
+    struct timeval  t1, t2;
+    double  rtt = 0.0, best = 0.0;
+    int     i, sock, err = 0;
+    socklen_t len = sizeof (err);
+
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons (port);
+    if (!inet_aton (host, &addr.sin_addr)) {
+	if ((he = dts_getHostByName (host)) == NULL)
+	    return (0.0);
+	memcpy (&addr.sin_addr, he->h_addr_list[0], sizeof (addr.sin_addr));
+    }
+
+    for (i=0; i < TUNE_PROBE_TRIES; i++) {
+	if ((sock = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+	    break;
+	fcntl (sock, F_SETFL, O_NONBLOCK);
+
+	gettimeofday (&t1, NULL);
+	if (connect (sock, (struct sockaddr *)&addr, sizeof (addr)) < 0 &&
+	    errno != EINPROGRESS) {
+		close (sock);
+		break;
+	}
+
+	if (dts_sockWait (sock, POLLOUT, TUNE_PROBE_TIME) <= 0 ||
+	    getsockopt (sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+		close (sock);
+		break;
+	}
+	gettimeofday (&t2, NULL);
+	close (sock);
+
+	rtt = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1000000.0;
+	if (best <= 0.0 || rtt < best)
+	    best = rtt;
+    }
+
+    return (best);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ *****************************************************************************/
+
+/**
+ *  DTS_TUNEFIND -- Find (or create) the entry for a peer.  Must be called
+ *  with the table locked.  When the table is full the least recently
+ *  used entry is replaced.
+ */
+static dtsTune *
+dts_tuneFind (char *host, int create)
+{
+    register int i;
+    dtsTune *t = (dtsTune *) NULL, *old = &tune[0];
+
+
+    for (i=0; i < MAX_TUNE_PEERS; i++) {
+	if (tune[i].host[0] && strcmp (tune[i].host, host) == 0)
+	    return (&tune[i]);
+	if (!t && !tune[i].host[0])
+	    t = &tune[i];
+	if (tune[i].last < old->last)
+	    old = &tune[i];
+    }
+
+    if (!create)
+	return ((dtsTune *) NULL);
+
+    if (!t)
+	t = old;
+    memset (t, 0, sizeof (dtsTune));
+    strncpy (t->host, host, SZ_FNAME-1);
+    t->state = TUNE_PROBE;
+    t->last  = time ((time_t) 0);
+
+    return (t);
+}
+
+
+/**
+ *  DTS_TUNEBUFFERS -- Size the socket buffers and chunks from the per-stream
+ *  bandwidth-delay product.  Buffers are left to the kernel until the BDP
+ *  is more than it will normally handle, after that they're doubled for
+ *  as long as the streams look window-limited.  Returns non-zero if
+ *  anything changed.
+ */
+static int
+dts_tuneBuffers (dtsTune *t)
+{
+    double  rate, bdp;
+    long    chunk = 0;
+    int     sockbuf = t->sockbuf;
+
+
+    if (t->rtt <= 0.0 || t->nthreads <= 0)
+	return (0);
+
+    rate = (t->tput * 1000000.0 / 8.0) / t->nthreads;	/* bytes/sec	*/
+    bdp  = rate * t->rtt;
+
+    if (sockbuf == 0) {
+	if (2 * bdp > TUNE_AUTO_BUF)
+	    sockbuf = (int) min (4 * bdp, TUNE_MAX_BUF);
+    } else if (bdp >= 0.4 * sockbuf)
+	sockbuf = min (2 * sockbuf, TUNE_MAX_BUF);
+
+    /*  Keep the BDP (with headroom) in the CS_CHUNK send window, chunks
+    **  are only ever made larger than the default.
+    */
+    chunk = (long) (2 * bdp / PS_WINDOW);
+    chunk = ((chunk + PS_UNIT_ALIGN - 1) / PS_UNIT_ALIGN) * PS_UNIT_ALIGN;
+    chunk = (chunk > SZ_XFER_CHUNK ? min (chunk, TUNE_MAX_CHUNK) : 0);
+
+    if (sockbuf == t->sockbuf && chunk == t->chunk)
+	return (0);
+
+    t->sockbuf = sockbuf;
+    t->chunk   = chunk;
+    return (1);
+}
@@ -50,24 +50,22 @@ int	udt_checksum_policy	= CS_NONE;
     
 extern struct timeval io_tv;
 extern int    queue_delay;
-extern int    thread_sem;
 extern DTS   *dts;
 extern int    first_write;
 
-static int    err_return	= -1;
 
 
 
 /**
- *  UDTSPAWNTHREADS -- Spawn a worker thread for the transfer.  All we do here
- *  is start a thread to run the function passed in.  This may be used to
- *  either read or write the data.
+ *  UDTSPAWNTHREADS -- Spawn the worker threads for the transfer.  All we do
+ *  here is queue the function passed in for each stream in the worker
+ *  pool.  This may be used to either read or write the data.
  *
  *
- *  @brief  Spawn a worker thread for the transfer.
+ *  @brief  Spawn the worker threads for the transfer.
  *  @fn     int udtSpawnThreads (void *worker, int nthreads, char *dir, 
  *		char *fname, long fsize, int mode, int rate, int port, 
- *		char *host, int verbose, pthread_t *tids)
+ *		char *host, int verbose, dtsWorkGroup *grp)
  *
  *  @param  worker	worker function 
  *  @param  nthreads	number of threads to create
@@ -79,7 +77,7 @@ static int    err_return	= -1;
  *  @param  port	client base port number
  *  @param  host	client host name
  *  @param  verbose	verbose output flag
- *  @param  tids	thread id array
+ *  @param  grp		work group for the transfer
  *
  *  @return		status code
  *
@@ -87,22 +85,15 @@ static int    err_return	= -1;
 int
 udtSpawnThreads (void *worker, int nthreads, char *dir, char *fname, 
 	long fsize, int mode, int rate, int port, char *host, int verbose, 
-	pthread_t  *tids)
+	dtsWorkGroup *grp)
 {
-    int    t, rc;
+    int    t;
     long   start, end, stripeSize;
 #ifdef STATIC_ARG
     static psArg  arg[MAX_THREADS];
 #else
     psArg  *arg = (psArg *) NULL, *argP = (psArg *) NULL;
 #endif
-    pthread_attr_t  attr;                       /* thread attributes    */
-
-
-    /* Initialize the service processing thread attribute.
-    */
-    pthread_attr_init (&attr);
-    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_JOINABLE);
 
 
     /* Do the actual file transfer.
@@ -136,61 +127,32 @@ udtSpawnThreads (void *worker, int nthreads, char *dir, char *fname,
 	    dtsErrLog (NULL, "Spawning thread %2d ...%10ld to %10ld\n", 
 		t, argP->start, argP->end);
 	    
-        if ((rc = pthread_create (&tids[t], &attr, (void *)worker, 
-		(void *)argP))) {
-                    dtsErrLog (NULL, 
-			"ERROR: pthread_create() fails, code: %d\n", rc);
-                    return (ERR);
+        if (dts_workSubmit (grp, t, worker, (void *)argP) != OK) {
+            dtsErrLog (NULL, "ERROR: cannot queue transfer thread %d\n", t);
+            return (ERR);
         }
     }
 
-    pthread_attr_destroy (&attr);
     return (OK);
 }
 
 
 /**
  *  UDTCOLLECTTHREADS -- Collect the worker threads for the transfer.  Our
- *  onl job  here is start a thread to rejoin the previously createed
- *  threads.
+ *  only job here is to wait for the streams queued in the group to
+ *  complete.
  *
  *  @brief  Collect worker threads for the transfer.
- *  @fn     int udtCollectThreads (int nthreads, pthread_t *tids)
+ *  @fn     int *udtCollectThreads (dtsWorkGroup *grp)
  *
- *  @param  nthreads	number of threads to create
- *  @param  tids	thread IDs
- *  @return		status code
+ *  @param  grp		work group for the transfer
+ *  @return		array of thread status if any failed, else NULL
  *
  */
-
-#define USE_PTHREAD_JOIN
-
 int *
-udtCollectThreads (int nthreads, pthread_t *tids)
+udtCollectThreads (dtsWorkGroup *grp)
 {
-#ifdef USE_PTHREAD_JOIN
-    int  nerrs = 0;
-    void *s;
-#endif
-    int  t, rc;
-    //static int stat[MAX_THREADS];
-    int *stat = calloc (MAX_THREADS, sizeof (int));
-
-    memset (stat, 0, MAX_THREADS);
-    /* Free attribute and wait for the threads to complete.
-    */
-#ifdef USE_PTHREAD_JOIN
-    for (t=0; t < nthreads; t++) {
-        if ((rc = pthread_join (tids[t], (void **)&s)) ) {
-            stat[t] =  *((int *) s);
-	    nerrs++;
-        }
-    }
-#else
-    ;
-#endif
-
-    return ( nerrs ? stat : NULL );
+    return (dts_workWait (grp));
 }
 
 
@@ -244,10 +206,11 @@ udtSendFile (void *data)
 	if (ps < 0) {
             dtsErrLog (NULL, 
 		"udtSendFile: cannot open server socket %d\n", arg->port);
+	    dts_workStatus (ERR);
 	    return;
 	}
 
-        dts_semDecr (thread_sem);
+        dts_workReady ();
 
         /* Accept a connection on the port.
         */
@@ -280,6 +243,7 @@ udtSendFile (void *data)
             dtsErrLog (NULL, 
 		"udtSendFile: cannot open client socket to %s:%d ps=%d\n",
 		arg->host, arg->port, ps);
+	    dts_workStatus (ERR);
 	    return;
 	}
 	sock = ps;
@@ -303,7 +267,8 @@ udtSendFile (void *data)
     	        arg->nbytes);
 	    free ((void *) fp);
             lock = pthread_mutex_unlock (&udt_mutex);
-            pthread_exit (&err_return);
+            dts_workStatus (ERR);
+            return;
 	}
 
         nread = dts_fileRead (fd, buf, arg->nbytes);	/* read stripe	*/
@@ -317,7 +282,8 @@ udtSendFile (void *data)
     	    dts_sandboxPath(arg->fname), arg->fname);
 	free ((void *) fp);
         lock = pthread_mutex_unlock (&udt_mutex);
-        pthread_exit (&err_return);
+        dts_workStatus (ERR);
+        return;
     }
 
     lock = pthread_mutex_unlock (&udt_mutex);
@@ -327,8 +293,8 @@ udtSendFile (void *data)
 
     if (PTCP_VERB) {
         dtsErrLog (NULL, 
-	    "Send t %d, fsize=%10d  offset=%10d  stripe=%10d port=%d fd=%d\n",
-	    arg->tnum, (int)arg->fsize, (int)arg->start, (int)arg->nbytes, 
+	    "Send t %d, fsize=%10ld  offset=%10ld  stripe=%10ld port=%d fd=%d\n",
+	    arg->tnum, arg->fsize, arg->start, arg->nbytes, 
 	    arg->port, sock);
     }
         
@@ -376,7 +342,6 @@ udtSendFile (void *data)
     if (arg) free ((void *) arg);
 #endif
     udt_cleanup ();
-    pthread_exit (NULL);
 }
 
 
@@ -427,6 +392,7 @@ udtReceiveFile (void *data)
             dtsErrLog (NULL, 
 		"udtReceiveFile: cannot open client socket to %s:%d\n",
                 arg->host, arg->port);
+            dts_workStatus (ERR);
             return;
         }
 	sock = ps;
@@ -437,10 +403,11 @@ udtReceiveFile (void *data)
         if (ps < 0) {
             dtsErrLog (NULL, "udtReceiveFile: cannot open server socket %d\n",
 		arg->port);
+            dts_workStatus (ERR);
             return;
         }
 
-	dts_semDecr (thread_sem);
+	dts_workReady ();
 
         /* Accept a connection on the port.
         */
@@ -472,8 +439,8 @@ udtReceiveFile (void *data)
 
     if (PTCP_VERB) {
         dtsErrLog (NULL, 
-	    "Recv t %d, fsize=%10d  offset=%10d  chunk=%10d  %d/%d %d\n",
-	    arg->tnum, (int)arg->fsize, (int)arg->start, (int)arg->nbytes,
+	    "Recv t %d, fsize=%10ld  offset=%10ld  chunk=%10ld  %d/%d %d\n",
+	    arg->tnum, arg->fsize, arg->start, arg->nbytes,
 	    arg->port, sock, fd);
     }
 
@@ -512,7 +479,8 @@ udtReceiveFile (void *data)
 	    if (dts_preAlloc (arg->fname, arg->fsize) != OK) {
 	        if (dbuf) free ((void *) dbuf);
                 lock = pthread_mutex_unlock (&udt_mutex);
-                pthread_exit (&err_return);
+                dts_workStatus (ERR);
+                return;
 	    }
     	    if (dts->debug > 2)
         	dtsLog (dts, "udtReceive: file prealloc time: %.4g sec\n", 
@@ -557,7 +525,8 @@ udtReceiveFile (void *data)
 	    */
 	    if (dbuf) free ((void *) dbuf);
             lock = pthread_mutex_unlock (&udt_mutex);
-            pthread_exit (&err_return);
+            dts_workStatus (ERR);
+            return;
         }
 
         lock = pthread_mutex_unlock (&udt_mutex);
@@ -586,7 +555,6 @@ udtReceiveFile (void *data)
 #endif
 
     udt_cleanup ();
-    pthread_exit (NULL);
 }
 
 
@@ -774,8 +742,8 @@ udtComputeStripe (long fsize, int nthreads, int tnum,
         *chsize = fsize;
 
     } else {
-        size = (int) (fsize / nthreads);
-        remain = (int) (fsize  - ( nthreads * size));
+        size = fsize / nthreads;
+        remain = fsize  - ( nthreads * size);
 
         if (tnum < remain) {
             size++;
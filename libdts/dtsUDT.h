@@ -69,8 +69,8 @@ pthread_mutex_t svc_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int     udtSpawnThreads (void *worker, int nthreads, char *dir, char *fname,
                         long fsize, int mode, int rate, int port, char *host,
-                        int verbose, pthread_t *tids);
-int    *udtCollectThreads (int nthreads, pthread_t *tids);
+                        int verbose, dtsWorkGroup *grp);
+int    *udtCollectThreads (dtsWorkGroup *grp);
 
 
 void 	udtSendFile (void *data);
@@ -0,0 +1,872 @@
+/**
+ *  DTSURING.C -- DTS io_uring transfer routines.
+ *
+ *  The 'uring' transfer method moves a file over the same set of parallel
+ *  sockets as the 'psock' method, but rather than one blocking thread per
+ *  stream a single worker drives every stream of the transfer through a
+ *  Linux io_uring.  Each stream has one registered chunk buffer and at
+ *  most one chunk in flight:  the sender queues a file read linked to the
+ *  socket send of that chunk, the receiver a socket recv linked to the
+ *  file write.  The streams take chunks from the file in turn as they
+ *  finish the last, so a slow stream simply sends less of the file.
+ *
+ *  On the wire each chunk is preceeded by a phdr giving its offset and
+ *  size, a stream ends with a PS_EOS header whose 'maxbytes' is the data
+ *  total sent on the stream.  No checksums are computed in transit, the
+ *  file is validated by the queue once delivered as usual.  The header is
+ *  kept just below an aligned data area in the buffer so a large file may
+ *  be read or written with O_DIRECT, a chunk that isn't aligned goes
+ *  through the file's buffered descriptor.
+ *
+ *	urSpawnTransfer (worker, nthreads, dir, fname, fsize, mode, port,
+ *			session, dport, host, verbose, fd, grp)
+ *	     urSendFile (data)
+ *	     urReceiveFile (data)
+ *
+ *  @file       dtsURing.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  DTS io_uring transfer routines.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "dts.h"
+#include "dtsPSock.h"
+#include "dtsURing.h"
+
+#if defined(Linux) && defined(__NR_io_uring_setup)
+#define	HAVE_URING
+#include <linux/io_uring.h>
+#endif
+
+
+extern DTS   *dts;
+
+
+#ifdef HAVE_URING
+
+#define	UR_HDR		sizeof (phdr)	/* chunk header size		*/
+#define	UR_DOFF		DIO_ALIGN	/* data offset in stream buffer	*/
+#define	UR_HOFF		(UR_DOFF-UR_HDR) /* header offset, ends at data	*/
+
+#define	UR_OP_DISK	0		/* file read/write		*/
+#define	UR_OP_NET	1		/* socket send/recv		*/
+
+#define	UR_HEAD		0		/* receiving chunk header	*/
+#define	UR_DATA		1		/* moving chunk data		*/
+#define	UR_EOS		2		/* sending end-of-stream	*/
+#define	UR_DONE		3		/* stream complete		*/
+
+
+/*  Submission and completion rings shared with the kernel.
+*/
+typedef struct {
+    int       fd;			/* ring descriptor		*/
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned  sq_entries;		/* submission ring size		*/
+    unsigned  npending;			/* entries not yet submitted	*/
+
+    struct io_uring_sqe *sqes;		/* submission entries		*/
+    struct io_uring_cqe *cqes;		/* completion entries		*/
+
+    void     *sq_ptr, *cq_ptr;		/* ring mappings		*/
+    size_t    sq_sz, cq_sz, sqe_sz;	/* mapping sizes		*/
+} urRing;
+
+/*  Per-stream state.
+*/
+typedef struct {
+    int      sock;			/* data socket			*/
+    int      state;			/* stream state			*/
+    int      linked;			/* net op linked to disk op?	*/
+    int      inflight;			/* ops in flight		*/
+    unsigned char *buf;			/* header + chunk buffer	*/
+    long     offset;			/* file offset of chunk		*/
+    long     nbytes;			/* chunk size			*/
+    long     ndisk;			/* chunk bytes read/written	*/
+    long     nnet;			/* bytes sent/received		*/
+    long     total;			/* data bytes on the stream	*/
+} urStream;
+
+/*  Transfer state.
+*/
+typedef struct {
+    urRing   ring;			/* the io_uring			*/
+    urStream *str;			/* streams			*/
+    int      nstreams;			/* number of streams		*/
+    int      ndone;			/* streams completed		*/
+    int      sender;			/* sending the file?		*/
+    int      fixed;			/* buffers registered?		*/
+    int      fd;			/* file descriptor		*/
+    int      error;			/* transfer failed		*/
+    long     fsize;			/* file size			*/
+    long     next;			/* offset of next chunk		*/
+    char    *qname;			/* queue name (for shaping)	*/
+} urXfer;
+
+
+static int  ur_transfer (urArg *arg, int sender);
+static int  ur_connect (urArg *arg, urStream *str, int server, int retry);
+static int  ur_run (urXfer *x);
+static int  ur_complete (urXfer *x, urStream *s, int op, int res);
+static int  ur_sendNext (urXfer *x, urStream *s);
+static int  ur_recvHead (urXfer *x, urStream *s);
+static int  ur_queueDisk (urXfer *x, urStream *s, int flags);
+static int  ur_queueNet (urXfer *x, urStream *s, int flags);
+static void ur_abort (urXfer *x);
+
+static int  ur_ringInit (urRing *r, unsigned entries);
+static void ur_ringFree (urRing *r);
+static struct io_uring_sqe *ur_getSqe (urRing *r);
+static int  ur_enter (urRing *r, unsigned wait_nr);
+
+#endif
+
+
+
+
+/**
+ *  URSPAWNTRANSFER -- Queue the worker for the transfer.  All streams are
+ *  run by the one worker so only a single item is queued in the pool.
+ *
+ *  @brief  Queue the worker for the transfer.
+ *  @fn     int urSpawnTransfer (void *worker, int nthreads, char *dir,
+ *		char *fname, long fsize, int mode, int port, int session,
+ *		int dport, char *host, int verbose, int fd, 
+ *		dtsWorkGroup *grp)
+ *
+ *  @param  worker	worker function
+ *  @param  nthreads	number of streams to open
+ *  @param  dir		working directory
+ *  @param  fname	file name
+ *  @param  fsize	file size
+ *  @param  mode	transfer mode (push or pull)
+ *  @param  port	client base port number
+ *  @param  session	transfer session on the data port
+ *  @param  dport	listener's shared data port (0 for none)
+ *  @param  host	client host name
+ *  @param  verbose	verbose output flag
+ *  @param  fd		shared file descriptor (or -1)
+ *  @param  grp		work group for the transfer
+ *
+ *  @return		status code
+ */
+int
+urSpawnTransfer (void *worker, int nthreads, char *dir, char *fname,
+	long fsize, int mode, int port, int session, int dport, char *host, 
+	int verbose, int fd, dtsWorkGroup *grp)
+{
+    urArg *arg = (urArg *) NULL;
+    long   chunk = 0;
+
+
+    if ((arg = (urArg *) calloc (1, sizeof (urArg))) == NULL)
+	return (ERR);
+
+    strcpy (arg->host, host);
+    strcpy (arg->fname, fname);
+    strcpy (arg->dir, dir);
+    arg->fsize    = fsize;
+    arg->fd       = fd;
+    arg->port     = port;
+    arg->session  = session;
+    arg->dport    = dport;
+    arg->mode     = mode;
+    arg->nstreams = max (1, min (nthreads, MAX_THREADS));
+    dts_tuneSocket (host, &chunk, &arg->sockbuf);
+    (void) dts_poolKeepalive (dir, arg->qname);		/* get queue name */
+
+    if (verbose)
+	dtsErrLog (NULL, "Spawning uring transfer: %d streams, %ld bytes\n",
+	    arg->nstreams, fsize);
+
+    if (dts_workSubmit (grp, 0, worker, (void *)arg) != OK) {
+	dtsErrLog (NULL, "ERROR: cannot queue uring transfer\n");
+	free ((void *) arg);
+	return (ERR);
+    }
+
+    return (OK);
+}
+
+
+/**
+ *  urSendFile -- Send a file to a remote DTS.  We are the server for the
+ *  data connections in a push, the client in a pull.
+ *
+ *  @brief  Send a file to a remote DTS.
+ *  @fn     urSendFile (void *data)
+ *
+ *  @param  data	caller thread data
+ *  @return		nothing
+ */
+void
+urSendFile (void *data)
+{
+    urArg *arg = data;
+    int    status = ERR;
+
+
+#ifdef HAVE_URING
+    status = ur_transfer (arg, 1);
+#else
+    dtsErrLog (NULL, "urSendFile: io_uring not supported\n");
+    dts_workReady ();
+#endif
+    dts_workStatus (status);
+    free ((void *) arg);
+}
+
+
+/**
+ *  urReceiveFile -- Receive a file from a remote DTS.  We are the client
+ *  for the data connections in a push, the server in a pull.  The output
+ *  file was opened by our parent (see psOpenReceiveFile).
+ *
+ *  @brief  Receive a file from a remote DTS.
+ *  @fn     urReceiveFile (void *data)
+ *
+ *  @param  data	caller thread data
+ *  @return		nothing
+ */
+void
+urReceiveFile (void *data)
+{
+    urArg *arg = data;
+    int    status = ERR;
+
+
+#ifdef HAVE_URING
+    status = ur_transfer (arg, 0);
+#else
+    dtsErrLog (NULL, "urReceiveFile: io_uring not supported\n");
+    dts_workReady ();
+#endif
+    dts_workStatus (status);
+    free ((void *) arg);
+}
+
+
+
+#ifdef HAVE_URING
+
+/*****************************************************************************
+ *  Private procedures.
+ *****************************************************************************/
+
+/**
+ *  UR_TRANSFER -- Connect the streams and run the transfer.
+ */
+static int
+ur_transfer (urArg *arg, int sender)
+{
+    urXfer   x;
+    urStream *s = (urStream *) NULL;
+    struct iovec *iov = (struct iovec *) NULL;
+    char    *fp = NULL;
+    int      i, server, status = ERR, flag = 1;
+    struct timeval tv1;
+
+
+    memset (&x, 0, sizeof (x));
+    x.ring.fd  = -1;
+    x.fd       = -1;
+    x.sender   = sender;
+    x.fsize    = arg->fsize;
+    x.nstreams = arg->nstreams;
+    x.qname    = arg->qname;
+    server     = (sender ? (arg->mode == XFER_PUSH) : (arg->mode == XFER_PULL));
+
+    if ((x.str = calloc (x.nstreams, sizeof (urStream))) == NULL ||
+	(iov = calloc (x.nstreams, sizeof (struct iovec))) == NULL) {
+	    dtsErrLog (NULL, "ur_transfer: cannot alloc %d streams\n",
+		x.nstreams);
+	    dts_workReady ();
+	    goto done_;
+    }
+
+    /*  Open the file, the receiver's was opened by our parent.
+    */
+    if (sender) {
+	if (strcmp (arg->dir, "./") != 0) {
+	    char *pdir  = dts_sandboxPath (arg->dir);
+
+	    if (access (pdir, F_OK) != 0)
+		dts_makePath (pdir, TRUE);
+	    chdir (pdir);
+	    free ((void *) pdir);
+	}
+	if ((x.fd = dts_fileOpenDirect ((fp=dts_sandboxPath(arg->fname)),
+	    O_RDONLY, arg->fsize)) < 0) {
+		dtsErrLog (NULL, "urSendFile: cannot open '%s' (%s)\n",
+		    fp, arg->fname);
+		free ((void *) fp);
+		dts_workReady ();
+		goto done_;
+	}
+	free ((void *) fp);
+	posix_fadvise (x.fd, (off_t) 0, (off_t) 0, POSIX_FADV_SEQUENTIAL);
+    } else
+	x.fd = arg->fd;
+
+    /*  Set up the ring and the stream buffers.  If the buffers can't be
+    **  registered (e.g. locked memory limits) we use plain read/write.
+    */
+    if (ur_ringInit (&x.ring, (unsigned) (x.nstreams * UR_DEPTH)) != OK) {
+	dtsErrLog (NULL, "ur_transfer: io_uring setup fails: %s\n",
+	    strerror (errno));
+	dts_workReady ();
+	goto done_;
+    }
+    for (i=0; i < x.nstreams; i++) {
+	if (posix_memalign ((void **) &x.str[i].buf, DIO_ALIGN, UR_DOFF+UR_CHUNK)) {
+	    dtsErrLog (NULL, "ur_transfer: cannot alloc stream buffer\n");
+	    dts_workReady ();
+	    goto done_;
+	}
+	iov[i].iov_base = x.str[i].buf;
+	iov[i].iov_len  = UR_DOFF + UR_CHUNK;
+    }
+    x.fixed = (syscall (__NR_io_uring_register, x.ring.fd,
+	IORING_REGISTER_BUFFERS, iov, x.nstreams) == 0);
+
+    /*  Make the data connections.
+    */
+    if (ur_connect (arg, x.str, server, (sender ? 1 : 3)) != OK)
+	goto done_;
+    for (i=0; i < x.nstreams; i++) {
+	if (!DTS_NAGLE)
+	    setsockopt (x.str[i].sock, IPPROTO_TCP, TCP_NODELAY,
+		(char *)&flag, sizeof(flag));
+    }
+
+    if (PTCP_VERB)
+	dtsErrLog (NULL, "uring %s: %d streams fsize=%ld fixed=%d\n",
+	    (sender ? "send" : "recv"), x.nstreams, x.fsize, x.fixed);
+
+    /*  Start every stream, then run the ring until they're all done.
+    */
+    gettimeofday (&tv1, NULL);
+    for (i=0; i < x.nstreams && !x.error; i++) {
+	s = &x.str[i];
+	if ((sender ? ur_sendNext (&x, s) : ur_recvHead (&x, s)) != OK)
+	    ur_abort (&x);
+    }
+    status = ur_run (&x);
+
+    if (PTCP_VERB)
+	dtsTimeLog ("uring: transfer time: %.4g sec\n", tv1);
+
+done_:
+    if (x.ring.fd >= 0)
+	ur_ringFree (&x.ring);		/* also drops the buffers	*/
+    if (x.str) {
+	for (i=0; i < x.nstreams; i++) {
+	    if (x.str[i].sock > 0)
+		close (x.str[i].sock);
+	    if (x.str[i].buf)
+		free ((void *) x.str[i].buf);
+	}
+	free ((void *) x.str);
+    }
+    if (iov)
+	free ((void *) iov);
+    if (sender && x.fd >= 0)
+	dts_fileClose (x.fd);
+
+    return (status);
+}
+
+
+/**
+ *  UR_CONNECT -- Make the data connections.  As a server we open all the
+ *  listening sockets before telling our parent we're ready.
+ */
+static int
+ur_connect (urArg *arg, urStream *str, int server, int retry)
+{
+    int  i, *lsock = (int *) NULL, status = OK;
+
+
+    if (!server) {
+	dts_workReady ();
+	for (i=0; i < arg->nstreams; i++) {
+	    if ((str[i].sock = dts_dataConnect (arg->host, arg->dport, 
+		arg->session, i, arg->port + i, retry, arg->sockbuf)) < 0) {
+		    dtsErrLog (NULL,
+			"ur_connect: cannot open client socket to %s:%d\n",
+			arg->host, arg->port + i);
+		    str[i].sock = 0;
+		    return (ERR);
+	    }
+	}
+	return (OK);
+    }
+
+    if ((lsock = calloc (arg->nstreams, sizeof (int))) == NULL) {
+	dts_workReady ();
+	return (ERR);
+    }
+    for (i=0; i < arg->nstreams; i++) {
+	if ((lsock[i] = dts_dataRegister (arg->dport, arg->session, i, 
+	    arg->port + i, arg->sockbuf)) < 0) {
+		dtsErrLog (NULL, "ur_connect: cannot open server socket %d\n",
+		    arg->port + i);
+		lsock[i] = 0;
+		status = ERR;
+		break;
+	}
+    }
+    dts_workReady ();				/* tell parent we're ready */
+
+    for (i=0; status == OK && i < arg->nstreams; i++) {
+	if ((str[i].sock = dts_dataAccept (lsock[i], arg->sockbuf)) < 0) {
+            dtsErrLog (NULL, "ur_connect: accept(%d): %s\n", arg->port + i,
+		strerror(errno));
+	    str[i].sock = 0;
+	    status = ERR;
+	}
+    }
+
+    for (i=0; i < arg->nstreams; i++) {
+	if (lsock[i] > 0)
+	    close (lsock[i]);
+    }
+    free ((void *) lsock);
+
+    return (status);
+}
+
+
+/**
+ *  UR_RUN -- Submit queued requests and handle completions until every
+ *  stream is done.  After an error we keep going until whatever is still
+ *  in flight has completed since it may be using the stream buffers.
+ */
+static int
+ur_run (urXfer *x)
+{
+    urRing   *r = &x->ring;
+    urStream *s = (urStream *) NULL;
+    struct io_uring_cqe *cqe;
+    unsigned  head, tail;
+    int       i, inflight, op, res;
+
+
+    while (1) {
+	for (i=0, inflight=0; i < x->nstreams; i++)
+	    inflight += x->str[i].inflight;
+	if (inflight == 0 && (x->error || x->ndone == x->nstreams))
+	    break;
+	if (inflight == 0 && r->npending == 0) {
+	    dtsErrLog (NULL, "ur_run: transfer stalled\n");
+	    x->error = 1;
+	    break;
+	}
+
+	if (ur_enter (r, 1) < 0) {
+	    dtsErrLog (NULL, "ur_run: io_uring_enter: %s\n", strerror(errno));
+	    ur_abort (x);
+	    continue;
+	}
+
+	head = *r->cq_head;
+	tail = __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE);
+	for ( ; head != tail; head++) {
+	    cqe = &r->cqes[head & *r->cq_mask];
+	    s   = &x->str[cqe->user_data >> 1];
+	    op  = (int) (cqe->user_data & 1);
+	    res = cqe->res;
+
+	    s->inflight--;
+	    if (!x->error && ur_complete (x, s, op, res) != OK)
+		ur_abort (x);
+	}
+	__atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return (x->error ? ERR : OK);
+}
+
+
+/**
+ *  UR_COMPLETE -- Handle the completion of a request on a stream.
+ */
+static int
+ur_complete (urXfer *x, urStream *s, int op, int res)
+{
+    phdr  *h = (phdr *) (s->buf + UR_HOFF);
+    long   len;
+
+
+    /*  A short result fails the link, the second request of the pair is
+    **  then cancelled and we queue it again ourselves.
+    */
+    if (res == -ECANCELED)
+	return (OK);
+    if (res < 0) {
+	dtsErrLog (NULL, "ur_complete: %s error: %s\n",
+	    (op == UR_OP_DISK ? "file" : "socket"), strerror (-res));
+	return (ERR);
+    }
+
+    if (x->sender) {
+	if (op == UR_OP_DISK) {			/* read done		*/
+	    if (res == 0) {
+		dtsErrLog (NULL, "ur_complete: unexpected EOF at %ld\n",
+		    s->offset + s->ndisk);
+		return (ERR);
+	    }
+	    if ((s->ndisk += res) < s->nbytes) {
+		s->linked = 0;
+		return (ur_queueDisk (x, s, 0));
+	    }
+	    return (s->linked ? OK : ur_queueNet (x, s, 0));
+	}
+
+	len = UR_HDR + s->nbytes;		/* send done		*/
+	if (res == 0)
+	    return (ERR);
+	if ((s->nnet += res) < len)
+	    return (ur_queueNet (x, s, 0));
+	if (s->state == UR_EOS) {
+	    s->state = UR_DONE;
+	    x->ndone++;
+	    return (OK);
+	}
+	s->total += s->nbytes;
+	return (ur_sendNext (x, s));
+    }
+
+    if (op == UR_OP_NET) {
+	if (res == 0) {
+	    dtsErrLog (NULL, "ur_complete: connection closed by peer\n");
+	    return (ERR);
+	}
+	s->nnet += res;
+
+	if (s->state == UR_HEAD) {		/* header recv done	*/
+	    if (s->nnet < UR_HDR)
+		return (ur_queueNet (x, s, 0));
+
+	    if (h->chunkSize == PS_EOS) {
+		if (h->maxbytes != s->total) {
+		    dtsErrLog (NULL, "ur_complete: got %ld of %ld bytes\n",
+			s->total, (long) h->maxbytes);
+		    return (ERR);
+		}
+		s->state = UR_DONE;
+		x->ndone++;
+		return (OK);
+	    }
+	    if (h->chunkSize <= 0 || h->chunkSize > UR_CHUNK ||
+		h->offset < 0 || (h->offset + h->chunkSize) > x->fsize) {
+		    dtsErrLog (NULL, "ur_complete: bad chunk %ld:%d\n",
+			(long) h->offset, h->chunkSize);
+		    return (ERR);
+	    }
+
+	    s->offset = h->offset;
+	    s->nbytes = h->chunkSize;
+	    s->nnet   = s->ndisk = 0;
+	    s->state  = UR_DATA;
+	    s->linked = 1;
+	    if (ur_queueNet (x, s, IOSQE_IO_LINK) != OK)
+		return (ERR);
+	    return (ur_queueDisk (x, s, 0));
+	}
+
+	if (s->nnet < s->nbytes) {		/* data recv done	*/
+	    s->linked = 0;
+	    return (ur_queueNet (x, s, 0));
+	}
+	return (s->linked ? OK : ur_queueDisk (x, s, 0));
+    }
+
+    if ((s->ndisk += res) < s->nbytes)		/* write done		*/
+	return (ur_queueDisk (x, s, 0));
+    s->total += s->nbytes;
+    return (ur_recvHead (x, s));
+}
+
+
+/**
+ *  UR_SENDNEXT -- Send the next chunk of the file on the stream, or the
+ *  end-of-stream header when there are none left.
+ */
+static int
+ur_sendNext (urXfer *x, urStream *s)
+{
+    phdr  *h = (phdr *) (s->buf + UR_HOFF);
+
+
+    memset (h, 0, UR_HDR);
+    s->nnet = s->ndisk = 0;
+
+    if (x->next >= x->fsize) {
+	h->chunkSize = PS_EOS;
+	h->maxbytes  = s->total;
+	s->nbytes    = 0;
+	s->state     = UR_EOS;
+	return (ur_queueNet (x, s, 0));
+    }
+
+    s->offset = x->next;
+    s->nbytes = min (UR_CHUNK, x->fsize - x->next);
+    x->next  += s->nbytes;
+    dts_shapeWait (x->qname, s->nbytes);	/* pace the whole transfer */
+
+    h->chunkSize = (int) s->nbytes;
+    h->offset    = s->offset;
+    h->maxbytes  = s->nbytes;
+    s->state     = UR_DATA;
+    s->linked    = 1;
+
+    if (ur_queueDisk (x, s, IOSQE_IO_LINK) != OK)
+	return (ERR);
+    return (ur_queueNet (x, s, 0));
+}
+
+
+/**
+ *  UR_RECVHEAD -- Receive the next chunk header on the stream.
+ */
+static int
+ur_recvHead (urXfer *x, urStream *s)
+{
+    s->state = UR_HEAD;
+    s->nnet  = s->ndisk = 0;
+    return (ur_queueNet (x, s, 0));
+}
+
+
+/**
+ *  UR_QUEUEDISK -- Queue the file read/write of the rest of the chunk.
+ */
+static int
+ur_queueDisk (urXfer *x, urStream *s, int flags)
+{
+    struct io_uring_sqe *sqe = ur_getSqe (&x->ring);
+
+
+    if (!sqe)
+	return (ERR);
+
+    if (x->fixed) {
+	sqe->opcode = (x->sender ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED);
+	sqe->buf_index = (unsigned short) (s - x->str);
+    } else
+	sqe->opcode = (x->sender ? IORING_OP_READ : IORING_OP_WRITE);
+    sqe->flags     = flags;
+    sqe->fd        = x->fd;
+    if (((s->offset + s->ndisk) | (s->nbytes - s->ndisk)) & (DIO_ALIGN - 1))
+	sqe->fd    = dts_fileBuffered (x->fd);	/* unaligned, no O_DIRECT */
+    sqe->addr      = (unsigned long) (s->buf + UR_DOFF + s->ndisk);
+    sqe->len       = (unsigned) (s->nbytes - s->ndisk);
+    sqe->off       = (unsigned long) (s->offset + s->ndisk);
+    sqe->user_data = ((unsigned long) (s - x->str) << 1) | UR_OP_DISK;
+    s->inflight++;
+
+    return (OK);
+}
+
+
+/**
+ *  UR_QUEUENET -- Queue the socket send/recv of the rest of the header or
+ *  chunk.
+ */
+static int
+ur_queueNet (urXfer *x, urStream *s, int flags)
+{
+    struct io_uring_sqe *sqe = ur_getSqe (&x->ring);
+    unsigned char *addr;
+    long   len;
+
+
+    if (!sqe)
+	return (ERR);
+
+    if (x->sender) {				/* header and data	*/
+	addr = s->buf + UR_HOFF + s->nnet;
+	len  = UR_HDR + s->nbytes - s->nnet;
+    } else if (s->state == UR_HEAD) {
+	addr = s->buf + UR_HOFF + s->nnet;
+	len  = UR_HDR - s->nnet;
+    } else {
+	addr = s->buf + UR_DOFF + s->nnet;
+	len  = s->nbytes - s->nnet;
+    }
+
+    sqe->opcode    = (x->sender ? IORING_OP_SEND : IORING_OP_RECV);
+    sqe->flags     = flags;
+    sqe->fd        = s->sock;
+    sqe->addr      = (unsigned long) addr;
+    sqe->len       = (unsigned) len;
+    sqe->msg_flags = MSG_WAITALL | (x->sender ? MSG_NOSIGNAL : 0);
+    sqe->user_data = ((unsigned long) (s - x->str) << 1) | UR_OP_NET;
+    s->inflight++;
+
+    return (OK);
+}
+
+
+/**
+ *  UR_ABORT -- Fail the transfer.  Shutting down the sockets completes any
+ *  socket requests still waiting on the peer.
+ */
+static void
+ur_abort (urXfer *x)
+{
+    int  i;
+
+    x->error = 1;
+    for (i=0; i < x->nstreams; i++) {
+	if (x->str[i].sock > 0)
+	    shutdown (x->str[i].sock, SHUT_RDWR);
+    }
+}
+
+
+/**
+ *  UR_RINGINIT -- Create the ring and map it.
+ */
+static int
+ur_ringInit (urRing *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+
+    memset (&p, 0, sizeof (p));
+    memset (r, 0, sizeof (urRing));
+    if ((r->fd = (int) syscall (__NR_io_uring_setup, entries, &p)) < 0)
+	return (ERR);
+
+    r->sq_sz  = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    r->cq_sz  = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    r->sqe_sz = p.sq_entries * sizeof (struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	r->sq_sz = r->cq_sz = max (r->sq_sz, r->cq_sz);
+
+    r->sq_ptr = mmap (NULL, r->sq_sz, PROT_READ|PROT_WRITE,
+	MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+	goto err_;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	r->cq_ptr = r->sq_ptr;
+    else if ((r->cq_ptr = mmap (NULL, r->cq_sz, PROT_READ|PROT_WRITE,
+	MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+	    goto err_;
+    r->sqes = mmap (NULL, r->sqe_sz, PROT_READ|PROT_WRITE,
+	MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+	goto err_;
+
+    r->sq_head    = (unsigned *) ((char *) r->sq_ptr + p.sq_off.head);
+    r->sq_tail    = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+    r->sq_mask    = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array   = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+    r->cq_head    = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+    r->cq_tail    = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+    r->cq_mask    = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes       = (struct io_uring_cqe *) ((char *)r->cq_ptr+p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+
+    return (OK);
+
+err_:
+    if (r->sqes && r->sqes != MAP_FAILED)
+	munmap (r->sqes, r->sqe_sz);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+	munmap (r->cq_ptr, r->cq_sz);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+	munmap (r->sq_ptr, r->sq_sz);
+    close (r->fd);
+    r->fd = -1;
+    return (ERR);
+}
+
+
+/**
+ *  UR_RINGFREE -- Unmap and close the ring.
+ */
+static void
+ur_ringFree (urRing *r)
+{
+    munmap (r->sqes, r->sqe_sz);
+    if (r->cq_ptr != r->sq_ptr)
+	munmap (r->cq_ptr, r->cq_sz);
+    munmap (r->sq_ptr, r->sq_sz);
+    close (r->fd);
+    r->fd = -1;
+}
+
+
+/**
+ *  UR_GETSQE -- Get the next free submission entry, submitting what's
+ *  queued if the ring is full.
+ */
+static struct io_uring_sqe *
+ur_getSqe (urRing *r)
+{
+    struct io_uring_sqe *sqe;
+    unsigned  tail = *r->sq_tail, idx;
+
+
+    while ((tail - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE)) >=
+	r->sq_entries) {
+	    if (ur_enter (r, 0) < 0)
+		return ((struct io_uring_sqe *) NULL);
+    }
+
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset (sqe, 0, sizeof (struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n (r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->npending++;
+
+    return (sqe);
+}
+
+
+/**
+ *  UR_ENTER -- Submit the pending entries, waiting for at least 'wait_nr'
+ *  completions.
+ */
+static int
+ur_enter (urRing *r, unsigned wait_nr)
+{
+    int  n;
+
+
+    do {
+	n = (int) syscall (__NR_io_uring_enter, r->fd, r->npending, wait_nr,
+	    (wait_nr ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+	r->npending -= min ((unsigned) n, r->npending);
+    return (n);
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+**  DTSURING.H -- Structures and constants for io_uring transfers.
+**
+*/
+
+#define	UR_CHUNK	SZ_XFER_CHUNK	/* transfer chunk size		*/
+#define	UR_DEPTH	4		/* ring entries per stream	*/
+
+
+/*  Data structure used to pass information into the transfer worker.  All
+**  the streams of a transfer are driven by this one worker.
+*/
+typedef struct {
+    char     fname[256];		/* file name			*/
+    char     dir[256];			/* working directory		*/
+    long     fsize;			/* file size			*/
+    int      fd;			/* shared file descriptor	*/
+
+    char     host[256];			/* remote host name		*/
+    int      port;			/* remote base port number	*/
+    int      session;			/* transfer session		*/
+    int      dport;			/* listener's data port (0=none)*/
+    int      mode;			/* push or pull mode		*/
+    int      nstreams;			/* number of streams		*/
+    int      sockbuf;			/* socket buffer size (0=kernel)*/
+    char     qname[SZ_FNAME];		/* queue name (for shaping)	*/
+} urArg, *urArgP;
+
+
+int     urSpawnTransfer (void *worker, int nthreads, char *dir, char *fname,
+			long fsize, int mode, int port, int session, 
+			int dport, char *host, int verbose, int fd, 
+			dtsWorkGroup *grp);
+
+void 	urSendFile (void *data);
+void 	urReceiveFile (void *data);
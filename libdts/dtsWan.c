@@ -0,0 +1,503 @@
+/**
+ *  DTSWAN.C -- WAN emulation of data connections, for testing only.
+ *
+ *  Tuning changes (windows, stream counts, chunk sizes) only show their
+ *  effect on a long or lossy link, which we rarely have to hand.  With
+ *  emulation turned on the data connections of a transfer between two
+ *  daemons on the same machine are held back the way such a link would
+ *  hold them.  The link is described by a string of the form
+ *
+ *	delay=75,jitter=5,loss=0.1,reorder=0.5,rate=1000,window=4096,seed=1
+ *
+ *  where 'delay' and 'jitter' are the one-way delay and its variation in
+ *  ms, 'loss' and 'reorder' the percentage of segments lost or delivered
+ *  out of order, 'rate' a cap on the link in Mb/s, 'window' the largest
+ *  TCP window in KB (the socket buffer size by default) and 'seed' the
+ *  start of the random sequence, so that a run can be repeated.  Any item
+ *  may be left out.  A queue is emulated with the 'wan' keyword in its
+ *  config block, or every data connection with the DTS_WAN environment
+ *  variable, e.g.
+ *
+ *	DTS_WAN="delay=75,loss=0.1" dtsd -c wan.cfg ...
+ *
+ *  The src/dts.wantest script starts two such daemons, pushes a file from
+ *  one to the other and reports the throughput and validation result.
+ *
+ *  The data are still sent at once, we only sleep before each send for as
+ *  long as the emulated link would be busy.  The model is that of a Reno
+ *  TCP connection:  the sender has at most a window of data in flight per
+ *  round trip, the window starts small and opens as rounds go by, and a
+ *  lost segment costs an extra round trip and halves the window.  On a
+ *  byte stream a reordered segment can only be late, it holds the stream
+ *  for one jitter period.  Each change of direction on the connection
+ *  (e.g. a request and its reply) costs a one-way delay.  The sender
+ *  does the emulating, so both daemons should use the same settings.
+ *
+ *  UDT connections read the DTS_WAN variable themselves, the datagrams
+ *  are really dropped, reordered and delayed (see libudt/channel.cpp).
+ *
+ *	  stat = dts_wanParse (spec, w)
+ *	  stat = dts_wanAttach (fd, qname)
+ *	         dts_wanDetach (fd)
+ *	  nmax = dts_wanSend (fd, nbytes)
+ *	         dts_wanSent (fd, nbytes)
+ *	         dts_wanRecv (fd)
+ *
+ *  @file       dtsWan.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  WAN emulation of data connections, for testing only.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "dts.h"
+#include "dtsPSock.h"
+
+
+extern  DTS  *dts;
+
+typedef struct {
+    int     used;			/* link in use?			*/
+    int     fd;				/* connection			*/
+    dtsWanSpec  w;			/* link settings		*/
+    unsigned int seed;			/* random state			*/
+
+    double  ready;			/* time the link can next send	*/
+    double  rstart;			/* start of current round trip	*/
+    long    rbytes;			/* bytes sent this round trip	*/
+    long    cwnd;			/* congestion window (bytes)	*/
+    long    ssthresh;			/* slow start threshold (bytes)	*/
+    long    window;			/* max window (bytes)		*/
+    int     turn;			/* last op was a read?		*/
+} dtsWanLink;
+
+static  dtsWanLink  links[MAX_WAN_LINKS];
+static  volatile int nlinks	= 0;		/* links in use		*/
+static  pthread_mutex_t wan_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static  dtsWanSpec  wan_env;			/* DTS_WAN settings	*/
+static  int  wan_haveEnv	= 0;
+static  pthread_once_t wan_once = PTHREAD_ONCE_INIT;
+
+static void         dts_wanInit (void);
+static dtsWanLink  *dts_wanFind (int fd);
+static double       dts_wanNow (void);
+static double       dts_wanRand (dtsWanLink *l);
+static double       dts_wanDelay (dtsWanLink *l, double secs);
+static void         dts_wanSleep (double secs);
+
+
+
+/**
+ *  DTS_WANPARSE -- Parse a WAN emulation setting.
+ *
+ *  @brief  Parse a WAN emulation setting.
+ *  @fn     int dts_wanParse (char *spec, dtsWanSpec *w)
+ *
+ *  @param  spec	setting string, e.g. "delay=75,loss=0.1"
+ *  @param  w		link settings (output)
+ *  @return		OK, or ERR if the setting is invalid
+ */
+int
+dts_wanParse (char *spec, dtsWanSpec *w)
+{
+    char   buf[SZ_LINE], *ip, *key, *val, *end;
+    double d;
+
+
+    memset (w, 0, sizeof (dtsWanSpec));
+    w->seed = 1;
+    if (!spec || !spec[0])
+	return (ERR);
+
+    memset (buf, 0, SZ_LINE);
+    strncpy (buf, spec, SZ_LINE - 1);
+
+    for (key = strtok_r (buf, ", \t", &ip); key;
+	 key = strtok_r (NULL, ", \t", &ip)) {
+	    if ((val = strchr (key, (int) '=')) == NULL)
+		return (ERR);
+	    *val++ = '\0';
+	    d = strtod (val, &end);
+	    if (end == val || *end || d < 0.0)
+		return (ERR);
+
+	    if (strcasecmp (key, "delay") == 0)
+		w->delay = d / 1000.0;
+	    else if (strcasecmp (key, "jitter") == 0)
+		w->jitter = d / 1000.0;
+	    else if (strcasecmp (key, "loss") == 0 && d <= 100.0)
+		w->loss = d / 100.0;
+	    else if (strcasecmp (key, "reorder") == 0 && d <= 100.0)
+		w->reorder = d / 100.0;
+	    else if (strcasecmp (key, "rate") == 0)
+		w->rate = d;
+	    else if (strcasecmp (key, "window") == 0)
+		w->window = (long) (d * 1024.0);
+	    else if (strcasecmp (key, "seed") == 0)
+		w->seed = (unsigned int) d;
+	    else
+		return (ERR);
+    }
+
+    return (OK);
+}
+
+
+/**
+ *  DTS_WANATTACH -- Start emulating a data connection, if its queue (or
+ *  the environment) asks for it.  A connection taken from the pool starts
+ *  over as a new one.
+ *
+ *  @brief  Start emulating a data connection.
+ *  @fn     int dts_wanAttach (int fd, char *qname)
+ *
+ *  @param  fd		connected socket
+ *  @param  qname	queue name (may be empty)
+ *  @return		OK if the connection is emulated, else ERR
+ */
+int
+dts_wanAttach (int fd, char *qname)
+{
+    dtsQueue   *dtsq = (dtsQueue *) NULL;
+    dtsWanSpec  w;
+    dtsWanLink *l = (dtsWanLink *) NULL;
+    int     i, sz = 0, stat = ERR;
+    socklen_t len = sizeof (int);
+
+
+    pthread_once (&wan_once, dts_wanInit);
+
+    if (fd < 0)
+	return (ERR);
+    if (qname && qname[0] && (dtsq = dts_queueLookup (qname)) && dtsq->wan[0])
+	stat = dts_wanParse (dtsq->wan, &w);
+    else if (wan_haveEnv) {
+	memcpy (&w, &wan_env, sizeof (dtsWanSpec));
+	stat = OK;
+    }
+    if (stat != OK) {
+	dts_wanDetach (fd);			/* not emulated		*/
+	return (ERR);
+    }
+
+    pthread_mutex_lock (&wan_mutex);
+    if (!(l = dts_wanFind (fd))) {
+	for (i=0; i < MAX_WAN_LINKS; i++) {
+	    if (!links[i].used) {
+		l = &links[i];
+		nlinks++;
+		break;
+	    }
+	}
+    }
+    if (!l) {
+	pthread_mutex_unlock (&wan_mutex);
+	dtsErrLog (NULL, "wan: too many emulated connections\n");
+	return (ERR);
+    }
+
+    memset (l, 0, sizeof (dtsWanLink));
+    memcpy (&l->w, &w, sizeof (dtsWanSpec));
+    l->used   = 1;
+    l->fd     = fd;
+    l->seed   = w.seed + (unsigned int) fd;
+    l->turn   = 1;				/* first send is delayed	*/
+    l->ready  = l->rstart = dts_wanNow ();
+
+    if ((l->window = w.window) <= 0) {
+	if (getsockopt (fd, SOL_SOCKET, SO_SNDBUF, &sz, &len) < 0 || sz <= 0)
+	    sz = TCP_WINDOW_SZ;
+	l->window = (long) sz;
+    }
+    l->ssthresh = l->window;
+    l->cwnd = min (l->window, WAN_INIT_CWND * WAN_MSS);
+    pthread_mutex_unlock (&wan_mutex);
+
+    if (PERF_DEBUG)
+	dtsErrLog (NULL, "wan: fd %d  delay=%g ms loss=%g%% rate=%g win=%ld\n",
+	    fd, w.delay * 1000.0, w.loss * 100.0, w.rate, l->window);
+
+    return (OK);
+}
+
+
+/**
+ *  DTS_WANDETACH -- Stop emulating a connection, e.g. before it is closed.
+ *
+ *  @brief  Stop emulating a connection.
+ *  @fn     void dts_wanDetach (int fd)
+ *
+ *  @param  fd		connected socket
+ *  @return		nothing
+ */
+void
+dts_wanDetach (int fd)
+{
+    dtsWanLink *l = (dtsWanLink *) NULL;
+
+    if (nlinks == 0)
+	return;
+
+    pthread_mutex_lock (&wan_mutex);
+    if ((l = dts_wanFind (fd))) {
+	l->used = 0;
+	nlinks--;
+    }
+    pthread_mutex_unlock (&wan_mutex);
+}
+
+
+/**
+ *  DTS_WANSEND -- Wait until the emulated link could carry more data.  We
+ *  are called before each send and return how much may be sent in this
+ *  step, the caller then reports what it sent with dts_wanSent().
+ *
+ *  @brief  Wait until the emulated link could carry more data.
+ *  @fn     long dts_wanSend (int fd, long nbytes)
+ *
+ *  @param  fd		connected socket
+ *  @param  nbytes	bytes the caller has to send
+ *  @return		max bytes to send now
+ */
+long
+dts_wanSend (int fd, long nbytes)
+{
+    dtsWanLink *l = (dtsWanLink *) NULL;
+    double  now, wait = 0.0;
+
+
+    if (nlinks == 0)
+	return (nbytes);
+
+    pthread_mutex_lock (&wan_mutex);
+    if (!(l = dts_wanFind (fd))) {
+	pthread_mutex_unlock (&wan_mutex);
+	return (nbytes);
+    }
+
+    now = dts_wanNow ();
+    if (l->turn) {				/* change of direction	*/
+	l->ready = max (l->ready, now) + dts_wanDelay (l, l->w.delay);
+	l->rstart = l->ready;
+	l->rbytes = 0;
+	l->turn = 0;
+    }
+    wait = l->ready - now;
+    pthread_mutex_unlock (&wan_mutex);
+
+    if (wait > 0.0)
+	dts_wanSleep (wait);
+
+    return (min (nbytes, WAN_CHUNK));
+}
+
+
+/**
+ *  DTS_WANSENT -- Account for data sent on an emulated connection:  the
+ *  time to put it on the link at the capped rate, the round trips needed
+ *  to get it through the window, and any losses along the way.
+ *
+ *  @brief  Account for data sent on an emulated connection.
+ *  @fn     void dts_wanSent (int fd, long nbytes)
+ *
+ *  @param  fd		connected socket
+ *  @param  nbytes	bytes sent
+ *  @return		nothing
+ */
+void
+dts_wanSent (int fd, long nbytes)
+{
+    dtsWanLink *l = (dtsWanLink *) NULL;
+    double  now, t, rtt, p;
+    long    nseg;
+
+
+    if (nlinks == 0 || nbytes <= 0)
+	return;
+
+    pthread_mutex_lock (&wan_mutex);
+    if (!(l = dts_wanFind (fd))) {
+	pthread_mutex_unlock (&wan_mutex);
+	return;
+    }
+
+    now = dts_wanNow ();
+    t = max (l->ready, now);
+    rtt = 2.0 * l->w.delay;
+
+    /*  Time to put the data on the wire.
+    */
+    if (l->w.rate > 0.0)
+	t += ((double) nbytes * 8.0) / (l->w.rate * 1000000.0);
+
+    /*  Round trips to get the data through the window.  A round that has
+    **  gone idle starts over, a full one has to wait for its ACKs.
+    */
+    if (rtt > 0.0) {
+	if (t >= l->rstart + rtt) {
+	    l->rstart = t;
+	    l->rbytes = 0;
+	}
+	for (l->rbytes += nbytes; l->rbytes > l->cwnd; ) {
+	    l->rbytes -= l->cwnd;
+	    l->rstart += dts_wanDelay (l, rtt);
+	    if (l->cwnd < l->ssthresh)			/* slow start	*/
+		l->cwnd = min (2 * l->cwnd, l->ssthresh);
+	    else					/* cong. avoid.	*/
+		l->cwnd += WAN_MSS;
+	    l->cwnd = min (l->cwnd, l->window);
+	}
+	t = max (t, l->rstart);
+    }
+
+    /*  Losses and reordering.  For small probabilities the chance of any
+    **  segment in the send being hit is close enough to nseg times that
+    **  for one segment.
+    */
+    nseg = (nbytes + WAN_MSS - 1) / WAN_MSS;
+    if (l->w.loss > 0.0) {
+	p = min (1.0, (double) nseg * l->w.loss);
+	if (dts_wanRand (l) < p) {
+	    t += dts_wanDelay (l, max (rtt, 0.001));
+	    l->ssthresh = l->cwnd = max (l->cwnd / 2, 2 * WAN_MSS);
+	    l->rstart = t;
+	    l->rbytes = 0;
+	}
+    }
+    if (l->w.reorder > 0.0) {
+	p = min (1.0, (double) nseg * l->w.reorder);
+	if (dts_wanRand (l) < p)
+	    t += (l->w.jitter > 0.0 ? l->w.jitter : 0.001);
+    }
+
+    l->ready = t;
+    pthread_mutex_unlock (&wan_mutex);
+}
+
+
+/**
+ *  DTS_WANRECV -- Note a read on an emulated connection, the next send is
+ *  a reply and has to cross the link first.
+ *
+ *  @brief  Note a read on an emulated connection.
+ *  @fn     void dts_wanRecv (int fd)
+ *
+ *  @param  fd		connected socket
+ *  @return		nothing
+ */
+void
+dts_wanRecv (int fd)
+{
+    dtsWanLink *l = (dtsWanLink *) NULL;
+
+    if (nlinks == 0)
+	return;
+
+    pthread_mutex_lock (&wan_mutex);
+    if ((l = dts_wanFind (fd)))
+	l->turn = 1;
+    pthread_mutex_unlock (&wan_mutex);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ ****************************************************************************/
+
+/**
+ *  DTS_WANINIT -- Read the DTS_WAN environment setting once.
+ */
+static void
+dts_wanInit (void)
+{
+    char  *spec = getenv (WAN_ENV);
+
+
+    if (spec && spec[0]) {
+	if (dts_wanParse (spec, &wan_env) == OK) {
+	    wan_haveEnv = 1;
+	    dtsErrLog (NULL, "wan: emulating '%s' on all connections\n", spec);
+	} else
+	    dtsErrLog (NULL, "wan: invalid %s setting '%s'\n", WAN_ENV, spec);
+    }
+}
+
+
+/**
+ *  DTS_WANFIND -- Find the link for a connection.  Called with the lock.
+ */
+static dtsWanLink *
+dts_wanFind (int fd)
+{
+    register int i;
+
+    for (i=0; i < MAX_WAN_LINKS; i++)
+	if (links[i].used && links[i].fd == fd)
+	    return (&links[i]);
+    return ((dtsWanLink *) NULL);
+}
+
+
+/**
+ *  DTS_WANNOW -- Current time in seconds.
+ */
+static double
+dts_wanNow (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return ((double) tv.tv_sec + (double) tv.tv_usec / 1000000.0);
+}
+
+
+/**
+ *  DTS_WANRAND -- Next random number in [0,1) for a link.
+ */
+static double
+dts_wanRand (dtsWanLink *l)
+{
+    return ((double) rand_r (&l->seed) / ((double) RAND_MAX + 1.0));
+}
+
+
+/**
+ *  DTS_WANDELAY -- A delay with the link's jitter added.
+ */
+static double
+dts_wanDelay (dtsWanLink *l, double secs)
+{
+    if (l->w.jitter > 0.0)
+	secs += (2.0 * dts_wanRand (l) - 1.0) * l->w.jitter;
+    return (max (secs, 0.0));
+}
+
+
+/**
+ *  DTS_WANSLEEP -- Sleep for a (fractional) number of seconds.
+ */
+static void
+dts_wanSleep (double secs)
+{
+    struct timespec ts, rem;
+
+    ts.tv_sec  = (time_t) secs;
+    ts.tv_nsec = (long) ((secs - (double) ts.tv_sec) * 1000000000.0);
+    while (nanosleep (&ts, &rem) < 0 && errno == EINTR)
+	ts = rem;
+}
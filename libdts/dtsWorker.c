@@ -0,0 +1,469 @@
+/**
+ *  DTSWORKER.C -- DTS transfer worker thread pool.
+ *
+ *  The stream threads of a transfer are run by a persistent pool of
+ *  worker threads rather than being created and joined for each file.
+ *  Work items are queued with dts_workSubmit() as part of a group, one
+ *  group per transfer.  The caller may wait for all items in the group
+ *  to be ready (e.g. have their server socket open), and then for all
+ *  items to complete.  The pool grows whenever no free worker is able
+ *  to take a queued item so the streams of a transfer always run
+ *  concurrently; workers idle for longer than DEF_WORKER_IDLE seconds
+ *  exit, leaving at least MIN_WORKERS in the pool.
+ *
+ *	grp = dts_workGroup (void)
+ *	   dts_workSubmit (grp, tnum, func, arg)
+ *	      dts_workReady (void)			(called from 'func')
+ *	      dts_workStatus (status)			(called from 'func')
+ *	      dts_workCancelled (void)			(called from 'func')
+ *	   dts_workWaitReady (grp)
+ *	   dts_workCancel (grp)
+ *	stat = dts_workWait (grp)
+ *	   dts_workFree (grp)
+ *
+ *  @file       dtsWorker.c
+ *  @author     Mike Fitzpatrick, NOAO
+ *  @date       6/10/09
+ *
+ *  @brief  DTS transfer worker thread pool.
+ */
+
+
+/*****************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "dts.h"
+
+
+static dtsWork *work_head	= (dtsWork *) NULL;	/* work queue	*/
+static dtsWork *work_tail	= (dtsWork *) NULL;
+static int      work_nqueued	= 0;		/* items waiting	*/
+static int      work_nworkers	= 0;		/* worker threads	*/
+static int      work_nbusy	= 0;		/* workers running item */
+
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work_cond  = PTHREAD_COND_INITIALIZER;
+
+static pthread_key_t   work_key;		/* current item 	*/
+static pthread_once_t  work_once  = PTHREAD_ONCE_INIT;
+
+static void  dts_workInitKey (void);
+static void *dts_worker (void *data);
+static void  dts_workSetReady (dtsWork *w);
+static int   dts_workUnqueue (dtsWork *w);
+
+
+
+/**
+ *  DTS_WORKGROUP -- Create a new (empty) work group.
+ *
+ *  @brief  Create a new work group.
+ *  @fn     dtsWorkGroup *dts_workGroup (void)
+ *
+ *  @return		new work group, or NULL on error
+ */
+dtsWorkGroup *
+dts_workGroup (void)
+{
+    dtsWorkGroup *grp = calloc (1, sizeof (dtsWorkGroup));
+
+    if (grp) {
+	pthread_mutex_init (&grp->mutex, NULL);
+	pthread_cond_init (&grp->cond, NULL);
+    }
+    return (grp);
+}
+
+
+/**
+ *  DTS_WORKSUBMIT -- Queue a work item in the pool.  The function will be
+ *  called in a worker thread as 'func (arg)', a new worker is started if
+ *  no free worker can take the item.
+ *
+ *  @brief  Queue a work item.
+ *  @fn     int dts_workSubmit (dtsWorkGroup *grp, int tnum,
+ *		void (*func)(void *data), void *arg)
+ *
+ *  @param  grp		work group
+ *  @param  tnum	item number within the group
+ *  @param  func	function to execute
+ *  @param  arg		function argument
+ *  @return		status code
+ */
+int
+dts_workSubmit (dtsWorkGroup *grp, int tnum, void (*func)(void *data),
+	void *arg)
+{
+    dtsWork  *w = (dtsWork *) NULL;
+    pthread_t tid;
+    pthread_attr_t  attr;
+    int   rc = 0, dequeued = 0;
+
+
+    if (!grp || tnum < 0 || tnum >= MAX_WORK_GROUP)
+	return (ERR);
+    if ((w = calloc (1, sizeof (dtsWork))) == NULL)
+	return (ERR);
+
+    pthread_once (&work_once, dts_workInitKey);
+
+    w->func = func;
+    w->arg  = arg;
+    w->tnum = tnum;
+    w->grp  = grp;
+
+    pthread_mutex_lock (&grp->mutex);
+    grp->nwork++;
+    pthread_mutex_unlock (&grp->mutex);
+
+    pthread_mutex_lock (&work_mutex);
+    if (work_tail)
+	work_tail->next = w;
+    else
+	work_head = w;
+    work_tail = w;
+    work_nqueued++;
+
+    /*  Start another worker if there aren't enough free to take every
+    **  queued item, the streams of a transfer must all run at once.
+    */
+    if ((work_nworkers - work_nbusy) < work_nqueued) {
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	if ((rc = pthread_create (&tid, &attr, dts_worker, NULL)) == 0)
+	    work_nworkers++;
+	pthread_attr_destroy (&attr);
+
+	/*  Nobody is free to run the item, so take it back off the queue
+	**  rather than leave it waiting on a worker which may never come.
+	*/
+	if (rc && (dequeued = dts_workUnqueue (w)))
+	    work_nqueued--;
+    }
+    if (!dequeued)
+	pthread_cond_signal (&work_cond);
+    pthread_mutex_unlock (&work_mutex);
+
+    if (rc) {
+	dtsErrLog (NULL, "ERROR: worker pthread_create() fails, code: %d\n",
+	    rc);
+	if (dequeued) {
+	    pthread_mutex_lock (&grp->mutex);
+	    grp->nwork--;
+	    pthread_mutex_unlock (&grp->mutex);
+	    free ((void *) w);
+	    return (ERR);
+	}
+    }
+    return (OK);
+}
+
+
+/**
+ *  DTS_WORKREADY -- Signal that the calling work item is ready, e.g. its
+ *  server socket is open.  Does nothing when not called from a worker.
+ *
+ *  @brief  Signal the current work item is ready.
+ *  @fn     void dts_workReady (void)
+ *
+ *  @return		nothing
+ */
+void
+dts_workReady (void)
+{
+    dtsWork *w;
+
+    pthread_once (&work_once, dts_workInitKey);
+    if ((w = (dtsWork *) pthread_getspecific (work_key)))
+	dts_workSetReady (w);
+}
+
+
+/**
+ *  DTS_WORKSTATUS -- Set the completion status of the calling work item.
+ *  Does nothing when not called from a worker.
+ *
+ *  @brief  Set the status of the current work item.
+ *  @fn     void dts_workStatus (int status)
+ *
+ *  @param  status	item status (OK or error value)
+ *  @return		nothing
+ */
+void
+dts_workStatus (int status)
+{
+    dtsWork *w;
+
+    pthread_once (&work_once, dts_workInitKey);
+    if ((w = (dtsWork *) pthread_getspecific (work_key))) {
+	pthread_mutex_lock (&w->grp->mutex);
+	w->grp->stat[w->tnum] = status;
+	pthread_mutex_unlock (&w->grp->mutex);
+    }
+}
+
+
+/**
+ *  DTS_WORKCANCELLED -- See whether the group of the calling work item
+ *  has been cancelled.  An item waiting on a peer should check this now
+ *  and then and give up if set.
+ *
+ *  @brief  See whether the current work item has been cancelled.
+ *  @fn     int dts_workCancelled (void)
+ *
+ *  @return		1 if cancelled, else 0
+ */
+int
+dts_workCancelled (void)
+{
+    dtsWork *w;
+    int   cancel = 0;
+
+    pthread_once (&work_once, dts_workInitKey);
+    if ((w = (dtsWork *) pthread_getspecific (work_key))) {
+	pthread_mutex_lock (&w->grp->mutex);
+	cancel = w->grp->cancel;
+	pthread_mutex_unlock (&w->grp->mutex);
+    }
+    return (cancel);
+}
+
+
+/**
+ *  DTS_WORKCANCEL -- Cancel the items of a group, e.g. when a transfer
+ *  can't be started after some of its streams were queued.  Items aren't
+ *  interrupted, they see the flag with dts_workCancelled() and complete
+ *  early.  The caller should still wait for the group.
+ *
+ *  @brief  Cancel the items of a group.
+ *  @fn     void dts_workCancel (dtsWorkGroup *grp)
+ *
+ *  @param  grp		work group
+ *  @return		nothing
+ */
+void
+dts_workCancel (dtsWorkGroup *grp)
+{
+    if (!grp)
+	return;
+
+    pthread_mutex_lock (&grp->mutex);
+    grp->cancel = 1;
+    pthread_mutex_unlock (&grp->mutex);
+}
+
+
+/**
+ *  DTS_WORKWAITREADY -- Wait for all items in the group to be ready.  An
+ *  item which completes without signalling is counted as ready so a
+ *  failed stream can't hang the caller.
+ *
+ *  @brief  Wait for all items in the group to be ready.
+ *  @fn     void dts_workWaitReady (dtsWorkGroup *grp)
+ *
+ *  @param  grp		work group
+ *  @return		nothing
+ */
+void
+dts_workWaitReady (dtsWorkGroup *grp)
+{
+    if (!grp)
+	return;
+
+    pthread_mutex_lock (&grp->mutex);
+    while (grp->nready < grp->nwork)
+	pthread_cond_wait (&grp->cond, &grp->mutex);
+    pthread_mutex_unlock (&grp->mutex);
+}
+
+
+/**
+ *  DTS_WORKWAIT -- Wait for all items in the group to complete.
+ *
+ *  @brief  Wait for all items in the group to complete.
+ *  @fn     int *dts_workWait (dtsWorkGroup *grp)
+ *
+ *  @param  grp		work group
+ *  @return		array of item status if any failed, else NULL
+ */
+int *
+dts_workWait (dtsWorkGroup *grp)
+{
+    int  i, nerrs = 0;
+
+
+    if (!grp)
+	return ((int *) NULL);
+
+    pthread_mutex_lock (&grp->mutex);
+    while (grp->ndone < grp->nwork)
+	pthread_cond_wait (&grp->cond, &grp->mutex);
+    for (i=0; i < MAX_WORK_GROUP; i++)
+	nerrs += (grp->stat[i] != OK);
+    grp->nerrs = nerrs;
+    pthread_mutex_unlock (&grp->mutex);
+
+    return (nerrs ? grp->stat : (int *) NULL);
+}
+
+
+/**
+ *  DTS_WORKFREE -- Free a work group.  If items are still running (e.g. a
+ *  stream waiting on a peer that never connected) the group is freed by
+ *  the worker completing the last item instead, so we never block here.
+ *
+ *  @brief  Free a work group.
+ *  @fn     void dts_workFree (dtsWorkGroup *grp)
+ *
+ *  @param  grp		work group
+ *  @return		nothing
+ */
+void
+dts_workFree (dtsWorkGroup *grp)
+{
+    if (!grp)
+	return;
+
+    pthread_mutex_lock (&grp->mutex);
+    if (grp->ndone < grp->nwork) {
+	grp->freed = 1;
+	pthread_mutex_unlock (&grp->mutex);
+	return;
+    }
+    pthread_mutex_unlock (&grp->mutex);
+
+    pthread_mutex_destroy (&grp->mutex);
+    pthread_cond_destroy (&grp->cond);
+    free ((void *) grp);
+}
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ *****************************************************************************/
+
+/**
+ *  DTS_WORKER -- Worker thread.  Run queued items until we've been idle
+ *  for too long.
+ */
+static void *
+dts_worker (void *data)
+{
+    dtsWork *w = (dtsWork *) NULL;
+    dtsWorkGroup *grp = (dtsWorkGroup *) NULL;
+    struct timeval  now;
+    struct timespec abstime;
+    int     rc = 0, release = 0;
+
+
+    pthread_mutex_lock (&work_mutex);
+    while (1) {
+	while (work_head == NULL) {
+	    gettimeofday (&now, NULL);
+	    abstime.tv_sec  = now.tv_sec + DEF_WORKER_IDLE;
+	    abstime.tv_nsec = now.tv_usec * 1000;
+
+	    rc = pthread_cond_timedwait (&work_cond, &work_mutex, &abstime);
+	    if (rc == ETIMEDOUT && work_head == NULL &&
+		work_nworkers > MIN_WORKERS) {
+		    work_nworkers--;
+		    pthread_mutex_unlock (&work_mutex);
+		    return (NULL);
+	    }
+	}
+
+	/*  Take the next item off the queue.
+	*/
+	w = work_head;
+	if ((work_head = w->next) == NULL)
+	    work_tail = (dtsWork *) NULL;
+	work_nqueued--;
+	work_nbusy++;
+	pthread_mutex_unlock (&work_mutex);
+
+	pthread_setspecific (work_key, w);
+	(*w->func) (w->arg);
+	pthread_setspecific (work_key, NULL);
+
+	/*  Mark the item done, and ready in case it never said so.
+	*/
+	grp = w->grp;
+	dts_workSetReady (w);
+	pthread_mutex_lock (&grp->mutex);
+	grp->ndone++;
+	release = (grp->freed && grp->ndone == grp->nwork);
+	pthread_cond_broadcast (&grp->cond);
+	pthread_mutex_unlock (&grp->mutex);
+	free ((void *) w);
+
+	if (release) {				/* owner has let go	*/
+	    pthread_mutex_destroy (&grp->mutex);
+	    pthread_cond_destroy (&grp->cond);
+	    free ((void *) grp);
+	}
+
+	pthread_mutex_lock (&work_mutex);
+	work_nbusy--;
+    }
+
+    return (NULL);
+}
+
+
+/**
+ *  DTS_WORKSETREADY -- Mark an item as ready (once).
+ */
+static void
+dts_workSetReady (dtsWork *w)
+{
+    pthread_mutex_lock (&w->grp->mutex);
+    if (!w->ready) {
+	w->ready = 1;
+	w->grp->nready++;
+	pthread_cond_broadcast (&w->grp->cond);
+    }
+    pthread_mutex_unlock (&w->grp->mutex);
+}
+
+
+/**
+ *  DTS_WORKINITKEY -- Create the key holding a worker's current item.
+ */
+static void
+dts_workInitKey (void)
+{
+    pthread_key_create (&work_key, NULL);
+}
+
+
+/**
+ *  DTS_WORKUNQUEUE -- Take an item back off the work queue before any
+ *  worker has started it.  Called with the work mutex held.
+ */
+static int
+dts_workUnqueue (dtsWork *w)
+{
+    dtsWork *p = (dtsWork *) NULL, *prev = (dtsWork *) NULL;
+
+    for (p=work_head; p && p != w; p = p->next)
+	prev = p;
+    if (p == (dtsWork *) NULL)
+	return (0);
+
+    if (prev)
+	prev->next = w->next;
+    else
+	work_head = w->next;
+    if (work_tail == w)
+	work_tail = prev;
+
+    return (1);
+}
@@ -2,6 +2,17 @@
  *  DTSHOTTO.C -- Client-callable DTS commands to transfer files TO a remote
  *  host machine..
  *
+ *  All the state of a transfer is kept in a dtsXferCtx, so threads in a
+ *  daemon (or client) may run transfers concurrently, each with its own
+ *  context and port range:
+ *
+ *	         dts_xferInit (ctx, method, rate, loPort, hiPort, nthreads, mode)
+ *	  stat = dts_xferTo (ctx, host, port, argc, argv)
+ *	  stat = dts_xferFrom (ctx, host, port, argc, argv)
+ *
+ *  The results are left in ctx->stats.  dts_hostTo() and dts_hostFrom()
+ *  do the same with a context of their own.
+ *
  *  @brief      Client-callable DTS commands to transfer files TO a remote
  *  host machine..
  *
@@ -11,6 +22,7 @@
  */
 /*****************************************************************************/
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -41,15 +53,51 @@ extern  DTS *dts;
 extern  int  dts_monitor;
 
 
-static int  nthreads 		= 0;
-static int  xfer_port 		= DEF_XFER_PORT;
-      	     
-static char src_host[SZ_PATH], dest_host[SZ_PATH], msg_host[SZ_PATH];
-static char s_url[SZ_PATH],    d_url[SZ_PATH];
-static char s_path[SZ_PATH],   d_path[SZ_PATH];
-static char s_dir[SZ_PATH],    d_dir[SZ_PATH];
-static char s_fname[SZ_PATH],  d_fname[SZ_PATH];
-
+/*  The files of a directory transfer.  The tree is walked first to build
+**  the list, which is then drained by up to DEF_XFER_FILES workers, each
+**  with its own copy of the transfer context and its own block of ports.
+*/
+typedef struct xferItem {
+    char    s_path[SZ_PATH];		/* source path			*/
+    char    d_path[SZ_PATH];		/* destination path		*/
+    long    fsize;			/* file size			*/
+    mode_t  fmode;			/* file mode			*/
+    struct xferItem *next;
+} xferItem;
+
+typedef struct {
+    xferItem *head, *tail;		/* file list			*/
+    xferItem *next;			/* next file to send		*/
+    int     nitems;			/* number of files		*/
+
+    char   *caller;			/* calling procedure		*/
+    char   *host;			/* host to call			*/
+    int     setmode;			/* restore local file modes?	*/
+
+    long    nbytes;			/* bytes sent			*/
+    int     stat;			/* OK, or ERR to stop workers	*/
+    pthread_mutex_t mutex;
+} xferList;
+
+typedef struct {
+    dtsXferCtx  ctx;			/* worker transfer context	*/
+    xferList   *list;			/* shared file list		*/
+    int         pooled;			/* running in the worker pool?	*/
+} xferWorker;
+
+
+static int   dts_xferWalkTo (xferList *list, char *path, char *root, 
+		char *prefix, char *lastdir);
+static void  dts_xferWalkFrom (xferList *list, char *srcHost, char *path, 
+		char *prefix);
+static int   dts_xferAddItem (xferList *list, char *s_path, char *d_path,
+		long fsize, mode_t fmode);
+static int   dts_xferRunList (dtsXferCtx *ctx, xferList *list);
+static void  dts_xferWorker (void *data);
+static void  dts_xferFreeList (xferList *list);
+static void  dts_xferSplitPath (char *path, char *dir, char *fname);
+static int   dts_xferJoinPath (dtsXferCtx *ctx);
+static void  dts_xferCloseClient (dtsXferCtx *ctx);
 
 
 
@@ -80,84 +128,178 @@ int
 dts_hostTo (char *host, int port, int method, int rate, int loPort, int hiPort, 
 		int threads, int mode, int argc, char *argv[], xferStat *xfs)
 {
-    char *shost = src_host, *dhost = dest_host, *mhost = msg_host;
-    char *func = NULL, *path = NULL, *path_A = NULL, *path_B = NULL;
+    dtsXferCtx ctx;
+    int   res;
+
+
+    dts_xferInit (&ctx, method, rate, loPort, hiPort, threads, mode);
+    res = dts_xferTo (&ctx, host, port, argc, argv);
+    memcpy (xfs, &ctx.stats, sizeof (xferStat));
+
+    return (res);
+}
+
+
+/**
+ *  DTS_HOSTFROM -- Pull a file from A to B.
+ *
+ *  @brief  Pull a file from a remote host.
+ *  @fn     stat = dts_hostFrom (char *host, int port, int method, int rate,
+ *			int loPort, int hiPort, 
+ *			int threads, int mode, int argc, char *argv[], 
+ *			xferStat *xfs);
+ *
+ *  @param  host	host machine name (or IP string)
+ *  @param  port	local DTS command port
+ *  @param  method	transport method
+ *  @param  rate	transport rate (Mbps)
+ *  @param  loPort	low DTS transfer port
+ *  @param  hiPort	high DTS transfer port
+ *  @param  threads	number of transfer threads
+ *  @param  mode	transfer mode
+ *  @param  argc	argument counter
+ *  @param  argv	argument vector
+ *  @param  xfs		transfer stats
+ *  @return		1 (one) if DTS succeeds.
+ */
+
+int
+dts_hostFrom (char *host, int port, int method, int rate, 
+		int loPort, int hiPort, 
+		int threads, int mode, int argc, char *argv[], xferStat *xfs)
+{
+    dtsXferCtx ctx;
+    int   res;
+
+
+    dts_xferInit (&ctx, method, rate, loPort, hiPort, threads, mode);
+    res = dts_xferFrom (&ctx, host, port, argc, argv);
+    memcpy (xfs, &ctx.stats, sizeof (xferStat));
+
+    return (res);
+}
+
+
+/**
+ *  DTS_XFERINIT -- Initialize a transfer context.  A context may be used
+ *  for any number of transfers one after the other, but only by one
+ *  thread at a time.
+ *
+ *  @brief  Initialize a transfer context.
+ *  @fn     void dts_xferInit (dtsXferCtx *ctx, int method, int rate, 
+ *			int loPort, int hiPort, int threads, int mode)
+ *
+ *  @param  ctx		transfer context
+ *  @param  method	transport method
+ *  @param  rate	transfer rate (Mbps)
+ *  @param  loPort	low DTS transfer port
+ *  @param  hiPort	high DTS transfer port
+ *  @param  threads	number of transfer threads
+ *  @param  mode	transfer mode
+ *  @return		nothing
+ */
+void
+dts_xferInit (dtsXferCtx *ctx, int method, int rate, int loPort, int hiPort,
+		int threads, int mode)
+{
+    memset (ctx, 0, sizeof (dtsXferCtx));
+
+    ctx->method   = method;
+    ctx->rate     = rate;
+    ctx->mode     = mode;
+    ctx->nthreads = threads;
+    ctx->port     = loPort;		/* first transfer port		*/
+    ctx->maxport  = hiPort;		/* last transfer port		*/
+    ctx->client   = -1;
+}
+
+
+/**
+ *  DTS_XFERTO -- Move a file from A 'to' B using the given context.  This
+ *  is dts_hostTo() for callers running several transfers at once.
+ *
+ *  @brief  Push a file to a remote host using a transfer context.
+ *  @fn     stat = dts_xferTo (dtsXferCtx *ctx, char *host, int port,
+ *			int argc, char *argv[])
+ *
+ *  @param  ctx		transfer context (see dts_xferInit())
+ *  @param  host	host machine name (or IP string)
+ *  @param  port	local DTS command port
+ *  @param  argc	argument counter
+ *  @param  argv	argument vector
+ *  @return		1 (one) if DTS succeeds, stats are in ctx->stats
+ */
+int
+dts_xferTo (dtsXferCtx *ctx, char *host, int port, int argc, char *argv[])
+{
+    char *shost = ctx->src_host, *dhost = ctx->dest_host;
+    char *mhost = ctx->msg_host;
+    char *path = NULL, *path_A = NULL, *path_B = NULL;
     char *localIP = dts_getLocalIP();
-    int   res, fsize, fmode, len = strlen (localIP);
-    int   srcLocal = 1, dstLocal = 0, isDir = 0, verbose = 0;
+    int   res, len = strlen (localIP);
+    int   isDir = 0, verbose = 0;
     struct stat st;
 
 
-    memset (s_url,     0, SZ_PATH); 		/* Initialize		*/
-    memset (d_url,     0, SZ_PATH); 
-    memset (msg_host,  0, SZ_PATH); 
-    memset (src_host,  0, SZ_PATH); 
-    memset (dest_host, 0, SZ_PATH); 
-    memset (s_dir,     0, SZ_PATH); 
-    memset (d_dir,     0, SZ_PATH); 
-    memset (s_path,    0, SZ_PATH); 
-    memset (d_path,    0, SZ_PATH); 
-    memset (s_fname,   0, SZ_PATH); 
-    memset (d_fname,   0, SZ_PATH); 
-
-    nthreads = threads;
-    xfer_port = loPort;		/* first transfer port		*/
+    ctx->srcLocal = 1;
+    ctx->dstLocal = 0;
+    memset (&ctx->stats, 0, sizeof (xferStat));
+    gettimeofday (&ctx->start, NULL);
 
 /*
-    sprintf (src_host, "%s", dts_getLocalIP() );
-    sprintf (dest_host, "%s", dts_resolveHost (host) );
+    sprintf (ctx->src_host, "%s", dts_getLocalIP() );
+    sprintf (ctx->dest_host, "%s", dts_resolveHost (host) );
 */
-    sprintf (src_host, "%s:%d", dts->serverIP, dts->serverPort);
-    sprintf (dest_host, "%s", host);
-    sprintf (msg_host, "%s", host);
+    sprintf (ctx->src_host, "%s:%d", dts->serverIP, dts->serverPort);
+    sprintf (ctx->dest_host, "%s", host);
+    sprintf (ctx->msg_host, "%s", host);
 
 
     /* Process the remaining argument vector.
     */
-    dts_xferParseArgs (argc, argv, &nthreads, &port, &verbose,
+    dts_xferParseArgs (argc, argv, &ctx->nthreads, &port, &verbose,
 	&path_A, &path_B);
 
     /* Sort out the pathnames on each side of the transfer.
     */
-    dts_xferParsePaths (host, &path_A, &path_B, &srcLocal, &dstLocal,
-	&shost, &dhost, &mhost, &path);
+    dts_xferParsePaths (host, &path_A, &path_B, &ctx->srcLocal, 
+	&ctx->dstLocal, &shost, &dhost, &mhost, &path);
 
-    strcpy (s_dir, dts_pathDir (path_A));
-    strcpy (d_dir, dts_pathDir (path_B));
-    strcpy (s_fname, dts_pathFname (path_A));
-    strcpy (d_fname, dts_pathFname (path_B));
-    sprintf (s_path, "%s/%s", s_dir, s_fname);
-    sprintf (d_path, "%s/%s", d_dir, d_fname);
-    isDir = dts_isDir (s_path);
+    dts_xferSplitPath (path_A, ctx->s_dir, ctx->s_fname);
+    dts_xferSplitPath (path_B, ctx->d_dir, ctx->d_fname);
+    if (dts_xferJoinPath (ctx) != OK)
+	return (ERR);
+    isDir = dts_isDir (ctx->s_path);
 
     /*
-    srcLocal = (strcmp (dts_getLocalIP(), src_host) == 0);
-    dstLocal = (strcmp (dts_getLocalIP(), dest_host) == 0);
+    srcLocal = (strcmp (dts_getLocalIP(), ctx->src_host) == 0);
+    dstLocal = (strcmp (dts_getLocalIP(), ctx->dest_host) == 0);
     */
-    if (strncmp (localIP, src_host, len) != 0 && 
-	strncmp (localIP, dest_host, len) != 0)
+    if (strncmp (localIP, ctx->src_host, len) != 0 && 
+	strncmp (localIP, ctx->dest_host, len) != 0)
 	    port = DTS_PORT;
 
     if (XFER_DEBUG) {
 	fprintf (stderr, "    host = %s\n", host);
-	fprintf (stderr, "nthreads = %d\n", nthreads);
-	fprintf (stderr, "    port = %d  (%d,%d)\n", port, loPort, hiPort);
-	fprintf (stderr, "xfer_ort = %d\n", xfer_port);
-	fprintf (stderr, "    rate = %d\n", rate);
+	fprintf (stderr, "nthreads = %d\n", ctx->nthreads);
+	fprintf (stderr, "    port = %d  (%d,%d)\n", port, ctx->port, 
+	    ctx->maxport);
+	fprintf (stderr, "xfer_ort = %d\n", ctx->port);
+	fprintf (stderr, "    rate = %d\n", ctx->rate);
 	fprintf (stderr, "  path_A = %s\n", path_A);
 	fprintf (stderr, "  path_B = %s\n", path_B);
-	fprintf (stderr, "srcLocal = %d\n", srcLocal);
-	fprintf (stderr, "dstLocal = %d\n", dstLocal);
+	fprintf (stderr, "srcLocal = %d\n", ctx->srcLocal);
+	fprintf (stderr, "dstLocal = %d\n", ctx->dstLocal);
 	fprintf (stderr, "   isDir = %d\n", isDir);
-	fprintf (stderr, "   s_dir = %s\n", s_dir);
-	fprintf (stderr, "   d_dir = %s\n", d_dir);
-	fprintf (stderr, " s_fname = %s\n", s_fname);
-	fprintf (stderr, " d_fname = %s\n", d_fname);
-	fprintf (stderr, "  s_path = %s\n", s_path);
-	fprintf (stderr, "  d_path = %s\n", d_path);
+	fprintf (stderr, "   s_dir = %s\n", ctx->s_dir);
+	fprintf (stderr, "   d_dir = %s\n", ctx->d_dir);
+	fprintf (stderr, " s_fname = %s\n", ctx->s_fname);
+	fprintf (stderr, " d_fname = %s\n", ctx->d_fname);
+	fprintf (stderr, "  s_path = %s\n", ctx->s_path);
+	fprintf (stderr, "  d_path = %s\n", ctx->d_path);
 	fprintf (stderr, "    path = %s\n", path);
-	fprintf (stderr, "src_host = %s\n", src_host);
-	fprintf (stderr, "dst_host = %s\n", dest_host);
+	fprintf (stderr, "src_host = %s\n", ctx->src_host);
+	fprintf (stderr, "dst_host = %s\n", ctx->dest_host);
     }
 
     /*  Sanity checks.
@@ -166,66 +308,70 @@ dts_hostTo (char *host, int port, int method, int rate, int loPort, int hiPort,
 	fprintf (stderr, "Error: No filename specified\n");
 	return (ERR);
 
-    } else if (srcLocal && access (s_path, R_OK) < 0) {
-	fprintf (stderr, "Error: Cannot access local file '%s'\n", s_path);
+    } else if (ctx->srcLocal && access (ctx->s_path, R_OK) < 0) {
+	fprintf (stderr, "Error: Cannot access local file '%s'\n", ctx->s_path);
 	return (ERR);
 
-    } else if (srcLocal && stat (s_path, &st) < 0) {
-	fprintf (stderr, "Error: Cannot stat() file '%s'\n", s_path);
+    } else if (ctx->srcLocal && stat (ctx->s_path, &st) < 0) {
+	fprintf (stderr, "Error: Cannot stat() file '%s'\n", ctx->s_path);
 	return (ERR);
 
-    } else if (!src_host[0]) {
+    } else if (!ctx->src_host[0]) {
 	fprintf (stderr, "Error: No source host specified\n");
 	return (ERR);
 
-    } else if (!dest_host[0]) {
+    } else if (!ctx->dest_host[0]) {
 	fprintf (stderr, "Error: No dest host specified\n");
 	return (ERR);
 
     }
-    stat (s_path, &st);
-    fsize = (int) dts_du (s_path);
-    fmode = (int) st.st_mode;
+    stat (ctx->s_path, &st);
+    if ((ctx->fsize = dts_cutSize (ctx->s_path)) < 0)	/* may still be     */
+        ctx->fsize = dts_du (ctx->s_path);		/* arriving	    */
+    ctx->fmode = (mode_t) st.st_mode;
 
     dts_cmdInit();			/* initialize static variables	*/
 
     
     /* Set calling parameters.
     */
-    memset (s_url, 0, SZ_PATH); 
-    if (strchr (src_host, (int)':'))
-        sprintf (s_url, "http://%s/RPC2", src_host);
+    memset (ctx->s_url, 0, SZ_PATH); 
+    if (strchr (ctx->src_host, (int)':'))
+        sprintf (ctx->s_url, "http://%s/RPC2", ctx->src_host);
     else
-        sprintf (s_url, "http://%s:%d/RPC2", src_host, port);
+        sprintf (ctx->s_url, "http://%s:%d/RPC2", ctx->src_host, port);
 
-    memset (d_url, 0, SZ_PATH); 
-    if (strchr (dest_host, (int)':'))
-        sprintf (d_url, "http://%s/RPC2", dest_host);
+    memset (ctx->d_url, 0, SZ_PATH); 
+    if (strchr (ctx->dest_host, (int)':'))
+        sprintf (ctx->d_url, "http://%s/RPC2", ctx->dest_host);
     else
-        sprintf (d_url, "http://%s:%d/RPC2", dest_host, DTS_PORT);
+        sprintf (ctx->d_url, "http://%s:%d/RPC2", ctx->dest_host, DTS_PORT);
 
 
     /* If mode is PUSH, we send a command to the DTSD on the source machine,
     ** otherwise the command is sent to the dest machine. 
     */
-    if (mode == XFER_PUSH) {
-        func   = "xferPushFile";
-        sprintf (src_host, "%s:%d", dts_getLocalIP(), port );
-	host = src_host;
+    if (ctx->mode == XFER_PUSH) {
+        ctx->func = "xferPushFile";
+        sprintf (ctx->src_host, "%s:%d", dts_getLocalIP(), port );
+	strcpy (ctx->host, ctx->src_host);
 	
         if (XFER_DEBUG)
-	    fprintf (stderr, "hostTo  xferPushFile = %d  (%s)\n", port, host);
+	    fprintf (stderr, "hostTo  xferPushFile = %d  (%s)\n", port, 
+		ctx->host);
     } else {
-        func   = "xferPullFile";
-	host = dest_host;
+        ctx->func = "xferPullFile";
+	strcpy (ctx->host, ctx->dest_host);
 
         if (XFER_DEBUG)
-	    fprintf (stderr, "hostTo  xferPullFile = %d  (%s)\n", port, host);
+	    fprintf (stderr, "hostTo  xferPullFile = %d  (%s)\n", port, 
+		ctx->host);
     }
 
     if (XFER_DEBUG) 
         dtsLog (dts, "%6.6s >  XFER: hostTo: func=%s src=%s dest=%s\n", 
-	    dts_queueFromPath(s_dir), func, src_host, dest_host);
+	    dts_queueFromPath(ctx->s_dir), ctx->func, ctx->src_host, 
+	    ctx->dest_host);
 
 
     /* Finally, do the transfer and return the result.
@@ -233,23 +379,31 @@ dts_hostTo (char *host, int port, int method, int rate, int loPort, int hiPort,
     if (dts_isDir (path) > 0) {
 	char prefix[PATH_MAX], root[PATH_MAX];
 
-	memset (prefix, 0, PATH_MAX);		/* save static copy of prefix */
-	strcpy (prefix, s_dir);
-	memset (root, 0, PATH_MAX);		/* save static copy of root   */
-	strcpy (root, d_dir);
+	memset (prefix, 0, PATH_MAX);		/* save copy of prefix	*/
+	strcpy (prefix, ctx->s_dir);
+	memset (root, 0, PATH_MAX);		/* save copy of root	*/
+	strcpy (root, ctx->d_dir);
 
-        if (dts_hostMkdir (host, d_dir) == ERR) { /* create start dir         */
-	    fprintf (stderr, "Cannot create host dir '%s'\n", d_dir);
+        if (dts_hostMkdir (ctx->host, ctx->d_dir) == ERR) { /* start dir */
+	    fprintf (stderr, "Cannot create host dir '%s'\n", ctx->d_dir);
 	    return (ERR);
 	}
 
-        res = dts_xferDirTo (host, func, method, rate, path, root, prefix, xfs);
+	/*  With parallel sockets send the tree as one tar stream if we can,
+	**  falling back to a file at a time (e.g. for an older peer).
+	*/
+	res = ERR;
+	if (ctx->method == TM_PSOCK && (ctx->fsize = dts_tarSize (path)) > 0)
+	    res = dts_xferDirStream (ctx, path, ctx->fsize);
+
+	if (res != OK)
+            res = dts_xferDirTo (ctx, path, root, prefix);
 
         if (XFER_DEBUG && res != OK)
 	    fprintf (stderr, "hostTo  xferDirTo fails\n");
 
     } else {
-        res = dts_xferFile (host, func, method, rate, path, fsize, fmode, xfs);
+        res = dts_xferFile (ctx, path, ctx->fsize, ctx->fmode);
 
         if (XFER_DEBUG && res != OK)
 	    fprintf (stderr, "hostTo  xferFile fails\n");
@@ -260,62 +414,43 @@ dts_hostTo (char *host, int port, int method, int rate, int loPort, int hiPort,
 
 
 /**
- *  DTS_HOSTFROM -- Pull a file from A to B.
+ *  DTS_XFERFROM -- Pull a file from A to B using the given context.  This
+ *  is dts_hostFrom() for callers running several transfers at once.
  *
- *  @brief  Pull a file from a remote host.
- *  @fn     stat = dts_hostFrom (char *host, int port, int method, int rate,
- *			int loPort, int hiPort, 
- *			int threads, int mode, int argc, char *argv[], 
- *			xferStat *xfs);
+ *  @brief  Pull a file from a remote host using a transfer context.
+ *  @fn     stat = dts_xferFrom (dtsXferCtx *ctx, char *host, int port,
+ *			int argc, char *argv[])
  *
+ *  @param  ctx		transfer context (see dts_xferInit())
  *  @param  host	host machine name (or IP string)
  *  @param  port	local DTS command port
- *  @param  method	transport method
- *  @param  rate	transport rate (Mbps)
- *  @param  loPort	low DTS transfer port
- *  @param  hiPort	high DTS transfer port
- *  @param  threads	number of transfer threads
- *  @param  mode	transfer mode
  *  @param  argc	argument counter
  *  @param  argv	argument vector
- *  @param  xfs		transfer stats
- *  @return		1 (one) if DTS succeeds.
+ *  @return		1 (one) if DTS succeeds, stats are in ctx->stats
  */
-
 int
-dts_hostFrom (char *host, int port, int method, int rate, 
-		int loPort, int hiPort, 
-		int threads, int mode, int argc, char *argv[], xferStat *xfs)
+dts_xferFrom (dtsXferCtx *ctx, char *host, int port, int argc, char *argv[])
 {
-    char  *func = NULL, *path = NULL, *path_A = NULL, *path_B = NULL;
+    char  *path = NULL, *path_A = NULL, *path_B = NULL;
     char  *localIP = dts_getLocalIP();
-    int   res, fsize, fmode, len = strlen (localIP);
-    int   srcLocal = 0, dstLocal = 0, verbose = 0;
+    int   res, fmode, len = strlen (localIP);
+    long  fsize;
+    int   verbose = 0;
 
 
-    memset (s_url,     0, SZ_PATH); 
-    memset (d_url,     0, SZ_PATH); 
-    memset (msg_host,  0, SZ_PATH); 
-    memset (src_host,  0, SZ_PATH); 
-    memset (dest_host, 0, SZ_PATH); 
-    memset (s_dir,     0, SZ_PATH); 
-    memset (d_dir,     0, SZ_PATH); 
-    memset (s_path,    0, SZ_PATH); 
-    memset (d_path,    0, SZ_PATH); 
-    memset (s_fname,   0, SZ_PATH); 
-    memset (d_fname,   0, SZ_PATH); 
+    ctx->srcLocal = 0;
+    ctx->dstLocal = 0;
+    memset (&ctx->stats, 0, sizeof (xferStat));
+    gettimeofday (&ctx->start, NULL);
 
-    nthreads = threads;
-    xfer_port = loPort;		/* first transfer port		*/
-
-    sprintf (src_host, "%s", dts_resolveHost (host) );
-    sprintf (dest_host, "%s", dts_getLocalIP() );
-    sprintf (msg_host, "%s", host);
+    sprintf (ctx->src_host, "%s", dts_resolveHost (host) );
+    sprintf (ctx->dest_host, "%s", dts_getLocalIP() );
+    sprintf (ctx->msg_host, "%s", host);
 
 
     /* Process the remaining argument vector.
     */
-    dts_xferParseArgs (argc, &argv[0], &nthreads, &port, &verbose,
+    dts_xferParseArgs (argc, &argv[0], &ctx->nthreads, &port, &verbose,
 	&path_A, &path_B);
 
     /* Sort out the pathnames on each side of the transfer.
@@ -323,48 +458,46 @@ dts_hostFrom (char *host, int port, int method, int rate,
         &shost, &dhost, &mhost, &path);
     */
 
-    strcpy (s_dir, dts_pathDir (path_A));
-    strcpy (d_dir, dts_pathDir (path_B));
-    strcpy (s_fname, dts_pathFname (path_A));
-    strcpy (d_fname, dts_pathFname (path_B));
-    sprintf (s_path, "%s/%s", s_dir, s_fname);
-    sprintf (d_path, "%s/%s", d_dir, d_fname);
-
-    srcLocal = (strncmp (localIP, src_host, len) == 0);
-    dstLocal = (strncmp (localIP, dest_host, len) == 0);
-    if (strncmp (localIP, src_host, len) != 0 && 
-        strncmp (localIP, dest_host, len) != 0)
+    dts_xferSplitPath (path_A, ctx->s_dir, ctx->s_fname);
+    dts_xferSplitPath (path_B, ctx->d_dir, ctx->d_fname);
+    if (dts_xferJoinPath (ctx) != OK)
+	return (ERR);
+
+    ctx->srcLocal = (strncmp (localIP, ctx->src_host, len) == 0);
+    ctx->dstLocal = (strncmp (localIP, ctx->dest_host, len) == 0);
+    if (strncmp (localIP, ctx->src_host, len) != 0 && 
+        strncmp (localIP, ctx->dest_host, len) != 0)
             port = DTS_PORT;
-    if (!d_fname[0])
-	strcpy (d_fname, s_fname);
+    if (!ctx->d_fname[0])
+	strcpy (ctx->d_fname, ctx->s_fname);
 
 
     if (XFER_DEBUG) {
         fprintf (stderr, "    host = %s\n", host);
         fprintf (stderr, "  path_A = %s\n", path_A);
         fprintf (stderr, "  path_B = %s\n", path_B);
-        fprintf (stderr, "nthreads = %d\n", nthreads);
+        fprintf (stderr, "nthreads = %d\n", ctx->nthreads);
         fprintf (stderr, "    port = %d\n", port);
-	fprintf (stderr, "xfer_ort = %d\n", xfer_port);
-        fprintf (stderr, "srcLocal = %d\n", srcLocal);
-        fprintf (stderr, "dstLocal = %d\n", dstLocal);
+	fprintf (stderr, "xfer_ort = %d\n", ctx->port);
+        fprintf (stderr, "srcLocal = %d\n", ctx->srcLocal);
+        fprintf (stderr, "dstLocal = %d\n", ctx->dstLocal);
         fprintf (stderr, "   isDir = %d\n", 0);
         fprintf (stderr, "srcLocal = %d  dstLocal = %d  isDir = %d\n", 
-						srcLocal, dstLocal, 0);
-        fprintf (stderr, "   s_dir = %s\n", s_dir);
-        fprintf (stderr, "   d_dir = %s\n", d_dir);
-        fprintf (stderr, " s_fname = %s\n", s_fname);
-        fprintf (stderr, " d_fname = %s\n", d_fname);
-        fprintf (stderr, "  s_path = %s\n", s_path);
-        fprintf (stderr, "  d_path = %s\n", d_path);
+					    ctx->srcLocal, ctx->dstLocal, 0);
+        fprintf (stderr, "   s_dir = %s\n", ctx->s_dir);
+        fprintf (stderr, "   d_dir = %s\n", ctx->d_dir);
+        fprintf (stderr, " s_fname = %s\n", ctx->s_fname);
+        fprintf (stderr, " d_fname = %s\n", ctx->d_fname);
+        fprintf (stderr, "  s_path = %s\n", ctx->s_path);
+        fprintf (stderr, "  d_path = %s\n", ctx->d_path);
         fprintf (stderr, "    path = %s\n", path);
-	fprintf (stderr, "src_host = %s\n", src_host);
-	fprintf (stderr, "dst_host = %s\n", dest_host);
-	fprintf (stderr, "msg_host = %s\n", msg_host);
+	fprintf (stderr, "src_host = %s\n", ctx->src_host);
+	fprintf (stderr, "dst_host = %s\n", ctx->dest_host);
+	fprintf (stderr, "msg_host = %s\n", ctx->msg_host);
     }
 
     if (!path)
-	path = s_path;
+	path = ctx->s_path;
     
 
 
@@ -374,18 +507,20 @@ dts_hostFrom (char *host, int port, int method, int rate,
 	fprintf (stderr, "Error: No filename specified\n");
 	return (ERR);
 
-    } else if ( dts_hostAccess (msg_host, s_path, R_OK) != OK) {
+    } else if ( dts_hostAccess (ctx->msg_host, ctx->s_path, R_OK) != OK) {
 	fprintf (stderr, "Error: Cannot access file '%s'\n", path);
 	return (ERR);
 
-    } else if ( (fsize = dts_hostFSize (msg_host, s_path)) < 0) {
+    } else if ( (fsize = dts_hostFSize (ctx->msg_host, ctx->s_path)) < 0) {
 	fprintf (stderr, "Error: Cannot get filesize for '%s'\n", path);
 	return (ERR);
 
-    } else if ( (fmode = dts_hostFMode (msg_host, s_path)) < 0) {
+    } else if ( (fmode = dts_hostFMode (ctx->msg_host, ctx->s_path)) < 0) {
 	fprintf (stderr, "Error: Cannot get file mode for '%s'\n", path);
 	return (ERR);
     }
+    ctx->fsize = fsize;
+    ctx->fmode = (mode_t) fmode;
 
     dts_cmdInit();			/* initialize static variables	*/
 
@@ -395,60 +530,70 @@ dts_hostFrom (char *host, int port, int method, int rate,
 
     /* Set calling parameters.
     */
-    memset (s_url, 0, SZ_PATH); 
-    if (strchr (src_host, (int)':'))
-        sprintf (s_url, "http://%s/RPC2", src_host);
+    memset (ctx->s_url, 0, SZ_PATH); 
+    if (strchr (ctx->src_host, (int)':'))
+        sprintf (ctx->s_url, "http://%s/RPC2", ctx->src_host);
     else
-        sprintf (s_url, "http://%s:%d/RPC2", src_host, DTS_PORT);
+        sprintf (ctx->s_url, "http://%s:%d/RPC2", ctx->src_host, DTS_PORT);
 
-    memset (d_url, 0, SZ_PATH); 
-    if (strchr (dest_host, (int)':'))
-        sprintf (d_url, "http://%s/RPC2", dest_host);
+    memset (ctx->d_url, 0, SZ_PATH); 
+    if (strchr (ctx->dest_host, (int)':'))
+        sprintf (ctx->d_url, "http://%s/RPC2", ctx->dest_host);
     else
-        sprintf (d_url, "http://%s:%d/RPC2", dest_host, port);
+        sprintf (ctx->d_url, "http://%s:%d/RPC2", ctx->dest_host, port);
 
 
 
     /* If mode is PUSH, we send a command to the DTSD on the source machine,
     ** otherwise the command is sent to the dest machine. 
     */
-    if (mode == XFER_PUSH) {
-        func   = "xferPushFile";
-        host = src_host;
+    if (ctx->mode == XFER_PUSH) {
+        ctx->func = "xferPushFile";
+        strcpy (ctx->host, ctx->src_host);
     } else {
-        func   = "xferPullFile";
-        // sprintf (dest_host, "%s:%d", dts_getLocalIP(), port );  FIXME -
+        ctx->func = "xferPullFile";
+        // sprintf (ctx->dest_host, "%s:%d", dts_getLocalIP(), port );  FIXME -
         // for remote->remote xfers
-        host = dest_host;
+        strcpy (ctx->host, ctx->dest_host);
     }
 
     if (XFER_DEBUG) 
         dtsLog (dts, "%6.6s <  XFER: hostFrom: func=%s src=%s dest=%s\n", 
-	    dts_queueFromPath(d_dir), func, src_host, dest_host);
+	    dts_queueFromPath(ctx->d_dir), ctx->func, ctx->src_host, 
+	    ctx->dest_host);
 
 
     /* Finally, do the transfer and return the result.
     */
-    if (dts_hostIsDir (src_host, path) > 0) {
+    if (dts_hostIsDir (ctx->src_host, path) > 0) {
         char prefix[PATH_MAX];
 
         memset (prefix, 0, PATH_MAX);
-	strcpy (prefix, d_dir);
+	strcpy (prefix, ctx->d_dir);
 
-	if (dstLocal) { 			/* create start dir 	      */
-	    if (dts_localMkdir (d_path) == ERR)
+	if (ctx->dstLocal) { 			/* create start dir 	      */
+	    if (dts_localMkdir (ctx->d_path) == ERR)
 		return (ERR);
 	} else {
-            strcpy (prefix, s_dir);           /* save static copy of prefix */
-	    if (dts_hostMkdir (dest_host, d_dir) == ERR)
+            strcpy (prefix, ctx->s_dir);        /* save copy of prefix        */
+	    if (dts_hostMkdir (ctx->dest_host, ctx->d_dir) == ERR)
 		return (ERR);
 	}
 
-        res = dts_xferDirFrom (src_host, dest_host, dstLocal,
-	    func, method, rate, path, s_dir, prefix, xfs);
+	/*  With parallel sockets pull the tree as one tar stream if we can,
+	**  falling back to a file at a time (e.g. for an older peer).  The
+	**  source sizes the stream itself, we only need an estimate.
+	*/
+	res = ERR;
+	if (ctx->method == TM_PSOCK && strcmp (ctx->d_fname, ctx->s_fname) == 0 &&
+	    (fsize = dts_hostDiskUsed (ctx->msg_host, path)) >= 0)
+	        res = dts_xferDirStream (ctx, path, (fsize > 0 ? fsize : 1));
+
+	if (res != OK)
+            res = dts_xferDirFrom (ctx, path, prefix);
 
     } else {
-        res = dts_xferFile (host, func, method, rate, path, fsize, fmode, xfs);
+        res = dts_xferFile (ctx, path, ctx->fsize, ctx->fmode);
     }
 
     return (res);
@@ -456,310 +601,218 @@ dts_hostFrom (char *host, int port, int method, int rate,
 
 
 /**
- *  DTS_XFERDIRTO -- Recursively transfer a directory between hosts.
+ *  DTS_XFERDIRTO -- Recursively transfer a directory between hosts.  Up to
+ *  DEF_XFER_FILES files are sent at once, as the port range allows.
  *
  *  @brief  Recursively transfer a directory between hosts.
- *  @fn     stat = dts_xferDirTo (char *host, char *func, int method,
- *			int rate, char *path, char *root, char *prefix, 
- *			xferStat *xs)
+ *  @fn     stat = dts_xferDirTo (dtsXferCtx *ctx, char *path, char *root, 
+ *			char *prefix)
  *
- *  @param  host	host to call
- *  @param  func	RPC method to call
- *  @param  method	transport method
- *  @param  rate	transfer rate
- *  @param  path	path to file
+ *  @param  ctx		transfer context
+ *  @param  path	path to directory
  *  @param  root	destination root
  *  @param  prefix	source prefix dir
- *  @param  xfs		transfer stats
  *  @return		1 (one) if DTS succeeds.
  */
 int
-dts_xferDirTo (char *host, char *func, int method, int rate, char *path, 
-	char *root, char *prefix, xferStat *xs)
+dts_xferDirTo (dtsXferCtx *ctx, char *path, char *root, char *prefix)
 {
-    DIR   *dp;
-    struct dirent *entry;
-    char   rpath[PATH_MAX];
-    char   newfile[PATH_MAX + 1];
-    int    len , plen = strlen (prefix), fsize, fmode;
+    xferList  list;
+    char      lastdir[SZ_PATH];
+    int       res = OK;
 
 
-    /*  Open the directory.
-    */
-    if (! (dp = opendir (path)) ) {
-        dtsErrLog (NULL, "Cannot open dir '%s'\n", path);
-        return (ERR);
-    }
+    memset (&list, 0, sizeof (list));
+    memset (lastdir, 0, SZ_PATH);
+    pthread_mutex_init (&list.mutex, NULL);
 
-    len = strlen (path);
-    if (plen && path[len - 1] == '/')
-        path[--len] = '\0';
-
-    while ((entry = readdir (dp))) {
-        char *name = entry->d_name;
-
-        if ((strcmp (name, "..") == 0) || (strcmp (name, ".") == 0))
-            continue;
-
-        memset (newfile, 0, PATH_MAX);
-        memset (rpath, 0, PATH_MAX);
+    list.caller = "xferDirTo";
+    list.host   = ctx->host;
 
-        sprintf (newfile, "%s/%s", path, name);
-        sprintf (rpath, "%s/%s", root, &newfile[plen]);
-
-	if (dts_isDir (newfile) > 0) {
-	    if (dts_xferDirTo (host, func, method, rate, newfile, root, 
-		prefix, xs) == ERR) {
-		    closedir (dp);
-		    fprintf (stderr, 
-			"xferDirTo: isDir xferDirTo() fails on '%s'\n",
-		        newfile);
-		    return (ERR);
-	    }
-
-	} else {
-	    /* Update the transfer parameters.
-	    */
-	    strcpy (s_dir, dts_pathDir (newfile));
-	    strcpy (d_dir, dts_pathDir (rpath));
-	    strcpy (s_fname, dts_pathFname (newfile));
-	    strcpy (d_fname, dts_pathFname (rpath));
-	    sprintf (s_path, "%s", newfile);
-	    sprintf (d_path, "%s", rpath);
-
-	    /* Create leading directory components.
-	    */
-	    if (dts_hostMkdir (host, d_dir) == ERR) {
-		closedir (dp);
-		fprintf (stderr, "hostMkdir(): xferFile() fails\n");
-		return (ERR);
-	    }
-        
-	    fsize = (int) dts_nameSize (newfile);
-	    fmode = (mode_t) dts_nameMode (newfile);
-            if (dts_xferFile (host, func, method, rate, newfile, 
-		fsize, fmode, xs) == ERR) {
-		    closedir (dp);
-		    fprintf (stderr, "xferDirTo: xferFile() fails on '%s'\n",
-		        newfile);
-		    return (ERR);
-	    }
-
-#ifdef DTS_CHMOD
-	    /* Set the remote file mode
-	    */
-	    if (dts_hostChmod (host, newfile, fmode) == ERR) {
-		closedir (dp);
-		fprintf (stderr, "xferDirTo: hostChmod() fails '%s' to %d\n",
-		    newfile, fmode);
-		return (ERR);
-	    }
-#endif
-	}
-    }
-    closedir (dp);
+    if ((res = dts_xferWalkTo (&list, path, root, prefix, lastdir)) == OK)
+	res = dts_xferRunList (ctx, &list);
 
-    return (OK);
+    dts_xferFreeList (&list);
+    return (res);
 }
 
 
 /**
- *  DTS_XFERDIRFROM -- Recursively transfer a directory between hosts.
+ *  DTS_XFERDIRFROM -- Recursively transfer a directory between hosts.  Up
+ *  to DEF_XFER_FILES files are sent at once, as the port range allows.
  *
  *  @brief  Recursively transfer a directory between hosts.
- *  @fn     stat = dts_xferDirFrom (char *srcHost, char *dstHost,
- *  			int dstLocal, char *func, int method, int rate,
- *			char *path, char *root, char *prefix, xferStat *xs)
+ *  @fn     stat = dts_xferDirFrom (dtsXferCtx *ctx, char *path, 
+ *			char *prefix)
  *
- *  @param  srcHost	source host
- *  @param  dstHost	destination host
- *  @param  dstLocal	is dest the local machine?
- *  @param  func	RPC method to call
- *  @param  method	transport method
- *  @param  rate	transfer rate
- *  @param  path	path to file
- *  @param  root	destination root
+ *  @param  ctx		transfer context
+ *  @param  path	path to directory
  *  @param  prefix	destination path prefix
- *  @param  xfs		transfer stats
  *  @return		1 (one) if DTS succeeds.
  */
 int
-dts_xferDirFrom (char *srcHost, char *dstHost, int dstLocal, char *func, 
-		int method, int rate, char *path, char *root, 
-		char *prefix, xferStat *xs)
+dts_xferDirFrom (dtsXferCtx *ctx, char *path, char *prefix)
 {
-    char  *list = NULL, *ip, *op, name[SZ_FNAME];
-    char  newfile[PATH_MAX];
-    char  lpath[PATH_MAX];
-    int   isDir, len;
+    xferList  list;
+    char     *list_str = NULL;
+    int       res = OK;
 
 
-    /* Get a directory listing from the source host.
+    /* Make sure we can list the source before starting.
     */
-    if ( (list = dts_hostDir (srcHost, path, 0)) == NULL ) {
+    if ( (list_str = dts_hostDir (ctx->src_host, path, 0)) == NULL ) {
 	dtsErrLog (NULL, "Warning: Can't list '%s'\n", path);
-	if (list) free (list);
 	return (ERR);
     }
-    len = strlen (list);
+    free (list_str);
 
-    for (ip=list; *ip && (ip - len) <= list; ) {
-	memset ((op = name), 0, SZ_FNAME);
+    memset (&list, 0, sizeof (list));
+    pthread_mutex_init (&list.mutex, NULL);
 
-	while (*ip && *ip == '\n')
-	    ip++;
-	while (*ip && (*ip != '/' && *ip != '\n'))
-	    *op++ = *ip++;
-
-	isDir = ((*ip && *ip == '/') ? 1 : 0);
-	if (*ip == '/')
-	    ip++;
-
-	memset (newfile, 0, PATH_MAX);
-	memset (lpath, 0, PATH_MAX);
-        sprintf (newfile, "%s/%s", path, name);
-        sprintf (lpath, "%s%s/%s", prefix, path, name);
-
-	if (isDir) {
-	    if (XFER_DEBUG)
-	        fprintf (stderr, "dir\t%s -> %s\n", newfile, lpath);
-	    dts_xferDirFrom (srcHost, dstHost, dstLocal, func, 
-			method, rate, newfile, root, prefix, xs);
-	} else {
-	    int  fsize = dts_hostFSize (srcHost, newfile);
-	    mode_t  fmode = (mode_t) dts_hostFMode (srcHost, newfile);
+    list.caller  = "xferDirFrom";
+    list.host    = ctx->host;
+    list.setmode = ctx->dstLocal;
 
+    dts_xferWalkFrom (&list, ctx->src_host, path, prefix);
+    if (list.stat == OK)
+	res = dts_xferRunList (ctx, &list);
+    else
+	res = ERR;
 
-	    /* Update the transfer parameters.
-	    */
-	    strcpy (s_dir, dts_pathDir (newfile));
-	    strcpy (d_dir, dts_pathDir (lpath));
-	    strcpy (s_fname, dts_pathFname (newfile));
-	    strcpy (d_fname, dts_pathFname (lpath));
-	    sprintf (s_path, "%s", newfile);
-	    sprintf (d_path, "%s", lpath);
+    dts_xferFreeList (&list);
+    return (res);
+}
 
-	    if (XFER_DEBUG) {
-	        fprintf (stderr, "file\t%s -> %s\n", newfile, lpath);
-	        fprintf (stderr, "fsize\t%d -> fmode %d\n", fsize, (int) fmode);
-	    }
 
-            if (dts_xferFile (
-		((strcmp (func, "xferPushFile") == 0) ? srcHost : dstHost),
-		func, method, rate, newfile, 
-		fsize, fmode, xs) == ERR) {
-		    if (list) free (list);
-		    return (ERR);
-            }
+/**
+ *  DTS_XFERDIRSTREAM -- Transfer a directory between hosts as a single
+ *  tar stream.  The source builds the archive as it is sent and the dest
+ *  unpacks it as it arrives (see dtsTar.c), so the whole tree moves in
+ *  one parallel socket transfer rather than one per file.  Both ends must
+ *  support streams.
+ *
+ *  @brief  Transfer a directory between hosts as a single tar stream.
+ *  @fn     stat = dts_xferDirStream (dtsXferCtx *ctx, char *path, 
+ *			long fsize)
+ *
+ *  @param  ctx		transfer context
+ *  @param  path	path to directory
+ *  @param  fsize	stream size (or estimate)
+ *  @return		1 (one) if DTS succeeds.
+ */
+int
+dts_xferDirStream (dtsXferCtx *ctx, char *path, long fsize)
+{
+    int  res;
 
-	    if (dstLocal)			/* restore permissions */
-		(void) chmod (lpath, fmode);
-	}
-    }
+    ctx->stream = 1;
+    res = dts_xferFile (ctx, path, fsize, (mode_t) 0);
+    ctx->stream = 0;
 
-    if (list) free (list);
-    return (OK);
+    return (res);
 }
 
 
 /**
- *  DTS_XFERFILE -- Transfer a single file between hosts.
+ *  DTS_XFERFILE -- Transfer a single file between hosts.  The hosts, 
+ *  paths and transfer parameters are taken from the context, the stats
+ *  are left in ctx->stats.
  *
  *  @brief  Transfer a single file between hosts.
- *  @fn     stat = dts_xferFile (char *host, char *func, int method, 
- *			int rate, char *path,
- *			int fsize, mode_t fmode, xferStat *xs)
+ *  @fn     stat = dts_xferFile (dtsXferCtx *ctx, char *path, long fsize, 
+ *			mode_t fmode)
  *
- *  @param  host	client host
- *  @param  func	RPC method to call
- *  @param  method	transport method
- *  @param  rate	transfer rate (Mbps)
+ *  @param  ctx		transfer context
  *  @param  path	path to file
  *  @param  fsize	file size
  *  @param  fmode	file protection mode
- *  @param  xfs		transfer stats
  *  @return		1 (one) if DTS succeeds.
  */
 int
-dts_xferFile (char *host, char *func, int method, int rate, char *path, 
-		int fsize, mode_t fmode, xferStat *xs)
+dts_xferFile (dtsXferCtx *ctx, char *path, long fsize, mode_t fmode)
 {
+    xferStat *xs = &ctx->stats;
     int  sec, usec, res = OK;
-    int  client = dts_getClient (host);
     char dtscp_local = 0;
 
 
+    ctx->fsize  = fsize;
+    ctx->fmode  = fmode;
+    ctx->client = dts_getClient (ctx->host);
+    gettimeofday (&ctx->start, NULL);
+
     // FIXME -- should not hardwire the port number
-    dtscp_local = (strstr(d_url,":2997") != NULL);
+    dtscp_local = (strstr(ctx->d_url,":2997") != NULL);
     if (! fsize) {
         if (dtscp_local) {
-            if (! dts_isDir (d_dir))
-                dts_localMkdir (d_dir);
-            dts_localTouch (d_path);
+            if (! dts_isDir (ctx->d_dir))
+                dts_localMkdir (ctx->d_dir);
+            dts_localTouch (ctx->d_path);
         } else {        
 
-            if (! dts_hostIsDir (dest_host,d_dir)) {
+            if (! dts_hostIsDir (ctx->dest_host,ctx->d_dir)) {
                 char holder[SZ_PATH];
                 /*  FIXME -- MKDIR WONT WORK UNLESS IT HAS A ./
 		 */
-                memset (holder, 0, PATH_MAX);    
-                strcpy (holder,d_dir);
-                memmove (&holder[1], &holder[0], strlen(holder));
-                holder[0] = '.';
-                dts_hostMkdir (dest_host,holder);
+                memset (holder, 0, SZ_PATH);    
+                if (snprintf (holder, SZ_PATH, ".%s", ctx->d_dir) < SZ_PATH)
+                    dts_hostMkdir (ctx->dest_host,holder);
             }
 
-            res = dts_hostTouch (dest_host,d_path);
+            res = dts_hostTouch (ctx->dest_host,ctx->d_path);
         }
+        dts_xferCloseClient (ctx);
         return (OK); //Re add in touch.
     }
 
     if (XFER_DEBUG) {
 	fprintf (stderr, "------------ dts_xferFile ------------------\n");
-	fprintf (stderr, "      src = '%s'\n", src_host);
-	fprintf (stderr, "     dest = '%s'\n", dest_host);
-	fprintf (stderr, "     path = '%s'   size = %d\n", path, fsize);
-	fprintf (stderr, "     func = %s\n", func);
-	fprintf (stderr, "     rate = %d\n", rate);
-	fprintf (stderr, "   client = %d\n", client);
+	fprintf (stderr, "      src = '%s'\n", ctx->src_host);
+	fprintf (stderr, "     dest = '%s'\n", ctx->dest_host);
+	fprintf (stderr, "     path = '%s'   size = %ld\n", path, fsize);
+	fprintf (stderr, "     func = %s\n", ctx->func);
+	fprintf (stderr, "     rate = %d\n", ctx->rate);
+	fprintf (stderr, "   client = %d\n", ctx->client);
 	fprintf (stderr, "    fmode = %d\n", fmode);
-	fprintf (stderr, " nthreads = %d\n", nthreads);
-	fprintf (stderr, "xfer_port = %d\n", xfer_port);
-	fprintf (stderr, "    s_url = %s\n", s_url);
-	fprintf (stderr, "    d_url = %s\n", d_url);
-	fprintf (stderr, "    s_dir = %s\n", s_dir);
-	fprintf (stderr, "    d_dir = %s\n", d_dir);
-	fprintf (stderr, "   s_path = %s\n", s_path);
-	fprintf (stderr, "   d_path = %s\n", d_path);
-	fprintf (stderr, "  s_fname = %s\n", s_fname);
-	fprintf (stderr, "  d_fname = %s\n", d_fname);
+	fprintf (stderr, " nthreads = %d\n", ctx->nthreads);
+	fprintf (stderr, "xfer_port = %d\n", ctx->port);
+	fprintf (stderr, "    s_url = %s\n", ctx->s_url);
+	fprintf (stderr, "    d_url = %s\n", ctx->d_url);
+	fprintf (stderr, "    s_dir = %s\n", ctx->s_dir);
+	fprintf (stderr, "    d_dir = %s\n", ctx->d_dir);
+	fprintf (stderr, "   s_path = %s\n", ctx->s_path);
+	fprintf (stderr, "   d_path = %s\n", ctx->d_path);
+	fprintf (stderr, "  s_fname = %s\n", ctx->s_fname);
+	fprintf (stderr, "  d_fname = %s\n", ctx->d_fname);
 	fprintf (stderr, "--------------------------------------------\n");
     }
 
     /* Set the calling params.
     */
-    xr_initParam (client);
-    xr_setStringInParam (client, "dtsCmd");
-    xr_setStringInParam (client, dts_cfgQMethodStr (method));
-    xr_setStringInParam (client, path);
-    xr_setIntInParam    (client, (int) fsize);
-    xr_setIntInParam    (client, nthreads);
-    xr_setIntInParam    (client, rate);
-    xr_setIntInParam    (client, xfer_port);
-    xr_setStringInParam (client, src_host);
-    xr_setStringInParam (client, dest_host);
-    xr_setStringInParam (client, s_url);
-    xr_setStringInParam (client, d_url);
-    xr_setStringInParam (client, s_dir);
-    xr_setStringInParam (client, d_dir);
-    xr_setStringInParam (client, s_fname);
-    xr_setStringInParam (client, d_fname);
-
-    if (xr_callSync (client, func) == OK) {
+    xr_initParam (ctx->client);
+    xr_setStringInParam (ctx->client, "dtsCmd");
+    xr_setStringInParam (ctx->client, dts_cfgQMethodStr (ctx->method));
+    xr_setStringInParam (ctx->client, path);
+    xr_setLongLongInParam (ctx->client, (long long) fsize);
+    xr_setIntInParam    (ctx->client, ctx->nthreads);
+    xr_setIntInParam    (ctx->client, ctx->rate);
+    xr_setIntInParam    (ctx->client, ctx->port);
+    xr_setStringInParam (ctx->client, ctx->src_host);
+    xr_setStringInParam (ctx->client, ctx->dest_host);
+    xr_setStringInParam (ctx->client, ctx->s_url);
+    xr_setStringInParam (ctx->client, ctx->d_url);
+    xr_setStringInParam (ctx->client, ctx->s_dir);
+    xr_setStringInParam (ctx->client, ctx->d_dir);
+    xr_setStringInParam (ctx->client, ctx->s_fname);
+    xr_setStringInParam (ctx->client, ctx->d_fname);
+    if (ctx->stream)
+        xr_setIntInParam (ctx->client, 1);
+
+    if (xr_callSync (ctx->client, ctx->func) == OK) {
 
         char  str_res[SZ_CONFIG+1], *sres = str_res;
 
-        xr_getStringFromResult (client, &sres);
+        xr_getStringFromResult (ctx->client, &sres);
 	sscanf (sres, "%d %d %d", &sec, &usec, &res);
 
 	xs->fsize   = fsize;
@@ -773,13 +826,13 @@ dts_xferFile (char *host, char *func, int method, int rate, char *path,
         if (XFER_DEBUG) {
 	    fprintf (stderr, "dts_xferFile:  res = %d\n", res);
 	    fprintf (stderr, 
-		"File: '%s' (%d bytes %d.%d sec)\n    src = '%s'  dest = '%s'",
-        	path, (int) fsize, sec, usec, src_host, dest_host);
+		"File: '%s' (%ld bytes %d.%d sec)\n    src = '%s'  dest = '%s'",
+        	path, fsize, sec, usec, ctx->src_host, ctx->dest_host);
 	    fprintf (stderr, "    %g Mb/s   %g MB/s   %d.%d sec\n",
         	transferMb(fsize,sec,usec), transferMB(fsize,sec,usec), 
 		sec, usec);
 	}
-	dts_closeClient (client);
+	dts_xferCloseClient (ctx);
 
 
 #ifdef DTS_CHMOD
@@ -787,10 +840,10 @@ dts_xferFile (char *host, char *func, int method, int rate, char *path,
          */
         fmode = (mode_t) dts_nameMode (path);
 	for (i=3; i > 0; i--) {
-            if (dts_hostChmod (dest_host, d_path, fmode) == ERR) {
+            if (dts_hostChmod (ctx->dest_host, ctx->d_path, fmode) == ERR) {
 		if (i == 1) {
     	            fprintf (stderr, "Error: Chmod of '%s' fails 3 retries\n", 
-			d_path);
+			ctx->d_path);
 	            return (ERR);
 		} else 
 		    dtsSleep (SOCK_PAUSE_TIME);
@@ -801,12 +854,13 @@ dts_xferFile (char *host, char *func, int method, int rate, char *path,
 
         return (res);
     }
-    dts_closeClient (client);
+    dts_xferCloseClient (ctx);
 
     if (XFER_DEBUG) 
-	fprintf (stderr, "Remote method '%s' fails\n", func);
+	fprintf (stderr, "Remote method '%s' fails\n", ctx->func);
 
-    dtsErrLog (NULL, "Error: Remote method '%s' fails\n", func);
+    dtsErrLog (NULL, "Error: Remote method '%s' fails\n", ctx->func);
+    xs->stat = ERR;
     return (ERR);
 }
 
@@ -1004,3 +1058,395 @@ dts_xferParsePaths (char *host, char **path_A, char **path_B,
 
     return (OK);
 }
+
+
+
+/*****************************************************************************
+ *  Private procedures.
+ *****************************************************************************/
+
+/**
+ *  DTS_XFERWALKTO -- Add the files of a local directory tree to the list,
+ *  creating the remote directories as we go.
+ */
+static int
+dts_xferWalkTo (xferList *list, char *path, char *root, char *prefix,
+	char *lastdir)
+{
+    DIR   *dp;
+    struct dirent *entry;
+    char   rpath[PATH_MAX];
+    char   newfile[PATH_MAX + 1];
+    char  *d_dir = NULL;
+    int    len , plen = strlen (prefix);
+
+
+    /*  Open the directory.
+    */
+    if (! (dp = opendir (path)) ) {
+        dtsErrLog (NULL, "Cannot open dir '%s'\n", path);
+        return (ERR);
+    }
+
+    len = strlen (path);
+    if (plen && path[len - 1] == '/')
+        path[--len] = '\0';
+
+    while ((entry = readdir (dp))) {
+        char *name = entry->d_name;
+
+        if ((strcmp (name, "..") == 0) || (strcmp (name, ".") == 0))
+            continue;
+
+        memset (newfile, 0, PATH_MAX);
+        memset (rpath, 0, PATH_MAX);
+
+        sprintf (newfile, "%s/%s", path, name);
+        sprintf (rpath, "%s/%s", root, &newfile[plen]);
+
+	if (dts_isDir (newfile) > 0) {
+	    if (dts_xferWalkTo (list, newfile, root, prefix, lastdir) == ERR) {
+		closedir (dp);
+		fprintf (stderr, "xferDirTo: isDir xferDirTo() fails on '%s'\n",
+		    newfile);
+		return (ERR);
+	    }
+
+	} else {
+	    /* Create leading directory components, once per directory.
+	    */
+	    d_dir = dts_pathDir (rpath);
+	    if (strcmp (d_dir, lastdir) != 0) {
+		if (dts_hostMkdir (list->host, d_dir) == ERR) {
+		    closedir (dp);
+		    fprintf (stderr, "hostMkdir(): xferFile() fails\n");
+		    return (ERR);
+		}
+		strncpy (lastdir, d_dir, SZ_PATH - 1);
+	    }
+
+	    if (dts_xferAddItem (list, newfile, rpath, dts_nameSize (newfile),
+		(mode_t) dts_nameMode (newfile)) == ERR) {
+		    closedir (dp);
+		    return (ERR);
+	    }
+	}
+    }
+    closedir (dp);
+
+    return (OK);
+}
+
+
+/**
+ *  DTS_XFERWALKFROM -- Add the files of a remote directory tree to the
+ *  list.  Unreadable subdirectories are skipped.
+ */
+static void
+dts_xferWalkFrom (xferList *list, char *srcHost, char *path, char *prefix)
+{
+    char  *dlist = NULL, *ip, *op, name[SZ_FNAME];
+    char  newfile[PATH_MAX];
+    char  lpath[PATH_MAX];
+    int   isDir, len;
+
+
+    /* Get a directory listing from the source host.
+    */
+    if ( (dlist = dts_hostDir (srcHost, path, 0)) == NULL ) {
+	dtsErrLog (NULL, "Warning: Can't list '%s'\n", path);
+	return;
+    }
+    len = strlen (dlist);
+
+    for (ip=dlist; *ip && (ip - len) <= dlist && list->stat == OK; ) {
+	memset ((op = name), 0, SZ_FNAME);
+
+	while (*ip && *ip == '\n')
+	    ip++;
+	while (*ip && (*ip != '/' && *ip != '\n'))
+	    *op++ = *ip++;
+
+	isDir = ((*ip && *ip == '/') ? 1 : 0);
+	if (*ip == '/')
+	    ip++;
+
+	memset (newfile, 0, PATH_MAX);
+	memset (lpath, 0, PATH_MAX);
+        sprintf (newfile, "%s/%s", path, name);
+        sprintf (lpath, "%s%s/%s", prefix, path, name);
+
+	if (isDir) {
+	    if (XFER_DEBUG)
+	        fprintf (stderr, "dir\t%s -> %s\n", newfile, lpath);
+	    dts_xferWalkFrom (list, srcHost, newfile, prefix);
+	} else {
+	    long fsize = dts_hostFSize (srcHost, newfile);
+	    mode_t  fmode = (mode_t) dts_hostFMode (srcHost, newfile);
+
+	    if (XFER_DEBUG) {
+	        fprintf (stderr, "file\t%s -> %s\n", newfile, lpath);
+	        fprintf (stderr, "fsize\t%ld -> fmode %d\n", fsize, (int) fmode);
+	    }
+	    if (dts_xferAddItem (list, newfile, lpath, fsize, fmode) == ERR)
+		list->stat = ERR;
+	}
+    }
+
+    free (dlist);
+}
+
+
+/**
+ *  DTS_XFERADDITEM -- Append a file to the transfer list.
+ */
+static int
+dts_xferAddItem (xferList *list, char *s_path, char *d_path, long fsize,
+	mode_t fmode)
+{
+    xferItem *it = calloc (1, sizeof (xferItem));
+
+    if (it == (xferItem *) NULL) {
+	dtsErrLog (NULL, "%s: cannot allocate file list\n", list->caller);
+	return (ERR);
+    }
+    strncpy (it->s_path, s_path, SZ_PATH - 1);
+    strncpy (it->d_path, d_path, SZ_PATH - 1);
+    it->fsize = fsize;
+    it->fmode = fmode;
+
+    if (list->tail)
+	list->tail->next = it;
+    else
+	list->head = list->next = it;
+    list->tail = it;
+    list->nitems++;
+
+    return (OK);
+}
+
+
+/**
+ *  DTS_XFERRUNLIST -- Send the files in the list.  Each worker takes a
+ *  block of 'nthreads' ports from the context's range so concurrent
+ *  files don't collide on the data ports, the number of workers is
+ *  bounded by DEF_XFER_FILES and by how many blocks fit in the range.
+ */
+static int
+dts_xferRunList (dtsXferCtx *ctx, xferList *list)
+{
+    xferStat     *xs = &ctx->stats;
+    dtsWorkGroup *grp = (dtsWorkGroup *) NULL;
+    xferWorker   *w = (xferWorker *) NULL;
+    struct timeval t0, t1;
+    int   i, nw, nsub = 0, sec, usec;
+    int   nt = (ctx->nthreads > 0 ? ctx->nthreads : 1);
+
+
+    memset (xs, 0, sizeof (xferStat));
+    if (list->nitems == 0)
+	return (OK);
+
+    nw = (ctx->maxport - ctx->port + 1) / nt;
+    if (nw > DEF_XFER_FILES)
+	nw = DEF_XFER_FILES;
+    if (nw > list->nitems)
+	nw = list->nitems;
+    if (nw < 1)
+	nw = 1;
+
+    if ((w = calloc (nw, sizeof (xferWorker))) == (xferWorker *) NULL) {
+	dtsErrLog (NULL, "%s: cannot allocate workers\n", list->caller);
+	return (ERR);
+    }
+    for (i=0; i < nw; i++) {
+	memcpy (&w[i].ctx, ctx, sizeof (dtsXferCtx));
+	w[i].ctx.port = ctx->port + (i * nt);
+	w[i].list = list;
+    }
+
+    gettimeofday (&t0, NULL);
+    ctx->start = t0;
+
+    if (nw > 1 && (grp = dts_workGroup ())) {
+	for (i=0; i < nw; i++) {
+	    w[i].pooled = 1;
+	    if (dts_workSubmit (grp, nsub, dts_xferWorker, &w[i]) == OK)
+		nsub++;
+	}
+	if (nsub == 0) {
+	    w[0].pooled = 0;			/* no pool, run it here	*/
+	    dts_xferWorker (&w[0]);
+	}
+	if (dts_workWait (grp))
+	    list->stat = ERR;
+	dts_workFree (grp);
+    } else
+	dts_xferWorker (&w[0]);
+
+    gettimeofday (&t1, NULL);
+
+    sec  = (int) (t1.tv_sec - t0.tv_sec);
+    usec = (int) (t1.tv_usec - t0.tv_usec);
+    if (usec < 0) {
+	sec--;
+	usec += 1000000;
+    }
+
+    xs->fsize   = list->nbytes;
+    xs->tput_mb = transferMb (list->nbytes, sec, usec);
+    xs->tput_MB = transferMB (list->nbytes, sec, usec);
+    xs->time    = ((double) sec + (double) usec / 1000000.0);
+    xs->sec     = sec;
+    xs->usec    = usec;
+    xs->stat    = list->stat;
+
+    free ((void *) w);
+    return (list->stat);
+}
+
+
+/**
+ *  DTS_XFERWORKER -- Send files from the list until it is empty or some
+ *  other worker has failed.
+ */
+static void
+dts_xferWorker (void *data)
+{
+    xferWorker *w = (xferWorker *) data;
+    xferList   *list = w->list;
+    dtsXferCtx *ctx = &w->ctx;
+    xferItem   *it = (xferItem *) NULL;
+    int         stat = OK;
+
+
+    while (1) {
+	pthread_mutex_lock (&list->mutex);
+	if (list->stat != OK || (it = list->next) == (xferItem *) NULL) {
+	    pthread_mutex_unlock (&list->mutex);
+	    break;
+	}
+	list->next = it->next;
+
+	pthread_mutex_unlock (&list->mutex);
+
+	/* Update the transfer parameters.
+	*/
+	dts_xferSplitPath (it->s_path, ctx->s_dir, ctx->s_fname);
+	dts_xferSplitPath (it->d_path, ctx->d_dir, ctx->d_fname);
+	strcpy (ctx->s_path, it->s_path);
+	strcpy (ctx->d_path, it->d_path);
+
+	if (dts_xferFile (ctx, it->s_path, it->fsize, it->fmode) == ERR) {
+		fprintf (stderr, "%s: xferFile() fails on '%s'\n",
+		    list->caller, it->s_path);
+		stat = ERR;
+		break;
+	}
+
+	if (list->setmode)			/* restore permissions */
+	    (void) chmod (it->d_path, it->fmode);
+
+	pthread_mutex_lock (&list->mutex);
+	list->nbytes += it->fsize;
+	pthread_mutex_unlock (&list->mutex);
+    }
+
+    if (stat != OK) {
+	pthread_mutex_lock (&list->mutex);
+	list->stat = ERR;
+	pthread_mutex_unlock (&list->mutex);
+    }
+    if (w->pooled)
+	dts_workStatus (stat);
+}
+
+
+/**
+ *  DTS_XFERFREELIST -- Free the transfer list.
+ */
+static void
+dts_xferFreeList (xferList *list)
+{
+    xferItem *it, *next;
+
+    for (it=list->head; it; it=next) {
+	next = it->next;
+	free ((void *) it);
+    }
+    list->head = list->tail = list->next = (xferItem *) NULL;
+    pthread_mutex_destroy (&list->mutex);
+}
+
+
+/**
+ *  DTS_XFERSPLITPATH -- Split a path into its directory and file name as
+ *  dts_pathDir() and dts_pathFname() do, but into the caller's buffers 
+ *  (each SZ_PATH) rather than the shared string buffers.
+ */
+static void
+dts_xferSplitPath (char *path, char *dir, char *fname)
+{
+    char  *ip, *sp;
+    int    len;
+
+
+    memset (dir, 0, SZ_PATH);
+    memset (fname, 0, SZ_PATH);
+    if (!path) {
+	strcpy (dir, "./");
+	return;
+    }
+
+    if ((ip = strrchr (path, (int) '/')) == (char *) NULL) {
+	strcpy (dir, "./");			/* no directory specified  */
+	strncpy (fname, path, SZ_PATH - 1);
+	return;
+    }
+
+    /*  Skip any host prefix on the directory.
+    */
+    if ((sp = strchr (path, (int) ':')) && sp < ip)
+	sp++;
+    else
+	sp = path;
+
+    if ((len = (int) (ip - sp)) > 0)
+	strncpy (dir, sp, min (len, SZ_PATH - 1));
+    else
+	strcpy (dir, "/");
+
+    if (ip[1])
+	strncpy (fname, ip + 1, SZ_PATH - 1);
+}
+
+
+/**
+ *  DTS_XFERJOINPATH -- Build the full source and dest paths of the context
+ *  from the directories and file names.
+ */
+static int
+dts_xferJoinPath (dtsXferCtx *ctx)
+{
+    if (snprintf (ctx->s_path, SZ_PATH, "%s/%s", ctx->s_dir, 
+	    ctx->s_fname) >= SZ_PATH ||
+        snprintf (ctx->d_path, SZ_PATH, "%s/%s", ctx->d_dir, 
+	    ctx->d_fname) >= SZ_PATH) {
+	        fprintf (stderr, "Error: Path too long '%s/%s'\n", ctx->s_dir,
+		    ctx->s_fname);
+	        return (ERR);
+    }
+    return (OK);
+}
+
+
+/**
+ *  DTS_XFERCLOSECLIENT -- Close the context's RPC client handle, if open.
+ */
+static void
+dts_xferCloseClient (dtsXferCtx *ctx)
+{
+    if (ctx->client >= 0)
+	dts_closeClient (ctx->client);
+    ctx->client = -1;
+}
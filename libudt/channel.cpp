@@ -46,6 +46,8 @@ written by
    #include <cstring>
    #include <cstdio>
    #include <cerrno>
+   #include <cstdlib>
+   #include <sys/time.h>
 #else
    #include <winsock2.h>
    #include <ws2tcpip.h>
@@ -53,6 +55,7 @@ written by
       #include <wspiapi.h>
    #endif
 #endif
+#include "common.h"
 #include "channel.h"
 #include "packet.h"
 
@@ -74,6 +77,7 @@ m_iSocket(),
 m_iSndBufSize(65536),
 m_iRcvBufSize(65536)
 {
+   setWAN();
 }
 
 CChannel::CChannel(const int& version):
@@ -83,10 +87,16 @@ m_iSndBufSize(65536),
 m_iRcvBufSize(65536)
 {
    m_iSockAddrSize = (AF_INET == m_iIPversion) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+   setWAN();
 }
 
 CChannel::~CChannel()
 {
+   #ifndef WIN32
+      if (m_bWAN)
+         pthread_mutex_destroy(&m_WANLock);
+   #endif
+   delete [] m_pcWANHold;
 }
 
 void CChannel::open(const sockaddr* addr)
@@ -179,6 +189,65 @@ void CChannel::setUDPSockOpt()
       if (0 != setsockopt(m_iSocket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(timeval)))
          throw CUDTException(1, 3, NET_ERROR);
    #endif
+
+   #ifndef WIN32
+      // the receiver applies the emulated delay from the arrival time of each packet
+      int on = 1;
+      if (m_bWAN)
+         setsockopt(m_iSocket, SOL_SOCKET, SO_TIMESTAMP, (char *)&on, sizeof(int));
+   #endif
+}
+
+void CChannel::setWAN()
+{
+   m_bWAN = false;
+   m_ullWANDelay = m_ullWANJitter = 0;
+   m_dWANLoss = m_dWANReorder = m_dWANRate = 0.0;
+   m_uWANSndSeed = m_uWANRcvSeed = 1;
+   m_ullWANNextTime = 0;
+   m_pcWANHold = NULL;
+   m_iWANHoldSize = 0;
+
+   #ifndef WIN32
+      // same format as the DTS 'wan' queue keyword, see libdts/dtsWan.c
+      const char* spec = getenv("DTS_WAN");
+      if ((NULL == spec) || ('\0' == *spec))
+         return;
+
+      char buf[256], *last = NULL;
+      strncpy(buf, spec, sizeof(buf) - 1);
+      buf[sizeof(buf) - 1] = '\0';
+
+      for (char* key = strtok_r(buf, ", \t", &last); NULL != key; key = strtok_r(NULL, ", \t", &last))
+      {
+         char* val = strchr(key, '=');
+         if (NULL == val)
+            continue;
+         *val++ = '\0';
+         double d = atof(val);
+         if (d < 0)
+            continue;
+
+         if (0 == strcasecmp(key, "delay"))
+            m_ullWANDelay = uint64_t(d * 1000);
+         else if (0 == strcasecmp(key, "jitter"))
+            m_ullWANJitter = uint64_t(d * 1000);
+         else if (0 == strcasecmp(key, "loss"))
+            m_dWANLoss = d / 100;
+         else if (0 == strcasecmp(key, "reorder"))
+            m_dWANReorder = d / 100;
+         else if (0 == strcasecmp(key, "rate"))
+            m_dWANRate = d;
+         else if (0 == strcasecmp(key, "seed"))
+            m_uWANSndSeed = m_uWANRcvSeed = (unsigned int)d;
+      }
+
+      if (m_dWANReorder > 0)
+         m_pcWANHold = new char[65536];
+
+      pthread_mutex_init(&m_WANLock, NULL);
+      m_bWAN = true;
+   #endif
 }
 
 void CChannel::close() const
@@ -234,6 +303,8 @@ void CChannel::getPeerAddr(sockaddr* addr) const
 
 int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
 {
+   bool data = (0 == packet.getFlag());
+
    // convert control information into network order
    if (packet.getFlag())
       for (int i = 0, n = packet.getLength() / 4; i < n; ++ i)
@@ -259,7 +330,7 @@ int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
       mh.msg_controllen = 0;
       mh.msg_flags = 0;
 
-      int res = sendmsg(m_iSocket, &mh, 0);
+      int res = m_bWAN ? sendWAN(mh, data) : sendmsg(m_iSocket, &mh, 0);
    #else
       DWORD size = CPacket::m_iPktHdrSize + packet.getLength();
       int addrsize = m_iSockAddrSize;
@@ -286,6 +357,68 @@ int CChannel::sendto(const sockaddr* addr, CPacket& packet) const
    return res;
 }
 
+int CChannel::sendWAN(msghdr& mh, bool data) const
+{
+   #ifndef WIN32
+      int size = mh.msg_iov[0].iov_len + mh.msg_iov[1].iov_len;
+      if (!data)
+         return sendmsg(m_iSocket, &mh, 0);
+
+      uint64_t wait = 0;
+      bool drop = false, hold = false;
+      char held[65536];
+      int heldsize = 0;
+      sockaddr_in6 heldaddr;
+
+      pthread_mutex_lock(&m_WANLock);
+
+      // pace the data packets at the link rate
+      if (m_dWANRate > 0)
+      {
+         uint64_t now = CTimer::getTime();
+         if (m_ullWANNextTime > now)
+            wait = m_ullWANNextTime - now;
+         else
+            m_ullWANNextTime = now;
+         m_ullWANNextTime += uint64_t(size * 8 / m_dWANRate);
+      }
+
+      if ((m_dWANLoss > 0) && (rand_r(&m_uWANSndSeed) < m_dWANLoss * RAND_MAX))
+         drop = true;
+      else if ((NULL != m_pcWANHold) && (0 == m_iWANHoldSize) && (rand_r(&m_uWANSndSeed) < m_dWANReorder * RAND_MAX))
+      {
+         // hold this one back and send it after the next
+         memcpy(m_pcWANHold, mh.msg_iov[0].iov_base, mh.msg_iov[0].iov_len);
+         memcpy(m_pcWANHold + mh.msg_iov[0].iov_len, mh.msg_iov[1].iov_base, mh.msg_iov[1].iov_len);
+         memcpy(&m_WANHoldAddr, mh.msg_name, mh.msg_namelen);
+         m_iWANHoldSize = size;
+         hold = true;
+      }
+      else if (m_iWANHoldSize > 0)
+      {
+         memcpy(held, m_pcWANHold, m_iWANHoldSize);
+         memcpy(&heldaddr, &m_WANHoldAddr, sizeof(sockaddr_in6));
+         heldsize = m_iWANHoldSize;
+         m_iWANHoldSize = 0;
+      }
+
+      pthread_mutex_unlock(&m_WANLock);
+
+      if (wait > 0)
+         usleep(wait);
+      if (drop || hold)
+         return size;
+
+      int res = sendmsg(m_iSocket, &mh, 0);
+      if (heldsize > 0)
+         ::sendto(m_iSocket, held, heldsize, 0, (sockaddr*)&heldaddr, m_iSockAddrSize);
+
+      return res;
+   #else
+      return -1;
+   #endif
+}
+
 int CChannel::recvfrom(sockaddr* addr, CPacket& packet) const
 {
    #ifndef WIN32
@@ -298,6 +431,13 @@ int CChannel::recvfrom(sockaddr* addr, CPacket& packet) const
       mh.msg_controllen = 0;
       mh.msg_flags = 0;
 
+      char cmsg[CMSG_SPACE(sizeof(timeval))];
+      if (m_bWAN)
+      {
+         mh.msg_control = cmsg;
+         mh.msg_controllen = sizeof(cmsg);
+      }
+
       #ifdef UNIX
          fd_set set;
          timeval tv;
@@ -324,6 +464,34 @@ int CChannel::recvfrom(sockaddr* addr, CPacket& packet) const
       return -1;
    }
 
+   #ifndef WIN32
+      // emulated WAN: hand the packet up only once it would have crossed the link
+      if (m_bWAN && (m_ullWANDelay > 0))
+      {
+         timeval tv;
+         gettimeofday(&tv, 0);
+         uint64_t now = tv.tv_sec * 1000000ULL + tv.tv_usec;
+         uint64_t arrival = now;
+
+         for (cmsghdr* c = CMSG_FIRSTHDR(&mh); NULL != c; c = CMSG_NXTHDR(&mh, c))
+         {
+            if ((SOL_SOCKET == c->cmsg_level) && (SCM_TIMESTAMP == c->cmsg_type))
+            {
+               timeval* ts = (timeval*)CMSG_DATA(c);
+               arrival = ts->tv_sec * 1000000ULL + ts->tv_usec;
+            }
+         }
+
+         int64_t jitter = 0;
+         if (m_ullWANJitter > 0)
+            jitter = int64_t((2.0 * rand_r(&m_uWANRcvSeed) / RAND_MAX - 1.0) * m_ullWANJitter);
+         uint64_t deliver = arrival + m_ullWANDelay + jitter;
+
+         if (deliver > now)
+            usleep(deliver - now);
+      }
+   #endif
+
    packet.setLength(res - CPacket::m_iPktHdrSize);
 
    // convert back into local host order
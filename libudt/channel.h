@@ -157,6 +157,26 @@ public:
 private:
    void setUDPSockOpt();
 
+      // Functionality:
+      //    Read the WAN emulation settings (testing only) from the DTS_WAN
+      //    environment variable, e.g. "delay=75,jitter=5,loss=0.1".
+      // Parameters:
+      //    None.
+      // Returned value:
+      //    None.
+
+   void setWAN();
+
+      // Functionality:
+      //    Send a packet through the emulated WAN: drop, hold back or pace it.
+      // Parameters:
+      //    0) [in] mh: message to send, already in network order.
+      //    1) [in] data: true for a data packet.
+      // Returned value:
+      //    Actual size of data sent (as if sent when dropped or held).
+
+   int sendWAN(msghdr& mh, bool data) const;
+
 private:
    int m_iIPversion;                    // IP version
    int m_iSockAddrSize;                 // socket address structure size (pre-defined to avoid run-time test)
@@ -165,6 +185,20 @@ private:
 
    int m_iSndBufSize;                   // UDP sending buffer size
    int m_iRcvBufSize;                   // UDP receiving buffer size
+
+   bool m_bWAN;                         // WAN emulation on (testing only)
+   uint64_t m_ullWANDelay;              // emulated one-way delay, microseconds
+   uint64_t m_ullWANJitter;             // variation of the delay, microseconds
+   double m_dWANLoss;                   // fraction of data packets dropped
+   double m_dWANReorder;                // fraction of data packets delivered late
+   double m_dWANRate;                   // link rate cap, Mbps (0 = none)
+   mutable unsigned int m_uWANSndSeed;  // random sequence for sending
+   mutable unsigned int m_uWANRcvSeed;  // random sequence for receiving
+   mutable uint64_t m_ullWANNextTime;   // time the emulated link is free again
+   mutable char* m_pcWANHold;           // packet held back to be reordered
+   mutable int m_iWANHoldSize;          // size of the held packet (0 = none)
+   mutable sockaddr_in6 m_WANHoldAddr;  // destination of the held packet
+   mutable pthread_mutex_t m_WANLock;   // protects the sending state
 };
 
 
@@ -64,6 +64,7 @@
 #include <pthread.h>
 #include <stdarg.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 
 #include <xmlrpc-c/base.h>
@@ -722,6 +723,34 @@ xr_setIntInParam (int cnum, int value)
 }
 
 
+/*  A value which fits is sent as a plain int, so that a peer which
+**  doesn't know about i8 can still read it.
+*/
+void
+xr_setLongLongInParam (int cnum, long long value)
+{
+    ClientP client = xr_getClientByNum (cnum);
+    xmlrpc_value *v = (xmlrpc_value *) NULL;
+
+
+    assert (cnum < MAX_CLIENTS);		/* validate the client number */
+
+    xmlrpc_env_init (&client->env);
+    if (value >= INT_MIN && value <= INT_MAX)
+	v = xmlrpc_int_new (&client->env, (int) value);
+    else
+	v = xmlrpc_i8_new (&client->env, (xmlrpc_int64) value);
+
+    if (! client->param)	/* safety initialization	*/
+	client->param = xmlrpc_array_new (&client->env);
+
+    xmlrpc_array_append_item (&client->env, client->param, v);
+    if (client_verbose)
+	warn_on_error (&client->env);
+    xmlrpc_DECREF(v);
+}
+
+
 void
 xr_setDoubleInParam (int cnum, double value)
 {
@@ -867,6 +896,34 @@ xr_getIntFromResult (int cnum, int *value)
 }
 
 
+/*  A 64-bit result may come back as a plain int from a peer which
+**  doesn't know about it, take either.
+*/
+int
+xr_getLongLongFromResult (int cnum, long long *value)
+{
+    ClientP client = xr_getClientByNum (cnum);
+    xmlrpc_int64 llval = 0;
+    int   ival = 0;
+
+    assert (cnum < MAX_CLIENTS);		/* validate the client number */
+
+    if (client_errstat == OK) {
+        xmlrpc_env_init (&client->env);
+	if (xmlrpc_value_type (client->result) == XMLRPC_TYPE_INT) {
+	    xmlrpc_read_int (&client->env, client->result, &ival); 
+	    *value = (long long) ival;
+	} else {
+	    xmlrpc_read_i8 (&client->env, client->result, &llval); 
+	    *value = (long long) llval;
+	}
+
+        return (client->env.fault_occurred ? ERR : OK);
+    } else
+	return (ERR);
+}
+
+
 int
 xr_getDoubleFromResult (int cnum, double *value)
 {
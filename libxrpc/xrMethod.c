@@ -52,6 +52,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <pthread.h>
 
@@ -105,6 +106,27 @@ xr_getIntFromParam (void *data, int index)
     return ( ((xr_errstat=c->env->fault_occurred) ? (int)NULL : ival) );
 }
 
+/*  As with results, a 64-bit param sent as a plain int is accepted.
+*/
+long long
+xr_getLongLongFromParam (void *data, int index)
+{
+    CallerP c = (Caller *) data;
+    xmlrpc_value *val = xr_getArrValue (c->param, index);
+    xmlrpc_int64 llval = 0;
+    int ival = 0;
+
+
+    if (xmlrpc_value_type (val) == XMLRPC_TYPE_INT) {
+        xmlrpc_read_int (c->env, val, &ival);
+	llval = (xmlrpc_int64) ival;
+    } else
+        xmlrpc_read_i8 (c->env, val, &llval);
+    xmlrpc_DECREF (val);
+
+    return ( ((xr_errstat=c->env->fault_occurred) ? 0LL : (long long)llval) );
+}
+
 double
 xr_getDoubleFromParam (void *data, int index)
 {
@@ -211,6 +233,20 @@ xr_getArrayFromParam (void *data, int index)
     return (arry);
 }
 
+/*  Number of params sent by the caller, lets a method accept optional
+**  trailing args from newer clients.
+*/
+int
+xr_getParamCount (void *data)
+{
+    CallerP c = (Caller *) data;
+    int npar = 0;
+
+    npar = xmlrpc_array_size (c->env, c->param);
+
+    return ( ((xr_errstat=c->env->fault_occurred) ? 0 : npar) );
+}
+
 
 
 
@@ -232,6 +268,21 @@ xr_setIntInResult (void *data, int val)
         c->result = xmlrpc_int_new (c->env, val);
 }
 
+/*  As with params, a value which fits is returned as a plain int.
+*/
+void
+xr_setLongLongInResult (void *data, long long val)
+{
+    CallerP c = (Caller *) data;
+
+    if (c->result)
+	xmlrpc_DECREF (c->result);
+    if (!xr_errstat && val >= INT_MIN && val <= INT_MAX)
+        c->result = xmlrpc_int_new (c->env, (int) val);
+    else if (!xr_errstat)
+        c->result = xmlrpc_i8_new (c->env, (xmlrpc_int64) val);
+}
+
 void
 xr_setDoubleInResult (void *data, double val)
 {
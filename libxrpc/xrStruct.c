@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 
 #include <xmlrpc-c/base.h>
 #include <xmlrpc-c/client.h>
@@ -135,7 +136,8 @@ void
 xr_setLongLongInStruct ( int snum, char *key, long long value)
 {
     PStruct *p = &sParams[snum];
-    xmlrpc_value *v = xmlrpc_i8_new (&env,value);
+    xmlrpc_value *v = ((value >= INT_MIN && value <= INT_MAX) ?
+	xmlrpc_int_new (&env, (int) value) : xmlrpc_i8_new (&env, value));
 
     xmlrpc_struct_set_value (&env,p->val,key,v);
     xmlrpc_DECREF (v);
@@ -216,7 +218,13 @@ xr_getLongLongFromStruct (int snum, char*key, long long *value)
 
     if (xmlrpc_struct_has_key (&env, s, (const char *) key)) {
         xmlrpc_struct_find_value (&env, s, (const char *)key, &v);
-        xmlrpc_read_i8 (&env, v, value);
+	if (xmlrpc_value_type (v) == XMLRPC_TYPE_INT) {
+	    int ival = 0;			/* older peers send an int */
+
+	    xmlrpc_read_int (&env, v, &ival);
+	    *value = (long long) ival;
+	} else
+            xmlrpc_read_i8 (&env, v, value);
     }
 }
 
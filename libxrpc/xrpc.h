@@ -88,6 +88,7 @@ void   xr_setVerbose (int verbose);
 void   xr_setDebug   (int debug);
 
 void   xr_setIntInParam (int cnum, int value);
+void   xr_setLongLongInParam (int cnum, long long value);
 void   xr_setDoubleInParam (int cnum, double value);
 void   xr_setBoolInParam (int cnum, int value);
 void   xr_setStringInParam (int cnum, char *str);
@@ -96,6 +97,7 @@ void   xr_setStructInParam (int cnum, int snum);
 void   xr_setArrayInParam (int cnum, int anum);
 
 int    xr_getIntFromResult (int cnum, int *value);
+int    xr_getLongLongFromResult (int cnum, long long *value);
 int    xr_getDoubleFromResult (int cnum, double *value);
 int    xr_getBoolFromResult (int cnum, int *value);
 int    xr_getStringFromResult (int cnum, char **value);
@@ -116,14 +118,17 @@ void   xr_printClient (int cnum);
 /*  xrMethod.c
 */
 int    xr_getIntFromParam (void *data, int index);
+long long xr_getLongLongFromParam (void *data, int index);
 double xr_getDoubleFromParam (void *data, int index);
 char  *xr_getStringFromParam (void *data, int index);
 int    xr_getBoolFromParam (void *data, int index);
 char  *xr_getDatetimeFromParam (void *data, int index);
+int    xr_getParamCount (void *data);
 int    xr_getStructFromParam (void *data, int index);
 int    xr_getArrayFromParam (void *data, int index);
 
 void   xr_setIntInResult (void *data, int val);
+void   xr_setLongLongInResult (void *data, long long val);
 void   xr_setDoubleInResult (void *data, double val);
 void   xr_setBoolInResult (void *data, int val);
 void   xr_setStringInResult (void *data, char *val);
@@ -157,6 +162,7 @@ int    xr_newStruct (void);
 void   xr_freeStruct (int snum);
 
 void   xr_setIntInStruct (int snum, char *key, int value);
+void   xr_setLongLongInStruct (int snum, char *key, long long value);
 void   xr_setDoubleInStruct (int snum, char *key, double value);
 void   xr_setBoolInStruct (int snum, char *key, int value);
 void   xr_setStringInStruct (int snum, char *key, char *value);
@@ -165,6 +171,7 @@ void   xr_setStructInStruct (int snum, char *key, int value);
 void   xr_setArrayInStruct (int snum, char *key, int value);
 
 void   xr_getIntFromStruct (int snum, char *key, int *value);
+void   xr_getLongLongFromStruct (int snum, char *key, long long *value);
 void   xr_getDoubleFromStruct (int snum, char *key, double *value);
 void   xr_getBoolFromStruct (int snum, char *key, int *value);
 void   xr_getStringFromStruct (int snum, char *key, char **value);
@@ -42,6 +42,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
@@ -355,6 +356,11 @@ main (int argc, char **argv)
             dtsLog (dts, "DTS server running\n");
         dtsLog (dts, "======================================================\n");
 
+	/*  Open the shared data port once we're in the daemon process.
+	*/
+	if (dts->dataPort > 0)
+	    dts_dataListen (dts->dataPort);
+
 #ifdef ORIG_SERVER
 	xr_startServer ();
 #else
@@ -376,6 +382,8 @@ main (int argc, char **argv)
 #endif
 
     } else {
+	if (dts->dataPort > 0)
+	    dts_dataListen (dts->dataPort);
         xr_startServerThread ();
 	dts_cmdLoop (dts);
     }
@@ -878,6 +886,7 @@ dts_launchQueueManager (void *data)
     case QUEUE_NORMAL: 	   dts_normalQueueManager    (dts, dtsq);   break;
     case QUEUE_SCHEDULED:  dts_scheduledQueueManager (dts, dtsq);   break;
     case QUEUE_PRIORITY:   dts_priorityQueueManager  (dts, dtsq);   break;
+    case QUEUE_FANOUT: 	   dts_normalQueueManager    (dts, dtsq);   break;
     default:
 	dtsLog (dts, "Invalid queue type '%d'", dtsq->name, dtsq->type);
 	break;
@@ -955,7 +964,10 @@ if (DBG_QUEUE)
     	    memset (lockfil, 0, SZ_PATH);
     	    sprintf (lockfil, "%s/_lock", dir);
 
-	    for (i=0; i < 5 && (access (lockfil, F_OK) == 0); i++) {
+	    /*  A cut-through object may be taken while still locked.
+	     */
+	    for (i=0; i < 5 && (access (lockfil, F_OK) == 0) &&
+		!dts_cutPending (dir); i++) {
 if (DBG_QUEUE)
   fprintf (stderr, "lockfile(%s): next=%d cur=%d cnt=%d\n", 
     lockfil, next, current, count);
@@ -988,7 +1000,7 @@ dts_normalQueueManager (DTS *dts, dtsQueue *dtsq)
     char  *qpath = (char *) NULL, msg[SZ_PATH], ppath[SZ_PATH], lfpath[SZ_PATH];
     char  *lp    = (char *) NULL, *dest = (char *) NULL;
     int    count=0, wait=0, current=0, done=0, stat=OK, key=0, nres=0, i;
-    int    activeVal = QUEUE_RUNNING;
+    int    activeVal = QUEUE_RUNNING, dup = 0, cut = 0, rfd;
     Control *ctrl = (Control *) NULL;
     Entry   *entry = (Entry *) NULL, *e = (Entry *) NULL;
     xferStat xfs;
@@ -1125,12 +1137,43 @@ dts_normalQueueManager (DTS *dts, dtsQueue *dtsq)
 
         sprintf (lpath, "%s%s", (lp = dts_sandboxPath(ctrl->queuePath)), 
 	    ctrl->xferName);
+
+	/*  An object on a cut-through queue is sent on while it's still
+	 *  arriving, but only committed at the next hop once it's been
+	 *  validated here.
+	 */
+	cut = dts_cutPending (cpath);
+
+	/*  A fan-out queue sends the object to all its destinations at once,
+	 *  reading it from the spool only once.
+	 */
+	if (dtsq->type == QUEUE_FANOUT) {
+	    free ((char *) lp);
+	    dts_dbSetTime (key, DTS_TSTART);
+            gettimeofday (&dtsq->init_time, NULL);
+	    if (dts_queueFanout (dtsq, ctrl, cpath, lpath) != OK) {
+	        memset (msg, 0, SZ_PATH);
+                sprintf (msg,
+		    "%6.6s >  PROC: Fan-out transfer fails '%.200s'\n", 
+		    dts_queueNameFmt (dtsq->name), ctrl->xferName);
+                dtsq->qstat->failedxfers++;	// failed transfer
+                dtsLogMsg (dtsq->dts, 1, msg);
+                dtsLogMsg (dtsq->dts, key, msg);
+	        dts_semIncr (dtsq->countSem);	// restore count value
+	        stat = ERR;
+	    }
+	    goto xfer_done;
+	}
+
 	for (done=0; ! done; ) {
 	    if (debug > 2)
 	        dtsLog (dtsq->dts, "%6.6s >  verifying %s {%s}\n", 
 		    dts_queueNameFmt (dtsq->name), dtsq->dest, dest);
 
-	    qpath = dts_verifyDTS (dest, dtsq->name, lpath);
+	    /*  The MD5 lets the peer find the dir of an earlier attempt to
+	     *  resume into, or a copy it already holds if it dedups.
+	     */
+	    qpath = dts_verifyDTS (dest, dtsq->name, lpath, ctrl->md5, &dup);
 	    if (! qpath ) {
 	        /*  There was some sort of error, wait and try again.
 	         *
@@ -1202,7 +1245,11 @@ dts_normalQueueManager (DTS *dts, dtsQueue *dtsq)
 
 	dts_dbSetTime (key, DTS_TSTART);
         gettimeofday (&dtsq->init_time, NULL);
-        if (dts_queueProcess(dtsq,ctrl->queuePath,qpath,ctrl->xferName) == OK) {
+	if (dup)
+	    dtsLog (dtsq->dts, "%6.6s >  PROC: %s already at %s, not sent\n",
+		dts_queueNameFmt (dtsq->name), ctrl->xferName, dest);
+        if (dup ||
+	    dts_queueProcess(dtsq,ctrl->queuePath,qpath,ctrl->xferName) == OK) {
 
 	    /*
 	    dts_semSetVal (dtsq->activeSem, QUEUE_WAITING);
@@ -1210,7 +1257,20 @@ dts_normalQueueManager (DTS *dts, dtsQueue *dtsq)
 		sleep (1);
 	    */
 
-            if (dts_hostEndTransfer(dest, dtsq->name, qpath) != OK) {
+	    if (cut && dts_cutWait (lpath) != OK) {
+	        memset (msg, 0, SZ_PATH);
+                sprintf (msg,
+		    "%6.6s >  PROC: '%.200s' not validated here, not committed\n",
+		    dts_queueNameFmt (dtsq->name), ctrl->xferName);
+                dtsq->qstat->failedxfers++;	// failed transfer
+                dtsLogMsg (dtsq->dts, 1, msg);
+                dtsLogMsg (dtsq->dts, key, msg);
+		if ((rfd = creat (rejpath, DTS_FILE_MODE)) >= 0)
+		    close (rfd);		// skip it from now on
+	        dts_semIncr (dtsq->countSem);		// restore count value
+		stat = ERR;
+
+            } else if (dts_hostEndTransfer(dest, dtsq->name, qpath) != OK) {
 	        memset (msg, 0, SZ_PATH);
                 sprintf (msg, "%6.6s >  PROC: Error in endTransfer '%s'\n",
 		    dts_queueNameFmt (dtsq->name), ctrl->xferName);
@@ -1232,6 +1292,7 @@ dts_normalQueueManager (DTS *dts, dtsQueue *dtsq)
 	    stat = ERR;
 	}
 
+xfer_done:
         gettimeofday (&dtsq->end_time, NULL);
         xfs.fsize = ctrl->fsize;
         xfs.time = (float) dts_timediff (dtsq->init_time, dtsq->end_time);
@@ -1329,7 +1390,7 @@ dts_scheduledQueueManager (DTS *dts, dtsQueue *dtsq)
     char  curfil[SZ_PATH], ctrlpath[SZ_PATH], cpath[SZ_PATH], lpath[SZ_PATH];
     char *qpath = (char *) NULL, *lp = (char *) NULL, msg[SZ_PATH];
     int   count = 0, wait = 0, current = 0, done = 0, stat = OK;
-    int   nres = 0, key = 0, i;
+    int   nres = 0, key = 0, i, dup = 0;
     time_t  last_time;
     struct timespec delay = { (time_t) 0, (long) 0 };
     Control *ctrl = (Control *) NULL;
@@ -1408,7 +1469,8 @@ dts_scheduledQueueManager (DTS *dts, dtsQueue *dtsq)
             sprintf (lpath, "%s%s", (lp = dts_sandboxPath(ctrl->queuePath)),
                 ctrl->xferName);
 	    for (done=0; ! done; ) {
-                qpath = dts_verifyDTS (dtsq->dest, dtsq->name, lpath);
+                qpath = dts_verifyDTS (dtsq->dest, dtsq->name, lpath,
+		    ctrl->md5, &dup);
                 if (! qpath) {
                     /*  There was some sort of error, wait and try again.
                      *
@@ -1450,7 +1512,10 @@ dts_scheduledQueueManager (DTS *dts, dtsQueue *dtsq)
             /* Process the file transfer.
              */
 	    dts_dbSetTime (key, DTS_TSTART);
-            if (dts_queueProcess (dtsq, ctrl->queuePath, 
+	    if (dup)
+		dtsLog (dtsq->dts, "%6.6s >  PROC: %s already at %s, not sent\n",
+		    dts_queueNameFmt (dtsq->name), ctrl->xferName, dtsq->dest);
+            if (dup || dts_queueProcess (dtsq, ctrl->queuePath, 
 		qpath, ctrl->xferName) == OK) {
                     if (dts_hostEndTransfer (dtsq->dest,dtsq->name,qpath)!=OK) {
 	        	memset (msg, 0, SZ_PATH);
@@ -1575,7 +1640,8 @@ dts_queueObjXfer (DTS *dts, dtsQueue *dtsq)
 
     while (! done) {
 	//qpath = dts_verifyDTS (dtsq->dest, dtsq->name, ctrl->xferName);
-	qpath = dts_verifyDTS (dtsq->dest, dtsq->name, ctrl->srcPath);
+	qpath = dts_verifyDTS (dtsq->dest, dtsq->name, ctrl->srcPath,
+	    NULL, NULL);
 	if (! qpath ) {
 	    /*  There was some sort of error, wait and try again.
 	     *
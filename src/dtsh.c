@@ -758,15 +758,17 @@ dts_shProcess (int argc, char *argv[])
 
     } else if (strcasecmp (cmd, "df") == 0) {		/* DF(ree)    	*/
 	path = argv[astart];
-	res = (noop ? -1 : dts_hostDiskFree (host, path));
+	size = (noop ? -1 : dts_hostDiskFree (host, path));
+	res = (size < 0 ? ERR : OK);
 	if (!quiet)
-	    printf ("%9d KB Free\t%s\n", res, (path ? path : "/"));
+	    printf ("%9ld KB Free\t%s\n", size, (path ? path : "/"));
 
     } else if (strcasecmp (cmd, "du") == 0) {		/* DU(sed)    	*/
 	path = argv[astart];
-	res = (noop ? -1 : dts_hostDiskUsed(host, path));
+	size = (noop ? -1 : dts_hostDiskUsed(host, path));
+	res = (size < 0 ? ERR : OK);
 	if (!quiet)
-	    printf ("%9d KB Used\t%s\n", res, (path ? path : "/"));
+	    printf ("%9ld KB Used\t%s\n", size, (path ? path : "/"));
 
     } else if (strcasecmp (cmd, "echo") == 0) {		/* ECHO       	*/
 	sres = (noop ? NULL : dts_hostEcho (host, argv[astart]));
@@ -777,9 +779,10 @@ dts_shProcess (int argc, char *argv[])
 
     } else if (strcasecmp (cmd, "fsize") == 0) {	/* FSIZE      	*/
 	path = argv[astart];
-	res = (noop ? -1 : dts_hostFSize (host, path));
+	size = (noop ? -1 : dts_hostFSize (host, path));
+	res = (size < 0 ? ERR : OK);
 	if (!quiet)
-	    printf ("%9d\t%s\n", res, path);
+	    printf ("%9ld\t%s\n", size, path);
 
     } else if (strcasecmp (cmd, "fmode") == 0) {	/* FMODE      	*/
 	path = argv[astart];
@@ -935,7 +938,7 @@ dts_shProcess (int argc, char *argv[])
 
     } else if (strcasecmp (cmd, "prealloc") == 0) {	/* PREALLOC   	*/
 	path = argv[astart++];
-	size = atoi(argv[astart]);
+	size = atol(argv[astart]);
 	res = (noop ? OK : dts_hostPrealloc (host, path, size));
 	if (!quiet)
 	    printf ("(%d) %s\n", res, (res == OK ? "OK" : "ERR"));
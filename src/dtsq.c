@@ -606,7 +606,7 @@ dts_qValidateDTS (char *fname)
 static void
 dts_qInitControl (char *qhost, char *fname)
 {
-    char *md5, opath[SZ_PATH];
+    char  opath[SZ_PATH];
 
 
     dts_qSetStatus (qhost, queue, "initializing");
@@ -623,19 +623,15 @@ dts_qInitControl (char *qhost, char *fname)
     strcpy (control.srcPath, dts_pathDir (fname));
     strcpy (control.igstPath, opath);
 
-    if ((md5 = dts_fileMD5 (fname))) {
-        strcpy (control.md5, md5);
-        free ((void *) md5);
-    } else
-        strcpy (control.md5, " \0");
-
     control.epoch = time (NULL);
     control.isDir = dts_isDir (fname);
 
-    if (control.isDir == 1) {
-        control.sum32 = control.crc32 = 0;
-    } else {
-        control.sum32 = dts_fileCRCChecksum (fname, &control.crc32);
+    /*  Compute the sums in one pass over the file.
+     */
+    if (control.isDir == 1 || dts_fileDigest (fname, DTS_DIGEST_ALL, 
+	&control.sum32, &control.crc32, control.md5) != OK) {
+            control.sum32 = control.crc32 = 0;
+            strcpy (control.md5, " \0");
     }
     control.fsize = dts_du (fname);
 